@@ -0,0 +1,227 @@
+/******************************************************************************
+ *
+ *  File        : aio.c
+ *  Description : Asynchronous syscall ring. A task places a ring inside its own
+ *                memory and registers it with sys_aio_setup(). It can queue many
+ *                operations on the submission ring, which are consumed on every
+ *                syscall entry (or by sys_aio_enter()). Results are placed on the
+ *                completion ring so one trap can service many operations.
+ *
+ *****************************************************************************/
+#include "kernel.h"
+#include "kmem.h"
+#include "schedule.h"
+#include "vfs.h"
+#include "aio.h"
+#include "pit.h"
+
+
+/**
+ * Places a completion on the completion ring of the current task. Must be called
+ * while the task's page directory is active since the ring lives in user memory.
+ */
+void aio_complete (aio_context_t *ctx, Uint32 user_data, int result) {
+  aio_ring_t *ring = ctx->ring;
+  Uint32 cq_entries = ctx->entries * 2;
+
+  ctx->inflight--;
+
+  // Completion ring is full. User space is not reaping fast enough
+  if (ring->cq_tail - ring->cq_head >= cq_entries) {
+    ring->overflow++;
+    return;
+  }
+
+  aio_cqe_t *cqe = AIO_CQES(ring, ctx->entries) + (ring->cq_tail & (cq_entries - 1));
+  cqe->user_data = user_data;
+  cqe->result = result;
+  ring->cq_tail++;
+}
+
+
+/**
+ * Moves expired sleep operations to the completion ring
+ */
+void aio_reap_timers (aio_context_t *ctx) {
+  int i;
+
+  for (i=0; i!=AIO_MAX_TIMERS; i++) {
+    if (! ctx->timer[i].active) continue;
+    if (ctx->timer[i].expires > _kernel_ticks) continue;
+
+    ctx->timer[i].active = 0;
+    aio_complete (ctx, ctx->timer[i].user_data, 0);
+  }
+}
+
+
+/**
+ * Queues a sleep operation of ms milliseconds (rounded up to whole timer ticks).
+ * Returns 0 on success, -1 when no timer slot is free.
+ */
+int aio_add_timer (aio_context_t *ctx, Uint32 ms, Uint32 user_data) {
+  int i;
+
+  for (i=0; i!=AIO_MAX_TIMERS; i++) {
+    if (ctx->timer[i].active) continue;
+
+    ctx->timer[i].expires = _kernel_ticks + PIT_MS_TO_TICKS (ms);
+    ctx->timer[i].user_data = user_data;
+    ctx->timer[i].active = 1;
+    return 0;
+  }
+  return -1;
+}
+
+
+/**
+ * Executes a single submission entry. Everything except AIO_OP_SLEEP completes
+ * right away.
+ */
+void aio_execute (aio_context_t *ctx, aio_sqe_t *sqe) {
+  int result;
+
+  ctx->inflight++;
+
+  switch (sqe->opcode) {
+    case AIO_OP_NOP :
+                      result = 0;
+                      break;
+    case AIO_OP_READ :
+                      result = sys_read (sqe->fd, (char *)sqe->addr, sqe->len);
+                      break;
+    case AIO_OP_WRITE :
+                      result = sys_write (sqe->fd, (char *)sqe->addr, sqe->len);
+                      break;
+    case AIO_OP_OPEN :
+                      result = sys_open ((const char *)sqe->addr, sqe->len);
+                      break;
+    case AIO_OP_CLOSE :
+                      result = sys_close (sqe->fd);
+                      break;
+    case AIO_OP_SLEEP :
+                      // Completion is posted by aio_reap_timers() later on
+                      if (aio_add_timer (ctx, sqe->len, sqe->user_data) == 0) return;
+                      result = -1;
+                      break;
+    default :
+                      result = -1;
+                      break;
+  }
+
+  aio_complete (ctx, sqe->user_data, result);
+}
+
+
+/**
+ * Consumes at most max entries from the submission ring. Returns the number of
+ * entries consumed.
+ */
+int aio_consume (aio_context_t *ctx, Uint32 max) {
+  aio_ring_t *ring = ctx->ring;
+  aio_sqe_t sqe;
+  int count = 0;
+
+  while (ring->sq_head != ring->sq_tail && count != max) {
+    // Copy the entry first, user space may reuse the slot as soon as sq_head moves
+    memcpy (&sqe, AIO_SQES(ring) + (ring->sq_head & (ctx->entries - 1)), sizeof (aio_sqe_t));
+    ring->sq_head++;
+
+    aio_execute (ctx, &sqe);
+    count++;
+  }
+
+  return count;
+}
+
+
+/**
+ * Called on every syscall entry. Consumes everything that is queued on the ring of
+ * the current task so a task can make progress without calling sys_aio_enter().
+ */
+void aio_submit_pending (void) {
+  aio_context_t *ctx = _current_task->aio;
+  if (! ctx) return;
+
+  aio_consume (ctx, ctx->entries);
+  aio_reap_timers (ctx);
+}
+
+
+/**
+ * Registers a ring that lives in the current task's memory. The ring must be
+ * AIO_RING_SIZE(entries) bytes large. Returns 0 on success, -1 on error.
+ */
+int sys_aio_setup (aio_ring_t *ring, Uint32 entries) {
+  // Entries must be a power of 2 so we can mask the indices
+  if (entries == 0 || entries > AIO_MAX_ENTRIES || (entries & (entries - 1))) return -1;
+
+  // The whole ring must be writable task memory, since it is cleared below
+  if (! is_user_address (_current_task->page_directory, (Uint32)ring, AIO_RING_SIZE(entries))) return -1;
+
+  // Only one ring per task
+  if (_current_task->aio) return -1;
+
+  aio_context_t *ctx = (aio_context_t *)kmalloc (sizeof (aio_context_t));
+  memset (ctx, 0, sizeof (aio_context_t));
+  ctx->ring = ring;
+  ctx->entries = entries;
+  sched_init_waitqueue (&ctx->wait);
+
+  memset (ring, 0, AIO_RING_SIZE(entries));
+  ring->entries = entries;
+
+  _current_task->aio = ctx;
+  return 0;
+}
+
+
+/**
+ * Submits at most to_submit entries and waits until at least min_complete completions
+ * are available on the completion ring. Returns the number of submitted entries.
+ */
+int sys_aio_enter (Uint32 to_submit, Uint32 min_complete) {
+  aio_context_t *ctx = _current_task->aio;
+  if (! ctx) return -1;
+
+  int submitted = aio_consume (ctx, to_submit);
+  aio_reap_timers (ctx);
+
+  // Wait for completions. Only pending timers can complete while we sleep.
+  while (ctx->ring->cq_tail - ctx->ring->cq_head < min_complete && ctx->inflight > 0) {
+    sched_interruptable_sleep (&ctx->wait);
+    aio_reap_timers (ctx);
+  }
+
+  return submitted;
+}
+
+
+/**
+ * Called from the timer for every task. Wakes up the task when one of its sleep
+ * operations has expired. The completion itself is posted in the task's own context.
+ */
+void aio_timer_tick (task_t *task) {
+  int i;
+
+  aio_context_t *ctx = task->aio;
+  if (! ctx) return;
+
+  for (i=0; i!=AIO_MAX_TIMERS; i++) {
+    if (ctx->timer[i].active && ctx->timer[i].expires <= _kernel_ticks) {
+      sched_wakeup (&ctx->wait);
+      return;
+    }
+  }
+}
+
+
+/**
+ * Removes the ring of a task (on exit)
+ */
+void aio_destroy (task_t *task) {
+  if (! task->aio) return;
+
+  kfree (task->aio);
+  task->aio = NULL;
+}
@@ -0,0 +1,610 @@
+/******************************************************************************
+ *
+ *  File        : bcache.c
+ *  Description : Block buffer cache. Blocks of block devices are kept in a fixed
+ *                pool of buffers, found through a hash on (major, minor, block)
+ *                and evicted with the CLOCK algorithm. Writes stay in the cache
+ *                until bdflush() (or eviction) writes them back to the device.
+ *
+ *****************************************************************************/
+#include "kernel.h"
+#include "kmem.h"
+#include "schedule.h"
+#include "device.h"
+#include "block.h"
+#include "bcache.h"
+
+
+buffer_t *bcache_buffers;                       // Pool with all buffers
+buffer_t *bcache_hash[BCACHE_HASH_SIZE];        // Hash buckets
+int bcache_clock_hand;                          // Next buffer the clock hand will look at
+waitqueue_t bcache_wait;                        // Tasks waiting for a locked (or any free) buffer
+bcache_stats_t bcache_stats;                    // Hit and miss counters
+int bcache_readahead_busy;                      // Somebody is reading ahead
+
+#define BCACHE_HASH(major, minor, block)   (((block) ^ ((block) >> 6) ^ ((major) << 4) ^ (minor)) & (BCACHE_HASH_SIZE - 1))
+
+
+/**
+ * Initializes the buffer cache. Must be called after the heap is available.
+ */
+void bcache_init (void) {
+  int i;
+
+  bcache_buffers = (buffer_t *)kmalloc (BCACHE_BUFFERS * sizeof (buffer_t));
+  memset (bcache_buffers, 0, BCACHE_BUFFERS * sizeof (buffer_t));
+
+  for (i=0; i!=BCACHE_BUFFERS; i++) {
+    bcache_buffers[i].data = (char *)kmalloc (BCACHE_BLOCK_SIZE);
+  }
+
+  for (i=0; i!=BCACHE_HASH_SIZE; i++) bcache_hash[i] = NULL;
+
+  bcache_readahead_busy = 0;
+
+  bcache_clock_hand = 0;
+  memset (&bcache_stats, 0, sizeof (bcache_stats_t));
+  sched_init_waitqueue (&bcache_wait);
+}
+
+
+/**
+ * Finds a block in the cache. Must be called with interrupts disabled.
+ */
+buffer_t *bcache_lookup (Uint8 major, Uint8 minor, Uint32 block) {
+  buffer_t *buf;
+
+  for (buf = bcache_hash[BCACHE_HASH(major, minor, block)]; buf != NULL; buf = buf->hash_next) {
+    if (buf->block == block && buf->major_num == major && buf->minor_num == minor) return buf;
+  }
+  return NULL;
+}
+
+
+/**
+ * Adds a buffer to its hash bucket
+ */
+void bcache_hash_add (buffer_t *buf) {
+  int bucket = BCACHE_HASH(buf->major_num, buf->minor_num, buf->block);
+
+  buf->hash_next = bcache_hash[bucket];
+  bcache_hash[bucket] = buf;
+}
+
+
+/**
+ * Removes a buffer from its hash bucket (if it's in there)
+ */
+void bcache_hash_remove (buffer_t *buf) {
+  buffer_t **ptr = &bcache_hash[BCACHE_HASH(buf->major_num, buf->minor_num, buf->block)];
+
+  while (*ptr) {
+    if (*ptr == buf) {
+      *ptr = buf->hash_next;
+      break;
+    }
+    ptr = &(*ptr)->hash_next;
+  }
+  buf->hash_next = NULL;
+}
+
+
+/**
+ * Waits until a buffer gets unlocked or released. Must be called with interrupts disabled.
+ */
+void bcache_sleep (void) {
+  // Without tasks there is nobody else that can hold a buffer
+  if (! _current_task) kpanic ("Buffer cache: all buffers are in use\n");
+
+  sched_interruptable_sleep (&bcache_wait);
+}
+
+
+/**
+ * Waits until a locked buffer gets unlocked. It might be locked by a readahead that is
+ * still pending in the queue of the device, and only tasks that wait on the device
+ * dispatch the queue, so we do that first. Must be called with interrupts disabled,
+ * state is what disable_ints() returned to the caller.
+ */
+void bcache_sleep_locked (device_t *dev, buffer_t *buf, int state) {
+  restore_ints (state);
+  block_unplug (dev);
+  disable_ints ();
+
+  if (buf->flags & BUF_LOCKED) bcache_sleep ();
+}
+
+
+/**
+ * Finds a buffer that can be reused with the CLOCK algorithm. Referenced buffers get
+ * a second chance, pinned and locked buffers are skipped. Must be called with interrupts
+ * disabled. Returns NULL when every buffer is in use.
+ */
+buffer_t *bcache_evict (void) {
+  buffer_t *buf;
+  int i;
+
+  for (i=0; i!=BCACHE_BUFFERS * 2; i++) {
+    buf = &bcache_buffers[bcache_clock_hand];
+    bcache_clock_hand = (bcache_clock_hand + 1) % BCACHE_BUFFERS;
+
+    if (buf->refcount > 0 || (buf->flags & BUF_LOCKED)) continue;
+
+    if (buf->flags & BUF_REFERENCED) {
+      buf->flags &= ~BUF_REFERENCED;
+      continue;
+    }
+
+    return buf;
+  }
+
+  return NULL;
+}
+
+
+/**
+ * Transfers a whole block between the device and the buffer through the block layer.
+ * Returns the number of bytes transferred.
+ */
+Uint32 bcache_transfer (device_t *dev, buffer_t *buf, int write) {
+  if (write) return block_write (dev, (Uint64)buf->block * BCACHE_BLOCK_SIZE, BCACHE_BLOCK_SIZE, buf->data);
+  return block_read (dev, (Uint64)buf->block * BCACHE_BLOCK_SIZE, BCACHE_BLOCK_SIZE, buf->data);
+}
+
+
+/**
+ * Writes a dirty buffer back to its device. The buffer must be locked by the caller
+ * and is unlocked when done. Returns 1 on success, 0 on error.
+ */
+int bcache_writeback (buffer_t *buf) {
+  device_t *dev = device_get_device (buf->major_num, buf->minor_num);
+  int ok = 0;
+
+  // Clear the dirty flag first, so changes made during the write mark it dirty again
+  int state = disable_ints ();
+  buf->flags &= ~BUF_DIRTY;
+  restore_ints (state);
+
+  if (dev && dev->write) ok = (bcache_transfer (dev, buf, 1) == BCACHE_BLOCK_SIZE);
+
+  // @TODO: We drop the data when the device fails, otherwise the buffer could never be reused
+  if (! ok) kprintf ("Buffer cache: cannot write block %d to device %d:%d\n", buf->block, buf->major_num, buf->minor_num);
+
+  state = disable_ints ();
+  if (ok) bcache_stats.writebacks++;
+  buf->flags &= ~BUF_LOCKED;
+  sched_wakeup (&bcache_wait);
+  restore_ints (state);
+
+  return ok;
+}
+
+
+/**
+ * Returns a pinned buffer for a block of a device. When fill is set the data is read
+ * from the device on a miss. Otherwise the caller promises to overwrite the whole block.
+ * Release the buffer with bcache_release(). Returns NULL on read error.
+ */
+buffer_t *bcache_get (device_t *dev, Uint32 block, int fill) {
+  buffer_t *buf;
+  Uint32 len;
+
+  int state = disable_ints ();
+
+  for (;;) {
+    buf = bcache_lookup (dev->major_num, dev->minor_num, block);
+    if (buf) {
+      // Somebody is reading or writing this block. Try again when done
+      if (buf->flags & BUF_LOCKED) {
+        bcache_sleep_locked (dev, buf, state);
+        continue;
+      }
+
+      buf->refcount++;
+      buf->flags |= BUF_REFERENCED;
+      bcache_stats.hits++;
+
+      restore_ints (state);
+      return buf;
+    }
+
+    buf = bcache_evict ();
+    if (! buf) {
+      // Everything is pinned. Wait until something gets released
+      bcache_sleep ();
+      continue;
+    }
+
+    // Write back the old data first. The block might be cached again after that, so look it up again
+    if (buf->flags & BUF_DIRTY) {
+      buf->flags |= BUF_LOCKED;
+      restore_ints (state);
+      bcache_writeback (buf);
+      state = disable_ints ();
+      continue;
+    }
+
+    break;
+  }
+
+  // Claim the buffer for the new block
+  if (buf->flags & BUF_VALID) bcache_stats.evictions++;
+  bcache_hash_remove (buf);
+  buf->major_num = dev->major_num;
+  buf->minor_num = dev->minor_num;
+  buf->block = block;
+  buf->refcount = 1;
+  buf->flags = BUF_REFERENCED;
+  bcache_hash_add (buf);
+
+  if (! fill) {
+    buf->flags |= BUF_VALID;
+    restore_ints (state);
+    return buf;
+  }
+
+  bcache_stats.misses++;
+  buf->flags |= BUF_LOCKED;
+  restore_ints (state);
+
+  len = bcache_transfer (dev, buf, 0);
+
+  state = disable_ints ();
+  buf->flags &= ~BUF_LOCKED;
+  if (len == 0) {
+    // Nothing could be read, remove it from the cache
+    bcache_hash_remove (buf);
+    buf->flags = 0;
+    buf->refcount = 0;
+    buf = NULL;
+  } else {
+    // Partial block at the end of the device
+    if (len < BCACHE_BLOCK_SIZE) memset (buf->data + len, 0, BCACHE_BLOCK_SIZE - len);
+    buf->flags |= BUF_VALID;
+  }
+  sched_wakeup (&bcache_wait);
+  restore_ints (state);
+
+  return buf;
+}
+
+
+/**
+ * Unpins a buffer returned by bcache_get()
+ */
+void bcache_release (buffer_t *buf) {
+  int state = disable_ints ();
+  buf->refcount--;
+  if (buf->refcount == 0) sched_wakeup (&bcache_wait);
+  restore_ints (state);
+}
+
+
+/**
+ * Marks a (pinned) buffer as changed. It will be written back later on.
+ */
+void bcache_mark_dirty (buffer_t *buf) {
+  int state = disable_ints ();
+  if (! (buf->flags & BUF_DIRTY)) buf->dirty_since = _kernel_ticks;
+  buf->flags |= BUF_DIRTY | BUF_VALID;
+  restore_ints (state);
+}
+
+
+/**
+ * Reads size bytes from offset of a block device through the cache. Works like the
+ * read() of a device. Returns the number of bytes read.
+ */
+Uint32 bcache_read (device_t *dev, Uint64 offset, Uint32 size, char *buffer) {
+  Uint32 count = 0;
+  Uint32 block_offset, len;
+  buffer_t *buf;
+
+  while (count != size) {
+    block_offset = (offset + count) % BCACHE_BLOCK_SIZE;
+    len = BCACHE_BLOCK_SIZE - block_offset;
+    if (len > size - count) len = size - count;
+
+    buf = bcache_get (dev, (offset + count) / BCACHE_BLOCK_SIZE, 1);
+    if (! buf) break;
+
+    memcpy (buffer + count, buf->data + block_offset, len);
+    bcache_release (buf);
+
+    count += len;
+  }
+
+  return count;
+}
+
+
+/**
+ * Writes size bytes to offset of a block device through the cache. The data reaches
+ * the device later on. Returns the number of bytes written.
+ */
+Uint32 bcache_write (device_t *dev, Uint64 offset, Uint32 size, char *buffer) {
+  Uint32 count = 0;
+  Uint32 block_offset, len;
+  buffer_t *buf;
+
+  while (count != size) {
+    block_offset = (offset + count) % BCACHE_BLOCK_SIZE;
+    len = BCACHE_BLOCK_SIZE - block_offset;
+    if (len > size - count) len = size - count;
+
+    // No need to read the block when we overwrite all of it
+    buf = bcache_get (dev, (offset + count) / BCACHE_BLOCK_SIZE, (len != BCACHE_BLOCK_SIZE));
+    if (! buf) break;
+
+    memcpy (buf->data + block_offset, buffer + count, len);
+    bcache_mark_dirty (buf);
+    bcache_release (buf);
+
+    count += len;
+  }
+
+  return count;
+}
+
+
+/**
+ * Returns the data of a block when it's in the cache. Locked blocks are waited for.
+ * Must be called with interrupts disabled, state is what disable_ints() returned to
+ * the caller. Returns a pinned buffer or NULL.
+ */
+buffer_t *bcache_peek (device_t *dev, Uint32 block, int state) {
+  buffer_t *buf;
+
+  for (;;) {
+    buf = bcache_lookup (dev->major_num, dev->minor_num, block);
+    if (! buf || ! (buf->flags & BUF_LOCKED)) break;
+    bcache_sleep_locked (dev, buf, state);
+  }
+  if (! buf || ! (buf->flags & BUF_VALID)) return NULL;
+
+  buf->refcount++;
+  buf->flags |= BUF_REFERENCED;
+  return buf;
+}
+
+
+/**
+ * Reads size bytes from offset of a block device without placing them in the cache, so
+ * large sequential reads do not push out the metadata. Blocks that are cached already
+ * (read ahead, or dirty) are copied from the cache, runs of other blocks are read from
+ * the device in one go. Partial blocks at the start and end go through the cache.
+ * Returns the number of bytes read.
+ */
+Uint32 bcache_read_uncached (device_t *dev, Uint64 offset, Uint32 size, char *buffer) {
+  Uint32 count, tail, block, run, done;
+  buffer_t *buf;
+  int state;
+
+  // Up to the first block boundary
+  count = (BCACHE_BLOCK_SIZE - offset % BCACHE_BLOCK_SIZE) % BCACHE_BLOCK_SIZE;
+  if (count > size) count = size;
+  if (count && bcache_read (dev, offset, count, buffer) != count) return 0;
+  if (count == size) return count;
+
+  // Whole blocks in between
+  tail = (offset + size) % BCACHE_BLOCK_SIZE;
+  while (count != size - tail) {
+    block = (offset + count) / BCACHE_BLOCK_SIZE;
+
+    state = disable_ints ();
+    buf = bcache_peek (dev, block, state);
+    if (buf) {
+      bcache_stats.hits++;
+      restore_ints (state);
+
+      memcpy (buffer + count, buf->data, BCACHE_BLOCK_SIZE);
+      bcache_release (buf);
+      count += BCACHE_BLOCK_SIZE;
+      continue;
+    }
+
+    // Find out how many blocks in a row are not cached
+    for (run = BCACHE_BLOCK_SIZE; count + run != size - tail; run += BCACHE_BLOCK_SIZE) {
+      if (bcache_lookup (dev->major_num, dev->minor_num, block + run / BCACHE_BLOCK_SIZE)) break;
+    }
+    restore_ints (state);
+
+    done = block_read (dev, offset + count, run, buffer + count);
+    if (done != run) return count + done;
+    count += run;
+  }
+
+  // Partial block at the end
+  if (tail) count += bcache_read (dev, offset + count, tail, buffer + count);
+
+  return count;
+}
+
+
+/**
+ * Completion of a readahead bio. The buffer becomes valid, or is thrown away when the
+ * device could not read it.
+ */
+void bcache_readahead_end_io (bio_t *bio) {
+  buffer_t *buf = (buffer_t *)bio->private;
+
+  int state = disable_ints ();
+  if (bio->done == bio->size) {
+    // Referenced, otherwise the next readahead would throw it out before it's used
+    buf->flags = BUF_VALID | BUF_REFERENCED;
+    bcache_stats.readaheads++;
+  } else {
+    bcache_hash_remove (buf);
+    buf->flags = 0;
+  }
+  buf->refcount = 0;
+  sched_wakeup (&bcache_wait);
+  restore_ints (state);
+}
+
+
+/**
+ * Reads blocks into the cache before anybody asks for them. Blocks that are cached
+ * already are skipped, missing blocks are read straight into their buffers with the
+ * bio of the buffer, which the block layer merges into a single request. Readahead is
+ * only a hint: it does not wait for the data, never writes back dirty buffers and gives
+ * up when another task is reading ahead. The buffers stay locked until their bio
+ * completes. Returns the number of blocks submitted.
+ */
+int bcache_readahead (device_t *dev, Uint64 offset, Uint32 size) {
+  buffer_t *run[BCACHE_READAHEAD_BLOCKS];
+  buffer_t *buf;
+  bio_t *bio;
+  Uint32 block, last;
+  int i, n, state;
+  int total = 0;
+
+  if (size == 0 || ! dev->read) return 0;
+
+  state = disable_ints ();
+  if (bcache_readahead_busy) {
+    restore_ints (state);
+    return 0;
+  }
+  bcache_readahead_busy = 1;
+  restore_ints (state);
+
+  block = offset / BCACHE_BLOCK_SIZE;
+  last = (offset + size - 1) / BCACHE_BLOCK_SIZE;
+
+  while (block <= last) {
+    state = disable_ints ();
+
+    // Skip what we have already
+    if (bcache_lookup (dev->major_num, dev->minor_num, block)) {
+      restore_ints (state);
+      block++;
+      continue;
+    }
+
+    // Claim buffers for the missing blocks. They stay locked until the data is in
+    for (n=0; n != BCACHE_READAHEAD_BLOCKS && block + n <= last; n++) {
+      if (n > 0 && bcache_lookup (dev->major_num, dev->minor_num, block + n)) break;
+
+      buf = bcache_evict ();
+      if (! buf || (buf->flags & BUF_DIRTY)) break;
+
+      if (buf->flags & BUF_VALID) bcache_stats.evictions++;
+      bcache_hash_remove (buf);
+      buf->major_num = dev->major_num;
+      buf->minor_num = dev->minor_num;
+      buf->block = block + n;
+      buf->refcount = 1;
+      buf->flags = BUF_LOCKED;
+      bcache_hash_add (buf);
+      run[n] = buf;
+    }
+    restore_ints (state);
+
+    // Cache is busy, try again later
+    if (n == 0) break;
+
+    // The bios live inside the buffers, so nobody has to wait for them
+    for (i=0; i!=n; i++) {
+      bio = &run[i]->bio;
+      memset (bio, 0, sizeof (bio_t));
+      bio->dev = dev;
+      bio->direction = BLOCK_READ;
+      bio->offset = (Uint64)(block + i) * BCACHE_BLOCK_SIZE;
+      bio->size = BCACHE_BLOCK_SIZE;
+      bio->buffer = run[i]->data;
+      bio->end_io = bcache_readahead_end_io;
+      bio->private = run[i];
+      block_submit (bio);
+    }
+
+    total += n;
+    block += n;
+  }
+
+  bcache_readahead_busy = 0;
+
+  // Let the driver start on them, bcache_readahead_end_io() finishes the buffers
+  block_unplug (dev);
+  return total;
+}
+
+
+/**
+ * Writes back all dirty buffers of a device (or all devices when dev is NULL) that are
+ * dirty for at least min_age ticks. Returns the number of blocks written.
+ */
+int bcache_flush (device_t *dev, Uint32 min_age) {
+  buffer_t *buf;
+  int i, state;
+  int count = 0;
+
+  for (i=0; i!=BCACHE_BUFFERS; i++) {
+    buf = &bcache_buffers[i];
+
+    state = disable_ints ();
+    if (! (buf->flags & BUF_DIRTY) || (buf->flags & BUF_LOCKED) ||
+        (dev && (buf->major_num != dev->major_num || buf->minor_num != dev->minor_num)) ||
+        _kernel_ticks - buf->dirty_since < min_age) {
+      restore_ints (state);
+      continue;
+    }
+    buf->flags |= BUF_LOCKED;
+    restore_ints (state);
+
+    if (bcache_writeback (buf)) count++;
+  }
+
+  return count;
+}
+
+
+/**
+ * Writes back all dirty buffers of a device and makes sure they are on the medium, not
+ * only in the write cache of the device. Returns 0 on success, -1 on error.
+ */
+int bcache_sync (device_t *dev) {
+  bcache_flush (dev, 0);
+  return block_flush (dev);
+}
+
+
+/**
+ * Writes back and drops all unpinned buffers of a device (when it's unmounted or removed)
+ */
+void bcache_invalidate (device_t *dev) {
+  buffer_t *buf;
+  int i;
+
+  bcache_sync (dev);
+
+  int state = disable_ints ();
+  for (i=0; i!=BCACHE_BUFFERS; i++) {
+    buf = &bcache_buffers[i];
+    if (buf->major_num != dev->major_num || buf->minor_num != dev->minor_num) continue;
+    if (buf->refcount > 0 || (buf->flags & (BUF_LOCKED | BUF_DIRTY))) continue;
+    if (! (buf->flags & BUF_VALID)) continue;
+
+    bcache_hash_remove (buf);
+    buf->flags = 0;
+  }
+  restore_ints (state);
+}
+
+
+/**
+ * Prints the cache counters
+ */
+void bcache_print_stats (void) {
+  kprintf ("Buffer cache: %d hits, %d misses, %d evictions, %d writebacks, %d read ahead\n",
+           bcache_stats.hits, bcache_stats.misses, bcache_stats.evictions, bcache_stats.writebacks, bcache_stats.readaheads);
+}
+
+
+/**
+ * Writes back buffers that are dirty for too long. Called periodically by the update
+ * task. Returns the number of blocks written.
+ */
+int sys_bdflush (void) {
+  return bcache_flush (NULL, BCACHE_DIRTY_AGE);
+}
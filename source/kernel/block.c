@@ -0,0 +1,575 @@
+/******************************************************************************
+ *
+ *  File        : block.c
+ *  Description : Block layer. Transfers to block devices are submitted as bios,
+ *                which are queued per device. Bios for adjacent ranges are merged
+ *                into a single request, and an I/O scheduler decides in which
+ *                order the requests are sent to the driver. There are no kernel
+ *                threads, so the task that waits for a bio dispatches the queue
+ *                when nobody else does. Requests queue up (and merge) while the
+ *                driver is busy with another one. Drivers with a submit()
+ *                function get all requests at once and complete them from their
+ *                IRQ handler, others get one request at a time through read()
+ *                and write().
+ *
+ *****************************************************************************/
+#include "kernel.h"
+#include "kmem.h"
+#include "schedule.h"
+#include "device.h"
+#include "block.h"
+
+
+block_stats_t block_stats;                      // Merge and request counters
+
+block_scheduler_t block_schedulers[] = {
+    { "noop",     block_noop_next },
+    { "deadline", block_deadline_next },
+    { "clook",    block_clook_next },
+    { NULL,       NULL }
+};
+
+block_scheduler_t *block_default_scheduler = &block_schedulers[1];    // Used for new queues
+
+waitqueue_t block_io_wait;                      // Tasks waiting in block_wait_io()
+
+char *block_bounce[BLOCK_BOUNCE_BUFFERS];       // Kernel buffers for transfers from and to task memory
+int block_bounce_busy[BLOCK_BOUNCE_BUFFERS];
+waitqueue_t block_bounce_wait;                  // Tasks waiting for a free bounce buffer
+
+
+/**
+ * Initializes the block layer. Queues are created when a device is first used.
+ */
+void block_init (void) {
+  int i;
+
+  memset (&block_stats, 0, sizeof (block_stats_t));
+  sched_init_waitqueue (&block_io_wait);
+
+  for (i=0; i!=BLOCK_BOUNCE_BUFFERS; i++) {
+    block_bounce[i] = (char *)kmalloc (BLOCK_MAX_MERGE);
+    block_bounce_busy[i] = 0;
+  }
+  sched_init_waitqueue (&block_bounce_wait);
+}
+
+
+/**
+ * Sleeps on a wait queue. Without multitasking (or as the idle task) we cannot sleep,
+ * so we return and the caller keeps spinning. Must be called with interrupts disabled.
+ */
+void block_sleep (waitqueue_t *queue) {
+  if (_current_task == NULL || _current_task->pid == PID_IDLE) return;
+  sched_interruptable_sleep (queue);
+}
+
+
+/**
+ * Finishes a bio and calls its completion function. Called by drivers when the
+ * transfer is done, which can be from an interrupt handler.
+ */
+void block_end_io (bio_t *bio) {
+  if (bio->done != bio->size) bio->flags |= BIO_ERROR;
+
+  // After BIO_DONE the owner might reuse the bio, so nobody may get in between
+  int state = disable_ints ();
+  if (bio->end_io) bio->end_io (bio);
+  bio->flags |= BIO_DONE;
+  sched_wakeup (&block_io_wait);
+  restore_ints (state);
+}
+
+
+/**
+ * Waits until a bio that was given to a driver directly (not through a queue) is done.
+ * Returns 0 on success, -1 when not everything could be transferred.
+ */
+int block_wait_io (bio_t *bio) {
+  while (! (bio->flags & BIO_DONE)) {
+    int state = disable_ints ();
+    if (! (bio->flags & BIO_DONE)) block_sleep (&block_io_wait);
+    restore_ints (state);
+  }
+
+  return (bio->flags & BIO_ERROR) ? -1 : 0;
+}
+
+
+/**
+ * Returns the request queue of a device, and creates it on first use
+ */
+request_queue_t *block_get_queue (device_t *dev) {
+  request_queue_t *queue;
+  int i;
+
+  int state = disable_ints ();
+  if (dev->queue) {
+    restore_ints (state);
+    return dev->queue;
+  }
+
+  queue = (request_queue_t *)kmalloc (sizeof (request_queue_t));
+  memset (queue, 0, sizeof (request_queue_t));
+  queue->dev = dev;
+  queue->scheduler = block_default_scheduler;
+  queue->bounce = (char *)kmalloc (BLOCK_MAX_MERGE);
+  sched_init_waitqueue (&queue->wait);
+
+  for (i=0; i!=BLOCK_QUEUE_DEPTH; i++) {
+    queue->requests[i].queue = queue;
+    queue->requests[i].next = queue->free;
+    queue->free = &queue->requests[i];
+  }
+
+  dev->queue = queue;
+  restore_ints (state);
+
+  return queue;
+}
+
+
+/**
+ * Changes the I/O scheduler of a device. Returns 1 on success, 0 when there is no
+ * scheduler with this name.
+ */
+int block_set_scheduler (device_t *dev, const char *name) {
+  request_queue_t *queue = block_get_queue (dev);
+  int i;
+
+  for (i=0; block_schedulers[i].name != NULL; i++) {
+    if (strcmp (block_schedulers[i].name, name) != 0) continue;
+
+    // Pending requests do not belong to a scheduler, so we can switch at any time
+    queue->scheduler = &block_schedulers[i];
+    return 1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * Adds the bio to a pending request when it continues or precedes it. Must be called
+ * with interrupts disabled. Returns 1 when merged.
+ */
+int block_merge (request_queue_t *queue, bio_t *bio) {
+  request_t *req;
+
+  for (req = queue->pending; req != NULL; req = req->next) {
+    if (req->direction != bio->direction) continue;
+    if (req->size + bio->size > BLOCK_MAX_MERGE) continue;
+
+    // Back merge: the bio starts where the request ends
+    if (req->offset + req->size == bio->offset) {
+      req->bio_tail->next = bio;
+      req->bio_tail = bio;
+      req->size += bio->size;
+      block_stats.back_merges++;
+      return 1;
+    }
+
+    // Front merge: the bio ends where the request starts
+    if (bio->offset + bio->size == req->offset) {
+      bio->next = req->bio;
+      req->bio = bio;
+      req->offset = bio->offset;
+      req->size += bio->size;
+      block_stats.front_merges++;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+/**
+ * Queues a bio. It is transferred when a task waits for it (or for another bio on the
+ * same device), or when the queue is unplugged. bio->end_io is called on completion.
+ * Sleeps when the queue is full and somebody else is dispatching.
+ */
+void block_submit (bio_t *bio) {
+  request_queue_t *queue = block_get_queue (bio->dev);
+  request_t *req, **ptr;
+
+  bio->done = 0;
+  bio->flags = 0;
+  bio->next = NULL;
+
+  int state = disable_ints ();
+  block_stats.bios++;
+
+  while (! block_merge (queue, bio)) {
+    req = queue->free;
+    if (req) {
+      queue->free = req->next;
+
+      req->direction = bio->direction;
+      req->offset = bio->offset;
+      req->size = bio->size;
+      req->bio = bio;
+      req->bio_tail = bio;
+      req->deadline = _kernel_ticks + (bio->direction == BLOCK_READ ? BLOCK_READ_EXPIRE : BLOCK_WRITE_EXPIRE);
+      req->next = NULL;
+
+      // Add to the end, so the pending list stays in arrival order
+      for (ptr = &queue->pending; *ptr != NULL; ptr = &(*ptr)->next) ;
+      *ptr = req;
+      break;
+    }
+
+    // Queue is full. Hand requests to the driver and wait until one completes
+    restore_ints (state);
+    while (block_dispatch (queue)) ;
+    state = disable_ints ();
+    if (queue->free == NULL && queue->inflight) block_sleep (&queue->wait);
+  }
+
+  restore_ints (state);
+}
+
+
+/**
+ * Completion of the bio that carried a request to the driver. Every bio of the request
+ * gets the part of the transfer that covers it. Can be called from an interrupt handler.
+ */
+void block_request_end_io (bio_t *rq_bio) {
+  request_t *req = (request_t *)rq_bio->private;
+  request_queue_t *queue = req->queue;
+  bio_t *bio, *next;
+  Uint32 pos;
+
+  for (pos = 0, bio = req->bio; bio != NULL; pos += bio->size, bio = next) {
+    next = bio->next;
+
+    bio->done = 0;
+    if (rq_bio->done > pos) bio->done = (rq_bio->done - pos > bio->size) ? bio->size : rq_bio->done - pos;
+
+    if (req->direction == BLOCK_READ && rq_bio->buffer == queue->bounce) memcpy (bio->buffer, queue->bounce + pos, bio->done);
+    block_end_io (bio);
+  }
+
+  int state = disable_ints ();
+  if (rq_bio->buffer == queue->bounce) queue->bounce_busy = 0;
+  req->next = queue->free;
+  queue->free = req;
+  queue->inflight--;
+  sched_wakeup (&queue->wait);
+  restore_ints (state);
+}
+
+
+/**
+ * Hands a request to the driver. A request with a single bio uses the buffer of the
+ * bio, merged requests go through the bounce buffer. Drivers without submit() do the
+ * transfer right away.
+ */
+void block_start (request_queue_t *queue, request_t *req) {
+  device_t *dev = queue->dev;
+  bio_t *rq_bio = &req->rq_bio;
+  bio_t *bio;
+  Uint32 len, pos;
+
+  memset (rq_bio, 0, sizeof (bio_t));
+  rq_bio->dev = dev;
+  rq_bio->direction = req->direction;
+  rq_bio->offset = req->offset;
+  rq_bio->size = req->size;
+  rq_bio->buffer = (req->bio == req->bio_tail) ? req->bio->buffer : queue->bounce;
+  rq_bio->end_io = block_request_end_io;
+  rq_bio->private = req;
+
+  if (req->direction == BLOCK_WRITE && rq_bio->buffer == queue->bounce) {
+    for (pos = 0, bio = req->bio; bio != NULL; pos += bio->size, bio = bio->next) {
+      memcpy (queue->bounce + pos, bio->buffer, bio->size);
+    }
+  }
+
+  if (dev->submit) {
+    dev->submit (dev->major_num, dev->minor_num, rq_bio);
+    if (dev->commit) queue->uncommitted = 1;
+    return;
+  }
+
+  // Drivers might transfer less than asked for (the floppy does one sector at a time)
+  while (rq_bio->done != rq_bio->size) {
+    if (req->direction == BLOCK_WRITE) {
+      len = dev->write ? dev->write (dev->major_num, dev->minor_num, rq_bio->offset + rq_bio->done, rq_bio->size - rq_bio->done, rq_bio->buffer + rq_bio->done) : 0;
+    } else {
+      len = dev->read ? dev->read (dev->major_num, dev->minor_num, rq_bio->offset + rq_bio->done, rq_bio->size - rq_bio->done, rq_bio->buffer + rq_bio->done) : 0;
+    }
+    if (len == 0) break;
+    rq_bio->done += len;
+  }
+  block_end_io (rq_bio);
+}
+
+
+/**
+ * Lets the driver start the requests it got since its last commit. Drivers with a
+ * commit() function only tell the device about new requests from there.
+ */
+void block_commit (request_queue_t *queue) {
+  device_t *dev = queue->dev;
+
+  int state = disable_ints ();
+  if (! queue->uncommitted) {
+    restore_ints (state);
+    return;
+  }
+  queue->uncommitted = 0;
+  block_stats.commits++;
+  restore_ints (state);
+
+  dev->commit (dev->major_num, dev->minor_num);
+}
+
+
+/**
+ * Sends the next request (as chosen by the scheduler) to the driver. Drivers without
+ * submit() only get a request when the previous one is done. Merged requests share the
+ * bounce buffer, so only one of them can be in flight. Returns 1 when a request was
+ * dispatched. When nothing can be dispatched anymore, the batch sent so far is
+ * committed, so callers only have to dispatch until this returns 0.
+ */
+int block_dispatch (request_queue_t *queue) {
+  request_t *req, **ptr;
+
+  int state = disable_ints ();
+  if (queue->pending == NULL || (queue->inflight && ! queue->dev->submit)) {
+    restore_ints (state);
+    block_commit (queue);
+    return 0;
+  }
+
+  req = queue->scheduler->next (queue);
+  if (req->bio != req->bio_tail) {
+    if (queue->bounce_busy) {
+      restore_ints (state);
+      block_commit (queue);
+      return 0;
+    }
+    queue->bounce_busy = 1;
+  }
+
+  for (ptr = &queue->pending; *ptr != req; ptr = &(*ptr)->next) ;
+  *ptr = req->next;
+
+  queue->inflight++;
+  queue->position = req->offset + req->size;
+  block_stats.requests++;
+  restore_ints (state);
+
+  block_start (queue, req);
+  return 1;
+}
+
+
+/**
+ * Waits until a submitted bio is done. Pending requests of the device are dispatched
+ * by this task (which might be requests of other tasks first).
+ * Returns 0 on success, -1 when not everything could be transferred.
+ */
+int block_wait (bio_t *bio) {
+  request_queue_t *queue = block_get_queue (bio->dev);
+
+  while (! (bio->flags & BIO_DONE)) {
+    if (block_dispatch (queue)) continue;
+
+    // Our bio is at the driver, or waits until the driver is done with another request
+    int state = disable_ints ();
+    if (! (bio->flags & BIO_DONE) && queue->inflight) block_sleep (&queue->wait);
+    restore_ints (state);
+  }
+
+  return (bio->flags & BIO_ERROR) ? -1 : 0;
+}
+
+
+/**
+ * Dispatches pending requests of a device. Used after submitting bios that are only
+ * completed through their end_io function. Requests that cannot be dispatched yet are
+ * sent by the next task that waits on the device.
+ */
+void block_unplug (device_t *dev) {
+  request_queue_t *queue = block_get_queue (dev);
+
+  while (block_dispatch (queue)) ;
+}
+
+
+/**
+ * Barrier: waits until everything submitted so far is done, and lets the device write
+ * its write cache to the medium. Writes only go to the medium before this when the
+ * device has no write cache. Returns 0 on success, -1 on error.
+ */
+int block_flush (device_t *dev) {
+  request_queue_t *queue = block_get_queue (dev);
+
+  while (queue->pending || queue->inflight) {
+    if (block_dispatch (queue)) continue;
+
+    int state = disable_ints ();
+    if (queue->inflight) block_sleep (&queue->wait);
+    restore_ints (state);
+  }
+
+  if (! dev->flush) return 0;
+  return dev->flush (dev->major_num, dev->minor_num);
+}
+
+
+/**
+ * Synchronous transfer of a kernel buffer through the queue of the device. Returns
+ * number of bytes transferred.
+ */
+Uint32 block_transfer_bio (device_t *dev, int direction, Uint64 offset, Uint32 size, char *buffer) {
+  bio_t bio;
+
+  memset (&bio, 0, sizeof (bio_t));
+  bio.dev = dev;
+  bio.direction = direction;
+  bio.offset = offset;
+  bio.size = size;
+  bio.buffer = buffer;
+
+  block_submit (&bio);
+  block_wait (&bio);
+
+  return bio.done;
+}
+
+
+/**
+ * Returns a free bounce buffer, sleeps until one is released when they are all in use
+ */
+char *block_get_bounce (void) {
+  int i;
+
+  int state = disable_ints ();
+  for (;;) {
+    for (i=0; i!=BLOCK_BOUNCE_BUFFERS; i++) {
+      if (block_bounce_busy[i]) continue;
+
+      block_bounce_busy[i] = 1;
+      restore_ints (state);
+      return block_bounce[i];
+    }
+    block_sleep (&block_bounce_wait);
+  }
+}
+
+
+/**
+ * Releases a bounce buffer from block_get_bounce()
+ */
+void block_put_bounce (char *bounce) {
+  int i;
+
+  int state = disable_ints ();
+  for (i=0; i!=BLOCK_BOUNCE_BUFFERS; i++) {
+    if (block_bounce[i] == bounce) block_bounce_busy[i] = 0;
+  }
+  sched_wakeup (&block_bounce_wait);
+  restore_ints (state);
+}
+
+
+/**
+ * Synchronous transfer through the queue of the device. Returns number of bytes transferred.
+ * Task memory (a user buffer from sys_read(), or a task's stack) is only mapped while that
+ * task runs, but the bio can be dispatched by another task or completed from an interrupt
+ * handler. Those transfers go through a kernel bounce buffer, copied in our own context.
+ */
+Uint32 block_transfer (device_t *dev, int direction, Uint64 offset, Uint32 size, char *buffer) {
+  pagedirectory_t *directory = _current_task ? _current_task->page_directory : _current_pagedirectory;
+  Uint32 count, len, done;
+  char *bounce;
+
+  if (size == 0) return 0;
+  if (is_kernel_address (directory, (Uint32)buffer, size)) return block_transfer_bio (dev, direction, offset, size, buffer);
+
+  bounce = block_get_bounce ();
+  for (count = 0; count != size; count += done) {
+    len = (size - count > BLOCK_MAX_MERGE) ? BLOCK_MAX_MERGE : size - count;
+
+    if (direction == BLOCK_WRITE) memcpy (bounce, buffer + count, len);
+    done = block_transfer_bio (dev, direction, offset + count, len, bounce);
+    if (direction == BLOCK_READ) memcpy (buffer + count, bounce, done);
+
+    if (done != len) {
+      count += done;
+      break;
+    }
+  }
+  block_put_bounce (bounce);
+
+  return count;
+}
+
+
+/**
+ * Reads from a block device through its request queue. Returns number of bytes read.
+ */
+Uint32 block_read (device_t *dev, Uint64 offset, Uint32 size, char *buffer) {
+  return block_transfer (dev, BLOCK_READ, offset, size, buffer);
+}
+
+
+/**
+ * Writes to a block device through its request queue. Returns number of bytes written.
+ */
+Uint32 block_write (device_t *dev, Uint64 offset, Uint32 size, char *buffer) {
+  return block_transfer (dev, BLOCK_WRITE, offset, size, buffer);
+}
+
+
+/**
+ * No-op scheduler: requests go to the driver in arrival order (after merging)
+ */
+request_t *block_noop_next (request_queue_t *queue) {
+  return queue->pending;
+}
+
+
+/**
+ * C-LOOK elevator: serves requests in ascending order from the current position. When
+ * there is nothing after the position anymore, it starts again at the lowest request.
+ */
+request_t *block_clook_next (request_queue_t *queue) {
+  request_t *req, *next = NULL, *lowest = NULL;
+
+  for (req = queue->pending; req != NULL; req = req->next) {
+    if (lowest == NULL || req->offset < lowest->offset) lowest = req;
+    if (req->offset < queue->position) continue;
+    if (next == NULL || req->offset < next->offset) next = req;
+  }
+
+  return next ? next : lowest;
+}
+
+
+/**
+ * Deadline scheduler: C-LOOK, except that the oldest request is served first as soon as
+ * it expires. Reads expire sooner than writes, since a task is usually waiting for them.
+ */
+request_t *block_deadline_next (request_queue_t *queue) {
+  request_t *req, *expired = NULL;
+
+  for (req = queue->pending; req != NULL; req = req->next) {
+    if (req->deadline > _kernel_ticks) continue;
+    if (expired == NULL || req->deadline < expired->deadline) expired = req;
+  }
+
+  return expired ? expired : block_clook_next (queue);
+}
+
+
+/**
+ * Prints the block layer counters
+ */
+void block_print_stats (void) {
+  kprintf ("Block layer: %d bios, %d back merges, %d front merges, %d requests, %d commits\n",
+           block_stats.bios, block_stats.back_merges, block_stats.front_merges, block_stats.requests, block_stats.commits);
+}
@@ -54,7 +54,7 @@ int device_register (device_t *dev, const char *filename) {
   // Create device node
   vfs_node_t node;
   vfs_get_node_from_path ("DEVICE:/", &node);
-  vfs_mknod (&node, filename, FS_BLOCKDEVICE, dev->major_num, dev->minor_num);
+  vfs_mknod (&node, filename, (dev->type == FS_CHARDEVICE) ? FS_CHARDEVICE : FS_BLOCKDEVICE, dev->major_num, dev->minor_num);
 
   return 1;
 }
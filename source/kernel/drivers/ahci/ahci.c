@@ -0,0 +1,745 @@
+/******************************************************************************
+ *
+ *  File        : ahci.c
+ *  Description : AHCI (SATA) controller. Every port has a list of 32 command
+ *                slots. On disks that support it, reads and writes are sent as
+ *                native queued commands (READ/WRITE FPDMA QUEUED), so the disk
+ *                works on all of them at once and picks its own order. The
+ *                data is transferred straight from and into the buffer of the
+ *                bio, the IRQ handler completes the bios.
+ *
+ *****************************************************************************/
+
+#include "drivers/ahci.h"
+#include "drivers/ide.h"
+#include "drivers/ide_partitions.h"
+#include "device.h"
+#include "kernel.h"
+#include "kmem.h"
+#include "paging.h"
+#include "pci.h"
+#include "schedule.h"
+
+static int ahci_disk_count = 0;
+
+
+/**
+ * Spins until (register & mask) == value. Returns 0 on success, -1 on timeout.
+ */
+int ahci_wait_register (volatile Uint32 *reg, Uint32 mask, Uint32 value) {
+  int timeout = AHCI_TIMEOUT;
+
+  while ((*reg & mask) != value) {
+    if (--timeout == 0) return -1;
+  }
+  return 0;
+}
+
+
+/**
+ * Fills the PRD table of a command with the physical pages of size bytes at buffer.
+ * Physically adjacent pages share an entry. Returns the number of entries. Commands are
+ * also issued from the IRQ handler and by other tasks, so the buffer must be kernel
+ * memory, which is the same in every page directory.
+ */
+int ahci_port_prdt (ahci_cmd_table_t *table, char *buffer, Uint32 size) {
+  pagedirectory_t *directory = _kernel_pagedirectory;
+  Uint32 address = (Uint32)buffer;
+  Uint32 phys, len;
+  int i = 0;
+
+  while (size > 0) {
+    phys = get_physical_address (directory, address);
+    len = 0x1000 - (address & 0xFFF);
+    if (len > size) len = size;
+
+    if (i > 0 && table->prdt[i-1].dba + (table->prdt[i-1].dbc & 0x3FFFFF) + 1 == phys &&
+        (table->prdt[i-1].dbc & 0x3FFFFF) + 1 + len <= AHCI_PRD_MAX_BYTES) {
+      table->prdt[i-1].dbc += len;
+    } else {
+      table->prdt[i].dba = phys;
+      table->prdt[i].dbau = 0;
+      table->prdt[i].reserved = 0;
+      table->prdt[i].dbc = len - 1;
+      i++;
+    }
+
+    address += len;
+    size -= len;
+  }
+
+  return i;
+}
+
+
+/**
+ * Returns 1 when the bio overlaps a transfer in progress and one of them is a write.
+ * Queued commands can finish in any order, so these have to wait.
+ */
+int ahci_port_overlaps (ahci_port_t *port, bio_t *bio) {
+  bio_t *busy;
+  int slot;
+
+  for (slot=0; slot!=port->slots; slot++) {
+    busy = port->slot_bio[slot];
+    if (! busy || busy->size == 0) continue;
+    if (bio->direction != BLOCK_WRITE && busy->direction != BLOCK_WRITE) continue;
+    if (bio->offset < busy->offset + busy->size && busy->offset < bio->offset + bio->size) return 1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * Sends the command for the next part of the bio in a free slot. A bio of 0 bytes
+ * flushes the write cache. Must be called with interrupts disabled.
+ */
+void ahci_port_issue (ahci_port_t *port, int slot, bio_t *bio) {
+  ahci_cmd_header_t *header = &port->cmd_list[slot];
+  ahci_cmd_table_t *table = &port->cmd_table[slot];
+  ahci_fis_h2d_t *fis = (ahci_fis_h2d_t *)table->cfis;
+  Uint64 lba = (bio->offset + bio->done) >> 9;
+  Uint32 count = (bio->size - bio->done) >> 9;
+  char queued = (port->ncq && bio->size > 0);
+
+  if (count > AHCI_MAX_SECTORS) count = AHCI_MAX_SECTORS;
+
+  memset (fis, 0, sizeof (ahci_fis_h2d_t));
+  fis->type = AHCI_FIS_REG_H2D;
+  fis->flags = AHCI_FIS_COMMAND;
+
+  header->flags = sizeof (ahci_fis_h2d_t) / 4;
+  header->prdbc = 0;
+
+  if (bio->size == 0) {
+    fis->command = port->lba48 ? AHCI_ATA_CACHE_FLUSH_EXT : AHCI_ATA_CACHE_FLUSH;
+    header->prdtl = 0;
+    port->flushing = 1;
+  } else {
+    if (bio->direction == BLOCK_WRITE) header->flags |= AHCI_CMD_WRITE;
+    header->prdtl = ahci_port_prdt (table, bio->buffer + bio->done, count << 9);
+
+    fis->lba0 = (lba >> 0) & 0xFF;
+    fis->lba1 = (lba >> 8) & 0xFF;
+    fis->lba2 = (lba >> 16) & 0xFF;
+    fis->device = 0x40;           // LBA addressing
+
+    if (queued) {
+      // The sector count goes into the features register, the count register holds the tag
+      fis->command = (bio->direction == BLOCK_WRITE) ? AHCI_ATA_WRITE_FPDMA : AHCI_ATA_READ_FPDMA;
+      fis->feature_lo = count & 0xFF;
+      fis->feature_hi = (count >> 8) & 0xFF;
+      fis->count_lo = slot << 3;
+    } else {
+      fis->count_lo = count & 0xFF;
+      fis->count_hi = (count >> 8) & 0xFF;
+      if (port->lba48) {
+        fis->command = (bio->direction == BLOCK_WRITE) ? AHCI_ATA_WRITE_DMA_EXT : AHCI_ATA_READ_DMA_EXT;
+      } else {
+        fis->command = (bio->direction == BLOCK_WRITE) ? AHCI_ATA_WRITE_DMA : AHCI_ATA_READ_DMA;
+        fis->device |= ((Uint32)lba >> 24) & 0x0F;
+      }
+    }
+    if (port->lba48) {
+      fis->lba3 = (lba >> 24) & 0xFF;
+      fis->lba4 = (lba >> 32) & 0xFF;
+      fis->lba5 = (lba >> 40) & 0xFF;
+    }
+  }
+
+  port->slot_bio[slot] = bio;
+  port->slot_bytes[slot] = count << 9;
+  port->slots_busy |= (1U << slot);
+
+  // The command table must be in memory before the HBA is told about it
+  __asm__ __volatile__ ("" : : : "memory");
+
+  if (queued) port->regs->sact = (1U << slot);
+  port->regs->ci = (1U << slot);
+}
+
+
+/**
+ * Issues waiting bios while there are free slots. Must be called with interrupts disabled.
+ */
+void ahci_port_start (ahci_port_t *port) {
+  bio_t *bio;
+  int slot;
+
+  while ((bio = port->bio_head) != NULL) {
+    // A flush waits until everything before it is done, and runs on its own
+    if (port->flushing) break;
+    if (bio->size == 0 && port->slots_busy) break;
+    if (ahci_port_overlaps (port, bio)) break;
+
+    for (slot=0; slot!=port->slots && (port->slots_busy & (1U << slot)); slot++) ;
+    if (slot == port->slots) break;
+
+    port->bio_head = bio->next;
+    if (port->bio_head == NULL) port->bio_tail = NULL;
+
+    ahci_port_issue (port, slot, bio);
+  }
+}
+
+
+/**
+ * Adds a bio to the end of the waiting list, and issues it when a slot is free. Must
+ * be called with interrupts disabled.
+ */
+void ahci_port_queue (ahci_port_t *port, bio_t *bio) {
+  bio->next = NULL;
+  if (port->bio_tail) port->bio_tail->next = bio; else port->bio_head = bio;
+  port->bio_tail = bio;
+
+  ahci_port_start (port);
+}
+
+
+/**
+ * Recovers the port after an error. The disk aborts all queued commands when one of
+ * them fails, so every command in progress is failed. The command engine has to be
+ * restarted before new commands are accepted. Must be called with interrupts disabled.
+ * @TODO: Read the NCQ error log to fail only the command that went wrong
+ */
+void ahci_port_error (ahci_port_t *port) {
+  ahci_port_regs_t *regs = port->regs;
+  bio_t *bio;
+  int slot;
+
+  kprintf ("AHCI: error on SATA%d (status %02X, error %02X)\n", port->disk_nr, regs->tfd & 0xFF, (regs->tfd >> 8) & 0xFF);
+
+  regs->cmd &= ~AHCI_PxCMD_ST;
+  ahci_wait_register (&regs->cmd, AHCI_PxCMD_CR, 0);
+  regs->serr = 0xFFFFFFFF;
+  regs->is = 0xFFFFFFFF;
+
+  // A device that is still busy blocks the command list, unless we override it
+  if ((regs->tfd & (AHCI_TFD_BSY | AHCI_TFD_DRQ)) && (port->controller->hba->cap & AHCI_CAP_SCLO)) {
+    regs->cmd |= AHCI_PxCMD_CLO;
+    ahci_wait_register (&regs->cmd, AHCI_PxCMD_CLO, 0);
+  }
+  regs->cmd |= AHCI_PxCMD_ST;
+
+  for (slot=0; slot!=port->slots; slot++) {
+    bio = port->slot_bio[slot];
+    if (! bio) continue;
+
+    port->slot_bio[slot] = NULL;
+    bio->flags |= BIO_ERROR;      // A failed flush has nothing to transfer, so mark it here
+    block_end_io (bio);
+  }
+  port->slots_busy = 0;
+  port->flushing = 0;
+}
+
+
+/**
+ * Finishes the commands that are done and issues the next ones. Called by the IRQ
+ * handler, or by the waiting task when there is no IRQ. Must be called with interrupts
+ * disabled.
+ */
+void ahci_port_complete (ahci_port_t *port) {
+  ahci_port_regs_t *regs = port->regs;
+  Uint32 status, done;
+  bio_t *bio;
+  int slot;
+
+  status = regs->is;
+  regs->is = status;
+
+  // A slot is busy until the HBA cleared its command issue bit, and for queued commands
+  // until the disk cleared its active bit as well
+  done = port->slots_busy & ~(regs->ci | regs->sact);
+
+  for (slot=0; done != 0; slot++) {
+    if (! (done & (1U << slot))) continue;
+    done &= ~(1U << slot);
+
+    bio = port->slot_bio[slot];
+    port->slot_bio[slot] = NULL;
+    port->slots_busy &= ~(1U << slot);
+    if (bio->size == 0) port->flushing = 0;
+
+    bio->done += port->slot_bytes[slot];
+    if (bio->done == bio->size) {
+      block_end_io (bio);
+      continue;
+    }
+
+    // Large bios take more commands, the rest goes first
+    bio->next = port->bio_head;
+    port->bio_head = bio;
+    if (port->bio_tail == NULL) port->bio_tail = bio;
+  }
+
+  if (status & AHCI_PxIS_ERRORS) ahci_port_error (port);
+
+  ahci_port_start (port);
+}
+
+
+/**
+ * Waits until a bio of the port is done. Without an IRQ nobody else finishes the
+ * commands, so we look at the port ourselves.
+ */
+void ahci_port_wait (ahci_port_t *port, bio_t *bio) {
+  while (! (bio->flags & BIO_DONE)) {
+    if (ints_enabled () && port->controller->irq) {
+      block_wait_io (bio);
+      return;
+    }
+
+    int state = disable_ints ();
+    ahci_port_complete (port);
+    restore_ints (state);
+  }
+}
+
+
+/**
+ * AHCI interrupt handler. Every port that raised the interrupt gets its finished
+ * commands completed. The port status has to be cleared before the status of the HBA.
+ */
+int ahci_interrupt (regs_t *r) {
+  ahci_controller_t *ctrl;
+  Uint32 status;
+  int i, port_nr, rescheduling = 0;
+
+  for (i=0; i!=AHCI_MAX_CONTROLLERS; i++) {
+    ctrl = &ahci_controllers[i];
+    if (! ctrl->enabled || ctrl->irq != r->int_no) continue;
+
+    // The IRQ line can be shared, so it might not be ours
+    status = ctrl->hba->is;
+    if (! status) continue;
+
+    for (port_nr=0; port_nr!=AHCI_MAX_PORTS; port_nr++) {
+      if (! (status & (1U << port_nr))) continue;
+
+      if (ctrl->port[port_nr].enabled) {
+        ahci_port_complete (&ctrl->port[port_nr]);
+      } else {
+        ctrl->hba->port[port_nr].is = ctrl->hba->port[port_nr].is;
+      }
+    }
+    ctrl->hba->is = status;
+
+    rescheduling = 1;
+  }
+
+  return rescheduling;
+}
+
+
+/**
+ * Synchronous transfer of whole sectors. Returns the number of bytes transferred.
+ */
+Uint32 ahci_port_transfer (ahci_port_t *port, int direction, Uint64 offset, Uint32 size, char *buffer) {
+  bio_t bio;
+
+  memset (&bio, 0, sizeof (bio_t));
+  bio.dev = device_get_device (DEV_MAJOR_SATA, port->disk_nr);
+  bio.direction = direction;
+  bio.offset = offset;
+  bio.size = size;
+  bio.buffer = buffer;
+
+  int state = disable_ints ();
+  ahci_port_queue (port, &bio);
+  restore_ints (state);
+  ahci_port_wait (port, &bio);
+
+  return bio.done;
+}
+
+
+/**
+ * Transfers a bio that does not start or end on a sector boundary, or has a buffer
+ * the HBA cannot use (it must be word aligned). Whole sectors are transferred directly,
+ * the rest goes through the scratch buffer of the port (read-modify-write for writes).
+ * Everything is done before we return.
+ */
+void ahci_block_partial (ahci_port_t *port, bio_t *bio) {
+  Uint64 offset = bio->offset;
+  Uint32 skip, len;
+
+  while (bio->done != bio->size) {
+    skip = offset & (AHCI_SECTOR_SIZE - 1);
+    len = bio->size - bio->done;
+
+    if (skip == 0 && len >= AHCI_SECTOR_SIZE && ((Uint32)(bio->buffer + bio->done) & 1) == 0) {
+      len &= ~(AHCI_SECTOR_SIZE - 1);
+      if (ahci_port_transfer (port, bio->direction, offset, len, bio->buffer + bio->done) != len) break;
+    } else {
+      if (len > AHCI_SECTOR_SIZE - skip) len = AHCI_SECTOR_SIZE - skip;
+
+      // Only one task at a time can use the scratch buffer
+      while (1) {
+        int state = disable_ints ();
+        if (! port->scratch_busy) {
+          port->scratch_busy = 1;
+          restore_ints (state);
+          break;
+        }
+        if (_current_task != NULL && _current_task->pid != PID_IDLE) sched_interruptable_sleep (&port->scratch_wait);
+        restore_ints (state);
+      }
+
+      Uint32 ret = ahci_port_transfer (port, BLOCK_READ, offset - skip, AHCI_SECTOR_SIZE, port->scratch);
+      if (ret == AHCI_SECTOR_SIZE) {
+        if (bio->direction == BLOCK_READ) {
+          memcpy (bio->buffer + bio->done, port->scratch + skip, len);
+        } else {
+          memcpy (port->scratch + skip, bio->buffer + bio->done, len);
+          ret = ahci_port_transfer (port, BLOCK_WRITE, offset - skip, AHCI_SECTOR_SIZE, port->scratch);
+        }
+      }
+
+      int state = disable_ints ();
+      port->scratch_busy = 0;
+      if (_current_task != NULL) sched_wakeup (&port->scratch_wait);
+      restore_ints (state);
+
+      if (ret != AHCI_SECTOR_SIZE) break;
+    }
+
+    bio->done += len;
+    offset += len;
+  }
+
+  block_end_io (bio);
+}
+
+
+/**
+ * Starts a transfer. The commands are issued right away when there are free slots,
+ * otherwise they wait for one. The IRQ handler completes the bio.
+ */
+void ahci_block_submit (Uint8 major, Uint8 minor, bio_t *bio) {
+  device_t *device = (major == DEV_MAJOR_SATA) ? device_get_device(major, minor) : NULL;
+  ahci_port_t *port = device ? (ahci_port_t *)device->data : NULL;
+
+  // Task memory cannot be translated outside of its task (the block layer bounces it)
+  bio->done = 0;
+  if (! port || ! port->enabled || bio->size == 0 ||
+      bio->offset + bio->size > port->size << 9 ||
+      ! is_kernel_address (_kernel_pagedirectory, (Uint32)bio->buffer, bio->size)) {
+    block_end_io (bio);
+    return;
+  }
+
+  if ((bio->offset & (AHCI_SECTOR_SIZE - 1)) || (bio->size & (AHCI_SECTOR_SIZE - 1)) || ((Uint32)bio->buffer & 1)) {
+    ahci_block_partial (port, bio);
+    return;
+  }
+
+  int state = disable_ints ();
+  ahci_port_queue (port, bio);
+  restore_ints (state);
+
+  // Without interrupts nobody would finish the transfer
+  if (! ints_enabled () || ! port->controller->irq) ahci_port_wait (port, bio);
+}
+
+
+/**
+ * Synchronous read, returns the number of bytes read
+ */
+Uint32 ahci_block_read (Uint8 major, Uint8 minor, Uint64 offset, Uint32 size, char *buffer) {
+  bio_t bio;
+
+  if (major != DEV_MAJOR_SATA) return 0;
+
+  memset (&bio, 0, sizeof (bio_t));
+  bio.dev = device_get_device(major, minor);
+  bio.direction = BLOCK_READ;
+  bio.offset = offset;
+  bio.size = size;
+  bio.buffer = buffer;
+
+  ahci_block_submit (major, minor, &bio);
+  block_wait_io (&bio);
+
+  return bio.done;
+}
+
+
+/**
+ * Synchronous write, returns the number of bytes written
+ */
+Uint32 ahci_block_write (Uint8 major, Uint8 minor, Uint64 offset, Uint32 size, char *buffer) {
+  bio_t bio;
+
+  if (major != DEV_MAJOR_SATA) return 0;
+
+  memset (&bio, 0, sizeof (bio_t));
+  bio.dev = device_get_device(major, minor);
+  bio.direction = BLOCK_WRITE;
+  bio.offset = offset;
+  bio.size = size;
+  bio.buffer = buffer;
+
+  ahci_block_submit (major, minor, &bio);
+  block_wait_io (&bio);
+
+  return bio.done;
+}
+
+
+/**
+ * Writes the write cache of the disk to the medium. The flush waits until the commands
+ * before it are done. Returns 0 on success, -1 on error.
+ */
+int ahci_block_flush (Uint8 major, Uint8 minor) {
+  bio_t bio;
+
+  device_t *device = (major == DEV_MAJOR_SATA) ? device_get_device(major, minor) : NULL;
+  ahci_port_t *port = device ? (ahci_port_t *)device->data : NULL;
+  if (! port || ! port->enabled) return -1;
+
+  // A bio without data is a flush for the port
+  memset (&bio, 0, sizeof (bio_t));
+  bio.dev = device;
+  bio.direction = BLOCK_WRITE;
+
+  int state = disable_ints ();
+  ahci_port_queue (port, &bio);
+  restore_ints (state);
+  ahci_port_wait (port, &bio);
+
+  return (bio.flags & BIO_ERROR) ? -1 : 0;
+}
+void ahci_block_open (Uint8 major, Uint8 minor) {
+  // Doesn't do anything.
+}
+void ahci_block_close (Uint8 major, Uint8 minor) {
+  // Doesn't do anything.
+}
+void ahci_block_seek (Uint8 major, Uint8 minor, Uint32 offset, Uint8 direction) {
+  // Doesn't do anything.
+}
+
+
+/**
+ * Reads the identify data of the disk into the scratch buffer. Interrupts of the port
+ * are not enabled yet, so the command is polled. Returns 0 on success, -1 on error.
+ */
+int ahci_port_identify (ahci_port_t *port) {
+  ahci_cmd_header_t *header = &port->cmd_list[0];
+  ahci_cmd_table_t *table = &port->cmd_table[0];
+  ahci_fis_h2d_t *fis = (ahci_fis_h2d_t *)table->cfis;
+  int timeout = AHCI_TIMEOUT;
+
+  memset (fis, 0, sizeof (ahci_fis_h2d_t));
+  fis->type = AHCI_FIS_REG_H2D;
+  fis->flags = AHCI_FIS_COMMAND;
+  fis->command = AHCI_ATA_IDENTIFY;
+
+  header->flags = sizeof (ahci_fis_h2d_t) / 4;
+  header->prdtl = 1;
+  header->prdbc = 0;
+  table->prdt[0].dba = port->scratch_phys;
+  table->prdt[0].dbau = 0;
+  table->prdt[0].dbc = AHCI_SECTOR_SIZE - 1;
+
+  __asm__ __volatile__ ("" : : : "memory");
+  port->regs->ci = 1;
+
+  while (port->regs->ci & 1) {
+    if (port->regs->is & AHCI_PxIS_TFES) return -1;
+    if (--timeout == 0) return -1;
+  }
+
+  port->regs->is = port->regs->is;
+  return 0;
+}
+
+
+/**
+ * Sets up the command list of a port with a disk attached, and identifies the disk.
+ */
+void ahci_init_port (ahci_controller_t *ctrl, int port_nr) {
+  ahci_port_t *port = &ctrl->port[port_nr];
+  ahci_port_regs_t *regs = &ctrl->hba->port[port_nr];
+  Uint16 *ident;
+  char *mem;
+  int i, depth;
+
+  port->enabled = 0;
+  port->port_nr = port_nr;
+  port->controller = ctrl;
+  port->regs = regs;
+
+  // Only ports with a live link to a disk
+  if ((regs->ssts & 0x0F) != AHCI_SSTS_DET_PRESENT) return;
+  if (((regs->ssts >> 8) & 0x0F) != AHCI_SSTS_IPM_ACTIVE) return;
+  if (regs->sig != AHCI_SIG_ATA) return;     // @TODO: SATAPI drives
+  if (ahci_disk_count == AHCI_MAX_DISKS) return;
+
+  // Stop the command engine before moving the command list
+  regs->cmd &= ~(AHCI_PxCMD_ST | AHCI_PxCMD_FRE);
+  if (ahci_wait_register (&regs->cmd, AHCI_PxCMD_CR | AHCI_PxCMD_FR, 0) != 0) return;
+
+  // Command list (1KB) and received FIS area (256 bytes) share a page
+  mem = (char *)kmalloc_dma (0x1000, &port->cmd_list_phys);
+  port->cmd_table = (ahci_cmd_table_t *)kmalloc_dma (ctrl->slots * sizeof (ahci_cmd_table_t), &port->cmd_table_phys);
+  port->scratch = (char *)kmalloc_dma (AHCI_SECTOR_SIZE, &port->scratch_phys);
+  if (! mem || ! port->cmd_table || ! port->scratch) return;
+
+  memset (mem, 0, 0x1000);
+  memset (port->cmd_table, 0, ctrl->slots * sizeof (ahci_cmd_table_t));
+  port->cmd_list = (ahci_cmd_header_t *)mem;
+  for (i=0; i!=ctrl->slots; i++) {
+    port->cmd_list[i].ctba = port->cmd_table_phys + i * sizeof (ahci_cmd_table_t);
+    port->cmd_list[i].ctbau = 0;
+  }
+
+  regs->clb = port->cmd_list_phys;
+  regs->clbu = 0;
+  regs->fb = port->cmd_list_phys + 0x400;
+  regs->fbu = 0;
+  regs->serr = 0xFFFFFFFF;
+  regs->is = 0xFFFFFFFF;
+  regs->cmd |= AHCI_PxCMD_FRE;
+
+  // The disk must be ready before the command engine starts
+  if (ahci_wait_register (&regs->tfd, AHCI_TFD_BSY | AHCI_TFD_DRQ, 0) != 0) {
+    if (! (ctrl->hba->cap & AHCI_CAP_SCLO)) return;
+    regs->cmd |= AHCI_PxCMD_CLO;
+    if (ahci_wait_register (&regs->cmd, AHCI_PxCMD_CLO, 0) != 0) return;
+  }
+  regs->cmd |= AHCI_PxCMD_ST;
+
+  if (ahci_port_identify (port) != 0) return;
+  ident = (Uint16 *)port->scratch;
+
+  // Get drive size
+  if (ident[AHCI_IDENT_COMMANDSETS] & (1 << 10)) {
+    port->size  = *(Uint64 *)&ident[AHCI_IDENT_MAX_LBA_EXT] & 0xFFFFFFFFFFFFULL;
+    port->lba48 = 1;
+  } else {
+    port->size  = *(Uint32 *)&ident[AHCI_IDENT_MAX_LBA];
+    port->lba48 = 0;
+  }
+
+  // Get identification string
+  for (i=0; i<20; i++) {
+    port->model[i*2] = ident[AHCI_IDENT_MODEL + i] >> 8;
+    port->model[i*2+1] = ident[AHCI_IDENT_MODEL + i] & 0xFF;
+  }
+  port->model[40] = 0;
+
+  // Queue as many commands as both the HBA and the disk can handle
+  port->slots = ctrl->slots;
+  port->ncq = (ctrl->ncq && (ident[AHCI_IDENT_SATA_CAP] & (1 << 8)));
+  if (port->ncq) {
+    depth = (ident[AHCI_IDENT_QUEUE_DEPTH] & 0x1F) + 1;
+    if (depth < port->slots) port->slots = depth;
+  }
+
+  sched_init_waitqueue (&port->scratch_wait);
+  port->slots_busy = 0;
+  port->flushing = 0;
+  port->bio_head = port->bio_tail = NULL;
+
+  regs->ie = AHCI_PxIS_DHRS | AHCI_PxIS_SDBS | AHCI_PxIS_ERRORS;
+
+  port->disk_nr = ahci_disk_count++;
+  port->enabled = 1;
+}
+
+
+/**
+ * Registers the disk on a port, and the partitions on it
+ */
+void ahci_register_port (ahci_port_t *port) {
+  device_t *device = (device_t *)kmalloc (sizeof (device_t));
+  memset (device, 0, sizeof (device_t));
+  device->major_num = DEV_MAJOR_SATA;
+  device->minor_num = port->disk_nr;
+  device->data = (ahci_port_t *)port;
+
+  device->read = ahci_block_read;
+  device->write = ahci_block_write;
+  device->open = ahci_block_open;
+  device->close = ahci_block_close;
+  device->seek = ahci_block_seek;
+  device->submit = ahci_block_submit;
+  device->flush = ahci_block_flush;
+
+  // Create device name
+  char filename[20];
+  memset (filename, 0, sizeof (filename));
+  sprintf (filename, "SATA%d", port->disk_nr);
+
+//  kprintf ("\n*** Registering device DEVICE:/%s\n", filename);
+  device_register (device, filename);
+
+  // Initialise partitions from the MBR
+  ide_read_partition_table (device, filename, DEV_MAJOR_SATA_PART, port->disk_nr * 16, 0);
+}
+
+
+/**
+ *
+ */
+void ahci_init_controller (ahci_controller_t *ctrl, pci_device_t *pci_dev) {
+  Uint32 abar, ports;
+  Uint8 irq;
+  int port_nr;
+
+  ctrl->pci = pci_dev;
+
+  // The registers are memory mapped through BAR5
+  abar = pci_config_get_dword (pci_dev, 0x24) & 0xFFFFFFF0;
+  if (! abar) return;
+  ctrl->hba = (ahci_hba_t *)kmap_mmio (abar, sizeof (ahci_hba_t));
+  if (! ctrl->hba) return;
+
+  // Enable memory space and let the controller become bus master
+  pci_config_set_word (pci_dev, 0x04, pci_config_get_word (pci_dev, 0x04) | 0x06);
+
+  // do_handle_irq() only hands IRQ 9 to 11 (where the BIOS puts PCI devices) to us. Otherwise we poll.
+  irq = pci_config_get_byte (pci_dev, 0x3C);
+  ctrl->irq = (AHCI_USE_IRQ && irq >= 9 && irq <= 11) ? irq : 0;
+
+  ctrl->hba->ghc |= AHCI_GHC_AE;
+  ctrl->slots = ((ctrl->hba->cap >> AHCI_CAP_NCS_SHIFT) & 0x1F) + 1;
+  ctrl->ncq = (ctrl->hba->cap & AHCI_CAP_SNCQ) ? 1 : 0;
+
+  ports = ctrl->hba->pi;
+  for (port_nr=0; port_nr!=AHCI_MAX_PORTS; port_nr++) {
+    if (ports & (1U << port_nr)) ahci_init_port (ctrl, port_nr);
+  }
+
+  // Interrupts are needed to read the partition tables
+  ctrl->enabled = 1;
+  ctrl->hba->is = 0xFFFFFFFF;
+  if (ctrl->irq) ctrl->hba->ghc |= AHCI_GHC_IE;
+
+  for (port_nr=0; port_nr!=AHCI_MAX_PORTS; port_nr++) {
+    if (ctrl->port[port_nr].enabled) ahci_register_port (&ctrl->port[port_nr]);
+  }
+}
+
+
+/**
+ *
+ */
+void ahci_init (void) {
+  int controller_num = 0;
+
+  memset (ahci_controllers, 0, sizeof (ahci_controllers));
+
+  // Detect SATA controllers in AHCI mode
+  pci_device_t *pci_dev = NULL;
+  while (pci_dev = pci_find_next_class (pci_dev, 0x01, 0x06), pci_dev != NULL) {
+    if (controller_num == AHCI_MAX_CONTROLLERS) break;
+
+    ahci_controllers[controller_num].controller_nr = controller_num;
+    ahci_init_controller (&ahci_controllers[controller_num], pci_dev);
+    controller_num++;
+  }
+}
@@ -8,6 +8,7 @@
 
 #include "drivers/floppy.h"
 #include "device.h"
+#include "block.h"
 #include "kernel.h"
 #include "kmem.h"
 
@@ -388,45 +389,66 @@ void fdc_read_floppy_sector (fdc_drive_t *drive, Uint32 lba_sector, char *buffer
 
 
 /**
- * Will read from 1 sector only. When offset % 512 == 0, we can read 512 bytes, less if
- * offset % 512 > 0
+ * Reads a bio sector by sector. The controller cannot queue anything, so the bio is
+ * completed before we return. Sectors that are only partly needed are read into a
+ * temporary buffer.
  */
-Uint32 fdc_block_read (Uint8 major, Uint8 minor, Uint32 offset, Uint32 size, char *buffer) {
+void fdc_block_submit (Uint8 major, Uint8 minor, bio_t *bio) {
   char tmpbuf[512];
+  Uint32 lba_sector, rest_data, len;
+
+  bio->done = 0;
 
   // Unknown minor device (ie: drive to read from)
-  if (minor < 0 || minor > 3) return 0;
+  device_t *device = (minor <= 3) ? device_get_device(major, minor) : NULL;
+
+  // @TODO: Writing to floppy is not supported yet
+  if (device && bio->direction == BLOCK_READ) {
+    // Switch to wanted drive
+    fdc_switch_active_drive ((fdc_drive_t *)device->data, 0);
 
-  device_t *device = device_get_device(major, minor);
-  if (! device) return 0;
+    while (bio->done != bio->size) {
+      // Find out starting sector (plus rest)
+      lba_sector = (bio->offset + bio->done) / 512;
+      rest_data = (bio->offset + bio->done) % 512;
 
-  // Switch to wanted drive
-//  kprintf ("Switch active drive\n");
-  fdc_switch_active_drive ((fdc_drive_t *)device->data, 0);
+      len = 512 - rest_data;
+      if (len > bio->size - bio->done) len = bio->size - bio->done;
 
-  // Find out starting sector (plus rest)
-  Uint32 lba_sector = offset / 512;
-  Uint32 rest_data = offset % 512;
+      // Read complete sector into temporary buffer and copy the part we need
+      fdc_read_floppy_sector ((fdc_drive_t *)device->data, lba_sector, (char *)&tmpbuf);
+      memcpy (bio->buffer + bio->done, &tmpbuf[rest_data], len);
 
-  // Truncate the amount we can read.
-  if (size + rest_data > 512) {
-    size = 512-rest_data;
-    kprintf ("Truncating size to %d\n", size);
+      bio->done += len;
+    }
   }
 
-  // Read complete sector into temporary buffer
-  fdc_read_floppy_sector ((fdc_drive_t *)device->data, lba_sector, (char *)&tmpbuf);
+  block_end_io (bio);
+}
+
+
+/**
+ * Synchronous read, returns the number of bytes read
+ */
+Uint32 fdc_block_read (Uint8 major, Uint8 minor, Uint64 offset, Uint32 size, char *buffer) {
+  bio_t bio;
+
+  memset (&bio, 0, sizeof (bio_t));
+  bio.dev = device_get_device(major, minor);
+  bio.direction = BLOCK_READ;
+  bio.offset = offset;
+  bio.size = size;
+  bio.buffer = buffer;
 
-  // Copy the part of the buffer we need
-//  kprintf ("fdc_block_read(): Returning from %d to %d (%d bytes)\n", rest_data, rest_data+size, size);
-  memcpy (buffer, &tmpbuf[rest_data], size);
+  fdc_block_submit (major, minor, &bio);
+  block_wait_io (&bio);
 
-  return size;
+  return bio.done;
 }
 
 
-Uint32 fdc_block_write (Uint8 major, Uint8 minor, Uint32 offset, Uint32 size, char *buffer) {
-  kprintf ("fdc_block_write(%d, %d, %d, %d, %08X)\n", major, minor, offset, size, buffer);
+Uint32 fdc_block_write (Uint8 major, Uint8 minor, Uint64 offset, Uint32 size, char *buffer) {
+  kprintf ("fdc_block_write(%d, %d, %d, %d, %08X)\n", major, minor, (Uint32)offset, size, buffer);
   kprintf ("write to floppy not supported yet\n");
   return 0;
 }
@@ -470,6 +492,7 @@ void fdc_init_drive (fdc_t *fdc, Uint8 drive_num, Uint8 drive_type) {
 
   // Register device so we can access it
   device_t *device = (device_t *)kmalloc (sizeof (device_t));
+  memset (device, 0, sizeof (device_t));
   device->major_num = DEV_MAJOR_FDC;
   device->minor_num = (fdc->controller_num * 2) + drive_num;
   device->data = (fdc_drive_t *)&fdc->drives[drive_num];
@@ -479,6 +502,7 @@ void fdc_init_drive (fdc_t *fdc, Uint8 drive_num, Uint8 drive_type) {
   device->open = fdc_block_open;
   device->close = fdc_block_close;
   device->seek = fdc_block_seek;
+  device->submit = fdc_block_submit;
 
   // Create device name
   char filename[12];
@@ -13,32 +13,30 @@
 #include "pci.h"
 
 /**
+ * Sends the read or write command for sector_count sectors to the drive. For DMA the
+ * bus master is prepared as well, but not started.
  *
+ * @return lba mode that was used (0: CHS, 1: LBA28, 2: LBA48)
  */
-Uint32 ide_ata_access(char direction, ide_drive_t *drive, Uint32 lba_sector, Uint32 sector_count, char *buf) {
-   unsigned char lba_mode /* 0: CHS, 1:LBA28, 2: LBA48 */, dma /* 0: No DMA, 1: DMA */, cmd;
+Uint8 ide_ata_issue(char direction, ide_drive_t *drive, Uint64 lba_sector, Uint32 sector_count, char dma) {
+   unsigned char lba_mode /* 0: CHS, 1:LBA28, 2: LBA48 */, cmd;
    unsigned char lba_io[6];
    unsigned int slavebit = drive->drive_nr;            // Read the Drive [Master/Slave]
-   unsigned int bus = drive->channel->base;            // Bus Base, like 0x1F0 which is also data port.
-   unsigned int words = 256;                           // Almost every ATA drive has a sector-size of 512-byte.
-   unsigned short cyl, i;
-   unsigned char head, sect, err;
-
-  // Disable IRQ's on channel
-  ide_port_write (drive->channel, IDE_REG_CONTROL, drive->channel->no_int = (ide_irq_invoked = 0x0) + 0x02);
+   unsigned short cyl;
+   unsigned char head, sect;
 
-  // when we want to read sector 0x10000000 or higher, it can only be done with LBA48
-  if (lba_sector >= 0x10000000) {
+  // Sectors from 0x10000000 and up, and more than 256 sectors at once, can only be done with LBA48
+  if (lba_sector + sector_count > 0x10000000 || sector_count > IDE_MAX_SECTORS_LBA28) {
     // lba48
     lba_mode  = 2;
-    lba_io[0] = (lba_sector & 0x000000FF) >> 0;
-    lba_io[1] = (lba_sector & 0x0000FF00) >> 8;
-    lba_io[2] = (lba_sector & 0x00FF0000) >> 16;
-    lba_io[3] = (lba_sector & 0xFF000000) >> 24;
-    lba_io[4] = 0; // LBA28 is integer, so 32-bits are enough to access 2TB.
-    lba_io[5] = 0; // LBA28 is integer, so 32-bits are enough to access 2TB.
+    lba_io[0] = (lba_sector >> 0) & 0xFF;
+    lba_io[1] = (lba_sector >> 8) & 0xFF;
+    lba_io[2] = (lba_sector >> 16) & 0xFF;
+    lba_io[3] = (lba_sector >> 24) & 0xFF;
+    lba_io[4] = (lba_sector >> 32) & 0xFF;
+    lba_io[5] = (lba_sector >> 40) & 0xFF;
     head      = 0; // Lower 4-bits of HDDEVSEL are not used here.
-  } else if (drive->capabilities & 0x200)  { // Drive supports LBA?
+  } else if (drive->capabilities & IDE_CAP_LBA)  { // Drive supports LBA?
     // lba28:
     lba_mode  = 1;
     lba_io[0] = (lba_sector & 0x00000FF) >> 0;
@@ -49,22 +47,19 @@ Uint32 ide_ata_access(char direction, ide_drive_t *drive, Uint32 lba_sector, Uin
     lba_io[5] = 0; // These Registers are not used here.
     head      = (lba_sector & 0xF000000) >> 24;
   } else {
-    // CHS:
+    // CHS: (drives without LBA are far below 4G sectors)
     lba_mode  = 0;
-    sect      = (lba_sector % 63) + 1;
-    cyl       = (lba_sector + 1  - sect) / (16 * 63);
+    sect      = ((Uint32)lba_sector % 63) + 1;
+    cyl       = ((Uint32)lba_sector + 1  - sect) / (16 * 63);
     lba_io[0] = sect;
     lba_io[1] = (cyl >> 0) & 0xFF;
     lba_io[2] = (cyl >> 8) & 0xFF;
     lba_io[3] = 0;
     lba_io[4] = 0;
     lba_io[5] = 0;
-    head      = (lba_sector + 1  - sect) % (16 * 63) / (63); // Head number is written to HDDEVSEL lower 4-bits.
+    head      = ((Uint32)lba_sector + 1  - sect) % (16 * 63) / (63); // Head number is written to HDDEVSEL lower 4-bits.
   }
 
-
-  dma = 0; // We don't support DMA
-
   while (ide_port_read (drive->channel, IDE_REG_STATUS) & IDE_SR_BSY) ; // Wait if busy.
 
   if (lba_mode == 0)
@@ -75,16 +70,19 @@ Uint32 ide_ata_access(char direction, ide_drive_t *drive, Uint32 lba_sector, Uin
 
   // (V) Write Parameters;
   if (lba_mode == 2) {
-    ide_port_write (drive->channel, IDE_REG_SECCOUNT1,   0);
+    ide_port_write (drive->channel, IDE_REG_SECCOUNT1,   (sector_count >> 8) & 0xFF);
     ide_port_write (drive->channel, IDE_REG_LBA3,   lba_io[3]);
     ide_port_write (drive->channel, IDE_REG_LBA4,   lba_io[4]);
     ide_port_write (drive->channel, IDE_REG_LBA5,   lba_io[5]);
   }
-  ide_port_write (drive->channel, IDE_REG_SECCOUNT0, sector_count);
+  ide_port_write (drive->channel, IDE_REG_SECCOUNT0, sector_count & 0xFF);   // 0 means 256 (or 65536 for LBA48)
   ide_port_write (drive->channel, IDE_REG_LBA0,   lba_io[0]);
   ide_port_write (drive->channel, IDE_REG_LBA1,   lba_io[1]);
   ide_port_write (drive->channel, IDE_REG_LBA2,   lba_io[2]);
 
+  // The bus master transfers from or into the bounce buffer
+  if (dma) ide_dma_prepare (drive->channel, sector_count * IDE_SECTOR_SIZE, direction);
+
   // Select command depending on the lba mode, dma and direction (read/write)
   if (lba_mode == 0 && dma == 0 && direction == 0) cmd = IDE_CMD_READ_PIO;
   if (lba_mode == 1 && dma == 0 && direction == 0) cmd = IDE_CMD_READ_PIO;
@@ -98,40 +96,127 @@ Uint32 ide_ata_access(char direction, ide_drive_t *drive, Uint32 lba_sector, Uin
   if (lba_mode == 0 && dma == 1 && direction == 1) cmd = IDE_CMD_WRITE_DMA;
   if (lba_mode == 1 && dma == 1 && direction == 1) cmd = IDE_CMD_WRITE_DMA;
   if (lba_mode == 2 && dma == 1 && direction == 1) cmd = IDE_CMD_WRITE_DMA_EXT;
+
+  // READ/WRITE MULTIPLE transfer a block of sectors per DRQ instead of a single sector
+  if (dma == 0 && direction == 0 && drive->multiple) cmd = (lba_mode == 2) ? IDE_CMD_READ_MULTIPLE_EXT : IDE_CMD_READ_MULTIPLE;
+  if (dma == 0 && direction == 1 && drive->multiple) cmd = (lba_mode == 2) ? IDE_CMD_WRITE_MULTIPLE_EXT : IDE_CMD_WRITE_MULTIPLE;
   ide_port_write (drive->channel, IDE_REG_COMMAND, cmd);
 
+  return lba_mode;
+}
+
+
+/**
+ * Transfers sector_count sectors with a single command. The caller makes sure the
+ * count fits the command (IDE_MAX_SECTORS_LBA28 or IDE_MAX_SECTORS_LBA48, or the
+ * DMA bounce buffer when the drive uses DMA). Written data can stay in the write cache
+ * of the drive until ide_ata_flush() is called.
+ *
+ * @return number of sectors transferred
+ */
+Uint32 ide_ata_access(char direction, ide_drive_t *drive, Uint64 lba_sector, Uint32 sector_count, char *buf) {
+   unsigned char dma /* 0: No DMA, 1: DMA */;
+   unsigned int bus = drive->channel->base;            // Bus Base, like 0x1F0 which is also data port.
+   unsigned int words = 256;                           // Almost every ATA drive has a sector-size of 512-byte.
+   Uint32 i, j, block;
+
+  // Enable IRQ's on channel, we sleep until the drive is done
+  dma = drive->dma;
+  ide_port_write (drive->channel, IDE_REG_CONTROL, drive->channel->no_int = 0x00);
+
+  if (dma && direction == 1) memcpy (drive->channel->dma_buffer, buf, sector_count * IDE_SECTOR_SIZE);
+  ide_ata_issue (direction, drive, lba_sector, sector_count, dma);
+
   if (dma) {
-    if (direction == 0) {
-       // @TODO: DMA Read.
-       kpanic ("DMA read is not supported yet.");
-    } else {
-      // @TODO: DMA Write.
-      kpanic ("DMA write is not supported yet.");
-    }
+    ide_dma_start (drive->channel);
+    if (ide_dma_wait (drive->channel) != 0) return 0;    // We cannot tell how much was transferred
+
+    if (direction == 0) memcpy (buf, drive->channel->dma_buffer, sector_count * IDE_SECTOR_SIZE);
   } else {
     if (direction == 0) {
       char *bufptr = buf;
-      // PIO Read.
-      for (i = 0; i < sector_count; i++) {
-        if ( (err = ide_polling (drive->channel, 1)), err != 0) return err; // Polling, set error and exit if there is.
-        insw (bus, (Uint32)bufptr, words);
-        bufptr += words*2;
+      // PIO Read. The last block of a READ MULTIPLE can be shorter than the others
+      block = drive->multiple ? drive->multiple : 1;
+      for (i = 0; i < sector_count; i += block) {
+        if (block > sector_count - i) block = sector_count - i;
+        if (ide_polling (drive->channel, 1) != 0) return i; // Polling, return what we have on errors
+        insw (bus, (Uint32)bufptr, words * block);
+        bufptr += words * 2 * block;
       }
     } else {
       char *bufptr = buf;
-      // PIO Write.
-      for (i = 0; i < sector_count; i++) {
-        ide_polling (drive->channel, 0); // Polling.
-        outsw (bus, (Uint32)bufptr, words);
-        bufptr += words*2;
+      // PIO Write. The drive raises an IRQ after every block, but not before the first one
+      block = drive->multiple ? drive->multiple : 1;
+      for (i = 0; i < sector_count; i += block) {
+        if (block > sector_count - i) block = sector_count - i;
+        if (i == 0) {
+          for (j = 0; j < 4; j++) ide_port_read (drive->channel, IDE_REG_ALTSTATUS);  // 400 nSecond delay
+          while (ide_port_read (drive->channel, IDE_REG_ALTSTATUS) & IDE_SR_BSY) ;
+          if (ide_port_read (drive->channel, IDE_REG_STATUS) & (IDE_SR_ERR | IDE_SR_DF)) return 0;
+        } else {
+          if (ide_polling (drive->channel, 1) != 0) return 0;  // We cannot tell which sectors made it
+        }
+        outsw (bus, (Uint32)bufptr, words * block);
+        bufptr += words * 2 * block;
       }
-
-      // Flush data
-      ide_port_write (drive->channel, IDE_REG_COMMAND, (char []) { IDE_CMD_CACHE_FLUSH, IDE_CMD_CACHE_FLUSH, IDE_CMD_CACHE_FLUSH_EXT }[lba_mode]);
-      ide_polling (drive->channel, 0); // Polling.
+      ide_polling (drive->channel, 0);
+      if (ide_port_read (drive->channel, IDE_REG_STATUS) & (IDE_SR_ERR | IDE_SR_DF)) return 0;
     }
   }
 
   // Return sector count
   return sector_count;
-}
\ No newline at end of file
+}
+
+
+/**
+ * Starts a DMA transfer and returns right away. The IRQ handler of the channel finishes
+ * it with ide_dma_stop(). The data is in (or must be in) the bounce buffer of the channel.
+ */
+void ide_ata_dma_start(char direction, ide_drive_t *drive, Uint64 lba_sector, Uint32 sector_count) {
+  ide_port_write (drive->channel, IDE_REG_CONTROL, drive->channel->no_int = 0x00);
+  ide_ata_issue (direction, drive, lba_sector, sector_count, 1);
+  ide_dma_start (drive->channel);
+}
+
+
+/**
+ * Lets the drive write its volatile write cache to the medium. Returns 0 on success,
+ * -1 on error.
+ */
+int ide_ata_flush(ide_drive_t *drive) {
+  // Enable IRQ's on channel, we sleep until the drive is done
+  ide_port_write (drive->channel, IDE_REG_CONTROL, drive->channel->no_int = 0x00);
+
+  while (ide_port_read (drive->channel, IDE_REG_STATUS) & IDE_SR_BSY) ; // Wait if busy.
+
+  ide_port_write (drive->channel, IDE_REG_HDDEVSEL, 0xE0 | (drive->drive_nr << 4));
+  ide_port_write (drive->channel, IDE_REG_COMMAND, drive->lba48 ? IDE_CMD_CACHE_FLUSH_EXT : IDE_CMD_CACHE_FLUSH);
+  ide_polling (drive->channel, 0);
+
+  if (ide_port_read (drive->channel, IDE_REG_STATUS) & (IDE_SR_ERR | IDE_SR_DF)) return -1;
+  return 0;
+}
+
+
+/**
+ * Enables READ/WRITE MULTIPLE with the given number of sectors per DRQ block. Leaves
+ * drive->multiple at 0 when the drive does not accept it.
+ */
+void ide_ata_set_multiple(ide_drive_t *drive, Uint8 sectors) {
+  drive->multiple = 0;
+  if (sectors == 0) return;
+
+  // Enable IRQ's on channel
+  ide_port_write (drive->channel, IDE_REG_CONTROL, drive->channel->no_int = 0x00);
+
+  while (ide_port_read (drive->channel, IDE_REG_STATUS) & IDE_SR_BSY) ; // Wait if busy.
+
+  ide_port_write (drive->channel, IDE_REG_HDDEVSEL, 0xA0 | (drive->drive_nr << 4));
+  ide_port_write (drive->channel, IDE_REG_SECCOUNT0, sectors);
+  ide_port_write (drive->channel, IDE_REG_COMMAND, IDE_CMD_SET_MULTIPLE);
+  ide_polling (drive->channel, 0);
+
+  if (ide_port_read (drive->channel, IDE_REG_STATUS) & (IDE_SR_ERR | IDE_SR_DF)) return;
+  drive->multiple = sectors;
+}
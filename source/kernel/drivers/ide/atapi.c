@@ -1,8 +1,9 @@
 /******************************************************************************
  *
  *  File        : atapi.c
- *  Description : ATAPI interface
- *
+ *  Description : ATAPI interface. Commands are SCSI packets that are sent to
+ *                the drive with the PACKET command, the data comes back over
+ *                PIO or through the bus master.
  *
  *****************************************************************************/
 
@@ -13,8 +14,182 @@
 #include "pci.h"
 
 
-Uint32 ide_atapi_access(char direction, ide_drive_t *drive, Uint32 lba_sector, Uint32 sector_count, char *buf) {
-  // @TODO: create atapi
-  kpanic ("IDE_ATAPI_ACCESS not supported");
+/**
+ * Sends the PACKET command and the command packet to the drive. size is the number of
+ * bytes the command returns. For DMA the bus master is prepared as well, but not started.
+ *
+ * @return 0 on success, -1 when the drive did not accept the packet
+ */
+int ide_atapi_issue(ide_drive_t *drive, Uint8 *packet, Uint32 size, char dma) {
+  ide_channel_t *channel = drive->channel;
+  Uint32 byte_count = (size > ATAPI_MAX_BYTE_COUNT) ? ATAPI_MAX_BYTE_COUNT : size;
+  Uint8 status;
+  int i;
+
+  // Enable IRQ's on channel, we sleep until the drive is done
+  ide_port_write (channel, IDE_REG_CONTROL, channel->no_int = 0x00);
+
+  while (ide_port_read (channel, IDE_REG_STATUS) & IDE_SR_BSY) ; // Wait if busy.
+
+  ide_port_write (channel, IDE_REG_HDDEVSEL, 0xA0 | (drive->drive_nr << 4));
+  for (i = 0; i < 4; i++) ide_port_read (channel, IDE_REG_ALTSTATUS);  // 400 nSecond delay
+
+  // With PIO the drive hands over at most byte_count bytes per DRQ block
+  ide_port_write (channel, IDE_REG_FEATURES, dma ? ATAPI_FEATURE_DMA : 0);
+  ide_port_write (channel, IDE_REG_LBA1, byte_count & 0xFF);
+  ide_port_write (channel, IDE_REG_LBA2, (byte_count >> 8) & 0xFF);
+
+  if (dma) ide_dma_prepare (channel, size, IDE_DIRECTION_READ);
+  ide_port_write (channel, IDE_REG_COMMAND, IDE_CMD_PACKET);
+
+  // Wait until the drive asks for the packet
+  for (i = 0; i < 4; i++) ide_port_read (channel, IDE_REG_ALTSTATUS);
+  while (ide_port_read (channel, IDE_REG_ALTSTATUS) & IDE_SR_BSY) ;
+  status = ide_port_read (channel, IDE_REG_STATUS);
+  if (status & (IDE_SR_ERR | IDE_SR_DF)) return -1;
+  if (! (status & IDE_SR_DRQ)) return -1;
+
+  // Some drives raise an IRQ when they want the packet, that one does not count
+  channel->irq_invoked = 0;
+  outsw (channel->base, (Uint32)packet, ATAPI_PACKET_SIZE / 2);
+
   return 0;
-}
\ No newline at end of file
+}
+
+
+/**
+ * Sends a command packet that reads size bytes (or nothing when size is 0) into buf,
+ * and waits until the drive is done.
+ *
+ * @return number of bytes read, or -1 on errors
+ */
+int ide_atapi_packet(ide_drive_t *drive, Uint8 *packet, char *buf, Uint32 size, char dma) {
+  ide_channel_t *channel = drive->channel;
+  Uint32 done = 0;
+  Uint32 bytes, len;
+
+  if (ide_atapi_issue (drive, packet, size, dma) != 0) return -1;
+
+  if (dma) {
+    ide_dma_start (channel);
+    if (ide_dma_wait (channel) != 0) return -1;    // We cannot tell how much was transferred
+    memcpy (buf, channel->dma_buffer, size);
+    return size;
+  }
+
+  // PIO: the drive raises an IRQ for every DRQ block, and tells how large the block is
+  while (done < size) {
+    if (ide_polling (channel, 1) != 0) return -1;
+
+    bytes = ide_port_read (channel, IDE_REG_LBA1) | (ide_port_read (channel, IDE_REG_LBA2) << 8);
+    if (bytes == 0) return -1;
+
+    len = (bytes > size - done) ? size - done : bytes;
+    insw (channel->base, (Uint32)(buf + done), len / 2);
+    done += len;
+
+    // Throw away what does not fit the buffer
+    for (; len < bytes; len += 2) inw (channel->base);
+  }
+
+  // And one more IRQ when the command is completed
+  ide_polling (channel, 0);
+  if (ide_port_read (channel, IDE_REG_STATUS) & (IDE_SR_ERR | IDE_SR_DF)) return -1;
+
+  return done;
+}
+
+
+/**
+ * Fills a READ(10) packet, or a READ(12) packet when the count does not fit 16 bits.
+ * All numbers inside a packet are big endian.
+ */
+void ide_atapi_read_packet(Uint8 *packet, Uint64 lba_sector, Uint32 sector_count) {
+  memset (packet, 0, ATAPI_PACKET_SIZE);
+
+  packet[2] = (lba_sector >> 24) & 0xFF;
+  packet[3] = (lba_sector >> 16) & 0xFF;
+  packet[4] = (lba_sector >> 8) & 0xFF;
+  packet[5] = (lba_sector >> 0) & 0xFF;
+
+  if (sector_count > 0xFFFF) {
+    packet[0] = ATAPI_CMD_READ_12;
+    packet[6] = (sector_count >> 24) & 0xFF;
+    packet[7] = (sector_count >> 16) & 0xFF;
+    packet[8] = (sector_count >> 8) & 0xFF;
+    packet[9] = (sector_count >> 0) & 0xFF;
+  } else {
+    packet[0] = ATAPI_CMD_READ_10;
+    packet[7] = (sector_count >> 8) & 0xFF;
+    packet[8] = (sector_count >> 0) & 0xFF;
+  }
+}
+
+
+/**
+ * Reads sector_count sectors of ATAPI_SECTOR_SIZE bytes with a single command. The
+ * caller makes sure the count fits the DMA bounce buffer when the drive uses DMA.
+ * CD-ROMs cannot be written.
+ *
+ * @return number of sectors transferred
+ */
+Uint32 ide_atapi_access(char direction, ide_drive_t *drive, Uint64 lba_sector, Uint32 sector_count, char *buf) {
+  Uint8 packet[ATAPI_PACKET_SIZE];
+  int ret;
+
+  if (direction != IDE_DIRECTION_READ) return 0;
+
+  ide_atapi_read_packet (packet, lba_sector, sector_count);
+  ret = ide_atapi_packet (drive, packet, buf, sector_count * ATAPI_SECTOR_SIZE, drive->dma);
+  if (ret < 0) return 0;
+
+  return ret / ATAPI_SECTOR_SIZE;
+}
+
+
+/**
+ * Starts a DMA read and returns right away. The IRQ handler of the channel finishes it
+ * with ide_dma_stop(), the data ends up in the bounce buffer of the channel.
+ *
+ * @return 0 on success, -1 when the drive did not accept the command (no IRQ will follow)
+ */
+int ide_atapi_dma_start(ide_drive_t *drive, Uint64 lba_sector, Uint32 sector_count) {
+  Uint8 packet[ATAPI_PACKET_SIZE];
+
+  ide_atapi_read_packet (packet, lba_sector, sector_count);
+  if (ide_atapi_issue (drive, packet, sector_count * ATAPI_SECTOR_SIZE, 1) != 0) return -1;
+
+  ide_dma_start (drive->channel);
+  return 0;
+}
+
+
+/**
+ * Reads the number of sectors on the medium into drive->size. A drive reports a unit
+ * attention (and fails the command) after the medium changed, so a few tries are done.
+ *
+ * @return 0 on success, -1 when there is no (readable) medium
+ */
+int ide_atapi_read_capacity(ide_drive_t *drive) {
+  Uint8 packet[ATAPI_PACKET_SIZE];
+  Uint8 capacity[8];
+  int tries;
+
+  drive->size = 0;
+  for (tries = 0; tries < 3; tries++) {
+    memset (packet, 0, ATAPI_PACKET_SIZE);
+    packet[0] = ATAPI_CMD_READ_CAPACITY;
+    if (ide_atapi_packet (drive, packet, (char *)capacity, sizeof (capacity), 0) != sizeof (capacity)) {
+      memset (packet, 0, ATAPI_PACKET_SIZE);
+      packet[0] = ATAPI_CMD_TEST_UNIT_READY;
+      ide_atapi_packet (drive, packet, NULL, 0, 0);
+      continue;
+    }
+
+    // Address of the last sector, and the sector size (which we expect to be 2048)
+    drive->size = (((Uint32)capacity[0] << 24) | (capacity[1] << 16) | (capacity[2] << 8) | capacity[3]) + 1;
+    return 0;
+  }
+
+  return -1;
+}
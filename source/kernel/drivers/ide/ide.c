@@ -16,8 +16,6 @@
 #include "kmem.h"
 #include "pci.h"
 
-char ide_irq_invoked = 0;
-
 // These are the standard IO ports for the controllers (only 1 controller currently supported)
 // @TODO: more controllers could be supported by boot-param: IDE2=x,x,x,x,x,x,x,x
 Uint16 ide_controller_ioports[][8] = {
@@ -30,6 +28,9 @@ Uint16 ide_controller_ioports[][8] = {
 void ide_port_write (ide_channel_t *channel, Uint8 reg, Uint8 data) {
   if (reg > 0x07 && reg < 0x0C) ide_port_write (channel, IDE_REG_CONTROL, 0x80 | channel->no_int);
 
+  // A new command, so any IRQ we have seen belongs to the previous one
+  if (reg == IDE_REG_COMMAND) channel->irq_invoked = 0;
+
   if (reg < 0x08) outb (channel->base + reg - 0x00, data);
   else if (reg < 0x0C) outb (channel->base + reg - 0x06, data);
   else if (reg < 0x0E) outb (channel->dev_ctl + reg - 0x0A, data);
@@ -58,7 +59,31 @@ Uint8 ide_port_read (ide_channel_t *channel, Uint8 reg) {
 
 
 /**
- *
+ * Waits until the channel raised its IRQ. The current task sleeps on the wait queue of
+ * the channel so other tasks can run while the drive is busy. Without multitasking (the
+ * commands sent during boot), as the idle task, or with interrupts disabled we cannot
+ * sleep, so we poll the drive instead of depending on the IRQ.
+ */
+void ide_wait_irq (ide_channel_t *channel) {
+  while (! channel->irq_invoked) {
+    if (! ints_enabled () || _current_task == NULL || _current_task->pid == PID_IDLE) {
+      if (! (ide_port_read (channel, IDE_REG_ALTSTATUS) & IDE_SR_BSY)) break;
+      continue;
+    }
+
+    // Check again with ints disabled so we cannot miss the wakeup
+    int state = disable_ints ();
+    if (! channel->irq_invoked) sched_interruptable_sleep (&channel->wait_queue);
+    restore_ints (state);
+  }
+
+  channel->irq_invoked = 0;
+}
+
+
+/**
+ * Waits until the drive is not busy anymore. When the IRQ of the channel is enabled
+ * this sleeps until the IRQ fires, otherwise the status register is polled.
  */
 int ide_polling (ide_channel_t *channel, char advanced_check) {
   int i;
@@ -68,6 +93,8 @@ int ide_polling (ide_channel_t *channel, char advanced_check) {
   // 400 uSecond delay by reading the altstatus port 4 times
   for (i=0; i<4; i++) ide_port_read (channel, IDE_REG_ALTSTATUS);
 
+  if (! channel->no_int) ide_wait_irq (channel);
+
   // Wait for BSY to be zero.
   while (ide_port_read (channel, IDE_REG_STATUS) & IDE_SR_BSY) ;
 
@@ -83,6 +110,116 @@ int ide_polling (ide_channel_t *channel, char advanced_check) {
 }
 
 
+/**
+ * IDE interrupt handler. IRQ 14 belongs to the primary channels and IRQ 15 to the
+ * secondary channels. Asynchronous transfers are finished right here. Otherwise it
+ * flags the channel and wakes up the task waiting for it, which finishes the transfer.
+ */
+int ide_interrupt (regs_t *r) {
+  ide_channel_t *channel;
+  Uint8 bm_status;
+  int i, rescheduling = 0;
+
+  for (i=0; i!=MAX_IDE_CONTROLLERS; i++) {
+    channel = &ide_controllers[i].channel[r->int_no == 14 ? IDE_CHANNEL_0 : IDE_CHANNEL_1];
+    if (! channel->base) continue;
+
+    // With a bus master we can see if the interrupt is ours (the IRQ line can be shared)
+    if (channel->bm_ide) {
+      bm_status = inb (channel->bm_ide + IDE_BM_REG_STATUS);
+      if (! (bm_status & IDE_BM_SR_IRQ)) continue;
+
+      // Clear the interrupt bit, but leave the error bit for the waiter
+      outb (channel->bm_ide + IDE_BM_REG_STATUS, (bm_status & ~IDE_BM_SR_ERR) | IDE_BM_SR_IRQ);
+    }
+
+    // Reading the status register acknowledges the interrupt on the drive
+    ide_port_read (channel, IDE_REG_STATUS);
+
+    if (channel->bio_head && ! channel->busy) {
+      ide_async_done (channel);
+    } else {
+      channel->irq_invoked = 1;
+    }
+
+    if (_current_task != NULL) sched_wakeup (&channel->wait_queue);
+    rescheduling = 1;
+  }
+
+  return rescheduling;
+}
+
+
+/**
+ * Sets up the PRD table for a transfer of size bytes from or into the bounce buffer of
+ * the channel, and clears the interrupt and error state of the bus master.
+ */
+void ide_dma_prepare (ide_channel_t *channel, Uint32 size, char direction) {
+  Uint32 address = channel->dma_buffer_phys;
+  Uint32 len;
+  int i = 0;
+
+  // Split the buffer on 64KB boundaries
+  while (size > 0) {
+    len = 0x10000 - (address & 0xFFFF);
+    if (len > size) len = size;
+
+    channel->prdt[i].address = address;
+    channel->prdt[i].size = len & 0xFFFF;
+    channel->prdt[i].flags = 0;
+
+    address += len;
+    size -= len;
+    i++;
+  }
+  channel->prdt[i-1].flags = IDE_PRD_EOT;
+
+  outl (channel->bm_ide + IDE_BM_REG_PRDT, channel->prdt_phys);
+  outb (channel->bm_ide + IDE_BM_REG_COMMAND, direction == IDE_DIRECTION_READ ? IDE_BM_CMD_READ : 0);
+
+  // Clear interrupt and error bits by writing them back
+  outb (channel->bm_ide + IDE_BM_REG_STATUS, inb (channel->bm_ide + IDE_BM_REG_STATUS) | IDE_BM_SR_IRQ | IDE_BM_SR_ERR);
+}
+
+
+/**
+ * Starts the bus master. Must be done after the DMA command has been sent to the drive.
+ */
+void ide_dma_start (ide_channel_t *channel) {
+  outb (channel->bm_ide + IDE_BM_REG_COMMAND, inb (channel->bm_ide + IDE_BM_REG_COMMAND) | IDE_BM_CMD_START);
+}
+
+
+/**
+ * Stops the bus master after the drive signaled the end of the transfer.
+ * Returns 0 on success, -1 on error.
+ */
+int ide_dma_stop (ide_channel_t *channel) {
+  Uint8 bm_status, status;
+
+  // Stop the bus master
+  outb (channel->bm_ide + IDE_BM_REG_COMMAND, inb (channel->bm_ide + IDE_BM_REG_COMMAND) & ~IDE_BM_CMD_START);
+
+  bm_status = inb (channel->bm_ide + IDE_BM_REG_STATUS);
+  outb (channel->bm_ide + IDE_BM_REG_STATUS, bm_status | IDE_BM_SR_IRQ | IDE_BM_SR_ERR);
+  status = ide_port_read (channel, IDE_REG_STATUS);
+
+  if (bm_status & IDE_BM_SR_ERR) return -1;
+  if (status & (IDE_SR_ERR | IDE_SR_DF)) return -1;
+  return 0;
+}
+
+
+/**
+ * Sleeps until the drive signals the end of the transfer and stops the bus master.
+ * Returns 0 on success, -1 on error.
+ */
+int ide_dma_wait (ide_channel_t *channel) {
+  ide_wait_irq (channel);
+  return ide_dma_stop (channel);
+}
+
+
 /**
  *
  */
@@ -99,56 +236,191 @@ void ide_port_read_buffer (ide_channel_t *channel, Uint8 reg, Uint32 buffer, Uin
 
 
 
+/**
+ * Takes the channel for a synchronous transfer. Waits until the running synchronous
+ * transfer, and all queued asynchronous transfers, are done.
+ */
+void ide_channel_lock (ide_channel_t *channel) {
+  while (1) {
+    int state = disable_ints ();
+    if (! channel->busy && ! channel->bio_head) {
+      channel->busy = 1;
+      restore_ints (state);
+      return;
+    }
+
+    if (! state || _current_task == NULL || _current_task->pid == PID_IDLE) {
+      // We cannot sleep, so finish the asynchronous transfer ourselves
+      if (channel->bio_head && ! channel->busy && ! (ide_port_read (channel, IDE_REG_ALTSTATUS) & IDE_SR_BSY)) ide_async_done (channel);
+    } else {
+      sched_interruptable_sleep (&channel->wait_queue);
+    }
+    restore_ints (state);
+  }
+}
 
 
 /**
- * Read specified number of sectors from drive into buffer,
- * returns number of sectors read
+ * Releases the channel, and starts the asynchronous transfers that were queued meanwhile
  */
-Uint32 ide_sector_read (ide_drive_t *drive, Uint32 lba_sector, Uint32 sector_count, char *buffer) {
-  int ret;
+void ide_channel_unlock (ide_channel_t *channel) {
+  int state = disable_ints ();
+  channel->busy = 0;
+  if (channel->bio_head) ide_async_start (channel);
+  if (_current_task != NULL) sched_wakeup (&channel->wait_queue);
+  restore_ints (state);
+}
 
-//  kprintf ("\nide_sector_read (drive, %d, %d, %08X)\n", lba_sector, sector_count, buffer);
 
-  // Not enabled drive
-  if (! drive->enabled) return 0;
+/**
+ * Starts the DMA command for the next part of the first queued bio. Must be called with
+ * interrupts disabled.
+ */
+void ide_async_start (ide_channel_t *channel) {
+  bio_t *bio = channel->bio_head;
+  ide_drive_t *drive = (ide_drive_t *)bio->driver_data;
+  Uint32 count = (bio->size - bio->done) >> drive->sector_shift;
+  Uint64 lba_sector = (bio->offset + bio->done) >> drive->sector_shift;
+
+  if (count > IDE_DMA_BUFFER_SIZE >> drive->sector_shift) count = IDE_DMA_BUFFER_SIZE >> drive->sector_shift;
+  channel->bio_sectors = count;
+
+  if (drive->type == IDE_DRIVE_TYPE_ATAPI) {
+    if (ide_atapi_dma_start (drive, lba_sector, count) == 0) return;
+
+    // No IRQ will come for this one, fail it and go on with the next
+    channel->bio_head = bio->next;
+    if (channel->bio_head) ide_async_start (channel);
+    block_end_io (bio);
+  } else if (bio->direction == BLOCK_WRITE) {
+    memcpy (channel->dma_buffer, bio->buffer + bio->done, count * IDE_SECTOR_SIZE);
+    ide_ata_dma_start (IDE_DIRECTION_WRITE, drive, lba_sector, count);
+  } else {
+    ide_ata_dma_start (IDE_DIRECTION_READ, drive, lba_sector, count);
+  }
+}
 
-  // Incorrect sector
-  if (lba_sector > drive->size) return 0;
 
-  if (drive->type == IDE_DRIVE_TYPE_ATA) {
-    ret = ide_ata_access (IDE_DIRECTION_READ, drive, lba_sector, sector_count, buffer);
-  } else if (drive->type == IDE_DRIVE_TYPE_ATAPI) {
-    ret = ide_atapi_access (IDE_DIRECTION_READ, drive, lba_sector, sector_count, buffer);
+/**
+ * Finishes the DMA command of the first queued bio (called from the IRQ handler). The
+ * bio is completed when it is transferred completely or on errors, and the next command is
+ * started before the owner of the bio gets to see it. Only bios with a kernel buffer are
+ * queued here, so the copy works whatever task is interrupted.
+ */
+void ide_async_done (ide_channel_t *channel) {
+  bio_t *bio = channel->bio_head;
+  ide_drive_t *drive = (ide_drive_t *)bio->driver_data;
+  int error = 0;
+
+  if (ide_dma_stop (channel) == 0) {
+    if (bio->direction == BLOCK_READ) memcpy (bio->buffer + bio->done, channel->dma_buffer, channel->bio_sectors * drive->sector_size);
+    bio->done += channel->bio_sectors * drive->sector_size;
   } else {
-    kpanic ("Unknown type (neither ATA nor ATAPI)");
+    error = 1;    // We cannot tell how much was transferred
   }
 
-  return ret;
+  if (! error && bio->done != bio->size) {
+    ide_async_start (channel);
+    return;
+  }
+
+  channel->bio_head = bio->next;
+  if (channel->bio_head) ide_async_start (channel);
+  block_end_io (bio);
 }
 
 
 /**
- * Write specified number of sectors from buffer to drive
+ * Transfers sectors between drive and buffer, with as few commands as possible (each
+ * command can do 256 sectors, or 65536 with LBA48). The caller must hold the channel.
+ * Returns number of sectors transferred
  */
-void ide_write_sectors(ide_drive_t *drive, Uint32 lba_sector, Uint32 count, char *buffer) {
-  int ret;
+Uint32 ide_sector_access (int direction, ide_drive_t *drive, Uint64 lba_sector, Uint32 sector_count, char *buffer) {
+  Uint32 done = 0;
+  Uint32 count, max, ret;
 
   // Not enabled drive
-  if (! drive->enabled) return;
+  if (! drive->enabled) return 0;
 
   // Incorrect sector
-  if (lba_sector > drive->size) return;
+  if (lba_sector >= drive->size) return 0;
+  if (sector_count > drive->size - lba_sector) sector_count = drive->size - lba_sector;
+
+  max = drive->lba48 ? IDE_MAX_SECTORS_LBA48 : IDE_MAX_SECTORS_LBA28;
+  if (drive->type == IDE_DRIVE_TYPE_ATAPI) max = IDE_MAX_SECTORS_ATAPI;
+  if (drive->dma) max = IDE_DMA_BUFFER_SIZE / drive->sector_size;    // Limited by the bounce buffer
+  while (done != sector_count) {
+    count = (sector_count - done > max) ? max : sector_count - done;
+
+    if (drive->type == IDE_DRIVE_TYPE_ATA) {
+      ret = ide_ata_access (direction, drive, lba_sector + done, count, buffer + done * IDE_SECTOR_SIZE);
+    } else if (drive->type == IDE_DRIVE_TYPE_ATAPI) {
+      ret = ide_atapi_access (direction, drive, lba_sector + done, count, buffer + done * drive->sector_size);
+    } else {
+      kpanic ("Unknown type (neither ATA nor ATAPI)");
+    }
 
-  if (drive->type == IDE_DRIVE_TYPE_ATA) {
-    ret = ide_ata_access (IDE_DIRECTION_WRITE, drive, lba_sector, count, buffer);
-  } else if (drive->type == IDE_DRIVE_TYPE_ATAPI) {
-    ret = ide_atapi_access (IDE_DIRECTION_WRITE, drive, lba_sector, count, buffer);
-  } else {
-    kpanic ("Unknown type (neither ATA nor ATAPI)");
+    done += ret;
+    if (ret != count) break;
   }
 
-  return;
+  return done;
+}
+
+
+/**
+ * Read specified number of sectors from drive into buffer.
+ * Returns number of sectors read
+ */
+Uint32 ide_sector_read (ide_drive_t *drive, Uint64 lba_sector, Uint32 sector_count, char *buffer) {
+  Uint32 done;
+
+//  kprintf ("\nide_sector_read (drive, %d, %d, %08X)\n", lba_sector, sector_count, buffer);
+
+  ide_channel_lock (drive->channel);
+  done = ide_sector_access (IDE_DIRECTION_READ, drive, lba_sector, sector_count, buffer);
+  ide_channel_unlock (drive->channel);
+  return done;
+}
+
+
+/**
+ * Write specified number of sectors from buffer to drive. The data can stay in the
+ * write cache of the drive until ide_block_flush().
+ * Returns number of sectors written
+ */
+Uint32 ide_write_sectors(ide_drive_t *drive, Uint64 lba_sector, Uint32 sector_count, char *buffer) {
+  Uint32 done;
+
+  ide_channel_lock (drive->channel);
+  done = ide_sector_access (IDE_DIRECTION_WRITE, drive, lba_sector, sector_count, buffer);
+  ide_channel_unlock (drive->channel);
+  return done;
+}
+
+
+/**
+ * Transfers len bytes at byte skip of a single sector through the sector buffer of the
+ * drive. Writes read the sector first (read-modify-write). The sector buffer is shared
+ * by everybody using the drive, so the channel is held for the whole sequence.
+ * Returns 1 on success, 0 on error
+ */
+int ide_partial_sector (int direction, ide_drive_t *drive, Uint64 lba_sector, Uint32 skip, Uint32 len, char *buffer) {
+  int ret = 0;
+
+  ide_channel_lock (drive->channel);
+  if (ide_sector_access (IDE_DIRECTION_READ, drive, lba_sector, 1, drive->databuf) == 1) {
+    if (direction == IDE_DIRECTION_READ) {
+      memcpy (buffer, &drive->databuf[skip], len);
+      ret = 1;
+    } else {
+      memcpy (&drive->databuf[skip], buffer, len);
+      ret = (ide_sector_access (IDE_DIRECTION_WRITE, drive, lba_sector, 1, drive->databuf) == 1);
+    }
+  }
+  ide_channel_unlock (drive->channel);
+
+  return ret;
 }
 
 
@@ -217,8 +489,8 @@ void ide_init_drive (ide_drive_t *drive) {
 
   // Get drive size
   if (drive->command_sets & (1 << 26)) {
-    // Device uses 48-Bit Addressing:
-    drive->size  = *(Uint32 *)(ide_info + IDE_IDENT_MAX_LBA);
+    // Device uses 48-Bit Addressing, the 28-bit count stops at 128GB
+    drive->size  = *(Uint64 *)(ide_info + IDE_IDENT_MAX_LBA_EXT) & 0xFFFFFFFFFFFFULL;
     drive->lba48 = 1;
   } else {
     // Device uses CHS or 28-bit Addressing
@@ -236,12 +508,37 @@ void ide_init_drive (ide_drive_t *drive) {
   }
   drive->model[40] = 0; // terminate string
 
+  // Let the drive hand over more than one sector per DRQ block (the size must be a power of 2)
+  drive->multiple = 0;
+  if (type == IDE_DRIVE_TYPE_ATA) {
+    Uint8 multiple = 0x80;
+    while (multiple > (Uint8)ide_info[IDE_IDENT_MAX_MULTIPLE]) multiple >>= 1;
+    ide_ata_set_multiple (drive, multiple);
+  }
+
+  // Use the bus master when both the channel and the drive can do DMA
+  drive->dma = (drive->channel->dma_buffer && (drive->capabilities & IDE_CAP_DMA));
+
   kfree(ide_info);
 
+  // CD-ROMs have 2048 byte sectors, and the size depends on the medium that is inserted
+  // @TODO: Medium changes are not noticed, the size is only read here
+  if (type == IDE_DRIVE_TYPE_ATAPI) {
+    drive->sector_size  = ATAPI_SECTOR_SIZE;
+    drive->sector_shift = ATAPI_SECTOR_SHIFT;
+    drive->lba48 = 0;
+    ide_atapi_read_capacity (drive);
+  } else {
+    drive->sector_size  = IDE_SECTOR_SIZE;
+    drive->sector_shift = 9;
+  }
+  drive->databuf = (char *)kmalloc (drive->sector_size);
+
 
 
   // Register device so we can access it
   device_t *device = (device_t *)kmalloc (sizeof (device_t));
+  memset (device, 0, sizeof (device_t));
   device->major_num = DEV_MAJOR_IDE;
   device->minor_num = (drive->channel->controller->controller_nr << 3) + (drive->channel->channel_nr << 1) + drive->drive_nr;
   device->data = (ide_drive_t *)drive;
@@ -251,6 +548,8 @@ void ide_init_drive (ide_drive_t *drive) {
   device->open = ide_block_open;
   device->close = ide_block_close;
   device->seek = ide_block_seek;
+  device->submit = ide_block_submit;
+  device->flush = ide_block_flush;
 
   // Create device name
   char filename[20];
@@ -261,9 +560,8 @@ void ide_init_drive (ide_drive_t *drive) {
 //  kprintf ("\n*** Registering device DEVICE:/%s\n", filename);
   device_register (device, filename);
 
-  // Initialise partitions from the MBR
-  // @TODO: Read partitions from ATAPI drives
-  if (drive->type == IDE_DRIVE_TYPE_ATA) ide_read_partition_table (drive, 0);
+  // Initialise partitions from the MBR (CD-ROMs are not partitioned)
+  if (drive->type == IDE_DRIVE_TYPE_ATA) ide_read_partition_table (device, filename, DEV_MAJOR_HDC, device->minor_num * 16, 0);
 
 //  kprintf ("    ide_init_drive() done \n");
 }
@@ -275,8 +573,10 @@ void ide_init_drive (ide_drive_t *drive) {
 void ide_init_channel (ide_channel_t *channel) {
 //  kprintf ("  ide_init_channel()\n");
 
-  // Disable IRQ
-  ide_port_write (channel, IDE_REG_CONTROL, 2);
+  sched_init_waitqueue (&channel->wait_queue);
+
+  // Disable IRQ, drives are detected by polling
+  ide_port_write (channel, IDE_REG_CONTROL, channel->no_int = 2);
 
   // Init both drives (if any)
   channel->drive[0].channel = channel;
@@ -291,6 +591,22 @@ void ide_init_channel (ide_channel_t *channel) {
 }
 
 
+/**
+ * Allocates the PRD table and bounce buffer for bus master DMA on a channel. The
+ * channel keeps using PIO when there is no DMA memory left.
+ */
+void ide_init_dma (ide_channel_t *channel, Uint16 bm_ide) {
+  channel->prdt = (ide_prd_t *)kmalloc_dma (IDE_PRD_ENTRIES * sizeof (ide_prd_t), &channel->prdt_phys);
+  channel->dma_buffer = (char *)kmalloc_dma (IDE_DMA_BUFFER_SIZE, &channel->dma_buffer_phys);
+  if (! channel->prdt || ! channel->dma_buffer) {
+    channel->dma_buffer = NULL;
+    return;
+  }
+
+  channel->bm_ide = bm_ide;
+}
+
+
 /**
  *
  */
@@ -305,6 +621,9 @@ void ide_init_controller (ide_controller_t *ctrl, pci_device_t *pci_dev, Uint16
   bar[3] = pci_config_get_dword (pci_dev, 0x1C) & 0xFFFFFFFC;
   bar[4] = pci_config_get_dword (pci_dev, 0x20) & 0xFFFFFFFC;
 
+  // Let the controller become bus master so it can do DMA
+  if (bar[4]) pci_config_set_word (pci_dev, 0x04, pci_config_get_word (pci_dev, 0x04) | 0x04);
+
   // Set standard info for channel 0 (master)
   int channel_nr;
   for (channel_nr=0; channel_nr != IDE_CONTROLLER_MAX_CHANNELS; channel_nr++) {
@@ -312,9 +631,14 @@ void ide_init_controller (ide_controller_t *ctrl, pci_device_t *pci_dev, Uint16
     ctrl->channel[channel_nr].channel_nr = channel_nr;
     ctrl->channel[channel_nr].base = io_port[channel_nr*2+0];
     ctrl->channel[channel_nr].dev_ctl = io_port[channel_nr*2+1] + 4;
-    ctrl->channel[channel_nr].bm_ide = bar[4] + 0;
+    ctrl->channel[channel_nr].bm_ide = 0;
     ctrl->channel[channel_nr].pci = pci_dev;
     ctrl->channel[channel_nr].controller = ctrl;   // Link back to controller from the channel
+
+    // Only the primary and secondary channel have bus master registers (8 ports each)
+    if (IDE_USE_DMA && bar[4] && channel_nr <= IDE_CHANNEL_1) {
+      ide_init_dma (&ctrl->channel[channel_nr], bar[4] + channel_nr * 8);
+    }
     ide_init_channel (&ctrl->channel[channel_nr]);
   }
 
@@ -380,61 +704,45 @@ void ide_init (void) {
 
 
 /**
- * Can read larger blocks
- *
- * @param major
- * @param minor
- * @param offset
- * @param size
- * @param buffer
- * @return
+ * Reads from the drive right away. Partial sectors at the start and end go through
+ * the sector buffer of the drive. Returns number of bytes read.
  */
-Uint32 ide_block_read (Uint8 major, Uint8 minor, Uint32 offset, Uint32 size, char *buffer) {
-//  kprintf("ide_block_read(%08X (%04X))\n", offset, size);
-  Uint32 lba_sector = offset / IDE_SECTOR_SIZE;
+Uint32 ide_block_read_sync (ide_drive_t *drive, Uint64 offset, Uint32 size, char *buffer) {
+  Uint64 lba_sector = offset >> drive->sector_shift;
   Uint32 read_size = 0;
-
-  if (major != DEV_MAJOR_IDE) return 0;
-
-  // Fetch drive info from device
-  device_t *device = device_get_device(major, minor);
-  ide_drive_t *drive = (ide_drive_t *)device->data;
-  if (! drive || ! drive->enabled) {
-    kprintf("Incorrect drive specified");
-    return 0;
-  }
+  Uint32 len, sectors;
 
   // Read pre misaligned sector data
-  if (offset % IDE_SECTOR_SIZE > 0) {
-    Uint8 restcount = offset % IDE_SECTOR_SIZE;
+  if ((offset & (drive->sector_size - 1)) > 0 && size > 0) {
+    Uint32 restcount = offset & (drive->sector_size - 1);
 //    kprintf("ide preread(%d)\n", restcount);
-    ide_sector_read(drive, lba_sector, 1, (char *)drive->databuf);
-    memcpy(buffer, &drive->databuf[restcount], 512-restcount);
+    len = drive->sector_size - restcount;
+    if (len > size) len = size;
+    if (! ide_partial_sector (IDE_DIRECTION_READ, drive, lba_sector, restcount, len, buffer)) return 0;
 
-    read_size += restcount;
+    read_size += len;
     lba_sector++;
-    size -= restcount;
-    buffer += restcount;
+    size -= len;
+    buffer += len;
   }
 
-  // Read as many full sectors as possible
-  while (size >= IDE_SECTOR_SIZE) {
-    // Read full sectors
-    ide_sector_read (drive, lba_sector, 1, buffer);
+  // Read all full sectors at once, ide_sector_read() only splits them when a command cannot do more
+  if (size >= drive->sector_size) {
+    sectors = ide_sector_read (drive, lba_sector, size / drive->sector_size, buffer);
+    read_size += sectors * drive->sector_size;
+    if (sectors != size / drive->sector_size) return read_size;
 
 //    kprintf ("Size: %d\n", size);
 
-    read_size += IDE_SECTOR_SIZE;
-    lba_sector++;
-    size -= IDE_SECTOR_SIZE;
-    buffer += IDE_SECTOR_SIZE;
+    lba_sector += sectors;
+    size -= sectors * drive->sector_size;
+    buffer += sectors * drive->sector_size;
   }
 
   // Read post misaligned sector data
   if (size > 0) {
 //    kprintf ("ide postread(%d)", size);
-    ide_sector_read(drive, lba_sector, 1, (char *)drive->databuf);
-    memcpy(buffer, &drive->databuf[0], size);
+    if (! ide_partial_sector (IDE_DIRECTION_READ, drive, lba_sector, 0, size, buffer)) return read_size;
 
     read_size += size;
   }
@@ -442,11 +750,163 @@ Uint32 ide_block_read (Uint8 major, Uint8 minor, Uint32 offset, Uint32 size, cha
   return read_size;
 }
 
-Uint32 ide_block_write (Uint8 major, Uint8 minor, Uint32 offset, Uint32 size, char *buffer) {
+/**
+ * Writes to the drive right away. Sectors that are only partly overwritten are read
+ * into the sector buffer of the drive first (read-modify-write), everything in between
+ * is written with as few commands as possible. Returns number of bytes written.
+ */
+Uint32 ide_block_write_sync (ide_drive_t *drive, Uint64 offset, Uint32 size, char *buffer) {
+  Uint64 lba_sector = offset >> drive->sector_shift;
+  Uint32 write_size = 0;
+  Uint32 len, sectors;
+
+  // Write pre misaligned sector data
+  if ((offset & (drive->sector_size - 1)) > 0 && size > 0) {
+    Uint32 restcount = offset & (drive->sector_size - 1);
+    len = drive->sector_size - restcount;
+    if (len > size) len = size;
+    if (! ide_partial_sector (IDE_DIRECTION_WRITE, drive, lba_sector, restcount, len, buffer)) return 0;
+
+    write_size += len;
+    lba_sector++;
+    size -= len;
+    buffer += len;
+  }
+
+  // Write all full sectors at once
+  if (size >= drive->sector_size) {
+    sectors = ide_write_sectors (drive, lba_sector, size / drive->sector_size, buffer);
+    write_size += sectors * drive->sector_size;
+    if (sectors != size / drive->sector_size) return write_size;
+
+    lba_sector += sectors;
+    size -= sectors * drive->sector_size;
+    buffer += sectors * drive->sector_size;
+  }
+
+  // Write post misaligned sector data
+  if (size > 0) {
+    if (! ide_partial_sector (IDE_DIRECTION_WRITE, drive, lba_sector, 0, size, buffer)) return write_size;
+
+    write_size += size;
+  }
+
+  return write_size;
+}
+
+
+/**
+ * Starts a transfer. Whole sectors on a DMA drive are transferred in the background and
+ * the IRQ handler completes the bio. Everything else is transferred before we return.
+ */
+void ide_block_submit (Uint8 major, Uint8 minor, bio_t *bio) {
+  device_t *device = (major == DEV_MAJOR_IDE) ? device_get_device(major, minor) : NULL;
+  ide_drive_t *drive = device ? (ide_drive_t *)device->data : NULL;
+  ide_channel_t *channel;
+
+  bio->done = 0;
+  if (! drive || ! drive->enabled) {
+    kprintf("Incorrect drive specified");
+    block_end_io (bio);
+    return;
+  }
+
+  /* Without interrupts nobody would finish the transfer. CD-ROMs are only read. The IRQ
+   * handler copies from the DMA buffer under any page directory, so the buffer must be
+   * kernel memory. Task memory is transferred right away, in the context of its owner. */
+  if (drive->dma && ints_enabled () && bio->size > 0 &&
+      is_kernel_address (_kernel_pagedirectory, (Uint32)bio->buffer, bio->size) &&
+      (drive->type == IDE_DRIVE_TYPE_ATA || bio->direction == BLOCK_READ) &&
+      (bio->offset & (drive->sector_size - 1)) == 0 && (bio->size & (drive->sector_size - 1)) == 0 &&
+      (bio->offset >> drive->sector_shift) + (bio->size >> drive->sector_shift) <= drive->size) {
+    channel = drive->channel;
+    bio->driver_data = drive;
+    bio->next = NULL;
+
+    // Start right away when the channel is free, otherwise the transfer before us starts it
+    int state = disable_ints ();
+    if (channel->bio_head) channel->bio_tail->next = bio; else channel->bio_head = bio;
+    channel->bio_tail = bio;
+    if (channel->bio_head == bio && ! channel->busy) ide_async_start (channel);
+    restore_ints (state);
+    return;
+  }
+
+  if (bio->direction == BLOCK_READ) {
+    bio->done = ide_block_read_sync (drive, bio->offset, bio->size, bio->buffer);
+  } else {
+    bio->done = ide_block_write_sync (drive, bio->offset, bio->size, bio->buffer);
+  }
+  block_end_io (bio);
+}
+
+
+/**
+ * Synchronous read, returns the number of bytes read
+ */
+Uint32 ide_block_read (Uint8 major, Uint8 minor, Uint64 offset, Uint32 size, char *buffer) {
+  bio_t bio;
+
+//  kprintf("ide_block_read(%08X (%04X))\n", offset, size);
+
   if (major != DEV_MAJOR_IDE) return 0;
-  kprintf ("ide_block_write(%d, %d, %d, %d, %08X)\n", major, minor, offset, size, buffer);
-  kprintf ("write to IDE not supported yet\n");
-  return 0;
+
+  memset (&bio, 0, sizeof (bio_t));
+  bio.dev = device_get_device(major, minor);
+  bio.direction = BLOCK_READ;
+  bio.offset = offset;
+  bio.size = size;
+  bio.buffer = buffer;
+
+  ide_block_submit (major, minor, &bio);
+  block_wait_io (&bio);
+
+  return bio.done;
+}
+
+
+/**
+ * Synchronous write, returns the number of bytes written
+ */
+Uint32 ide_block_write (Uint8 major, Uint8 minor, Uint64 offset, Uint32 size, char *buffer) {
+  bio_t bio;
+
+  if (major != DEV_MAJOR_IDE) return 0;
+
+  memset (&bio, 0, sizeof (bio_t));
+  bio.dev = device_get_device(major, minor);
+  bio.direction = BLOCK_WRITE;
+  bio.offset = offset;
+  bio.size = size;
+  bio.buffer = buffer;
+
+  ide_block_submit (major, minor, &bio);
+  block_wait_io (&bio);
+
+  return bio.done;
+}
+
+
+/**
+ * Writes the write cache of the drive to the medium. Everything written before this
+ * call is on the medium afterwards. Returns 0 on success, -1 on error.
+ */
+int ide_block_flush (Uint8 major, Uint8 minor) {
+  int ret = 0;
+
+  if (major != DEV_MAJOR_IDE) return -1;
+
+  device_t *device = device_get_device(major, minor);
+  ide_drive_t *drive = device ? (ide_drive_t *)device->data : NULL;
+  if (! drive || ! drive->enabled) return -1;
+  if (drive->type != IDE_DRIVE_TYPE_ATA) return 0;
+
+  // Waits until the queued asynchronous writes are done as well
+  ide_channel_lock (drive->channel);
+  ret = ide_ata_flush (drive);
+  ide_channel_unlock (drive->channel);
+
+  return ret;
 }
 void ide_block_open(Uint8 major, Uint8 minor) {
   if (major != DEV_MAJOR_IDE) return;
@@ -1,7 +1,8 @@
 /******************************************************************************
  *
  *  File        : partitions.c
- *  Description : Partitioning for ide devices
+ *  Description : Partitioning for hard disks (IDE, AHCI and virtio). The partitions are
+ *                proxies that hand transfers to the device of the whole disk.
  *
  *
  *****************************************************************************/
@@ -9,21 +10,23 @@
 #include "drivers/ide.h"
 #include "drivers/ide_partitions.h"
 #include "device.h"
+#include "block.h"
 #include "kernel.h"
 #include "kmem.h"
 #include "pci.h"
 
 
 /**
- * Read parition table from specified drive and sector. Checks for signature when
- * reading from sector 0.
+ * Read parition table from specified disk and sector. Checks for signature when
+ * reading from sector 0. Partitions are registered as <disk_name>P<nr>, with minor
+ * numbers counting up from first_minor.
  *
  * Restrictions:
  *   - Will only read 16 partitions
  *   - Extended partitions will only go 1 level deep (no extended partition into extended partitions)
  */
 static int ide_partitions_count = 0;
-void ide_read_partition_table (ide_drive_t *drive, Uint32 lba_sector) {
+void ide_read_partition_table (device_t *disk, const char *disk_name, Uint8 major, Uint8 first_minor, Uint32 lba_sector) {
   char buffer[512];
   int i;
 
@@ -33,7 +36,8 @@ void ide_read_partition_table (ide_drive_t *drive, Uint32 lba_sector) {
 
 //  kprintf ("Reading partition table on sector %08X\n", lba_sector);
 
-  ide_sector_read (drive, lba_sector, 1, buffer);
+  // Through the queue, the buffer lives on our stack and drivers only take kernel addresses
+  if (block_read (disk, (Uint64)lba_sector * IDE_SECTOR_SIZE, IDE_SECTOR_SIZE, buffer) != IDE_SECTOR_SIZE) return;
   if (lba_sector == 0 && (buffer[510] != 0x55 && buffer[511] != 0xAA)) return;   // No 55AA magic found
 
   // MBR points to buffer
@@ -54,10 +58,9 @@ void ide_read_partition_table (ide_drive_t *drive, Uint32 lba_sector) {
 
     // Register device so we can access it
     device_t *device = (device_t *)kmalloc (sizeof (device_t));
-    device->major_num = DEV_MAJOR_HDC;
-    device->minor_num = (drive->channel->controller->controller_nr << 3) + (drive->channel->channel_nr << 1) + drive->drive_nr;
-    device->minor_num *= 16;
-    device->minor_num += ide_partitions_count;
+    memset (device, 0, sizeof (device_t));
+    device->major_num = major;
+    device->minor_num = first_minor + ide_partitions_count;
 
     // Sortakinda proxy functions that take the partition offset into account
     device->read  = ide_partition_block_read;
@@ -65,9 +68,12 @@ void ide_read_partition_table (ide_drive_t *drive, Uint32 lba_sector) {
     device->open  = ide_partition_block_open;
     device->close = ide_partition_block_close;
     device->seek  = ide_partition_block_seek;
+    device->submit = ide_partition_block_submit;
+    device->flush = ide_partition_block_flush;
+    device->commit = disk->commit ? ide_partition_block_commit : NULL;
 
     ide_partition_t *partition = (ide_partition_t *)kmalloc(sizeof(ide_partition_t));
-    partition->drive = drive;
+    partition->disk = disk;
     partition->bootable = mbr->partition[i].boot;
     partition->lba_start = lba_sector + mbr->partition[i].first_lba_sector;
     partition->lba_size = mbr->partition[i].size;
@@ -79,7 +85,7 @@ void ide_read_partition_table (ide_drive_t *drive, Uint32 lba_sector) {
     // Create device name
     char filename[20];
     memset (filename, 0, sizeof (filename));
-    sprintf (filename, "IDE%dC%dD%dP%d", drive->channel->controller->controller_nr, drive->channel->channel_nr, drive->drive_nr, ide_partitions_count);
+    sprintf (filename, "%sP%d", disk_name, ide_partitions_count);
 
     // Register device
 //    kprintf ("\n*** Registering device DEVICE:/%s\n", filename);
@@ -94,59 +100,104 @@ void ide_read_partition_table (ide_drive_t *drive, Uint32 lba_sector) {
       // if (lba_sector != 0) kprintf ("Cannot read extended partition inside extended partition\n");
 
       // Read extended table (recursive if needed)
-      ide_read_partition_table (drive, lba_sector + mbr->partition[i].first_lba_sector);
+      ide_read_partition_table (disk, disk_name, major, first_minor, lba_sector + mbr->partition[i].first_lba_sector);
     }
   }
 }
 
 
 
-Uint32 ide_partition_block_read (Uint8 major, Uint8 minor, Uint32 offset, Uint32 size, char *buffer) {
-  if (major != DEV_MAJOR_HDC) return 0;
-
-//  kprintf("ide_partition_block_read(%08X (%04X)\n", offset, size);
+/**
+ * Moves the bio into the range of the partition and hands it to the disk. The bio
+ * keeps the disk offset, its owner only looks at bio->done.
+ */
+void ide_partition_block_submit (Uint8 major, Uint8 minor, bio_t *bio) {
+  bio->done = 0;
 
   device_t *device = device_get_device(major, minor);
-  if (! device) return 0;
+  if (! device) {
+    block_end_io (bio);
+    return;
+  }
 
   ide_partition_t *partition = (ide_partition_t *)device->data;
+  device_t *disk = partition->disk;
 
-  // We can (must) calculate the minor IDE node
-  Uint8 ide_minor = minor / 16;
-
-/*
-  Layout minor node for IDE partitions: Cccd pppp
-     C = controller (0 or 1)
-     cc = channel (0-3)
-     d = drive (0 or 1)
-     pppp = partition (0-16)
-*/
-
+  // if offset > size of partition, nothing to read
+  if (bio->offset >= ((Uint64)partition->lba_size * IDE_SECTOR_SIZE)) {
+    kprintf ("Trying to access outside partition bounds\n");
+    block_end_io (bio);
+    return;
+  }
 
-  // if size > offset + size of disk, trunk size
-  if (offset + size > (partition->lba_size * IDE_SECTOR_SIZE)) {
+  // if size > offset + size of partition, trunk size
+  if (bio->offset + bio->size > ((Uint64)partition->lba_size * IDE_SECTOR_SIZE)) {
     kprintf ("Trunking size since we are out of partition bounds\n");
-    size = (partition->lba_size * IDE_SECTOR_SIZE) - offset;
+    bio->size = ((Uint64)partition->lba_size * IDE_SECTOR_SIZE) - bio->offset;
   }
 
-  // if offset > size of disk return 0
-  if (offset > (partition->lba_end * IDE_SECTOR_SIZE)) {
-    kprintf ("Trying to read outside partition bounds\n");
-    return 0;
-  }
+  bio->offset += (Uint64)partition->lba_start * IDE_SECTOR_SIZE;
+
+//  kprintf ("partition offset: %d\n", (Uint32)bio->offset);
+
+  disk->submit (disk->major_num, disk->minor_num, bio);
+}
+
 
-  Uint32 partition_offset = offset + (partition->lba_start * IDE_SECTOR_SIZE);
+Uint32 ide_partition_block_read (Uint8 major, Uint8 minor, Uint64 offset, Uint32 size, char *buffer) {
+  bio_t bio;
 
-//  kprintf ("partition offset: %d\n", partition_offset);
+//  kprintf("ide_partition_block_read(%08X (%04X)\n", offset, size);
+
+  memset (&bio, 0, sizeof (bio_t));
+  bio.dev = device_get_device(major, minor);
+  bio.direction = BLOCK_READ;
+  bio.offset = offset;
+  bio.size = size;
+  bio.buffer = buffer;
+
+  ide_partition_block_submit (major, minor, &bio);
+  ide_partition_block_commit (major, minor);
+  block_wait_io (&bio);
+
+  return bio.done;
+}
+
+Uint32 ide_partition_block_write (Uint8 major, Uint8 minor, Uint64 offset, Uint32 size, char *buffer) {
+  bio_t bio;
+
+  memset (&bio, 0, sizeof (bio_t));
+  bio.dev = device_get_device(major, minor);
+  bio.direction = BLOCK_WRITE;
+  bio.offset = offset;
+  bio.size = size;
+  bio.buffer = buffer;
+
+  ide_partition_block_submit (major, minor, &bio);
+  ide_partition_block_commit (major, minor);
+  block_wait_io (&bio);
 
-  return ide_block_read(DEV_MAJOR_IDE, ide_minor, partition_offset, size, buffer);
+  return bio.done;
 }
 
-Uint32 ide_partition_block_write (Uint8 major, Uint8 minor, Uint32 offset, Uint32 size, char *buffer) {
-  if (major != DEV_MAJOR_HDC) return 0;
-  kprintf ("ide_partition_block_write(%d, %d, %d, %d, %08X)\n", major, minor, offset, size, buffer);
-  kprintf ("write to IDE not supported yet\n");
-  return 0;
+int ide_partition_block_flush (Uint8 major, Uint8 minor) {
+  device_t *device = device_get_device(major, minor);
+  if (! device) return -1;
+
+  // The disk has a single write cache for all partitions
+  device_t *disk = ((ide_partition_t *)device->data)->disk;
+  if (! disk->flush) return 0;
+  return disk->flush (disk->major_num, disk->minor_num);
+}
+/**
+ * Starts the bios that were handed to the disk, when the disk batches them
+ */
+void ide_partition_block_commit (Uint8 major, Uint8 minor) {
+  device_t *device = device_get_device(major, minor);
+  if (! device) return;
+
+  device_t *disk = ((ide_partition_t *)device->data)->disk;
+  if (disk->commit) disk->commit (disk->major_num, disk->minor_num);
 }
 void ide_partition_block_open(Uint8 major, Uint8 minor) {
   if (major != DEV_MAJOR_HDC) return;
@@ -0,0 +1,750 @@
+/******************************************************************************
+ *
+ *  File        : virtio_blk.c
+ *  Description : Virtio block device, as found in QEMU/KVM (-drive if=virtio),
+ *                through the legacy PCI interface. Requests are descriptor
+ *                chains in a single virtqueue: a header, the pages of the bio
+ *                buffer and a status byte. The block layer hands us a whole
+ *                batch of requests and commits it afterwards, so the device is
+ *                notified (a VM exit) once per batch, and not at all while it
+ *                is still working on the queue. Interrupts are suppressed
+ *                while the IRQ handler empties the used ring.
+ *
+ *****************************************************************************/
+
+#include "drivers/virtio_blk.h"
+#include "drivers/ide_partitions.h"
+#include "device.h"
+#include "io.h"
+#include "kernel.h"
+#include "kmem.h"
+#include "paging.h"
+#include "pci.h"
+#include "schedule.h"
+
+static int virtio_blk_count = 0;
+
+// Stores before it are visible to the device before loads after it are done
+#define virtio_mb() __asm__ __volatile__ ("lock; addl $0, 0(%%esp)" : : : "memory")
+
+
+/**
+ * Fills desc with the physical pages of size bytes at buffer. Physically adjacent pages
+ * share a descriptor. When there are more segments than the device takes, size is
+ * lowered to the whole sectors that fit. Returns the number of descriptors. Requests are
+ * also issued from the IRQ handler and by other tasks, so the buffer must be kernel
+ * memory, which is the same in every page directory.
+ */
+int virtio_blk_segments (virtio_blk_t *vblk, vring_desc_t *desc, char *buffer, Uint32 *size) {
+  pagedirectory_t *directory = _kernel_pagedirectory;
+  Uint32 address = (Uint32)buffer;
+  Uint32 remaining = *size;
+  Uint32 total = 0, excess;
+  Uint32 phys, len;
+  int i = 0;
+
+  while (remaining > 0) {
+    phys = get_physical_address (directory, address);
+    len = 0x1000 - (address & 0xFFF);
+    if (len > remaining) len = remaining;
+    if (vblk->size_max && len > vblk->size_max) len = vblk->size_max;
+
+    if (i > 0 && desc[i-1].addr + desc[i-1].len == phys &&
+        (! vblk->size_max || desc[i-1].len + len <= vblk->size_max)) {
+      desc[i-1].len += len;
+    } else {
+      if (i == vblk->max_segments) break;
+      desc[i].addr = phys;
+      desc[i].addr_hi = 0;
+      desc[i].len = len;
+      i++;
+    }
+
+    address += len;
+    remaining -= len;
+    total += len;
+  }
+
+  // Out of segments, the rest goes in the next request
+  if (remaining > 0) {
+    excess = total & (VIRTIO_BLK_SECTOR_SIZE - 1);
+    total -= excess;
+    while (excess > 0) {
+      if (desc[i-1].len <= excess) {
+        excess -= desc[i-1].len;
+        i--;
+      } else {
+        desc[i-1].len -= excess;
+        excess = 0;
+      }
+    }
+  }
+
+  *size = total;
+  return i;
+}
+
+
+/**
+ * Returns 1 when the bio overlaps a request in flight and one of them is a write. The
+ * device can finish requests in any order, so these have to wait.
+ */
+int virtio_blk_overlaps (virtio_blk_t *vblk, bio_t *bio) {
+  bio_t *busy;
+  int cmd_nr;
+
+  for (cmd_nr=0; cmd_nr!=vblk->nr_cmds; cmd_nr++) {
+    busy = vblk->cmd_bio[cmd_nr];
+    if (! busy || busy->size == 0) continue;
+    if (bio->direction != BLOCK_WRITE && busy->direction != BLOCK_WRITE) continue;
+    if (bio->offset < busy->offset + busy->size && busy->offset < bio->offset + bio->size) return 1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * Puts the request for the next part of the bio in the avail ring. A bio of 0 bytes
+ * flushes the write cache. The device is not notified, that is done for a whole batch
+ * by virtio_blk_kick(). Returns 0 on success, -1 when not even a single sector fits in
+ * a request. Must be called with interrupts disabled.
+ */
+int virtio_blk_issue (virtio_blk_t *vblk, int cmd_nr, bio_t *bio) {
+  virtio_blk_cmd_t *cmd = &vblk->cmds[cmd_nr];
+  Uint32 cmd_phys = vblk->cmds_phys + cmd_nr * sizeof (virtio_blk_cmd_t);
+  int indirect = (vblk->chain_length == 1);
+  int base = indirect ? 0 : cmd_nr * vblk->chain_length;
+  vring_desc_t *chain = indirect ? cmd->table : &vblk->desc[base];
+  Uint32 size = bio->size - bio->done;
+  Uint16 head;
+  int i, segments = 0;
+
+  if (size > VIRTIO_BLK_MAX_SECTORS * VIRTIO_BLK_SECTOR_SIZE) size = VIRTIO_BLK_MAX_SECTORS * VIRTIO_BLK_SECTOR_SIZE;
+
+  if (bio->size == 0) {
+    cmd->type = VIRTIO_BLK_T_FLUSH;
+    cmd->sector = 0;
+  } else {
+    cmd->type = (bio->direction == BLOCK_WRITE) ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    cmd->sector = (bio->offset + bio->done) >> 9;
+    segments = virtio_blk_segments (vblk, &chain[1], bio->buffer + bio->done, &size);
+    if (size == 0) return -1;
+  }
+  cmd->ioprio = 0;
+  cmd->status = 0xFF;
+
+  // Header, data segments (the device writes into them on reads) and the status byte
+  chain[0].addr = cmd_phys;
+  chain[0].addr_hi = 0;
+  chain[0].len = 16;
+  chain[0].flags = VRING_DESC_F_NEXT;
+  for (i=1; i<=segments; i++) {
+    chain[i].flags = VRING_DESC_F_NEXT | ((bio->direction == BLOCK_WRITE) ? 0 : VRING_DESC_F_WRITE);
+  }
+  chain[segments+1].addr = cmd_phys + ((Uint32)&cmd->status - (Uint32)cmd);
+  chain[segments+1].addr_hi = 0;
+  chain[segments+1].len = 1;
+  chain[segments+1].flags = VRING_DESC_F_WRITE;
+  chain[segments+1].next = 0;
+  for (i=0; i<=segments; i++) chain[i].next = base + i + 1;
+
+  // With indirect descriptors the request takes a single descriptor of the ring
+  if (indirect) {
+    vblk->desc[cmd_nr].addr = cmd_phys + ((Uint32)cmd->table - (Uint32)cmd);
+    vblk->desc[cmd_nr].addr_hi = 0;
+    vblk->desc[cmd_nr].len = (segments + 2) * sizeof (vring_desc_t);
+    vblk->desc[cmd_nr].flags = VRING_DESC_F_INDIRECT;
+    vblk->desc[cmd_nr].next = 0;
+    head = cmd_nr;
+  } else {
+    head = base;
+  }
+
+  if (bio->size == 0) vblk->flushing = 1;
+  vblk->cmd_bio[cmd_nr] = bio;
+  vblk->cmd_bytes[cmd_nr] = (bio->size == 0) ? 0 : size;
+  vblk->cmds_busy |= (1U << cmd_nr);
+  vblk->stats.requests++;
+
+  vblk->avail->ring[vblk->avail_idx & (vblk->queue_size - 1)] = head;
+
+  // The chain must be in memory before the device can see the new index
+  __asm__ __volatile__ ("" : : : "memory");
+  vblk->avail_idx++;
+  vblk->avail->idx = vblk->avail_idx;
+
+  return 0;
+}
+
+
+/**
+ * Puts waiting bios in the avail ring while there are free requests. Must be called
+ * with interrupts disabled.
+ */
+void virtio_blk_start (virtio_blk_t *vblk) {
+  bio_t *bio;
+  int cmd_nr;
+
+  while ((bio = vblk->bio_head) != NULL) {
+    // A flush waits until everything before it is done, and runs on its own
+    if (vblk->flushing) break;
+    if (bio->size == 0 && vblk->cmds_busy) break;
+    if (virtio_blk_overlaps (vblk, bio)) break;
+
+    for (cmd_nr=0; cmd_nr!=vblk->nr_cmds && (vblk->cmds_busy & (1U << cmd_nr)); cmd_nr++) ;
+    if (cmd_nr == vblk->nr_cmds) break;
+
+    vblk->bio_head = bio->next;
+    if (vblk->bio_head == NULL) vblk->bio_tail = NULL;
+
+    if (virtio_blk_issue (vblk, cmd_nr, bio) != 0) {
+      bio->flags |= BIO_ERROR;
+      block_end_io (bio);
+    }
+  }
+}
+
+
+/**
+ * Notifies the device of the requests added since the last notification. The device
+ * tells us when it does not need that, because it is still working on the queue and
+ * will find them by itself. Must be called with interrupts disabled.
+ */
+void virtio_blk_kick (virtio_blk_t *vblk) {
+  Uint16 old_idx = vblk->kicked_idx;
+  Uint16 new_idx = vblk->avail_idx;
+  int notify;
+
+  if (old_idx == new_idx) return;
+  vblk->kicked_idx = new_idx;
+
+  // The device must see the new index before we look at what it wants
+  virtio_mb ();
+
+  if (vblk->features & VIRTIO_F_EVENT_IDX) {
+    // Only when we went past the index the device asked to be notified at
+    notify = (Uint16)(new_idx - *vblk->avail_event - 1) < (Uint16)(new_idx - old_idx);
+  } else {
+    notify = ! (vblk->used->flags & VRING_USED_F_NO_NOTIFY);
+  }
+  if (! notify) return;
+
+  vblk->stats.kicks++;
+  outw (vblk->iobase + VIRTIO_PCI_QUEUE_NOTIFY, 0);
+}
+
+
+/**
+ * Adds a bio to the end of the waiting list, and puts it in the avail ring when a
+ * request is free. Must be called with interrupts disabled.
+ */
+void virtio_blk_queue (virtio_blk_t *vblk, bio_t *bio) {
+  bio->next = NULL;
+  if (vblk->bio_tail) vblk->bio_tail->next = bio; else vblk->bio_head = bio;
+  vblk->bio_tail = bio;
+
+  virtio_blk_start (vblk);
+}
+
+
+/**
+ * Finishes the requests in the used ring, and starts the next ones. Called by the IRQ
+ * handler, or by the waiting task when there is no IRQ. Must be called with interrupts
+ * disabled.
+ */
+void virtio_blk_complete (virtio_blk_t *vblk) {
+  volatile vring_used_elem_t *elem;
+  bio_t *bio;
+  int cmd_nr;
+
+  // No interrupts for requests that finish while we empty the ring. With event indices
+  // the device stays quiet by itself until we move used_event.
+  if (! (vblk->features & VIRTIO_F_EVENT_IDX)) vblk->avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+
+  while (1) {
+    while (vblk->last_used != vblk->used->idx) {
+      // The element has to be read after the index
+      __asm__ __volatile__ ("" : : : "memory");
+      elem = &vblk->used->ring[vblk->last_used & (vblk->queue_size - 1)];
+      cmd_nr = elem->id / vblk->chain_length;
+      vblk->last_used++;
+
+      if (cmd_nr >= vblk->nr_cmds || vblk->cmd_bio[cmd_nr] == NULL) continue;
+
+      bio = vblk->cmd_bio[cmd_nr];
+      vblk->cmd_bio[cmd_nr] = NULL;
+      vblk->cmds_busy &= ~(1U << cmd_nr);
+      if (bio->size == 0) vblk->flushing = 0;
+
+      if (vblk->cmds[cmd_nr].status != VIRTIO_BLK_S_OK) {
+        kprintf ("VIRTIO: error on VIRTIO%d (status %d)\n", vblk->disk_nr, vblk->cmds[cmd_nr].status);
+        bio->flags |= BIO_ERROR;
+        block_end_io (bio);
+        continue;
+      }
+
+      vblk->stats.bytes += vblk->cmd_bytes[cmd_nr];
+      bio->done += vblk->cmd_bytes[cmd_nr];
+      if (bio->done == bio->size) {
+        block_end_io (bio);
+        continue;
+      }
+
+      // Large bios take more requests, the rest goes first
+      bio->next = vblk->bio_head;
+      vblk->bio_head = bio;
+      if (vblk->bio_tail == NULL) vblk->bio_tail = bio;
+    }
+
+    // Without an IRQ interrupts stay off
+    if (! vblk->irq) break;
+
+    // Ask for an interrupt on the next request that finishes. One that finished in
+    // between would not give one, so look again.
+    if (vblk->features & VIRTIO_F_EVENT_IDX) {
+      *vblk->used_event = vblk->last_used;
+    } else {
+      vblk->avail->flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+    }
+    virtio_mb ();
+    if (vblk->last_used == vblk->used->idx) break;
+
+    if (! (vblk->features & VIRTIO_F_EVENT_IDX)) vblk->avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+  }
+
+  virtio_blk_start (vblk);
+  virtio_blk_kick (vblk);
+}
+
+
+/**
+ * Notifies the device, and waits until a bio is done. Without an IRQ nobody else
+ * finishes the requests, so we look at the used ring ourselves.
+ */
+void virtio_blk_wait (virtio_blk_t *vblk, bio_t *bio) {
+  int state = disable_ints ();
+  virtio_blk_kick (vblk);
+  restore_ints (state);
+
+  while (! (bio->flags & BIO_DONE)) {
+    if (ints_enabled () && vblk->irq) {
+      block_wait_io (bio);
+      return;
+    }
+
+    state = disable_ints ();
+    virtio_blk_complete (vblk);
+    restore_ints (state);
+  }
+}
+
+
+/**
+ * Virtio interrupt handler. Reading the ISR status acknowledges the interrupt, and
+ * tells us whether it was ours (the IRQ line can be shared).
+ */
+int virtio_blk_interrupt (regs_t *r) {
+  virtio_blk_t *vblk;
+  int i, rescheduling = 0;
+
+  for (i=0; i!=VIRTIO_BLK_MAX_DISKS; i++) {
+    vblk = &virtio_blk_disks[i];
+    if (! vblk->enabled || vblk->irq != r->int_no) continue;
+
+    if (! (inb (vblk->iobase + VIRTIO_PCI_ISR) & VIRTIO_ISR_QUEUE)) continue;
+
+    vblk->stats.interrupts++;
+    virtio_blk_complete (vblk);
+    rescheduling = 1;
+  }
+
+  return rescheduling;
+}
+
+
+/**
+ * Synchronous transfer of whole sectors. Returns the number of bytes transferred.
+ */
+Uint32 virtio_blk_transfer (virtio_blk_t *vblk, int direction, Uint64 offset, Uint32 size, char *buffer) {
+  bio_t bio;
+
+  memset (&bio, 0, sizeof (bio_t));
+  bio.dev = device_get_device (DEV_MAJOR_VIRTIO, vblk->disk_nr);
+  bio.direction = direction;
+  bio.offset = offset;
+  bio.size = size;
+  bio.buffer = buffer;
+
+  int state = disable_ints ();
+  virtio_blk_queue (vblk, &bio);
+  restore_ints (state);
+  virtio_blk_wait (vblk, &bio);
+
+  return bio.done;
+}
+
+
+/**
+ * Transfers a bio that does not start or end on a sector boundary. Whole sectors are
+ * transferred directly, the rest goes through the scratch buffer of the disk
+ * (read-modify-write for writes). Everything is done before we return.
+ */
+void virtio_blk_block_partial (virtio_blk_t *vblk, bio_t *bio) {
+  Uint64 offset = bio->offset;
+  Uint32 skip, len;
+
+  while (bio->done != bio->size) {
+    skip = offset & (VIRTIO_BLK_SECTOR_SIZE - 1);
+    len = bio->size - bio->done;
+
+    if (skip == 0 && len >= VIRTIO_BLK_SECTOR_SIZE) {
+      len &= ~(VIRTIO_BLK_SECTOR_SIZE - 1);
+      if (virtio_blk_transfer (vblk, bio->direction, offset, len, bio->buffer + bio->done) != len) break;
+    } else {
+      if (len > VIRTIO_BLK_SECTOR_SIZE - skip) len = VIRTIO_BLK_SECTOR_SIZE - skip;
+
+      // Only one task at a time can use the scratch buffer
+      while (1) {
+        int state = disable_ints ();
+        if (! vblk->scratch_busy) {
+          vblk->scratch_busy = 1;
+          restore_ints (state);
+          break;
+        }
+        if (_current_task != NULL && _current_task->pid != PID_IDLE) sched_interruptable_sleep (&vblk->scratch_wait);
+        restore_ints (state);
+      }
+
+      Uint32 ret = virtio_blk_transfer (vblk, BLOCK_READ, offset - skip, VIRTIO_BLK_SECTOR_SIZE, vblk->scratch);
+      if (ret == VIRTIO_BLK_SECTOR_SIZE) {
+        if (bio->direction == BLOCK_READ) {
+          memcpy (bio->buffer + bio->done, vblk->scratch + skip, len);
+        } else {
+          memcpy (vblk->scratch + skip, bio->buffer + bio->done, len);
+          ret = virtio_blk_transfer (vblk, BLOCK_WRITE, offset - skip, VIRTIO_BLK_SECTOR_SIZE, vblk->scratch);
+        }
+      }
+
+      int state = disable_ints ();
+      vblk->scratch_busy = 0;
+      if (_current_task != NULL) sched_wakeup (&vblk->scratch_wait);
+      restore_ints (state);
+
+      if (ret != VIRTIO_BLK_SECTOR_SIZE) break;
+    }
+
+    bio->done += len;
+    offset += len;
+  }
+
+  block_end_io (bio);
+}
+
+
+/**
+ * Starts a transfer. The request is put in the avail ring right away when one is free,
+ * but the device only hears about it on the commit of the batch. The IRQ handler
+ * completes the bio.
+ */
+void virtio_blk_block_submit (Uint8 major, Uint8 minor, bio_t *bio) {
+  device_t *device = (major == DEV_MAJOR_VIRTIO) ? device_get_device(major, minor) : NULL;
+  virtio_blk_t *vblk = device ? (virtio_blk_t *)device->data : NULL;
+
+  // Task memory cannot be translated outside of its task (the block layer bounces it)
+  bio->done = 0;
+  if (! vblk || ! vblk->enabled || bio->size == 0 ||
+      bio->offset + bio->size > vblk->size << 9 ||
+      ! is_kernel_address (_kernel_pagedirectory, (Uint32)bio->buffer, bio->size) ||
+      (bio->direction == BLOCK_WRITE && (vblk->features & VIRTIO_BLK_F_RO))) {
+    block_end_io (bio);
+    return;
+  }
+
+  if ((bio->offset & (VIRTIO_BLK_SECTOR_SIZE - 1)) || (bio->size & (VIRTIO_BLK_SECTOR_SIZE - 1))) {
+    virtio_blk_block_partial (vblk, bio);
+    return;
+  }
+
+  int state = disable_ints ();
+  virtio_blk_queue (vblk, bio);
+  restore_ints (state);
+
+  // Without interrupts nobody would finish the transfer
+  if (! ints_enabled () || ! vblk->irq) virtio_blk_wait (vblk, bio);
+}
+
+
+/**
+ * Notifies the device of all bios submitted since the last commit
+ */
+void virtio_blk_block_commit (Uint8 major, Uint8 minor) {
+  device_t *device = (major == DEV_MAJOR_VIRTIO) ? device_get_device(major, minor) : NULL;
+  virtio_blk_t *vblk = device ? (virtio_blk_t *)device->data : NULL;
+  if (! vblk || ! vblk->enabled) return;
+
+  int state = disable_ints ();
+  virtio_blk_kick (vblk);
+  restore_ints (state);
+}
+
+
+/**
+ * Synchronous read, returns the number of bytes read
+ */
+Uint32 virtio_blk_block_read (Uint8 major, Uint8 minor, Uint64 offset, Uint32 size, char *buffer) {
+  bio_t bio;
+
+  if (major != DEV_MAJOR_VIRTIO) return 0;
+
+  memset (&bio, 0, sizeof (bio_t));
+  bio.dev = device_get_device(major, minor);
+  bio.direction = BLOCK_READ;
+  bio.offset = offset;
+  bio.size = size;
+  bio.buffer = buffer;
+
+  virtio_blk_block_submit (major, minor, &bio);
+  virtio_blk_block_commit (major, minor);
+  block_wait_io (&bio);
+
+  return bio.done;
+}
+
+
+/**
+ * Synchronous write, returns the number of bytes written
+ */
+Uint32 virtio_blk_block_write (Uint8 major, Uint8 minor, Uint64 offset, Uint32 size, char *buffer) {
+  bio_t bio;
+
+  if (major != DEV_MAJOR_VIRTIO) return 0;
+
+  memset (&bio, 0, sizeof (bio_t));
+  bio.dev = device_get_device(major, minor);
+  bio.direction = BLOCK_WRITE;
+  bio.offset = offset;
+  bio.size = size;
+  bio.buffer = buffer;
+
+  virtio_blk_block_submit (major, minor, &bio);
+  virtio_blk_block_commit (major, minor);
+  block_wait_io (&bio);
+
+  return bio.done;
+}
+
+
+/**
+ * Writes the write cache of the device to the medium. The flush waits until the
+ * requests before it are done. Returns 0 on success, -1 on error.
+ */
+int virtio_blk_block_flush (Uint8 major, Uint8 minor) {
+  bio_t bio;
+
+  device_t *device = (major == DEV_MAJOR_VIRTIO) ? device_get_device(major, minor) : NULL;
+  virtio_blk_t *vblk = device ? (virtio_blk_t *)device->data : NULL;
+  if (! vblk || ! vblk->enabled) return -1;
+
+  // Without a write cache everything is on the medium already
+  if (! (vblk->features & VIRTIO_BLK_F_FLUSH)) return 0;
+
+  // A bio without data is a flush
+  memset (&bio, 0, sizeof (bio_t));
+  bio.dev = device;
+  bio.direction = BLOCK_WRITE;
+
+  int state = disable_ints ();
+  virtio_blk_queue (vblk, &bio);
+  restore_ints (state);
+  virtio_blk_wait (vblk, &bio);
+
+  return (bio.flags & BIO_ERROR) ? -1 : 0;
+}
+void virtio_blk_block_open (Uint8 major, Uint8 minor) {
+  // Doesn't do anything.
+}
+void virtio_blk_block_close (Uint8 major, Uint8 minor) {
+  // Doesn't do anything.
+}
+void virtio_blk_block_seek (Uint8 major, Uint8 minor, Uint32 offset, Uint8 direction) {
+  // Doesn't do anything.
+}
+
+
+/**
+ * Prints the notification and interrupt counters of all disks. Every notification
+ * and every interrupt costs the guest a VM exit.
+ */
+void virtio_blk_print_stats (void) {
+  virtio_blk_t *vblk;
+  Uint32 kbytes;
+  int i;
+
+  for (i=0; i!=virtio_blk_count; i++) {
+    vblk = &virtio_blk_disks[i];
+    kbytes = (Uint32)(vblk->stats.bytes >> 10);
+
+    kprintf ("VIRTIO%d: %d requests, %d kicks, %d interrupts, %d KB", i,
+             vblk->stats.requests, vblk->stats.kicks, vblk->stats.interrupts, kbytes);
+    if (kbytes >= 1024) kprintf (", %d kicks+interrupts per MB", (vblk->stats.kicks + vblk->stats.interrupts) / (kbytes >> 10));
+    kprintf ("\n");
+  }
+}
+
+
+/**
+ * Negotiates the features of a virtio disk and sets up its virtqueue. Returns 0 on
+ * success, -1 when the device cannot be used.
+ */
+int virtio_blk_init_device (virtio_blk_t *vblk, pci_device_t *pci_dev) {
+  Uint32 bar, host_features, ring_phys, ring_size, used_offset, seg_max;
+  Uint8 irq;
+  char *ring;
+  int n;
+
+  vblk->pci = pci_dev;
+
+  // The legacy registers are in I/O space
+  bar = pci_config_get_dword (pci_dev, 0x10);
+  if (! (bar & 1)) return -1;
+  vblk->iobase = bar & 0xFFFFFFFC;
+
+  // Enable I/O space and let the device become bus master
+  pci_config_set_word (pci_dev, 0x04, pci_config_get_word (pci_dev, 0x04) | 0x05);
+
+  // do_handle_irq() only hands IRQ 9 to 11 (where the BIOS puts PCI devices) to us. Otherwise we poll.
+  irq = pci_config_get_byte (pci_dev, 0x3C);
+  vblk->irq = (VIRTIO_BLK_USE_IRQ && irq >= 9 && irq <= 11) ? irq : 0;
+
+  // Reset, and tell the device we have a driver for it
+  outb (vblk->iobase + VIRTIO_PCI_STATUS, 0);
+  outb (vblk->iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+  outb (vblk->iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+  // Event indices only matter when we take interrupts
+  host_features = inl (vblk->iobase + VIRTIO_PCI_HOST_FEATURES);
+  vblk->features = host_features & (VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO | VIRTIO_BLK_F_FLUSH | VIRTIO_F_INDIRECT_DESC);
+  if (vblk->irq) vblk->features |= host_features & VIRTIO_F_EVENT_IDX;
+  outl (vblk->iobase + VIRTIO_PCI_GUEST_FEATURES, vblk->features);
+
+  // Legacy devices decide the size of the queue
+  outw (vblk->iobase + VIRTIO_PCI_QUEUE_SELECT, 0);
+  n = inw (vblk->iobase + VIRTIO_PCI_QUEUE_SIZE);
+  if (n < 4 || n > VIRTIO_MAX_QUEUE_SIZE || (n & (n - 1))) return -1;
+  vblk->queue_size = n;
+
+  // Descriptors and avail ring, then the used ring on the next page
+  used_offset = (n * sizeof (vring_desc_t) + 6 + n * 2 + 0xFFF) & ~0xFFF;
+  ring_size = used_offset + ((6 + n * sizeof (vring_used_elem_t) + 0xFFF) & ~0xFFF);
+  ring = (char *)kmalloc_dma (ring_size, &ring_phys);
+  vblk->cmds = (virtio_blk_cmd_t *)kmalloc_dma (VIRTIO_BLK_MAX_CMDS * sizeof (virtio_blk_cmd_t), &vblk->cmds_phys);
+  vblk->scratch = (char *)kmalloc (VIRTIO_BLK_SECTOR_SIZE);
+  if (! ring || ! vblk->cmds || ! vblk->scratch) return -1;
+
+  memset (ring, 0, ring_size);
+  memset (vblk->cmds, 0, VIRTIO_BLK_MAX_CMDS * sizeof (virtio_blk_cmd_t));
+  vblk->desc = (vring_desc_t *)ring;
+  vblk->avail = (vring_avail_t *)(ring + n * sizeof (vring_desc_t));
+  vblk->used = (vring_used_t *)(ring + used_offset);
+  vblk->used_event = &vblk->avail->ring[n];
+  vblk->avail_event = (volatile Uint16 *)&vblk->used->ring[n];
+  vblk->avail_idx = vblk->kicked_idx = vblk->last_used = 0;
+  if (! vblk->irq) vblk->avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+
+  vblk->size_max = 0;
+  if (vblk->features & VIRTIO_BLK_F_SIZE_MAX) {
+    vblk->size_max = inl (vblk->iobase + VIRTIO_PCI_CONFIG + VIRTIO_BLK_CONFIG_SIZE_MAX);
+    if (vblk->size_max < VIRTIO_BLK_SECTOR_SIZE) vblk->size_max = 0;
+  }
+  vblk->max_segments = VIRTIO_BLK_MAX_SEGMENTS;
+  if (vblk->features & VIRTIO_BLK_F_SEG_MAX) {
+    seg_max = inl (vblk->iobase + VIRTIO_PCI_CONFIG + VIRTIO_BLK_CONFIG_SEG_MAX);
+    if (seg_max > 0 && seg_max < vblk->max_segments) vblk->max_segments = seg_max;
+  }
+
+  // Every request is a single descriptor pointing to its own table. Otherwise the ring is
+  // divided in fixed chains, one for every request.
+  if (vblk->features & VIRTIO_F_INDIRECT_DESC) {
+    vblk->chain_length = 1;
+    vblk->nr_cmds = (n < VIRTIO_BLK_MAX_CMDS) ? n : VIRTIO_BLK_MAX_CMDS;
+  } else {
+    if (vblk->max_segments + 2 > n) vblk->max_segments = n - 2;
+    vblk->chain_length = vblk->max_segments + 2;
+    vblk->nr_cmds = n / vblk->chain_length;
+    if (vblk->nr_cmds > VIRTIO_BLK_MAX_CMDS) vblk->nr_cmds = VIRTIO_BLK_MAX_CMDS;
+  }
+
+  outl (vblk->iobase + VIRTIO_PCI_QUEUE_PFN, ring_phys >> 12);
+
+  vblk->size = inl (vblk->iobase + VIRTIO_PCI_CONFIG + VIRTIO_BLK_CONFIG_CAPACITY);
+  vblk->size |= (Uint64)inl (vblk->iobase + VIRTIO_PCI_CONFIG + VIRTIO_BLK_CONFIG_CAPACITY + 4) << 32;
+
+  sched_init_waitqueue (&vblk->scratch_wait);
+  vblk->cmds_busy = 0;
+  vblk->flushing = 0;
+  vblk->bio_head = vblk->bio_tail = NULL;
+
+  outb (vblk->iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+  return 0;
+}
+
+
+/**
+ * Registers a disk, and the partitions on it
+ */
+void virtio_blk_register (virtio_blk_t *vblk) {
+  device_t *device = (device_t *)kmalloc (sizeof (device_t));
+  memset (device, 0, sizeof (device_t));
+  device->major_num = DEV_MAJOR_VIRTIO;
+  device->minor_num = vblk->disk_nr;
+  device->data = (virtio_blk_t *)vblk;
+
+  device->read = virtio_blk_block_read;
+  device->write = virtio_blk_block_write;
+  device->open = virtio_blk_block_open;
+  device->close = virtio_blk_block_close;
+  device->seek = virtio_blk_block_seek;
+  device->submit = virtio_blk_block_submit;
+  device->commit = virtio_blk_block_commit;
+  device->flush = virtio_blk_block_flush;
+
+  // Create device name
+  char filename[20];
+  memset (filename, 0, sizeof (filename));
+  sprintf (filename, "VIRTIO%d", vblk->disk_nr);
+
+//  kprintf ("\n*** Registering device DEVICE:/%s\n", filename);
+  device_register (device, filename);
+
+  // Initialise partitions from the MBR
+  ide_read_partition_table (device, filename, DEV_MAJOR_VIRTIO_PART, vblk->disk_nr * 16, 0);
+}
+
+
+/**
+ *
+ */
+void virtio_blk_init (void) {
+  virtio_blk_t *vblk;
+
+  memset (virtio_blk_disks, 0, sizeof (virtio_blk_disks));
+
+  // Detect virtio block devices
+  pci_device_t *pci_dev = NULL;
+  while (pci_dev = pci_find_next_class (pci_dev, -1, -1), pci_dev != NULL) {
+    if (pci_dev->vendor_id != VIRTIO_PCI_VENDOR || pci_dev->device_id != VIRTIO_PCI_DEVICE_BLK) continue;
+    if (virtio_blk_count == VIRTIO_BLK_MAX_DISKS) break;
+
+    vblk = &virtio_blk_disks[virtio_blk_count];
+    if (virtio_blk_init_device (vblk, pci_dev) != 0) {
+      if (vblk->iobase) outb (vblk->iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+      memset (vblk, 0, sizeof (virtio_blk_t));
+      continue;
+    }
+
+    vblk->disk_nr = virtio_blk_count++;
+    vblk->enabled = 1;
+    virtio_blk_register (vblk);
+  }
+}
@@ -34,5 +34,8 @@ int sys_execve (regs_t *r, char *path, char **args, char **environ) {
   /* We return to the start of the newly loaded program instead of after execve. Since we can never
    * return from an execve() since the calling EIP is removed from the stack */
   r->eip = entrypoint;
+
+  // Handlers of the old program do not exist anymore
+  signal_reset_handlers (_current_task);
   return 0;
 }
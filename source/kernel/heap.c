@@ -13,6 +13,7 @@
 #define HEAP_START          0xD0000000      // Start of the heap
 #define MIN_HEAP_SIZE       0x50000         // Initial and also minimal heap size
 #define MIN_HEAP_GROWSIZE   0x10000         // Grow everytime with this size
+#define MAX_HEAP_SIZE       0x400000        // The heap must stay inside the single page table that every page directory links to
 #define HEAPMAGIC           0xCAFEBABE
 
 
@@ -79,10 +80,20 @@ int heap_init (void) {
 }
 
 void heap_expand (Uint32 size) {
+  Uint32 i;
+
 //  kprintf ("Expanding heap from 0x%08X with %d bytes.\n", _k_heap_size, size);
 
-  // TODO: add new page frames?
+  if (_k_heap_end + size > _k_heap_start + MAX_HEAP_SIZE) kpanic ("Out of heap memory!\n");
+
+  /* Map the new pages. The page table for the heap already exists and is linked into
+   * every page directory, so all tasks will see these pages as well. */
+  for (i=_k_heap_end; i!=_k_heap_end + size; i+=0x1000) {
+    create_pageframe (_kernel_pagedirectory, i, PAGEFLAG_USER + PAGEFLAG_PRESENT + PAGEFLAG_READWRITE);
+  }
+
   _k_heap_end += size;
+  _k_heap_size += size;
 }
 
 void heap_shrink (Uint32 size) {
@@ -101,12 +112,6 @@ void *_heap_kmalloc (Uint32 size, int pageboundary, Uint32 *physical_address) {
 
 //  kprintf ("\n_heap_kmalloc (%d, %d, ...)\n", size, pageboundary);
 
-  // Expand the heap if needed
-  while (_k_heap_top + size > _k_heap_end) {
-    kprintf ("Expanding heap\n");
-    heap_expand (MIN_HEAP_GROWSIZE);
-  }
-
 //  int old_k_heap_top = _k_heap_top;
 
   // Align the heaptop to the next 4KB page if needed.
@@ -115,6 +120,12 @@ void *_heap_kmalloc (Uint32 size, int pageboundary, Uint32 *physical_address) {
     _k_heap_top += 0x1000;
   }
 
+  // Expand the heap if needed (after aligning, otherwise we could end up outside the heap)
+  while (_k_heap_top + size > _k_heap_end) {
+//    kprintf ("Expanding heap\n");
+    heap_expand (MIN_HEAP_GROWSIZE);
+  }
+
   // mem_ptr is the base address of the new block
   mem_ptr = _k_heap_top;
 
@@ -19,6 +19,9 @@
 #include "gdt.h"
 #include "io.h"
 #include "drivers/floppy.h"
+#include "drivers/ide.h"
+#include "drivers/ahci.h"
+#include "drivers/virtio_blk.h"
 
 
 // Pointer to the kernel IDT
@@ -196,7 +199,7 @@ int idt_init (void) {
   idtr.base += 0xC0000000;
 
   // Disable all IRQ's
-  pic_mask_irq (0x1111);
+  pic_mask_irq (0xFFFF);
 
   // Load new interrupt descriptor table
   __asm__ __volatile__ ("lidt (%0)" : :"p" (&idtr));
@@ -240,18 +243,19 @@ void do_handle_irq (regs_t *r) {
     case 8 :
              break;
     case 9 :
-             break;
     case 10 :
-              break;
     case 11 :
+              // PCI devices
+              rescheduling = ahci_interrupt (r);
+              rescheduling |= virtio_blk_interrupt (r);
               break;
     case 12 :
               break;
     case 13 :
               break;
     case 14 :
-              break;
     case 15 :
+              rescheduling = ide_interrupt (r);
               break;
     default :
               break;
@@ -263,6 +267,9 @@ void do_handle_irq (regs_t *r) {
 
   // Reschedule if needed
   if (rescheduling) reschedule();
+
+  // Deliver signals when we return to user space
+  signal_deliver (r);
 }
 
 // =================================================================================
@@ -271,7 +278,13 @@ void do_handle_irq (regs_t *r) {
 // the call automatically places the ret addres onto the stack and that messes up the
 // rest of the parameters. Therefor, we just send a pointer.
 int do_handle_syscall (regs_t *r) {
-  return service_interrupt (r);
+  int ret = service_interrupt (r);
+
+  /* Deliver signals when we return to user space. The return value is part of the
+   * context that gets saved in the signal frame, so it must be inside the regs. */
+  r->eax = ret;
+  signal_deliver (r);
+  return r->eax;
 }
 
 // =================================================================================
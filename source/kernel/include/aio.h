@@ -0,0 +1,84 @@
+/******************************************************************************
+ *
+ *  File        : aio.h
+ *  Description : Asynchronous syscall ring defines and function headers
+ *
+ *****************************************************************************/
+#ifndef __AIO_H__
+#define __AIO_H__
+
+  #include "ktype.h"
+  #include "schedule.h"
+
+  // Operations that can be queued on the submission ring
+  #define AIO_OP_NOP                0     // Does nothing, completes with 0
+  #define AIO_OP_READ               1     // sys_read (fd, addr, len)
+  #define AIO_OP_WRITE              2     // sys_write (fd, addr, len)
+  #define AIO_OP_OPEN               3     // sys_open (addr, len), len holds the open flags
+  #define AIO_OP_CLOSE              4     // sys_close (fd)
+  #define AIO_OP_SLEEP              5     // Completes after len milliseconds
+
+  #define AIO_MAX_ENTRIES          64     // Maximum number of submission entries in a ring (power of 2)
+  #define AIO_MAX_TIMERS           16     // Maximum number of pending AIO_OP_SLEEP operations per ring
+
+  // Submission queue entry (filled by user space)
+  #pragma pack (1)
+  typedef struct {
+      Uint8  opcode;                    // AIO_OP_*
+      Uint8  flags;                     // Reserved, must be 0
+      Uint16 reserved;
+      int    fd;                        // File descriptor (when needed by the op)
+      Uint32 addr;                      // Buffer or path address (user space)
+      Uint32 len;                       // Length, open flags or sleep time
+      Uint32 user_data;                 // Copied untouched into the completion entry
+  } aio_sqe_t;
+
+  // Completion queue entry (filled by the kernel)
+  typedef struct {
+      Uint32 user_data;                 // user_data of the submission entry
+      int    result;                    // Return value of the operation
+  } aio_cqe_t;
+
+  /* Ring header as it lives in the task's memory. The submission array (entries items)
+   * directly follows this header, the completion array (entries * 2 items) follows the
+   * submission array. User space only moves sq_tail and cq_head, the kernel only moves
+   * sq_head and cq_tail. */
+  typedef struct {
+      Uint32 sq_head;                   // Next entry the kernel will consume
+      Uint32 sq_tail;                   // Next entry user space will fill
+      Uint32 cq_head;                   // Next completion user space will reap
+      Uint32 cq_tail;                   // Next completion the kernel will fill
+      Uint32 entries;                   // Number of submission entries
+      Uint32 overflow;                  // Completions dropped because the completion ring was full
+  } aio_ring_t;
+
+  // Number of bytes user space must reserve for a ring with this many entries
+  #define AIO_RING_SIZE(entries)  (sizeof (aio_ring_t) + (entries) * sizeof (aio_sqe_t) + (entries) * 2 * sizeof (aio_cqe_t))
+
+  // Start of the submission and completion arrays inside a ring
+  #define AIO_SQES(ring)          ((aio_sqe_t *)((Uint32)(ring) + sizeof (aio_ring_t)))
+  #define AIO_CQES(ring,entries)  ((aio_cqe_t *)((Uint32)AIO_SQES(ring) + (entries) * sizeof (aio_sqe_t)))
+
+  // Pending sleep operation
+  typedef struct {
+      int    active;                    // 1 when this timer is in use
+      Uint64 expires;                   // _kernel_ticks at which the operation completes
+      Uint32 user_data;                 // user_data of the submission entry
+  } aio_timer_t;
+
+  // Kernel side administration of a ring
+  typedef struct aio_context {
+      aio_ring_t  *ring;                // Ring inside the task's address space
+      Uint32      entries;              // Copy of ring->entries (user space could change it)
+      int         inflight;             // Operations submitted but not yet completed
+      waitqueue_t wait;                 // Task waits here inside sys_aio_enter()
+      aio_timer_t timer[AIO_MAX_TIMERS];
+  } aio_context_t;
+
+  int sys_aio_setup (aio_ring_t *ring, Uint32 entries);
+  int sys_aio_enter (Uint32 to_submit, Uint32 min_complete);
+  void aio_submit_pending (void);
+  void aio_timer_tick (task_t *task);
+  void aio_destroy (task_t *task);
+
+#endif //__AIO_H__
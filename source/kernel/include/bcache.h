@@ -0,0 +1,67 @@
+/******************************************************************************
+ *
+ *  File        : bcache.h
+ *  Description : Block buffer cache defines and function headers
+ *
+ *****************************************************************************/
+#ifndef __BCACHE_H__
+#define __BCACHE_H__
+
+  #include "ktype.h"
+  #include "device.h"
+  #include "block.h"
+
+  #define BCACHE_BLOCK_SIZE      1024     // Size of a cached block (all devices use the same size so blocks never overlap)
+  #define BCACHE_BUFFERS           64     // Number of buffers in the cache
+  #define BCACHE_HASH_SIZE         64     // Number of hash buckets (power of 2)
+  #define BCACHE_READAHEAD_BLOCKS  16     // Largest run of blocks bcache_readahead() reads at once
+
+  #define BCACHE_FLUSH_INTERVAL  5000     // Milliseconds between two bdflush() runs
+  #define BCACHE_DIRTY_AGE        300     // Dirty buffers older than this many ticks are written by bdflush()
+
+  // Defines for buffer_t.flags
+  #define BUF_VALID              0x01     // Data is read from (or completely written by) the device
+  #define BUF_DIRTY              0x02     // Data must be written back to the device
+  #define BUF_LOCKED             0x04     // Device I/O in progress, wait on the cache wait queue
+  #define BUF_REFERENCED         0x08     // Used since the clock hand passed, gets a second chance
+
+  typedef struct buffer {
+      Uint8  major_num;                   // Device of this block
+      Uint8  minor_num;
+      Uint32 block;                       // Block number on the device (in BCACHE_BLOCK_SIZE units)
+      char   *data;                       // BCACHE_BLOCK_SIZE bytes of block data
+      int    flags;                       // BUF_* flags
+      int    refcount;                    // Pinned (never evicted) while larger than 0
+      Uint64 dirty_since;                 // _kernel_ticks when the buffer became dirty
+      struct buffer *hash_next;           // Next buffer in the same hash bucket
+      bio_t  bio;                         // Readahead of the block, in progress while the buffer is locked
+  } buffer_t;
+
+  typedef struct {
+      Uint32 hits;                        // Blocks found in the cache
+      Uint32 misses;                      // Blocks read from the device
+      Uint32 evictions;                   // Valid blocks thrown out to make room
+      Uint32 writebacks;                  // Dirty blocks written to the device
+      Uint32 readaheads;                  // Blocks read before anybody asked for them
+  } bcache_stats_t;
+
+  extern bcache_stats_t bcache_stats;
+
+  void bcache_init (void);
+  buffer_t *bcache_get (device_t *dev, Uint32 block, int fill);
+  void bcache_release (buffer_t *buf);
+  void bcache_mark_dirty (buffer_t *buf);
+  Uint32 bcache_read (device_t *dev, Uint64 offset, Uint32 size, char *buffer);
+  Uint32 bcache_write (device_t *dev, Uint64 offset, Uint32 size, char *buffer);
+  Uint32 bcache_read_uncached (device_t *dev, Uint64 offset, Uint32 size, char *buffer);
+  int bcache_readahead (device_t *dev, Uint64 offset, Uint32 size);
+  void bcache_readahead_end_io (bio_t *bio);
+  int bcache_flush (device_t *dev, Uint32 min_age);
+  int bcache_sync (device_t *dev);
+  void bcache_invalidate (device_t *dev);
+  void bcache_print_stats (void);
+
+  int sys_bdflush (void);
+  int bdflush (void);
+
+#endif //__BCACHE_H__
@@ -0,0 +1,111 @@
+/******************************************************************************
+ *
+ *  File        : block.h
+ *  Description : Block layer defines and function headers
+ *
+ *****************************************************************************/
+#ifndef __BLOCK_H__
+#define __BLOCK_H__
+
+  #include "ktype.h"
+  #include "device.h"
+  #include "schedule.h"
+
+  #define BLOCK_READ                0
+  #define BLOCK_WRITE               1
+
+  #define BLOCK_QUEUE_DEPTH        32     // Requests that can be pending on a single device
+  #define BLOCK_MAX_MERGE       32768     // Requests do not grow larger than this by merging bios
+  #define BLOCK_BOUNCE_BUFFERS      4     // Kernel buffers for synchronous transfers from and to task memory (BLOCK_MAX_MERGE each)
+
+  #define BLOCK_READ_EXPIRE        50     // Ticks before the deadline scheduler serves a read out of order
+  #define BLOCK_WRITE_EXPIRE      500     // Ticks before the deadline scheduler serves a write out of order
+
+  // Defines for bio_t.flags
+  #define BIO_DONE               0x01     // Transfer has finished (successful or not)
+  #define BIO_ERROR              0x02     // Not everything could be transferred
+
+  struct bio;
+  struct request_queue;
+
+  // A single transfer between a buffer and a range of the device
+  typedef struct bio {
+      device_t      *dev;
+      int           direction;            // BLOCK_READ or BLOCK_WRITE
+      Uint64        offset;               // Byte offset on the device
+      Uint32        size;                 // Bytes to transfer
+      char          *buffer;              // Kernel address, drivers use it from other tasks and interrupt handlers
+      Uint32        done;                 // Bytes actually transferred
+      volatile int  flags;                // BIO_* flags
+      void          (*end_io)(struct bio *bio);   // Called on completion, can be NULL
+      void          *private;             // Free to use by the owner of the bio
+      void          *driver_data;         // Free to use by the driver while the bio is in progress
+      struct bio    *next;                // Next segment of the same request (the driver can use it while in progress)
+  } bio_t;
+
+  // Bios for adjacent ranges, merged into a single transfer
+  typedef struct request {
+      int           direction;            // BLOCK_READ or BLOCK_WRITE
+      Uint64        offset;               // Byte offset on the device
+      Uint32        size;                 // Total size of all bios
+      bio_t         *bio;                 // Segments in device order
+      bio_t         *bio_tail;
+      bio_t         rq_bio;               // Carries the whole request to the driver
+      struct request_queue *queue;
+      Uint64        deadline;             // _kernel_ticks after which the request is served first
+      struct request *next;               // Next pending request (in arrival order), or next free request
+  } request_t;
+
+  // I/O scheduler. Decides which pending request goes to the driver next
+  typedef struct block_scheduler {
+      const char    *name;
+      request_t     *(*next)(struct request_queue *queue);   // Returns the next request (does not remove it)
+  } block_scheduler_t;
+
+  typedef struct request_queue {
+      device_t          *dev;
+      block_scheduler_t *scheduler;
+      request_t         *pending;         // Pending requests in arrival order
+      request_t         *free;            // Unused requests
+      request_t         requests[BLOCK_QUEUE_DEPTH];
+      int               inflight;         // Requests handed to the driver and not completed yet
+      int               uncommitted;      // Requests were handed to the driver after its last commit()
+      Uint64            position;         // End of the last dispatched request (for the elevators)
+      char              *bounce;          // Merged requests are transferred through this buffer
+      int               bounce_busy;      // A merged request is in flight
+      waitqueue_t       wait;             // Tasks waiting for their bio, or for a free request
+  } request_queue_t;
+
+  typedef struct {
+      Uint32 bios;                        // Bios submitted
+      Uint32 back_merges;                 // Bios added to the end of a pending request
+      Uint32 front_merges;                // Bios added to the start of a pending request
+      Uint32 requests;                    // Requests sent to drivers
+      Uint32 commits;                     // Batches of requests committed to drivers
+  } block_stats_t;
+
+  extern block_stats_t block_stats;
+  extern block_scheduler_t block_schedulers[];
+
+  void block_init (void);
+  request_queue_t *block_get_queue (device_t *dev);
+  int block_set_scheduler (device_t *dev, const char *name);
+
+  void block_submit (bio_t *bio);
+  int block_wait (bio_t *bio);
+  void block_end_io (bio_t *bio);
+  int block_wait_io (bio_t *bio);
+  void block_unplug (device_t *dev);
+  int block_flush (device_t *dev);
+  int block_dispatch (request_queue_t *queue);
+  void block_commit (request_queue_t *queue);
+
+  Uint32 block_read (device_t *dev, Uint64 offset, Uint32 size, char *buffer);
+  Uint32 block_write (device_t *dev, Uint64 offset, Uint32 size, char *buffer);
+  void block_print_stats (void);
+
+  request_t *block_noop_next (request_queue_t *queue);
+  request_t *block_clook_next (request_queue_t *queue);
+  request_t *block_deadline_next (request_queue_t *queue);
+
+#endif //__BLOCK_H__
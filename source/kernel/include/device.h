@@ -15,20 +15,46 @@
     #define DEV_MAJOR_FDC           1   // Floppy disks
     #define DEV_MAJOR_IDE           2   // Ide controllers (ATA or ATAPI)
     #define DEV_MAJOR_HDC           3   // Hard disks (partitioned block device)
+    #define DEV_MAJOR_SATA          4   // AHCI drives
+    #define DEV_MAJOR_SATA_PART     5   // Partitions on AHCI drives
+    #define DEV_MAJOR_VIRTIO        6   // Virtio disks
+    #define DEV_MAJOR_VIRTIO_PART   7   // Partitions on virtio disks
     #define DEV_MAJOR_CONSOLES     10   // Consoles (3,0 = kconsole)    (@TODO: not used)
 
+    // Minor numbers for DEV_MAJOR_MISC
+    #define DEV_MINOR_KEYBOARD      1   // Keyboard input
+
+    struct poll_table;
+    struct request_queue;
+    struct bio;
+
     typedef struct {
       Uint8  major_num;            // Major device node
       Uint8  minor_num;            // Minor device node
       void   *data;                // Some data that might accompany the device
+      char   type;                 // FS_CHARDEVICE or FS_BLOCKDEVICE (0 is a block device)
       struct device_t *next;       // Pointer to next device
 
       // Block device functions
-      Uint32(*read)(Uint8 major, Uint8 minor, Uint32 offset, Uint32 size, char *buffer);
-      Uint32(*write)(Uint8 major, Uint8 minor, Uint32 offset, Uint32 size, char *buffer);
+      Uint32(*read)(Uint8 major, Uint8 minor, Uint64 offset, Uint32 size, char *buffer);
+      Uint32(*write)(Uint8 major, Uint8 minor, Uint64 offset, Uint32 size, char *buffer);
       void (*open)(Uint8 major, Uint8 minor);
       void (*close)(Uint8 major, Uint8 minor);
       void (*seek)(Uint8 major, Uint8 minor, Uint32 offset, Uint8 direction);
+      int (*poll)(Uint8 major, Uint8 minor, struct poll_table *table);   // NULL when the device never blocks
+
+      /* Asynchronous transfer of bio->size bytes at bio->offset. The driver calls block_end_io()
+       * when done, which can be before submit returns. NULL when the driver cannot do this. */
+      void (*submit)(Uint8 major, Uint8 minor, struct bio *bio);
+
+      /* Starts the bios given to submit() since the last call, so the device is notified
+       * once for a whole batch. NULL when submit() starts every bio itself. */
+      void (*commit)(Uint8 major, Uint8 minor);
+
+      // Writes the volatile write cache of the device to the medium. NULL when there is none
+      int (*flush)(Uint8 major, Uint8 minor);
+
+      struct request_queue *queue; // Block layer request queue, created on first use
     } device_t;
 
 
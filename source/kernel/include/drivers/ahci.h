@@ -0,0 +1,248 @@
+/******************************************************************************
+ *
+ *  File        : ahci.h
+ *  Description : AHCI (SATA) controller defines.
+ *
+ *****************************************************************************/
+
+#ifndef __DRIVERS_AHCI_H__
+#define __DRIVERS_AHCI_H__
+
+    #include "kernel.h"
+    #include "pci.h"
+    #include "block.h"
+
+    #define AHCI_MAX_CONTROLLERS      4
+    #define AHCI_MAX_PORTS           32
+    #define AHCI_MAX_SLOTS           32     // Command slots per port (also the deepest NCQ queue)
+    #define AHCI_MAX_DISKS           16     // Partition minors are disk * 16 + partition
+
+    // Interrupt driven completion stays off until IRQ 9..11 delivery has been checked on a
+    // real (or emulated) controller. All commands are polled until then.
+    #define AHCI_USE_IRQ              0
+
+    #define AHCI_SECTOR_SIZE        512
+    #define AHCI_MAX_SECTORS        256     // Most sectors per command, larger bios take more commands
+    #define AHCI_PRD_ENTRIES         40     // 128KB spans at most 33 pages, 40 keeps the table 128 byte aligned
+    #define AHCI_PRD_MAX_BYTES  0x400000    // Most bytes a single PRD entry can describe
+    #define AHCI_TIMEOUT         1000000    // Register reads before we give up waiting for the HBA
+
+    // Generic host control registers
+    #define AHCI_CAP_NCS_SHIFT        8     // Number of command slots - 1
+    #define AHCI_CAP_SCLO    0x01000000     // Supports command list override
+    #define AHCI_CAP_SNCQ    0x40000000     // Supports native command queuing
+
+    #define AHCI_GHC_HR      0x00000001     // HBA reset
+    #define AHCI_GHC_IE      0x00000002     // Interrupt enable
+    #define AHCI_GHC_AE      0x80000000     // AHCI enable
+
+    // Port registers
+    #define AHCI_PxIS_DHRS   0x00000001     // Device to host register FIS received (non-queued command done)
+    #define AHCI_PxIS_PSS    0x00000002     // PIO setup FIS received
+    #define AHCI_PxIS_DSS    0x00000004     // DMA setup FIS received
+    #define AHCI_PxIS_SDBS   0x00000008     // Set device bits FIS received (queued commands done)
+    #define AHCI_PxIS_IFS    0x08000000     // Interface fatal error
+    #define AHCI_PxIS_HBDS   0x10000000     // Host bus data error
+    #define AHCI_PxIS_HBFS   0x20000000     // Host bus fatal error
+    #define AHCI_PxIS_TFES   0x40000000     // Task file error
+    #define AHCI_PxIS_ERRORS (AHCI_PxIS_IFS | AHCI_PxIS_HBDS | AHCI_PxIS_HBFS | AHCI_PxIS_TFES)
+
+    #define AHCI_PxCMD_ST    0x00000001     // Start processing the command list
+    #define AHCI_PxCMD_CLO   0x00000008     // Command list override (clears BSY and DRQ)
+    #define AHCI_PxCMD_FRE   0x00000010     // FIS receive enable
+    #define AHCI_PxCMD_FR    0x00004000     // FIS receive running
+    #define AHCI_PxCMD_CR    0x00008000     // Command list running
+
+    #define AHCI_TFD_ERR           0x01     // Status register of the device (in the task file data)
+    #define AHCI_TFD_DRQ           0x08
+    #define AHCI_TFD_BSY           0x80
+
+    #define AHCI_SSTS_DET_PRESENT    3      // Device detected and communication established
+    #define AHCI_SSTS_IPM_ACTIVE     1      // Interface in active state
+
+    #define AHCI_SIG_ATA     0x00000101     // Signature of a SATA disk
+    #define AHCI_SIG_ATAPI   0xEB140101     // Signature of a SATAPI drive
+
+    #define AHCI_FIS_REG_H2D       0x27     // Register FIS, host to device
+    #define AHCI_FIS_COMMAND       0x80     // The register FIS holds a command
+
+    #define AHCI_CMD_WRITE       0x0040     // Command header: data goes from memory to the device
+
+    // ATA commands
+    #define AHCI_ATA_READ_DMA          0xC8
+    #define AHCI_ATA_READ_DMA_EXT      0x25
+    #define AHCI_ATA_WRITE_DMA         0xCA
+    #define AHCI_ATA_WRITE_DMA_EXT     0x35
+    #define AHCI_ATA_READ_FPDMA        0x60     // Read FPDMA queued (NCQ)
+    #define AHCI_ATA_WRITE_FPDMA       0x61     // Write FPDMA queued (NCQ)
+    #define AHCI_ATA_CACHE_FLUSH       0xE7
+    #define AHCI_ATA_CACHE_FLUSH_EXT   0xEA
+    #define AHCI_ATA_IDENTIFY          0xEC
+
+    // Words in the identify data
+    #define AHCI_IDENT_MODEL             27
+    #define AHCI_IDENT_MAX_LBA           60
+    #define AHCI_IDENT_QUEUE_DEPTH       75     // Bits 0-4: queue depth - 1
+    #define AHCI_IDENT_SATA_CAP          76     // Bit 8: NCQ supported
+    #define AHCI_IDENT_COMMANDSETS       83     // Bit 10: LBA48 supported
+    #define AHCI_IDENT_MAX_LBA_EXT      100
+
+
+#pragma pack(1)
+  // Registers of a single port
+  typedef volatile struct ahci_port_regs {
+    Uint32              clb;                 // Command list base address (1KB aligned)
+    Uint32              clbu;
+    Uint32              fb;                  // FIS base address (256 byte aligned)
+    Uint32              fbu;
+    Uint32              is;                  // Interrupt status (write 1 to clear)
+    Uint32              ie;                  // Interrupt enable
+    Uint32              cmd;
+    Uint32              reserved0;
+    Uint32              tfd;                 // Task file data (status and error register of the device)
+    Uint32              sig;
+    Uint32              ssts;                // SATA status
+    Uint32              sctl;
+    Uint32              serr;                // SATA error (write 1 to clear)
+    Uint32              sact;                // Queued commands that are not finished
+    Uint32              ci;                  // Command issue, cleared by the HBA when a command is done (or accepted by the device when queued)
+    Uint32              sntf;
+    Uint32              fbs;
+    Uint32              reserved1[11];
+    Uint32              vendor[4];
+  } ahci_port_regs_t;
+
+  // Memory mapped registers of the HBA (ABAR)
+  typedef volatile struct ahci_hba {
+    Uint32              cap;                 // Host capabilities
+    Uint32              ghc;                 // Global host control
+    Uint32              is;                  // Interrupt status, one bit per port (write 1 to clear)
+    Uint32              pi;                  // Ports implemented
+    Uint32              vs;
+    Uint32              ccc_ctl;
+    Uint32              ccc_ports;
+    Uint32              em_loc;
+    Uint32              em_ctl;
+    Uint32              cap2;
+    Uint32              bohc;
+    Uint8               reserved[0xA0 - 0x2C];
+    Uint8               vendor[0x100 - 0xA0];
+    ahci_port_regs_t    port[AHCI_MAX_PORTS];
+  } ahci_hba_t;
+
+  // Entry in the command list of a port
+  typedef struct ahci_cmd_header {
+    Uint16              flags;               // Bits 0-4: FIS length in dwords, AHCI_CMD_WRITE
+    Uint16              prdtl;               // Entries in the PRD table
+    volatile Uint32     prdbc;               // Bytes transferred (updated by the HBA)
+    Uint32              ctba;                // Command table base address (128 byte aligned)
+    Uint32              ctbau;
+    Uint32              reserved[4];
+  } ahci_cmd_header_t;
+
+  // Physical region descriptor
+  typedef struct ahci_prd {
+    Uint32              dba;                 // Data base address (word aligned)
+    Uint32              dbau;
+    Uint32              reserved;
+    Uint32              dbc;                 // Bits 0-21: byte count - 1
+  } ahci_prd_t;
+
+  // Register FIS, host to device
+  typedef struct ahci_fis_h2d {
+    Uint8               type;                // AHCI_FIS_REG_H2D
+    Uint8               flags;               // AHCI_FIS_COMMAND
+    Uint8               command;
+    Uint8               feature_lo;
+    Uint8               lba0;
+    Uint8               lba1;
+    Uint8               lba2;
+    Uint8               device;
+    Uint8               lba3;
+    Uint8               lba4;
+    Uint8               lba5;
+    Uint8               feature_hi;
+    Uint8               count_lo;
+    Uint8               count_hi;
+    Uint8               icc;
+    Uint8               control;
+    Uint8               reserved[4];
+  } ahci_fis_h2d_t;
+
+  // Command table, one for every command slot
+  typedef struct ahci_cmd_table {
+    Uint8               cfis[64];            // Command FIS
+    Uint8               acmd[16];            // ATAPI command
+    Uint8               reserved[48];
+    ahci_prd_t          prdt[AHCI_PRD_ENTRIES];
+  } ahci_cmd_table_t;
+
+  // A SATA port with a disk attached
+  typedef struct ahci_port {
+    char                   enabled;
+    Uint8                  port_nr;
+    Uint8                  disk_nr;          // Number of the disk (the minor device number)
+    struct ahci_controller *controller;
+    ahci_port_regs_t       *regs;
+
+    Uint64                 size;             // Size in sectors
+    char                   model[41];
+    char                   lba48;            // Device supports LBA48 instead of only LBA28
+    char                   ncq;              // Reads and writes are queued (READ/WRITE FPDMA QUEUED)
+    Uint8                  slots;            // Command slots we use (limited by the HBA and the queue depth of the disk)
+
+    ahci_cmd_header_t      *cmd_list;        // Command list and received FIS area
+    Uint32                 cmd_list_phys;
+    ahci_cmd_table_t       *cmd_table;       // One command table for every slot
+    Uint32                 cmd_table_phys;
+    char                   *scratch;         // Single sector buffer for identify and partial sectors
+    Uint32                 scratch_phys;
+    volatile char          scratch_busy;     // A task is using the scratch buffer
+    waitqueue_t            scratch_wait;     // Tasks waiting for the scratch buffer
+
+    bio_t                  *slot_bio[AHCI_MAX_SLOTS];    // Bio that is transferred in a slot
+    Uint32                 slot_bytes[AHCI_MAX_SLOTS];   // Bytes of the command in a slot
+    Uint32                 slots_busy;       // Slots with a command in progress
+    char                   flushing;         // A cache flush is in progress, nothing else may be issued
+
+    bio_t                  *bio_head;        // Bios waiting for a free slot
+    bio_t                  *bio_tail;
+  } ahci_port_t;
+
+  typedef struct ahci_controller {
+    char                enabled;
+    Uint8               controller_nr;
+    ahci_hba_t          *hba;                // Mapped registers
+    Uint8               irq;                 // 0 when the IRQ line is not handled, all transfers are polled then
+    Uint8               slots;               // Command slots per port
+    char                ncq;                 // HBA supports native command queuing
+    pci_device_t        *pci;
+    ahci_port_t         port[AHCI_MAX_PORTS];
+  } ahci_controller_t;
+
+  ahci_controller_t ahci_controllers[AHCI_MAX_CONTROLLERS];
+
+  void ahci_init (void);
+  int ahci_interrupt (regs_t *r);
+
+  int ahci_wait_register (volatile Uint32 *reg, Uint32 mask, Uint32 value);
+  int ahci_port_prdt (ahci_cmd_table_t *table, char *buffer, Uint32 size);
+  void ahci_port_start (ahci_port_t *port);
+  void ahci_port_issue (ahci_port_t *port, int slot, bio_t *bio);
+  void ahci_port_complete (ahci_port_t *port);
+  void ahci_port_error (ahci_port_t *port);
+  void ahci_port_wait (ahci_port_t *port, bio_t *bio);
+  void ahci_port_queue (ahci_port_t *port, bio_t *bio);
+  int ahci_port_overlaps (ahci_port_t *port, bio_t *bio);
+  Uint32 ahci_port_transfer (ahci_port_t *port, int direction, Uint64 offset, Uint32 size, char *buffer);
+
+  void ahci_block_partial (ahci_port_t *port, bio_t *bio);
+  void ahci_block_submit (Uint8 major, Uint8 minor, bio_t *bio);
+  Uint32 ahci_block_read (Uint8 major, Uint8 minor, Uint64 offset, Uint32 size, char *buffer);
+  Uint32 ahci_block_write (Uint8 major, Uint8 minor, Uint64 offset, Uint32 size, char *buffer);
+  int ahci_block_flush (Uint8 major, Uint8 minor);
+  void ahci_block_open (Uint8 major, Uint8 minor);
+  void ahci_block_close (Uint8 major, Uint8 minor);
+  void ahci_block_seek (Uint8 major, Uint8 minor, Uint32 offset, Uint8 direction);
+
+#endif //__DRIVERS_AHCI_H__
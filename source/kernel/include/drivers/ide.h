@@ -12,6 +12,7 @@
 
     #include "kernel.h"
     #include "pci.h"
+    #include "block.h"
 
     #define IDE_DRIVE_TYPE_ATA        0     // ATA interface needed for this drive
     #define IDE_DRIVE_TYPE_ATAPI      1     // ATAPI interface needed for this drive
@@ -67,6 +68,20 @@
     #define IDE_SR_IDX     0x02
     #define IDE_SR_ERR     0x01
 
+    // Bus master IDE registers (offsets from the bus master base of the channel)
+    #define IDE_BM_REG_COMMAND    0x00
+    #define IDE_BM_REG_STATUS     0x02
+    #define IDE_BM_REG_PRDT       0x04
+
+    #define IDE_BM_CMD_START      0x01
+    #define IDE_BM_CMD_READ       0x08      // Transfer from the drive into memory
+
+    #define IDE_BM_SR_ACTIVE      0x01
+    #define IDE_BM_SR_ERR         0x02
+    #define IDE_BM_SR_IRQ         0x04      // Drive raised its interrupt (write 1 to clear)
+    #define IDE_BM_SR_DRV0_DMA    0x20
+    #define IDE_BM_SR_DRV1_DMA    0x40
+
     // IDE commands
     #define IDE_CMD_READ_PIO          0x20
     #define IDE_CMD_READ_PIO_EXT      0x24
@@ -76,6 +91,11 @@
     #define IDE_CMD_WRITE_PIO_EXT     0x34
     #define IDE_CMD_WRITE_DMA         0xCA
     #define IDE_CMD_WRITE_DMA_EXT     0x35
+    #define IDE_CMD_READ_MULTIPLE     0xC4
+    #define IDE_CMD_READ_MULTIPLE_EXT 0x29
+    #define IDE_CMD_WRITE_MULTIPLE    0xC5
+    #define IDE_CMD_WRITE_MULTIPLE_EXT 0x39
+    #define IDE_CMD_SET_MULTIPLE      0xC6
     #define IDE_CMD_CACHE_FLUSH       0xE7
     #define IDE_CMD_CACHE_FLUSH_EXT   0xEA
     #define IDE_CMD_PACKET            0xA0
@@ -89,12 +109,16 @@
     #define IDE_IDENT_SECTORS      12
     #define IDE_IDENT_SERIAL       20
     #define IDE_IDENT_MODEL        54
+    #define IDE_IDENT_MAX_MULTIPLE 94     // Low byte: most sectors per DRQ block for READ/WRITE MULTIPLE
     #define IDE_IDENT_CAPABILITIES 98
     #define IDE_IDENT_FIELDVALID   106
     #define IDE_IDENT_MAX_LBA      120
     #define IDE_IDENT_COMMANDSETS  164
     #define IDE_IDENT_MAX_LBA_EXT  200
 
+    #define IDE_CAP_DMA         0x0100    // Capabilities: drive supports DMA
+    #define IDE_CAP_LBA         0x0200    // Capabilities: drive supports LBA
+
 /*
     // Return values for ide_detect_devtype ()
     #define IDEDEV_NONE          0
@@ -106,9 +130,29 @@
 */
 
 
-  #define   IDE_SECTOR_SIZE     512     // Size of a sector (@TODO: Atapi CDROM sector sizes?)
+  #define   IDE_SECTOR_SIZE     512     // Size of an ATA sector (ATAPI drives use 2048 byte sectors, see drive->sector_size)
   #define   IDE_MAX_PARITIONS   16      // Maximum 16 partitions per drive (because of node numbers)
 
+  #define   IDE_MAX_SECTORS_LBA28   256     // Most sectors one LBA28 command can transfer
+  #define   IDE_MAX_SECTORS_LBA48 65536     // Most sectors one LBA48 command can transfer
+  #define   IDE_MAX_SECTORS_ATAPI 0xFFFFFFFF  // READ(12) takes a 32 bit sector count
+
+  // Bus master DMA completes on IRQ 14/15. It stays off until that path has been checked on
+  // a real (or emulated) drive, all transfers are PIO until then.
+  #define   IDE_USE_DMA               0
+
+  #define   IDE_DMA_BUFFER_SIZE   65536     // Bounce buffer per channel, most bytes a single DMA command transfers
+  #define   IDE_PRD_ENTRIES           2     // A page aligned 64KB buffer is split in at most 2 regions
+  #define   IDE_PRD_EOT          0x8000     // Last entry of the PRD table
+
+  // Physical region descriptor. A region may not cross a 64KB boundary, a size of 0 means 64KB
+#pragma pack(1)
+  typedef struct ide_prd {
+    Uint32              address;             // Physical address of the region
+    Uint16              size;                // Size in bytes
+    Uint16              flags;               // IDE_PRD_EOT on the last entry
+  } ide_prd_t;
+
   // Slave or master drive (either atapi or ata)
   typedef struct ide_drive {
     char                enabled;             // Enabled or not (in case no extra drive on the IDE cable)
@@ -116,15 +160,19 @@
                                              // controller at *drive->channel->controller
     Uint8               drive_nr;            // Master drive (IDE_DRIVE_MASTER) or slave drive (IDE_DRIVE_SLAVE)
     char                type;                // ata (IDE_DRIVE_TYPE_ATAPI) or atapi (IDE_DRIVE_TYPE_ATAPI)
-    Uint32              size;                // Size in sectors
+    Uint64              size;                // Size in sectors
+    Uint32              sector_size;         // Bytes per sector (IDE_SECTOR_SIZE, or ATAPI_SECTOR_SIZE for CD-ROMs)
+    Uint8               sector_shift;        // Log2 of sector_size
     Uint16              signature;
     Uint16              capabilities;
     Uint32              command_sets;
     char                model[41];           // Model of the drive
 
     char                lba48;               // Device supports LBA48 instead of only LBA28
+    Uint8               multiple;            // Sectors per DRQ block for READ/WRITE MULTIPLE, 0 when not used
+    char                dma;                 // Transfers are done by the bus master instead of PIO
 
-    char                databuf[IDE_SECTOR_SIZE];    // Simple data structure that holds temporary data for 1 sector at most
+    char                *databuf;            // Holds temporary data for 1 sector at most (sector_size bytes)
   } ide_drive_t;
 
   // Primary or secondary master channels
@@ -135,7 +183,19 @@
     Uint16                 base;             // Base port address
     Uint16                 dev_ctl;          // Device port address
     Uint8                  no_int;           // Wheter or not this channel has an IRQ
-    Uint16                 bm_ide;           // Bus master IDE
+    Uint16                 bm_ide;           // Bus master IDE (0 when the channel cannot do DMA)
+
+    ide_prd_t              *prdt;            // PRD table and DMA bounce buffer (physically contiguous)
+    Uint32                 prdt_phys;
+    char                   *dma_buffer;
+    Uint32                 dma_buffer_phys;
+    volatile char          irq_invoked;      // Set by the IRQ handler when the drive signals the end of a transfer
+    waitqueue_t            wait_queue;       // Tasks waiting for the IRQ of this channel, or for the channel to become free
+
+    volatile char          busy;             // A task is doing a synchronous transfer on the channel
+    bio_t                  *bio_head;        // Queued asynchronous transfers, the first one is in progress
+    bio_t                  *bio_tail;
+    Uint32                 bio_sectors;      // Sectors of the DMA command in progress for bio_head
 
     pci_device_t           *pci;             // Pci device where this controller is on
     struct ide_drive       drive[2];         // Master / slave drive on this channel
@@ -150,25 +210,43 @@
   } ide_controller_t;
 
 
-  extern char ide_irq_invoked;
-
   // We support a maximum of 10 IDE controllers. Can change as soon as we use linked lists
   #define MAX_IDE_CONTROLLERS  10
   ide_controller_t ide_controllers[MAX_IDE_CONTROLLERS];  // @TODO : Must be linked list!
 
   void ide_init (void);
 
+  int ide_interrupt (regs_t *r);
+
+  void ide_wait_irq (ide_channel_t *channel);
   int ide_polling (ide_channel_t *channel, char advanced_check);
   Uint8 ide_port_read (ide_channel_t *channel, Uint8 reg);
   void ide_port_write (ide_channel_t *channel, Uint8 reg, Uint8 data);
 
-  Uint32 ide_block_read (Uint8 major, Uint8 minor, Uint32 offset, Uint32 size, char *buffer);
-  Uint32 ide_block_write (Uint8 major, Uint8 minor, Uint32 offset, Uint32 size, char *buffer);
+  Uint32 ide_block_read_sync (ide_drive_t *drive, Uint64 offset, Uint32 size, char *buffer);
+  Uint32 ide_block_write_sync (ide_drive_t *drive, Uint64 offset, Uint32 size, char *buffer);
+  void ide_block_submit (Uint8 major, Uint8 minor, bio_t *bio);
+  Uint32 ide_block_read (Uint8 major, Uint8 minor, Uint64 offset, Uint32 size, char *buffer);
+  Uint32 ide_block_write (Uint8 major, Uint8 minor, Uint64 offset, Uint32 size, char *buffer);
+  int ide_block_flush (Uint8 major, Uint8 minor);
   void ide_block_open(Uint8 major, Uint8 minor);
   void ide_block_close(Uint8 major, Uint8 minor);
   void ide_block_seek(Uint8 major, Uint8 minor, Uint32 offset, Uint8 direction);
 
-  Uint32 ide_sector_read (ide_drive_t *drive, Uint32 lba_sector, Uint32 count, char *buffer);
+  Uint32 ide_sector_access (int direction, ide_drive_t *drive, Uint64 lba_sector, Uint32 count, char *buffer);
+  Uint32 ide_sector_read (ide_drive_t *drive, Uint64 lba_sector, Uint32 count, char *buffer);
+  Uint32 ide_write_sectors (ide_drive_t *drive, Uint64 lba_sector, Uint32 count, char *buffer);
+  int ide_partial_sector (int direction, ide_drive_t *drive, Uint64 lba_sector, Uint32 skip, Uint32 len, char *buffer);
+
+  void ide_channel_lock (ide_channel_t *channel);
+  void ide_channel_unlock (ide_channel_t *channel);
+  void ide_async_start (ide_channel_t *channel);
+  void ide_async_done (ide_channel_t *channel);
+
+  void ide_dma_prepare (ide_channel_t *channel, Uint32 size, char direction);
+  void ide_dma_start (ide_channel_t *channel);
+  int ide_dma_stop (ide_channel_t *channel);
+  int ide_dma_wait (ide_channel_t *channel);
 
 
 
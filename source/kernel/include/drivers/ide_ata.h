@@ -10,6 +10,10 @@
 
   #include "drivers/ide.h"
 
-  Uint32 ide_ata_access(char direction, ide_drive_t *drive, Uint32 lba_sector, Uint32 sector_count, char *buf);
+  Uint8 ide_ata_issue(char direction, ide_drive_t *drive, Uint64 lba_sector, Uint32 sector_count, char dma);
+  Uint32 ide_ata_access(char direction, ide_drive_t *drive, Uint64 lba_sector, Uint32 sector_count, char *buf);
+  void ide_ata_dma_start(char direction, ide_drive_t *drive, Uint64 lba_sector, Uint32 sector_count);
+  int ide_ata_flush(ide_drive_t *drive);
+  void ide_ata_set_multiple(ide_drive_t *drive, Uint8 sectors);
 
 #endif //__DRIVERS_IDE_ATA_H__
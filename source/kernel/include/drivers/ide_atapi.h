@@ -10,6 +10,24 @@
 
   #include "drivers/ide.h"
 
-  Uint32 ide_atapi_access(char direction, ide_drive_t *drive, Uint32 lba_sector, Uint32 sector_count, char *buf);
+  #define ATAPI_SECTOR_SIZE         2048      // Size of a CD-ROM sector
+  #define ATAPI_SECTOR_SHIFT          11
+  #define ATAPI_PACKET_SIZE           12      // Bytes in a command packet
+
+  #define ATAPI_MAX_BYTE_COUNT    0xF800      // Most bytes per DRQ block for PIO (a multiple of the sector size)
+  #define ATAPI_FEATURE_DMA         0x01      // Features register: data phase is done by the bus master
+
+  // SCSI packet commands
+  #define ATAPI_CMD_TEST_UNIT_READY 0x00
+  #define ATAPI_CMD_READ_CAPACITY   0x25
+  #define ATAPI_CMD_READ_10         0x28
+  #define ATAPI_CMD_READ_12         0xA8
+
+  int ide_atapi_issue(ide_drive_t *drive, Uint8 *packet, Uint32 size, char dma);
+  int ide_atapi_packet(ide_drive_t *drive, Uint8 *packet, char *buf, Uint32 size, char dma);
+  void ide_atapi_read_packet(Uint8 *packet, Uint64 lba_sector, Uint32 sector_count);
+  Uint32 ide_atapi_access(char direction, ide_drive_t *drive, Uint64 lba_sector, Uint32 sector_count, char *buf);
+  int ide_atapi_dma_start(ide_drive_t *drive, Uint64 lba_sector, Uint32 sector_count);
+  int ide_atapi_read_capacity(ide_drive_t *drive);
 
 #endif //__DRIVERS_IDE_ATAPI_H__
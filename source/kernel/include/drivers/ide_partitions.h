@@ -32,7 +32,7 @@
   };
   
   typedef struct {
-      ide_drive_t  *drive;        // IDE drive structure for this partition
+      device_t     *disk;         // Device of the whole disk this partition is on (IDE, AHCI or virtio)
       Uint32       lba_start;     // LBA start
       Uint32       lba_end;       // LBA end
       Uint32       lba_size;      // start - end
@@ -40,10 +40,13 @@
       Uint8        system_id;     // 83 = linux
   } ide_partition_t;
 
-  void ide_read_partition_table (ide_drive_t *drive, Uint32 lba_sector);
+  void ide_read_partition_table (device_t *disk, const char *disk_name, Uint8 major, Uint8 first_minor, Uint32 lba_sector);
   
-  Uint32 ide_partition_block_read (Uint8 major, Uint8 minor, Uint32 offset, Uint32 size, char *buffer);
-  Uint32 ide_partition_block_write (Uint8 major, Uint8 minor, Uint32 offset, Uint32 size, char *buffer);
+  void ide_partition_block_submit (Uint8 major, Uint8 minor, bio_t *bio);
+  Uint32 ide_partition_block_read (Uint8 major, Uint8 minor, Uint64 offset, Uint32 size, char *buffer);
+  Uint32 ide_partition_block_write (Uint8 major, Uint8 minor, Uint64 offset, Uint32 size, char *buffer);
+  int ide_partition_block_flush (Uint8 major, Uint8 minor);
+  void ide_partition_block_commit (Uint8 major, Uint8 minor);
   void ide_partition_block_open(Uint8 major, Uint8 minor);
   void ide_partition_block_close(Uint8 major, Uint8 minor);
   void ide_partition_block_seek(Uint8 major, Uint8 minor, Uint32 offset, Uint8 direction);
@@ -0,0 +1,194 @@
+/******************************************************************************
+ *
+ *  File        : virtio_blk.h
+ *  Description : Virtio block device (legacy PCI interface) defines.
+ *
+ *****************************************************************************/
+
+#ifndef __DRIVERS_VIRTIO_BLK_H__
+#define __DRIVERS_VIRTIO_BLK_H__
+
+    #include "kernel.h"
+    #include "pci.h"
+    #include "block.h"
+
+    // Used ring interrupts stay off until IRQ 9..11 delivery has been checked on a real (or
+    // emulated) device. The used ring is polled until then.
+    #define VIRTIO_BLK_USE_IRQ          0
+
+    #define VIRTIO_BLK_MAX_DISKS       16     // Partition minors are disk * 16 + partition
+    #define VIRTIO_BLK_MAX_CMDS        32     // Requests in flight per disk
+    #define VIRTIO_BLK_MAX_SEGMENTS    34     // Data descriptors per request, 128KB spans at most 33 pages
+    #define VIRTIO_BLK_MAX_SECTORS    256     // Most sectors per request, larger bios take more requests
+    #define VIRTIO_BLK_SECTOR_SIZE    512     // Virtio always counts in 512 byte sectors
+    #define VIRTIO_MAX_QUEUE_SIZE    1024     // Larger queues are not supported (the device picks the size)
+
+    #define VIRTIO_PCI_VENDOR      0x1AF4
+    #define VIRTIO_PCI_DEVICE_BLK  0x1001     // Transitional block device, the legacy interface is in BAR0
+
+    // Legacy registers (I/O space), without MSI-X the device config follows at VIRTIO_PCI_CONFIG
+    #define VIRTIO_PCI_HOST_FEATURES     0x00
+    #define VIRTIO_PCI_GUEST_FEATURES    0x04
+    #define VIRTIO_PCI_QUEUE_PFN         0x08     // Physical page of the virtqueue, 0 to disable
+    #define VIRTIO_PCI_QUEUE_SIZE        0x0C
+    #define VIRTIO_PCI_QUEUE_SELECT      0x0E
+    #define VIRTIO_PCI_QUEUE_NOTIFY      0x10
+    #define VIRTIO_PCI_STATUS            0x12
+    #define VIRTIO_PCI_ISR               0x13     // Reading clears it (and the interrupt)
+    #define VIRTIO_PCI_CONFIG            0x14
+
+    // Block device config (offsets from VIRTIO_PCI_CONFIG)
+    #define VIRTIO_BLK_CONFIG_CAPACITY   0x00     // 64 bits, in 512 byte sectors
+    #define VIRTIO_BLK_CONFIG_SIZE_MAX   0x08     // Most bytes in a single segment
+    #define VIRTIO_BLK_CONFIG_SEG_MAX    0x0C     // Most segments in a request
+
+    #define VIRTIO_STATUS_ACKNOWLEDGE    0x01
+    #define VIRTIO_STATUS_DRIVER         0x02
+    #define VIRTIO_STATUS_DRIVER_OK      0x04
+    #define VIRTIO_STATUS_FAILED         0x80
+
+    #define VIRTIO_ISR_QUEUE             0x01
+
+    // Feature bits
+    #define VIRTIO_BLK_F_SIZE_MAX    (1 << 1)
+    #define VIRTIO_BLK_F_SEG_MAX     (1 << 2)
+    #define VIRTIO_BLK_F_RO          (1 << 5)
+    #define VIRTIO_BLK_F_FLUSH       (1 << 9)     // Device has a write cache and takes flush requests
+    #define VIRTIO_F_INDIRECT_DESC   (1 << 28)    // A descriptor can point to a table of descriptors
+    #define VIRTIO_F_EVENT_IDX       (1 << 29)    // Interrupts and notifications are suppressed by index
+
+    // Descriptor flags
+    #define VRING_DESC_F_NEXT        0x0001
+    #define VRING_DESC_F_WRITE       0x0002   // The device writes into the buffer
+    #define VRING_DESC_F_INDIRECT    0x0004
+
+    #define VRING_AVAIL_F_NO_INTERRUPT   0x0001
+    #define VRING_USED_F_NO_NOTIFY       0x0001
+
+    // Request types and status
+    #define VIRTIO_BLK_T_IN             0
+    #define VIRTIO_BLK_T_OUT            1
+    #define VIRTIO_BLK_T_FLUSH          4
+
+    #define VIRTIO_BLK_S_OK             0
+    #define VIRTIO_BLK_S_IOERR          1
+    #define VIRTIO_BLK_S_UNSUPP         2
+
+
+#pragma pack(1)
+  // Buffer descriptor
+  typedef struct vring_desc {
+    Uint32              addr;                // Physical address
+    Uint32              addr_hi;
+    Uint32              len;
+    Uint16              flags;               // VRING_DESC_F_*
+    Uint16              next;                // Next descriptor of the chain when VRING_DESC_F_NEXT is set
+  } vring_desc_t;
+
+  // Chains offered to the device. The ring has queue_size entries, used_event follows it
+  typedef struct vring_avail {
+    Uint16              flags;
+    volatile Uint16     idx;                 // Where the driver puts the next entry
+    Uint16              ring[1];
+  } vring_avail_t;
+
+  typedef struct vring_used_elem {
+    Uint32              id;                  // Head of the finished chain
+    Uint32              len;                 // Bytes written into the chain
+  } vring_used_elem_t;
+
+  // Chains the device is done with. The ring has queue_size entries, avail_event follows it
+  typedef volatile struct vring_used {
+    Uint16              flags;
+    Uint16              idx;                 // Where the device puts the next entry
+    vring_used_elem_t   ring[1];
+  } vring_used_t;
+
+  // Everything the device reads or writes for a single request. The indirect table holds
+  // the header, the data segments and the status byte.
+  typedef struct virtio_blk_cmd {
+    Uint32              type;                // VIRTIO_BLK_T_*
+    Uint32              ioprio;
+    Uint64              sector;
+    volatile Uint8      status;              // VIRTIO_BLK_S_*, written by the device
+    Uint8               reserved[15];        // Keeps the table 16 byte aligned
+    vring_desc_t        table[VIRTIO_BLK_MAX_SEGMENTS + 2];
+  } virtio_blk_cmd_t;
+#pragma pack()
+
+  typedef struct {
+    Uint32 requests;                         // Requests (commands) sent to the device
+    Uint32 kicks;                            // Queue notifications (each one is a VM exit)
+    Uint32 interrupts;                       // Interrupts that had finished requests for us
+    Uint64 bytes;                            // Data transferred
+  } virtio_blk_stats_t;
+
+  // A virtio disk
+  typedef struct virtio_blk {
+    char                   enabled;
+    Uint8                  disk_nr;          // Number of the disk (the minor device number)
+    pci_device_t           *pci;
+    Uint32                 iobase;           // Legacy registers (BAR0)
+    Uint8                  irq;              // 0 when the IRQ line is not handled, all transfers are polled then
+
+    Uint64                 size;             // Size in sectors
+    Uint32                 features;         // Negotiated features
+    Uint32                 size_max;         // Most bytes in a segment, 0 when there is no limit
+    Uint32                 max_segments;     // Most data segments in a request
+
+    Uint16                 queue_size;       // Descriptors in the virtqueue (a power of 2)
+    vring_desc_t           *desc;
+    vring_avail_t          *avail;
+    vring_used_t           *used;
+    volatile Uint16        *used_event;      // Interrupt when the device passes this used index (VIRTIO_F_EVENT_IDX)
+    volatile Uint16        *avail_event;     // Notify when we pass this avail index (VIRTIO_F_EVENT_IDX)
+    Uint16                 avail_idx;        // Next entry of the avail ring
+    Uint16                 kicked_idx;       // avail_idx when the device was last notified
+    Uint16                 last_used;        // Next entry of the used ring we look at
+    int                    chain_length;     // Descriptors a request takes in the ring (1 with indirect descriptors)
+
+    virtio_blk_cmd_t       *cmds;            // One for every request in flight
+    Uint32                 cmds_phys;
+    int                    nr_cmds;
+    bio_t                  *cmd_bio[VIRTIO_BLK_MAX_CMDS];    // Bio that is transferred by a request
+    Uint32                 cmd_bytes[VIRTIO_BLK_MAX_CMDS];   // Bytes of a request
+    Uint32                 cmds_busy;        // Requests in flight
+    char                   flushing;         // A flush is in flight, nothing else may be started
+
+    char                   *scratch;         // Single sector buffer for partial sectors
+    volatile char          scratch_busy;     // A task is using the scratch buffer
+    waitqueue_t            scratch_wait;     // Tasks waiting for the scratch buffer
+
+    bio_t                  *bio_head;        // Bios waiting for a free request
+    bio_t                  *bio_tail;
+
+    virtio_blk_stats_t     stats;
+  } virtio_blk_t;
+
+  virtio_blk_t virtio_blk_disks[VIRTIO_BLK_MAX_DISKS];
+
+  void virtio_blk_init (void);
+  int virtio_blk_interrupt (regs_t *r);
+  void virtio_blk_print_stats (void);
+
+  int virtio_blk_segments (virtio_blk_t *vblk, vring_desc_t *desc, char *buffer, Uint32 *size);
+  int virtio_blk_overlaps (virtio_blk_t *vblk, bio_t *bio);
+  int virtio_blk_issue (virtio_blk_t *vblk, int cmd_nr, bio_t *bio);
+  void virtio_blk_start (virtio_blk_t *vblk);
+  void virtio_blk_kick (virtio_blk_t *vblk);
+  void virtio_blk_queue (virtio_blk_t *vblk, bio_t *bio);
+  void virtio_blk_complete (virtio_blk_t *vblk);
+  void virtio_blk_wait (virtio_blk_t *vblk, bio_t *bio);
+  Uint32 virtio_blk_transfer (virtio_blk_t *vblk, int direction, Uint64 offset, Uint32 size, char *buffer);
+
+  void virtio_blk_block_partial (virtio_blk_t *vblk, bio_t *bio);
+  void virtio_blk_block_submit (Uint8 major, Uint8 minor, bio_t *bio);
+  void virtio_blk_block_commit (Uint8 major, Uint8 minor);
+  Uint32 virtio_blk_block_read (Uint8 major, Uint8 minor, Uint64 offset, Uint32 size, char *buffer);
+  Uint32 virtio_blk_block_write (Uint8 major, Uint8 minor, Uint64 offset, Uint32 size, char *buffer);
+  int virtio_blk_block_flush (Uint8 major, Uint8 minor);
+  void virtio_blk_block_open (Uint8 major, Uint8 minor);
+  void virtio_blk_block_close (Uint8 major, Uint8 minor);
+  void virtio_blk_block_seek (Uint8 major, Uint8 minor, Uint32 offset, Uint8 direction);
+
+#endif //__DRIVERS_VIRTIO_BLK_H__
@@ -19,5 +19,6 @@
   char *console_get_ctrltab_bar ();
 
   unsigned char keyboard_poll (void);
+  void keyboard_init (void);
 
 #endif //__KEYBOARD_H__
@@ -25,6 +25,12 @@
   void *kmalloc_physical (Uint32 size, Uint32 *physical_address);
   void *kmalloc_pageboundary_physical (Uint32 size, Uint32 *physical_address);
 
+  // Physically contiguous memory below 16MB. Cannot be freed.
+  void *kmalloc_dma (Uint32 size, Uint32 *physical_address);
+
+  // Maps memory mapped device registers (uncached). Cannot be unmapped.
+  void *kmap_mmio (Uint32 physical_address, Uint32 size);
+
   void kfree (void *ptr);
 
   void _preheap_kfree (void *);
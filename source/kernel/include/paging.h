@@ -38,8 +38,11 @@
   void flush_pagedirectory (void);
   void create_pageframe (pagedirectory_t *directory, Uint32 dst_address, int pagelevels);
   Uint32 get_physical_address (pagedirectory_t *directory, Uint32 virtual_address);
+  int is_kernel_address (pagedirectory_t *directory, Uint32 address, Uint32 size);
+  int is_user_address (pagedirectory_t *directory, Uint32 address, Uint32 size);
   pagedirectory_t *clone_pagedirectory (pagedirectory_t *src);
   void allocate_virtual_memory (Uint32 physical_address, Uint32 size, Uint32 virtual_address);
+  int swap_pageframes (pagedirectory_t *directory, Uint32 va1, Uint32 va2);
 
 
   pagedirectory_t *_kernel_pagedirectory;      // Page directory for kernel
@@ -55,6 +58,9 @@
   #define PAGEFLAG_SUPERVISOR        0x00
   #define PAGEFLAG_USER              0x04
 
+  #define PAGEFLAG_WRITETHROUGH      0x08
+  #define PAGEFLAG_NOCACHE           0x10
+
   #define PAGEFLAG_NOT_ACCESSED      0x00
   #define PAGEFLAG_ACCESSED          0x20
 
@@ -68,6 +74,13 @@
   #define DONT_SET_BITMAP            0
   #define SET_BITMAP                 1
 
+  // The lowest 1MB is mapped 1:1 for the kernel and the BIOS. Tasks are loaded above it.
+  #define USER_START         0x00100000
+
+  // Device registers are mapped here. A single page table, so every page directory links to it
+  #define MMIO_START         0xF1000000
+  #define MMIO_SIZE            0x400000
+
 
   // #define USER_STACK_SIZE        0x8000      // Initial user stack size
   // #define KERNEL_STACK_SIZE      0x1000      // Initial kernel stack size
@@ -39,5 +39,9 @@
   Uint8 pci_config_get_byte (pci_device_t *dev, int offset);
   Uint16 pci_config_get_word (pci_device_t *dev, int offset);
   Uint32 pci_config_get_dword (pci_device_t *dev, int offset);
+  void pci_config_set_word (pci_device_t *dev, int offset, Uint16 value);
+
+  Uint16 pci_readword (Uint16 bus, Uint16 slot, Uint16 func, Uint16 offset);
+  void pci_writeword (Uint16 bus, Uint16 slot, Uint16 func, Uint16 offset, Uint16 value);
 
 #endif //__PCI_H__
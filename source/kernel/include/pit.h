@@ -16,6 +16,12 @@
   // PIT Frequency
   #define PIT_FREQUENCY         0x1234DC
 
+  // Timer interrupts per second, _kernel_ticks counts these
+  #define PIT_HZ                100
+
+  // Milliseconds to timer ticks, rounded up
+  #define PIT_MS_TO_TICKS(ms)   (((ms) + (1000 / PIT_HZ) - 1) / (1000 / PIT_HZ))
+
   // modes for PIT_CONTROL_WORD
   #define PIT_CTR0              0x00
   #define PIT_CTR1              0x40
@@ -0,0 +1,38 @@
+/******************************************************************************
+ *
+ *  File        : poll.h
+ *  Description : Readiness multiplexing over file descriptors
+ *
+ *****************************************************************************/
+#ifndef __POLL_H__
+#define __POLL_H__
+
+  #include "ktype.h"
+  #include "schedule.h"
+
+  // Readiness events
+  #define POLLIN                0x01      // Data can be read without blocking
+  #define POLLOUT               0x04      // Data can be written without blocking
+  #define POLLERR               0x08      // Error condition (always reported)
+  #define POLLHUP               0x10      // Other side has hung up (always reported)
+  #define POLLNVAL              0x20      // Invalid file descriptor (always reported)
+
+  #define POLL_MAX_QUEUES         32      // Maximum number of wait queues a single poll can wait on
+
+  // Poll entry as passed by user space
+  typedef struct {
+      int   fd;                           // File descriptor to check
+      short events;                       // Events we are interested in
+      short revents;                      // Events that occured (filled by the kernel)
+  } pollfd_t;
+
+  // Wait queues the current task has been added to during a poll
+  typedef struct poll_table {
+      waitqueue_t *queue[POLL_MAX_QUEUES];
+      int         count;
+  } poll_table_t;
+
+  void poll_wait (poll_table_t *table, waitqueue_t *queue);
+  int sys_poll (pollfd_t *fds, int nfds, int timeout);
+
+#endif //__POLL_H__
@@ -9,6 +9,10 @@
 
   #include "kernel.h"
   #include "paging.h"
+  #include "signal.h"
+
+  struct vfs_file;              // Forward declarations (see vfs.h and aio.h)
+  struct aio_context;
 
   // Console creation defines for thread_create_*
   #define CONSOLE_USE_KCONSOLE           0    // Use the kernel console
@@ -16,13 +20,24 @@
   #define CONSOLE_NO_CONSOLE             2    // Thread does not use console
 
 
+  #define TASK_MAX_FILES          16          // Maximum number of open file descriptors per task
+
   // Standard cybos task. This is basically a raw process structure
   typedef char   state_t;
   typedef Uint32 pid_t;
   typedef Uint8  prio_t;
 
-  #pragma pack (1)
+  #define MAX_WAITQUEUE_TASKS     10          // Maximum number of items inside a wait queue
+
+  struct task;
+
   typedef struct {
+      struct task  *task[MAX_WAITQUEUE_TASKS];
+      int          count;
+  } waitqueue_t;
+
+  #pragma pack (1)
+  typedef struct task {
       void *prev;                             // Previous task or NULL on start
       void *next;                             // Next task or NULL on end
 
@@ -42,20 +57,20 @@
       pagedirectory_t *page_directory;        // Points to the page directory of this task
 
       int  alarm;                             // Remaining alarm ticks
+      Uint64 wakeup;                          // _kernel_ticks at which the kernel wakes up the sleeping task (0 when not set)
       int  signal;                            // Current raised signals (bitfields)
+      Uint32 sigmask;                         // Blocked signals (bitfield)
+      sigaction_t sigaction[NSIG];            // Signal actions
       char exitcode;                          // Tasks exit code (available only when we are a zombie)
 
       pid_t pid;                              // PID of the task
       pid_t ppid;                             // PID of the parent task (or 0 on no parent)
-  } task_t;
-
+      waitqueue_t child_wait;                 // This task waits here for children to exit (waitpid)
 
-  #define MAX_WAITQUEUE_TASKS     10          // Maximum number of items inside a wait queue
+      struct vfs_file *files[TASK_MAX_FILES]; // File descriptor table (index is the fd)
+      struct aio_context *aio;                // Async syscall ring or NULL when not set up
+  } task_t;
 
-  typedef struct {
-      task_t  *task[MAX_WAITQUEUE_TASKS];
-      int     count;
-  } waitqueue_t;
 
 
   #define PRIO_LOW            1     // Minimum priority
@@ -92,6 +107,8 @@
   void sched_interruptable_sleep (waitqueue_t *queue);
   void sched_wakeup (waitqueue_t *queue);
   void sched_init_waitqueue (waitqueue_t *queue);
+  int sched_waitqueue_add (waitqueue_t *queue, task_t *task);
+  void sched_waitqueue_remove (waitqueue_t *queue, task_t *task);
 
   void sched_add_task (task_t *task);
   void sched_remove_task (task_t *task);
@@ -99,6 +116,16 @@
   void sched_remove_runnable_task (task_t *task);
 
   void global_task_administration (void);
+  void sys_signal (task_t *task, int signal);
+  int signal_pending (task_t *task);
+  int signal_is_ignored (task_t *task, int signal);
+  void signal_deliver (regs_t *r);
+  void signal_reset_handlers (task_t *task);
+  int sys_sigaction (int signal, sigaction_t *act, sigaction_t *oldact);
+  int sys_sigprocmask (int how, Uint32 *set, Uint32 *oldset);
+  int sys_kill (int pid, int signal);
+  int sys_sigreturn (regs_t *r);
+  task_t *sched_get_task (int pid);
   void thread_create_kernel_thread (Uint32 start_address, char *taskname, int console);
 
   int sys_fork (regs_t *r);
@@ -116,4 +143,10 @@
   int idle (void);
   int sys_idle (void);
 
+  #define WNOHANG             1     // (sys_)waitpid() option: don't block when no child has exited
+
+  int sys_waitpid (int pid, int *status, int options);
+  int waitpid (int pid, int *status, int options);
+  int wait (int *status);
+
 #endif    // __SCHEDULE_H__
@@ -28,6 +28,27 @@
   #define SYS_EXIT                       15
   #define SYS_SIGNAL                     16
   #define SYS_EXECVE                     17
+  #define SYS_GETTICKS                   18
+  #define SYS_WAITPID                    19
+
+  #define SYS_OPEN                       20
+  #define SYS_CLOSE                      21
+  #define SYS_READ                       22
+  #define SYS_WRITE                      23
+  #define SYS_PIPE                       24
+  #define SYS_POLL                       25
+  #define SYS_BDFLUSH                    26
+  #define SYS_GETDENTS                   27
+  #define SYS_FTRUNCATE                  28
+  #define SYS_FSYNC                      29
+
+  #define SYS_AIO_SETUP                  30
+  #define SYS_AIO_ENTER                  31
+
+  #define SYS_SIGACTION                  40
+  #define SYS_SIGPROCMASK                41
+  #define SYS_KILL                       42
+  #define SYS_SIGRETURN                  43
 
 
   /* Function macro's to define syscall functions. Bascially every syscall get's a special syscall function. For instance:
@@ -80,6 +101,7 @@
   int sys_conwrite (char ch, int autoflush);
   int sys_conread (void);
   int sys_conflush (void);
+  int sys_getticks (void);
   int sys_getpid (void);
   int sys_getppid (void);
   int sys_idle (void);
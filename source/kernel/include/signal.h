@@ -7,6 +7,7 @@
 #ifndef __SIGNAL_H__
 #define __SIGNAL_H__
 
+    #include "ktype.h"
 
     // Most signals handlers can be overridden or ignored. However, some can't
 
@@ -30,5 +31,39 @@
     #define SIGCONT     18
     #define SIGSTOP     19      /* Cannot be overridden or ignored */
 
+    #define NSIG        32      // Number of signals (bits inside task_t.signal)
+
+    // Special handlers
+    #define SIG_DFL      0      // Default action
+    #define SIG_IGN      1      // Ignore signal
+
+    // sigaction_t.flags
+    #define SA_NODEFER   0x40000000     // Don't block the signal while its handler runs
+    #define SA_RESETHAND 0x80000000     // Restore the default action once the handler is called
+
+    // (sys_)sigprocmask() methods
+    #define SIG_BLOCK    0      // Add set to the blocked signals
+    #define SIG_UNBLOCK  1      // Remove set from the blocked signals
+    #define SIG_SETMASK  2      // Blocked signals become set
+
+    // Signals that can never be blocked, caught or ignored
+    #define SIG_UNCATCHABLE   ((1 << SIGKILL) | (1 << SIGSTOP))
+
+    typedef struct {
+        Uint32 handler;         // Handler address in user space, SIG_DFL or SIG_IGN
+        Uint32 mask;            // Additional signals blocked while the handler runs
+        Uint32 flags;           // SA_* flags
+    } sigaction_t;
+
+    // Frame that is pushed onto the user stack when a handler is called
+    typedef struct {
+        Uint32 retaddr;         // Return address of the handler, points to trampoline
+        int    signal;          // Argument for the handler
+        Uint32 oldmask;         // Blocked signals before the handler was called
+        Uint32 edi, esi, ebp, ebx, edx, ecx, eax;   // Interrupted user context
+        Uint32 eip, eflags, esp;
+        Uint8  trampoline[8];   // mov eax, SYS_SIGRETURN ; int 0x42
+    } sigframe_t;
+
 
 #endif //__SIGNAL_H__
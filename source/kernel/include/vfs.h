@@ -16,11 +16,26 @@
     // (sys_)mount() options
     #define MOUNTOPTION_REMOUNT         1         // Overwrite an existing mount
 
+    // (sys_)open() options
+    #define O_RDONLY                    0x00      // Open for reading
+    #define O_WRONLY                    0x01      // Open for writing
+    #define O_RDWR                      0x02      // Open for reading and writing
+    #define O_APPEND                    0x08      // Writes always go to the end of the file
+    #define O_CREAT                     0x10      // Create the file when it does not exist
+    #define O_TRUNC                     0x20      // Truncate the file to length 0 when opened for writing
+
 
 
     #define VFS_MAX_FILESYSTEMS     100     // Maximum 100 different filesystem
     #define VFS_MAX_MOUNTS          255     // Maximum 255 mounts can be made
 
+    #define VFS_DCACHE_SIZE          64     // Number of cached path components
+    #define VFS_DCACHE_HASH_SIZE     32     // Number of hash buckets for the path component cache (power of 2)
+    #define VFS_DCACHE_NAME_LEN      32     // Longer names are not cached
+
+    #define VFS_READAHEAD_MIN      4096     // Readahead window when a file starts to be read sequentially
+    #define VFS_READAHEAD_MAX     16384     // Largest readahead window (must stay well below the buffer cache size)
+
     // Defines for filesystem flags
     #define FS_FILE          0x01
     #define FS_DIRECTORY     0x02
@@ -37,6 +52,7 @@
     struct vfs_node;
     struct vfs_mount;
     struct dirent;
+    struct poll_table;
 
 
     // Holds all possible file operations on files inside a FS
@@ -48,6 +64,11 @@
       int (*readdir)(struct vfs_node *, Uint32, struct dirent *);
       int (*finddir)(struct vfs_node *, const char *, struct vfs_node *);
       void (*mknod)(struct vfs_node *, const char *, char, Uint8, Uint8);
+      int (*poll)(struct vfs_node *, struct poll_table *);
+      int (*getdents)(struct vfs_node *, Uint32 *, struct dirent *, int);   // Reads entries from a directory position
+      int (*create)(struct vfs_node *, const char *, struct vfs_node *);    // Creates a regular file inside a directory
+      int (*truncate)(struct vfs_node *, Uint32);                           // Sets the length of a regular file
+      void (*readahead)(struct vfs_node *, Uint32, Uint32);                 // Starts reading a part of a file into the cache
     };
 
 
@@ -105,8 +126,36 @@
 
         struct vfs_fileops   *fileops;        // File operations
         struct vfs_mount     *mount;          // Mount point
+        void                 *data;           // Private data for nodes without a mount (pipes)
     } vfs_node_t;
 
+    // Cached lookup of a name inside a directory (path component)
+    typedef struct vfs_dentry {
+        struct vfs_mount     *mount;          // Mount of the directory, NULL when this entry is free
+        inode_t              parent_inode;    // Inode of the directory
+        char                 name[VFS_DCACHE_NAME_LEN];
+        int                  negative;        // 1 when the name does not exist inside the directory
+        vfs_node_t           node;            // Node the name resolves to (when not negative)
+        Uint32               last_used;       // Value of the dcache clock when last used (for LRU trimming)
+        struct vfs_dentry    *hash_next;
+    } vfs_dentry_t;
+
+    // Sequential read detection of an opened file
+    typedef struct {
+        Uint32               next;            // Offset of the next read when the file is read sequentially
+        Uint32               size;            // Current readahead window, 0 when the file is read randomly
+        Uint32               end;             // Everything up to this offset is read ahead already
+    } vfs_readahead_t;
+
+    // An opened file. Tasks hold pointers to these in their file descriptor table
+    typedef struct vfs_file {
+        vfs_node_t           node;            // Node that is opened
+        Uint32               offset;          // Current read/write offset
+        int                  flags;           // O_* flags used while opening
+        int                  refcount;        // Number of descriptors (over all tasks) pointing to this file
+        vfs_readahead_t      ra;              // Readahead state
+    } vfs_file_t;
+
 
 
 
@@ -117,12 +166,16 @@
     // Exported file system functions
     Uint32 vfs_read (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer);
     Uint32 vfs_write (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer);
-    void vfs_create (vfs_node_t *node, const char *name);
+    void vfs_readahead (vfs_file_t *file, Uint32 size);
+    int vfs_create (vfs_node_t *node, const char *name, vfs_node_t *target_node);
+    int vfs_truncate (vfs_node_t *node, Uint32 length);
     void vfs_open (vfs_node_t *node);
     void vfs_close (vfs_node_t *node);
     int vfs_readdir (vfs_node_t *node, Uint32 index, vfs_dirent_t *target_dirent);
+    int vfs_getdents (vfs_node_t *node, Uint32 *offset, vfs_dirent_t *dirents, int count);
     int vfs_finddir (vfs_node_t *node, const char *name, vfs_node_t *target_node);
     void vfs_mknod (struct vfs_node *node, const char *name, char device_type, Uint8 major_node, Uint8 minor_node);
+    int vfs_poll (vfs_node_t *node, struct poll_table *table);
 
     // Filesystem registration functionality
     int vfs_register_filesystem (vfs_info_t *info);
@@ -132,9 +185,31 @@
     int sys_mount (const char *device_path, const char *fs_type, const char *mount, const char *path, int mount_options);
     int sys_umount (const char *mount_point);
 
+    // File descriptor service calls
+    int sys_open (const char *path, int flags);
+    int sys_close (int fd);
+    int sys_read (int fd, char *buffer, Uint32 size);
+    int sys_write (int fd, char *buffer, Uint32 size);
+    int sys_getdents (int fd, vfs_dirent_t *dirents, int count);
+    int getdents (int fd, vfs_dirent_t *dirents, int count);
+    int sys_ftruncate (int fd, Uint32 length);
+    int ftruncate (int fd, Uint32 length);
+    int sys_fsync (int fd);
+    int fsync (int fd);
+    vfs_file_t *vfs_get_file (int fd);
+    int vfs_install_file (vfs_file_t *file);
+    void vfs_release_file (vfs_file_t *file);
+    void vfs_dup_files (struct vfs_file **files);
+    void vfs_close_files (struct vfs_file **files);
+
+    // Path component cache
+    int vfs_lookup (vfs_node_t *node, const char *name, vfs_node_t *target_node);
+    void vfs_dcache_invalidate (struct vfs_mount *mount);
+
     // @TODO: remove
     int vfs_get_node_from_path (const char *path, vfs_node_t *node);
     vfs_mount_t *vfs_get_mount_from_path (const char *path);
+    int vfs_create_from_path (const char *path, vfs_node_t *node);
 
     // VFS init function
     void vfs_init (void);
@@ -29,6 +29,9 @@ typedef struct {
   int devfs_readdir (vfs_node_t *node, Uint32 index, vfs_dirent_t *target_dirent);
   int devfs_finddir (vfs_node_t *node, const char *name, vfs_node_t *target_node);
   void devfs_mknod (vfs_node_t *node, const char *name, char device_type, Uint8 major_node, Uint8 minor_node);
+  Uint32 devfs_read (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer);
+  Uint32 devfs_write (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer);
+  int devfs_poll (vfs_node_t *node, struct poll_table *table);
 
   vfs_node_t *devfs_mount (struct vfs_mount *mount, device_t *dev, const char *path);
   void devfs_umount (struct vfs_mount *mount);
@@ -8,6 +8,7 @@
 #define __VFS_EXT2_H__
 
 #include "drivers/floppy.h"
+#include "schedule.h"
 
 //// Ext structure is array of chars
 //typedef char * ext2_ext2_t;
@@ -27,8 +28,31 @@
 #define EXT2_BOOT_LOADER_INO               5
 #define EXT2_UNDEL_DIR_INO                 6
 
+// Inode flags
+#define EXT2_INDEX_FL                     0x00001000    // Directory is indexed with a hashed b-tree (htree)
+
+// Features and superblock flags
+#define EXT2_FEATURE_COMPAT_DIR_INDEX     0x0020        // Directories can be indexed with a htree
+#define EXT2_FEATURE_INCOMPAT_FILETYPE    0x0002        // Directory entries store the file type
+#define EXT2_FEATURE_RO_COMPAT_LARGE_FILE 0x0002        // Files can be 2GB and larger
+#define EXT2_FLAGS_UNSIGNED_HASH          0x0002        // Directory hashes use unsigned chars
+
+// Directory entry file types
+#define EXT2_FT_UNKNOWN                    0
+#define EXT2_FT_REG_FILE                   1
+#define EXT2_FT_DIR                        2
+
+// Directory htree hash versions
+#define EXT2_HASH_LEGACY                   0
+#define EXT2_HASH_HALF_MD4                 1
+#define EXT2_HASH_TEA                      2
+#define EXT2_HASH_LEGACY_UNSIGNED          3
+#define EXT2_HASH_HALF_MD4_UNSIGNED        4
+#define EXT2_HASH_TEA_UNSIGNED             5
+
 
 // -- file format --
+#define EXT2_S_IFMT	0xF000	// mask for the file format
 #define EXT2_S_IFSOCK	0xC000	// socket
 #define EXT2_S_IFLNK	0xA000	// symbolic link
 #define EXT2_S_IFREG	0x8000	// regular file
@@ -101,6 +125,20 @@ typedef struct {
     Uint32      journalInode;
     Uint32      journalDevice;
     Uint32      orphanInodeListHead;
+    Uint32      hashSeed[4];
+    Uint8       defaultHashVersion;
+    Uint8       journalBackupType;
+    Uint16      groupDescriptorSize;
+    Uint32      defaultMountOptions;
+    Uint32      firstMetaBlockGroup;
+    Uint32      mkfsTime;
+    Uint32      journalBlocks[17];
+    Uint32      blockCountHigh;
+    Uint32      reservedBlockCountHigh;
+    Uint32      unallocatedBlockCountHigh;
+    Uint16      minExtraInodeSize;
+    Uint16      wantExtraInodeSize;
+    Uint32      flags;
 } ext2_superblock_extended_t;
 
 #pragma pack(1)
@@ -151,9 +189,63 @@ typedef struct {
 } ext2_dir_t;
 
 
+#define EXT2_INODE_CACHE_SIZE     64      // Number of inodes cached (over all ext2 mounts)
+#define EXT2_INODE_HASH_SIZE      32      // Number of hash buckets for the inode cache (power of 2)
+#define EXT2_BLOCKMAP_WINDOW      32      // Number of blocks the block map looks ahead for a contiguous run
+#define EXT2_PREALLOC_BLOCKS       8      // Number of contiguous blocks reserved for a file when it grows
+
+/* Cached inode. The inode must stay the first member, ext2_release_inode() converts the
+ * ext2_inode_t pointer back into the cache entry. */
+typedef struct ext2_cached_inode {
+    ext2_inode_t                inode;
+    struct vfs_mount            *mount;         // Mount of the inode or NULL when the entry is free
+    Uint32                      inode_nr;
+    int                         refcount;       // Entry is on the LRU list when this is 0
+    struct ext2_cached_inode    *hash_next;
+    struct ext2_cached_inode    *lru_prev;      // Least recently used entries are at the tail
+    struct ext2_cached_inode    *lru_next;
+
+    // Last resolved run of the block map: file blocks map_index.. are on disk blocks map_block..
+    Uint32                      map_index;
+    Uint32                      map_block;
+    Uint32                      map_count;      // 0 when nothing is cached
+
+    // Blocks reserved in the bitmap for the next writes of this file
+    Uint32                      prealloc_block;
+    Uint32                      prealloc_count;
+} ext2_cached_inode_t;
+
+
+/* Htree root information. Lives in block 0 of an indexed directory, right after the
+ * (fake) '.' and '..' entries. The index entries follow at 24 + info_length. */
+#pragma pack(1)
+typedef struct {
+    Uint32      reserved_zero;
+    Uint8       hash_version;
+    Uint8       info_length;
+    Uint8       indirect_levels;
+    Uint8       unused_flags;
+} ext2_dx_root_info_t;
+
+// Htree index entry. The first entry of a node holds the limit and count instead of a hash (which is 0)
+#pragma pack(1)
+typedef struct {
+    Uint32      hash;
+    Uint32      block;          // Logical block inside the directory
+} ext2_dx_entry_t;
+
+#pragma pack(1)
+typedef struct {
+    Uint16      limit;          // Maximum number of entries in this node
+    Uint16      count;          // Number of entries in this node (including this one)
+    Uint32      block;
+} ext2_dx_countlimit_t;
+
+
 typedef struct {
     // Pointers to pre-read items
     ext2_superblock_t       *superblock;
+    ext2_superblock_extended_t *superblock_ext;     // NULL on revision 0 filesystems
     ext2_blockdescriptor_t  *block_descriptor;
     void                    *block_bitmap;
     void                    *inode_bitmap;
@@ -164,6 +256,13 @@ typedef struct {
     Uint32                  sectors_per_block;
     Uint32                  first_group_start;
     Uint32                  group_descriptor_count;
+    Uint32                  descriptor_offset;      // Disk offset of the group descriptor table
+    Uint32                  inode_size;             // Size of an inode inside the inode table
+    Uint32                  first_inode;            // First inode that is not reserved
+
+    // Bitmaps, group descriptors and the free counts are changed by one task at a time
+    volatile char           alloc_busy;
+    waitqueue_t             alloc_wait;             // Tasks waiting to allocate or free
 } ext2_info_t;
 
 
@@ -171,13 +270,42 @@ typedef struct {
   void ext2_init (void);
   Uint32 ext2_read (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer);
   Uint32 ext2_write (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer);
+  void ext2_readahead(vfs_node_t *node, Uint32 offset, Uint32 size);
   void ext2_open (vfs_node_t *node);
   void ext2_close (vfs_node_t *node);
   int ext2_readdir (vfs_node_t *node, Uint32 index, vfs_dirent_t *target_dirent);
+  int ext2_getdents (vfs_node_t *node, Uint32 *offset, vfs_dirent_t *dirents, int count);
   int ext2_finddir (vfs_node_t *node, const char *name, vfs_node_t *target_node);
 
   vfs_node_t *ext2_mount (struct vfs_mount *mount, device_t *dev, const char *path);
   void ext2_umount (struct vfs_mount *mount);
 
+  int ext2_create (vfs_node_t *node, const char *name, vfs_node_t *target_node);
+  int ext2_truncate (vfs_node_t *node, Uint32 length);
+
+  Uint32 ext2_read_block_pointer(struct vfs_mount *mount, Uint32 block, Uint32 index);
+  Uint32 ext2_get_file_block(struct vfs_mount *mount, ext2_inode_t *inode, Uint32 index);
+  int ext2_set_file_block(struct vfs_mount *mount, ext2_inode_t *inode, Uint32 index, Uint32 block);
+  Uint64 ext2_inode_size(ext2_inode_t *inode);
+  Uint32 ext2_map_blocks(struct vfs_mount *mount, ext2_inode_t *inode, Uint32 index, Uint32 max, Uint32 *count);
+  Uint32 ext2_dirhash(struct vfs_mount *mount, int hash_version, const char *name, int len);
+  Uint32 ext2_htree_leaf(struct vfs_mount *mount, ext2_inode_t *inode, const char *name, int namelen);
+
+  void ext2_lock_alloc(struct vfs_mount *mount);
+  void ext2_unlock_alloc(struct vfs_mount *mount);
+  Uint32 ext2_alloc_blocks(struct vfs_mount *mount, Uint32 goal, Uint32 max, Uint32 *count);
+  void ext2_free_blocks(struct vfs_mount *mount, Uint32 block, Uint32 count);
+  Uint32 ext2_alloc_inode(struct vfs_mount *mount, Uint32 parent_inode_nr);
+  void ext2_free_inode(struct vfs_mount *mount, Uint32 inode_nr);
+  Uint32 ext2_alloc_file_block(struct vfs_mount *mount, ext2_inode_t *inode, Uint32 index);
+  int ext2_zero(struct vfs_mount *mount, Uint64 disk_offset, Uint32 size);
+  void ext2_write_superblock(struct vfs_mount *mount);
+  void ext2_discard_prealloc(struct vfs_mount *mount, ext2_cached_inode_t *cached);
+
+  Uint64 ext2_inode_diskoffset(struct vfs_mount *mount, Uint32 inode_nr);
+  int ext2_write_inode(ext2_inode_t *inode);
+  ext2_inode_t *ext2_read_inode(struct vfs_mount *mount, Uint32 inode_nr);
+  void ext2_release_inode(ext2_inode_t *inode);
+
 #endif // __VFS_EXT2_H__
 
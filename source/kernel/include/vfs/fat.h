@@ -0,0 +1,205 @@
+/******************************************************************************
+ *
+ *  File        : fat.h
+ *  Description : FAT16 and FAT32 filesystem with VFAT long filenames
+ *
+ *****************************************************************************/
+#ifndef __VFS_FAT_H__
+#define __VFS_FAT_H__
+
+  #include "ktype.h"
+  #include "vfs.h"
+  #include "schedule.h"
+
+  #define FAT_TYPE_FAT16                  16
+  #define FAT_TYPE_FAT32                  32
+
+  // Volumes with less clusters are FAT12 (use the fat12 driver), with more clusters FAT32
+  #define FAT16_MIN_CLUSTERS            4085
+  #define FAT32_MIN_CLUSTERS           65525
+
+  // Special FAT entries
+  #define FAT_FREE_CLUSTER                 0
+  #define FAT16_EOC_MARK              0xFFFF        // Written to end a chain (anything that is not a valid cluster ends it)
+  #define FAT32_EOC_MARK          0x0FFFFFFF
+  #define FAT32_MASK              0x0FFFFFFF        // The upper 4 bits of FAT32 entries are reserved
+
+  // Directory entry attributes
+  #define FAT_ATTR_READONLY             0x01
+  #define FAT_ATTR_HIDDEN               0x02
+  #define FAT_ATTR_SYSTEM               0x04
+  #define FAT_ATTR_VOLUME               0x08
+  #define FAT_ATTR_DIRECTORY            0x10
+  #define FAT_ATTR_ARCHIVE              0x20
+  #define FAT_ATTR_LFN                  0x0F        // Long filename entry (readonly, hidden, system and volume)
+
+  #define FAT_ENTRY_END                 0x00        // First name byte: no more entries in this directory
+  #define FAT_ENTRY_DELETED             0xE5        // First name byte: entry is free
+  #define FAT_ENTRY_KANJI               0x05        // First name byte: name really starts with 0xE5
+
+  #define FAT_NT_LOWER_BASE             0x08        // Base of the short name is shown in lowercase
+  #define FAT_NT_LOWER_EXT              0x10        // Extension of the short name is shown in lowercase
+
+  #define FAT_LFN_LAST                  0x40        // Order flag of the last part of a long name (stored first)
+  #define FAT_LFN_ORDER_MASK            0x3F
+  #define FAT_LFN_CHARS                   13        // Characters inside a long filename entry
+  #define FAT_MAX_NAME                   255
+
+  #define FAT_MAX_DIR_SIZE       (65536 * 32)       // Directories cannot hold more entries than this
+
+  // FSInfo sector (FAT32 only)
+  #define FAT_FSINFO_LEAD_SIG     0x41615252
+  #define FAT_FSINFO_STRUCT_SIG   0x61417272
+  #define FAT_FSINFO_UNKNOWN      0xFFFFFFFF        // Free count or next free cluster is not known
+
+  #define FAT_ROOT_INO                     0        // Inode number of the root directory
+  #define FAT_CHAIN_CACHE                  8        // Number of remembered positions inside cluster chains
+
+
+#pragma pack(1)
+typedef struct {
+    Uint8   jmp[3];
+    Uint8   oem_name[8];
+    Uint16  bytes_per_sector;
+    Uint8   sectors_per_cluster;
+    Uint16  reserved_sectors;
+    Uint8   fat_count;
+    Uint16  root_entries;               // 0 on FAT32
+    Uint16  total_sectors16;
+    Uint8   media;
+    Uint16  sectors_per_fat16;          // 0 on FAT32
+    Uint16  sectors_per_track;
+    Uint16  heads;
+    Uint32  hidden_sectors;
+    Uint32  total_sectors32;
+
+    // FAT32 only
+    Uint32  sectors_per_fat32;
+    Uint16  ext_flags;                  // When bit 7 is set, only FAT (bits 0-3) is used
+    Uint16  version;
+    Uint32  root_cluster;
+    Uint16  fsinfo_sector;
+    Uint16  backup_boot_sector;
+    Uint8   reserved[12];
+} fat_bpb_t;
+
+#pragma pack(1)
+typedef struct {
+    Uint8   name[11];                   // 8.3 name, space padded
+    Uint8   attr;                       // FAT_ATTR_*
+    Uint8   nt_flags;                   // FAT_NT_*
+    Uint8   create_time_tenth;
+    Uint16  create_time;
+    Uint16  create_date;
+    Uint16  access_date;
+    Uint16  cluster_high;               // High 16 bits of the first cluster (FAT32)
+    Uint16  write_time;
+    Uint16  write_date;
+    Uint16  cluster_low;
+    Uint32  size;
+} fat_dirent_t;
+
+#pragma pack(1)
+typedef struct {
+    Uint8   order;                      // Part number (starting at 1), FAT_LFN_LAST for the last part
+    Uint16  name1[5];                   // UCS-2 characters
+    Uint8   attr;                       // Always FAT_ATTR_LFN
+    Uint8   type;                       // Always 0
+    Uint8   checksum;                   // Checksum of the short name this long name belongs to
+    Uint16  name2[6];
+    Uint16  cluster;                    // Always 0
+    Uint16  name3[2];
+} fat_lfn_t;
+
+#pragma pack(1)
+typedef struct {
+    Uint32  lead_signature;             // FAT_FSINFO_LEAD_SIG
+    Uint8   reserved1[480];
+    Uint32  struct_signature;           // FAT_FSINFO_STRUCT_SIG
+    Uint32  free_count;                 // Number of free clusters, or FAT_FSINFO_UNKNOWN
+    Uint32  next_free;                  // Where to start looking for free clusters, or FAT_FSINFO_UNKNOWN
+    Uint8   reserved2[12];
+    Uint32  trail_signature;
+} fat_fsinfo_t;
+
+// Remembered position inside a cluster chain, so sequential access does not walk the chain from the start
+typedef struct {
+    Uint32  start;                      // First cluster of the chain, 0 when unused
+    Uint32  index;                      // Index of the cluster inside the chain
+    Uint32  cluster;                    // Cluster at that index
+    Uint32  last_used;                  // Value of the chain clock when last used (for LRU)
+} fat_chain_t;
+
+typedef struct {
+    int         type;                   // FAT_TYPE_FAT16 or FAT_TYPE_FAT32
+    Uint32      cluster_size;           // Bytes per cluster
+    Uint32      cluster_count;          // Number of data clusters (cluster 2 up to cluster_count + 1)
+    Uint32      fat_offset;             // Disk offset of the first FAT
+    Uint32      fat_size;               // Size of a single FAT in bytes
+    Uint32      fat_count;              // Number of FATs
+    int         active_fat;             // Only FAT that is used, or -1 when all FATs are mirrored
+    Uint32      root_offset;            // Disk offset of the fixed root directory (FAT16)
+    Uint32      root_size;              // Size of the fixed root directory (FAT16)
+    Uint32      root_cluster;           // First cluster of the root directory (FAT32)
+    Uint32      data_offset;            // Disk offset of cluster 2
+
+    Uint32      fsinfo_offset;          // Disk offset of the FSInfo sector, 0 when there is none
+    Uint32      free_count;             // Free clusters, FAT_FSINFO_UNKNOWN when not known
+    Uint32      next_free;              // Cluster where the search for a free cluster starts
+    int         fsinfo_dirty;           // Free count or next free changed since the FSInfo was written
+    volatile char alloc_busy;           // A task is allocating or freeing clusters
+    waitqueue_t alloc_wait;             // Tasks waiting to allocate or free
+
+    fat_chain_t chain[FAT_CHAIN_CACHE];
+    Uint32      chain_clock;            // Increased on every chain lookup
+} fat_info_t;
+
+
+  void fat_init (void);
+  vfs_node_t *fat_mount (struct vfs_mount *mount, device_t *dev, const char *path);
+  void fat_umount (struct vfs_mount *mount);
+
+  Uint32 fat_read (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer);
+  Uint32 fat_write (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer);
+  void fat_readahead (vfs_node_t *node, Uint32 offset, Uint32 size);
+  void fat_open (vfs_node_t *node);
+  void fat_close (vfs_node_t *node);
+  int fat_readdir (vfs_node_t *node, Uint32 index, vfs_dirent_t *target_dirent);
+  int fat_getdents (vfs_node_t *node, Uint32 *offset, vfs_dirent_t *dirents, int count);
+  int fat_finddir (vfs_node_t *node, const char *name, vfs_node_t *target_node);
+  int fat_create (vfs_node_t *node, const char *name, vfs_node_t *target_node);
+  int fat_truncate (vfs_node_t *node, Uint32 length);
+
+  Uint64 fat_cluster2diskoffset (fat_info_t *fat_info, Uint32 cluster);
+  int fat_valid_cluster (fat_info_t *fat_info, Uint32 cluster);
+  Uint32 fat_get_entry (struct vfs_mount *mount, Uint32 cluster);
+  int fat_set_entry (struct vfs_mount *mount, Uint32 cluster, Uint32 value);
+  void fat_lock_alloc (struct vfs_mount *mount);
+  void fat_unlock_alloc (struct vfs_mount *mount);
+  Uint32 fat_map_clusters (struct vfs_mount *mount, Uint32 start, Uint32 index, Uint32 max, Uint32 *count);
+  void fat_chain_forget (fat_info_t *fat_info, Uint32 start);
+  Uint32 fat_alloc_cluster (struct vfs_mount *mount, Uint32 goal);
+  void fat_free_chain (struct vfs_mount *mount, Uint32 cluster);
+  void fat_write_fsinfo (struct vfs_mount *mount);
+  int fat_zero (struct vfs_mount *mount, Uint64 disk_offset, Uint32 size);
+
+  int fat_read_dirent (struct vfs_mount *mount, inode_t inode_nr, fat_dirent_t *entry);
+  int fat_write_dirent (struct vfs_mount *mount, inode_t inode_nr, fat_dirent_t *entry);
+  Uint32 fat_dirent_cluster (fat_info_t *fat_info, fat_dirent_t *entry);
+  void fat_dirent_set_cluster (fat_info_t *fat_info, fat_dirent_t *entry, Uint32 cluster);
+  Uint32 fat_write_range (struct vfs_mount *mount, fat_dirent_t *entry, Uint32 offset, Uint32 size, char *buffer);
+  Uint32 fat_dir_cluster (vfs_node_t *node);
+  Uint64 fat_dir_diskoffset (struct vfs_mount *mount, Uint32 dir_cluster, Uint32 position);
+  int fat_dir_next (struct vfs_mount *mount, Uint32 dir_cluster, Uint32 *position, char *name, fat_dirent_t *entry, inode_t *inode_nr);
+  int fat_dir_find_free (struct vfs_mount *mount, Uint32 dir_cluster, int count, Uint32 *position);
+
+  char fat_toupper (char c);
+  char fat_tolower (char c);
+  char fat_short_char (char c, int *exact);
+  Uint8 fat_lfn_checksum (const Uint8 *short_name);
+  void fat_short_to_c_name (fat_dirent_t *entry, char *name);
+  int fat_c_to_short_name (const char *name, Uint8 *short_name);
+  int fat_short_name_exists (struct vfs_mount *mount, Uint32 dir_cluster, const Uint8 *short_name);
+  int fat_compare_names (const char *name1, const char *name2);
+
+#endif //__VFS_FAT_H__
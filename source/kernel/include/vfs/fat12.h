@@ -12,6 +12,9 @@
 // Fat structure is array of chars
 typedef char * fat12_fat_t;
 
+#define FAT12_EXTENT_MAPS        16     // Number of files with a cached cluster map
+#define FAT12_MAX_EXTENTS        32     // Extents in a cluster map, further clusters are found through the FAT
+
 #pragma pack(1)
 typedef struct {
     Uint8   jmp_command[3];
@@ -67,10 +70,25 @@ typedef struct {
   Uint16      currentClusterOffset;   // Offset in the cluster
 } fat12_file_t;
 
+// Clusters of a file that follow each other on disk
+typedef struct {
+  Uint32      index;                  // Index of the first cluster inside the file
+  Uint16      cluster;                // First cluster on disk
+  Uint16      count;                  // Number of clusters
+} fat12_extent_t;
+
+// Cluster map of a file, so seeking does not have to walk the FAT every time
+typedef struct {
+  Uint16          start_cluster;      // First cluster of the file (it's inode number), 0 when unused
+  Uint16          extent_count;       // Number of used extents
+  Uint32          last_used;          // Value of the map clock when last used (for LRU)
+  fat12_extent_t  extent[FAT12_MAX_EXTENTS];
+} fat12_extent_map_t;
+
 typedef struct {
 	Uint8  numSectors;
 	Uint32 fatOffset;
-	Uint8  fatSizeBytes;
+	Uint32 fatSizeBytes;
 	Uint8  fatSizeSectors;
 	Uint8  fatEntrySizeBits;
 	Uint32 numRootEntries;
@@ -78,21 +96,31 @@ typedef struct {
 	Uint32 rootEntrySectors;
 	Uint32 rootOffset;
 	Uint32 rootSizeSectors;
-	Uint32 dataOffset;
+	Uint32 dataOffset;           // First sector of cluster 2
 
   fat12_bpb_t *bpb;            // Pointer to Bios Parameter Block
   fat12_fat_t *fat;            // Pointer to (primary) FAT table
+
+  Uint32 clusterSize;                 // Bytes per cluster
+  fat12_extent_map_t *extent_maps;    // FAT12_EXTENT_MAPS cached cluster maps
+  Uint32 extent_clock;                // Increased on every cluster map lookup
 } fat12_fatinfo_t;
 
 
   void fat12_init (void);
   Uint32 fat12_read (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer);
   Uint32 fat12_write (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer);
+  void fat12_readahead (vfs_node_t *node, Uint32 offset, Uint32 size);
   void fat12_open (vfs_node_t *node);
   void fat12_close (vfs_node_t *node);
   vfs_dirent_t *fat12_readdir (vfs_node_t *node, Uint32 index);
+  int fat12_getdents (vfs_node_t *node, Uint32 *offset, vfs_dirent_t *dirents, int count);
   vfs_node_t *fat12_finddir (vfs_node_t *node, const char *name);
 
+  Uint32 fat12_cluster2diskoffset (fat12_fatinfo_t *fat12_info, Uint16 cluster);
+  fat12_extent_map_t *fat12_get_extent_map (fat12_fatinfo_t *fat12_info, Uint16 start_cluster);
+  Uint16 fat12_map_clusters (fat12_fatinfo_t *fat12_info, Uint16 start_cluster, Uint32 index, Uint32 max, Uint32 *count);
+
   vfs_node_t *fat12_mount (struct vfs_mount *mount, device_t *dev, const char *path);
   void fat12_umount (struct vfs_mount *mount);
 
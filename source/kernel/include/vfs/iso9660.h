@@ -0,0 +1,141 @@
+/******************************************************************************
+ *
+ *  File        : iso9660.h
+ *  Description : ISO9660 filesystem with Joliet and Rock Ridge names
+ *
+ *****************************************************************************/
+#ifndef __VFS_ISO9660_H__
+#define __VFS_ISO9660_H__
+
+  #include "ktype.h"
+  #include "vfs.h"
+
+  #define ISO_SECTOR_SIZE               2048
+  #define ISO_FIRST_DESCRIPTOR            16        // Sector of the first volume descriptor
+  #define ISO_MAX_DESCRIPTORS             32        // Stop looking for the terminator after this many
+
+  // Volume descriptor types
+  #define ISO_VD_PRIMARY                   1
+  #define ISO_VD_SUPPLEMENTARY             2        // Joliet when the escape sequence says so
+  #define ISO_VD_TERMINATOR              255
+
+  // Directory record flags
+  #define ISO_FLAG_HIDDEN               0x01
+  #define ISO_FLAG_DIRECTORY            0x02
+  #define ISO_FLAG_ASSOCIATED           0x04
+  #define ISO_FLAG_MULTI_EXTENT         0x80        // More records of the same file follow
+
+  // Names that are shown, best first
+  #define ISO_NAMES_ISO                    0        // Plain ISO9660 (uppercase, version number stripped)
+  #define ISO_NAMES_JOLIET                 1        // UCS-2 names from the Joliet supplementary descriptor
+  #define ISO_NAMES_ROCKRIDGE              2        // POSIX names from the Rock Ridge NM entries
+
+  // Rock Ridge NM flags
+  #define ISO_RR_NM_CURRENT             0x02        // "."
+  #define ISO_RR_NM_PARENT              0x04        // ".."
+
+  #define ISO_RR_MAX_CE                    8        // Continuation areas followed for a single record
+  #define ISO_MAX_PATH_TABLE     (1024 * 1024)      // Larger path tables are not cached
+  #define ISO_MAX_NAME                   255
+
+  // Directories are identified by their index in the path table (the root is 1), all other
+  // files by the disk offset of their directory record divided by 2 (records are 2 byte aligned)
+  #define ISO_DIR_INO             0x80000000
+  #define ISO_ROOT_INO            (ISO_DIR_INO | 1)
+
+
+#pragma pack(1)
+typedef struct {
+    Uint8   length;                     // Length of the record, 0 pads to the end of the sector
+    Uint8   ext_attr_length;
+    Uint32  extent;                     // First logical block (little endian)
+    Uint32  extent_be;                  // Same in big endian
+    Uint32  size;                       // Data length
+    Uint32  size_be;
+    Uint8   date[7];
+    Uint8   flags;                      // ISO_FLAG_*
+    Uint8   unit_size;                  // Interleaved files only
+    Uint8   interleave;
+    Uint32  volume_seq;
+    Uint8   name_len;
+    Uint8   name[1];                    // name_len bytes, then system use entries (Rock Ridge)
+} iso_dirent_t;
+
+#pragma pack(1)
+typedef struct {
+    Uint8   type;                       // ISO_VD_*
+    Uint8   id[5];                      // "CD001"
+    Uint8   version;
+    Uint8   flags;                      // Supplementary only
+    Uint8   system_id[32];
+    Uint8   volume_id[32];
+    Uint8   unused1[8];
+    Uint32  volume_blocks;
+    Uint32  volume_blocks_be;
+    Uint8   escape[32];                 // Joliet: "%/@", "%/C" or "%/E"
+    Uint32  volume_set_size;
+    Uint32  volume_seq;
+    Uint16  block_size;                 // Logical block size, nearly always 2048
+    Uint16  block_size_be;
+    Uint32  path_table_size;
+    Uint32  path_table_size_be;
+    Uint32  path_table_l;               // Block of the little endian path table
+    Uint32  path_table_opt_l;
+    Uint32  path_table_m;
+    Uint32  path_table_opt_m;
+    iso_dirent_t root;                  // Directory record of the root directory
+    Uint8   rest[ISO_SECTOR_SIZE - 190];
+} iso_volume_desc_t;
+
+#pragma pack(1)
+typedef struct {
+    Uint8   name_len;
+    Uint8   ext_attr_length;
+    Uint32  extent;
+    Uint16  parent;                     // Index of the parent directory (the root is its own parent)
+} iso_path_entry_t;
+
+// A directory from the path table
+typedef struct {
+    Uint32  extent;                     // First logical block of the directory
+    Uint16  parent;                     // Index of the parent directory
+    Uint8   complete;                   // The names of all subdirectories are known
+    char    *name;                      // NULL when not known yet (Rock Ridge names come from the directory)
+} iso_path_t;
+
+typedef struct {
+    Uint32      block_size;             // Logical block size
+    int         names;                  // ISO_NAMES_*
+    Uint32      susp_skip;              // Bytes to skip at the start of every system use area
+    Uint32      root_extent;
+    Uint32      root_size;
+    Uint32      path_count;             // Directories in the path table
+    iso_path_t  *path;                  // path[1] up to path[path_count], in path table order
+} iso_info_t;
+
+
+  void iso9660_init (void);
+  vfs_node_t *iso9660_mount (struct vfs_mount *mount, device_t *dev, const char *path);
+  void iso9660_umount (struct vfs_mount *mount);
+
+  Uint32 iso9660_read (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer);
+  void iso9660_readahead (vfs_node_t *node, Uint32 offset, Uint32 size);
+  void iso9660_open (vfs_node_t *node);
+  int iso9660_readdir (vfs_node_t *node, Uint32 index, vfs_dirent_t *target_dirent);
+  int iso9660_getdents (vfs_node_t *node, Uint32 *offset, vfs_dirent_t *dirents, int count);
+  int iso9660_finddir (vfs_node_t *node, const char *name, vfs_node_t *target_node);
+
+  Uint64 iso9660_block2diskoffset (iso_info_t *iso_info, Uint32 block);
+  int iso9660_read_dirent (struct vfs_mount *mount, inode_t inode_nr, iso_dirent_t *entry);
+  int iso9660_dir_extent (vfs_node_t *node, Uint32 *extent, Uint32 *size);
+  int iso9660_dir_next (struct vfs_mount *mount, Uint32 dir_index, Uint32 extent, Uint32 size, Uint32 *position, char *name, iso_dirent_t *entry, inode_t *inode_nr);
+  int iso9660_load_path_table (struct vfs_mount *mount, iso_volume_desc_t *vd);
+  Uint32 iso9660_path_children (iso_info_t *iso_info, Uint32 dir_index);
+  Uint32 iso9660_path_find (iso_info_t *iso_info, Uint32 dir_index, Uint32 extent);
+
+  char iso9660_tolower (char c);
+  void iso9660_convert_name (iso_info_t *iso_info, const Uint8 *id, int len, char *name);
+  int iso9660_rr_name (struct vfs_mount *mount, iso_dirent_t *entry, char *name, Uint32 *child_link, int *relocated);
+  int iso9660_compare_names (iso_info_t *iso_info, const char *name1, const char *name2);
+
+#endif //__VFS_ISO9660_H__
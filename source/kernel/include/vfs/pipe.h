@@ -0,0 +1,44 @@
+/******************************************************************************
+ *
+ *  File        : pipe.h
+ *  Description : Anonymous pipes
+ *
+ *****************************************************************************/
+#ifndef __VFS_PIPE_H__
+#define __VFS_PIPE_H__
+
+  #include "vfs.h"
+  #include "schedule.h"
+
+  #define PIPE_PAGES             4          // Number of pages in the pipe ring
+  #define PIPE_PAGE_SIZE    0x1000          // Size of a single page
+
+  // Inode numbers of the two ends of a pipe
+  #define PIPE_READ_END          0
+  #define PIPE_WRITE_END         1
+
+  // (sys_)pipe() flags
+  #define PIPE_GIFT           0x01          // Writer gives away whole aligned pages (contents are undefined after write)
+
+  typedef struct pipe {
+      char        *page[PIPE_PAGES];        // Page aligned buffers
+      Uint32      len[PIPE_PAGES];          // Number of bytes written into the page
+      Uint32      off[PIPE_PAGES];          // Number of bytes already read from the page
+      int         head;                     // Page the reader reads from
+      int         used;                     // Number of pages holding data (starting at head)
+      int         readers;                  // Number of open read ends
+      int         writers;                  // Number of open write ends
+      int         flags;                    // PIPE_* flags
+      waitqueue_t read_wait;                // Readers waiting for data
+      waitqueue_t write_wait;               // Writers waiting for room
+      struct pipe *next_free;               // Next pipe on the free list (when both ends are closed)
+  } pipe_t;
+
+  Uint32 pipe_read (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer);
+  Uint32 pipe_write (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer);
+  void pipe_close (vfs_node_t *node);
+  int pipe_poll (vfs_node_t *node, struct poll_table *table);
+
+  int sys_pipe (int *fds, int flags);
+
+#endif // __VFS_PIPE_H__
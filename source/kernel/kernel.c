@@ -27,10 +27,17 @@
 #include "queue.h"
 #include "pci.h"
 #include "exec.h"
+#include "keyboard.h"
 #include "drivers/floppy.h"
 #include "drivers/ide.h"
+#include "drivers/ahci.h"
+#include "drivers/virtio_blk.h"
 #include "vfs.h"
+#include "block.h"
+#include "bcache.h"
 #include "vfs/fat12.h"
+#include "vfs/fat.h"
+#include "vfs/iso9660.h"
 #include "vfs/ext2.h"
 #include "vfs/cybfs.h"
 #include "vfs/devfs.h"
@@ -57,38 +64,40 @@
  */
 void readdir (vfs_node_t *root, int depth) {
 //  kprintf ("readdir(): Reading index (%s) %d at depth %d\n", root->name, root->inode_nr, depth);
-  vfs_dirent_t dirent;
+  vfs_dirent_t dirents[4];
   vfs_node_t node;
-  int index = 0;
-  int j;
-
-  while (vfs_readdir (root, index, &dirent)) {
-//    kprintf ("readdir(%d): Reading index %d\n", depth, index);
-    index++;
-
-    // File cannot be found (huh?)
-    if (! vfs_finddir (root, dirent.name, &node)) continue;
-
-    for (j=0; j!=depth; j++) kprintf ("  ");
-    if ((node.flags & FS_DIRECTORY) == FS_DIRECTORY)  {
-      // This is a directory
-      kprintf ("<%s> (%d bytes)\n", node.name, node.length);
-
-      // Read directory when it's not '.' or '..'
-      if (strcmp (node.name, ".") != 0 && strcmp (node.name, "..") != 0) {
-        readdir (&node, depth+1);
-      }
-    } else {
-      if ( (node.flags & FS_BLOCKDEVICE) == FS_BLOCKDEVICE ||
-           (node.flags & FS_CHARDEVICE) == FS_CHARDEVICE) {
-        // This is a device
-        kprintf ("%s  (Device %d:%d)\n", node.name, node.major_num, node.minor_num);
+  Uint32 offset = 0;
+  int i, j, count;
+
+  // Fetch a couple of entries at a time. The offset continues where the previous batch stopped
+  while ((count = vfs_getdents (root, &offset, dirents, 4)) > 0) {
+    for (i=0; i!=count; i++) {
+//      kprintf ("readdir(%d): Reading entry %s\n", depth, dirents[i].name);
+
+      // File cannot be found (huh?)
+      if (! vfs_lookup (root, dirents[i].name, &node)) continue;
+
+      for (j=0; j!=depth; j++) kprintf ("  ");
+      if ((node.flags & FS_DIRECTORY) == FS_DIRECTORY)  {
+        // This is a directory
+        kprintf ("<%s> (%d bytes)\n", node.name, node.length);
+
+        // Read directory when it's not '.' or '..'
+        if (strcmp (node.name, ".") != 0 && strcmp (node.name, "..") != 0) {
+          readdir (&node, depth+1);
+        }
       } else {
-        // This is a file
-        kprintf ("%s  (%d bytes)\n", node.name, node.length);
+        if ( (node.flags & FS_BLOCKDEVICE) == FS_BLOCKDEVICE ||
+             (node.flags & FS_CHARDEVICE) == FS_CHARDEVICE) {
+          // This is a device
+          kprintf ("%s  (Device %d:%d)\n", node.name, node.major_num, node.minor_num);
+        } else {
+          // This is a file
+          kprintf ("%s  (%d bytes)\n", node.name, node.length);
+        }
       }
     }
-  } // while readdir (root, length)
+  } // while getdents (root, offset)
 
 //  kprintf ("readdir(%d) done\n", depth);
 }
@@ -130,7 +139,7 @@ void kernel_setup (int stack_start, int total_sys_memory, const char *boot_param
 
   // Initialize interrupt timer
   kprintf ("PIT ");
-  pit_set_frequency (100);      // Set PIT frequency to 1000 ints per second (1ms apart)
+  pit_set_frequency (PIT_HZ);      // Set PIT frequency to 100 ints per second (10ms apart)
 
   // Initialise timer
   kprintf ("TMR ");
@@ -169,12 +178,21 @@ void kernel_setup (int stack_start, int total_sys_memory, const char *boot_param
   kprintf ("DEV ");
   device_init ();
 
+  // Init block buffer cache
+  kprintf ("BLK ");
+  block_init ();
+
+  kprintf ("BUF ");
+  bcache_init ();
+
   // Init virtual file system and global file systems present in the kernel
   kprintf ("VFS ");
   vfs_init ();
   cybfs_init ();
   devfs_init ();
   fat12_init ();
+  fat_init ();
+  iso9660_init ();
   ext2_init ();
 
   int ret = sys_mount (NULL, "devfs", "DEVICE", "/", 0);
@@ -184,6 +202,10 @@ void kernel_setup (int stack_start, int total_sys_memory, const char *boot_param
   // Start interrupts, needed because we now do IRQ's for floppy access
   sti ();
 
+  // Init keyboard device and wait queue
+  kprintf ("KBD ");
+  keyboard_init ();     // Creates DEVICES:/KEYBOARD
+
   // Init floppy disk controllers and drives
   kprintf ("FDC ");
   fdc_init ();      // Creates DEVICES:/FLOPPY* devices
@@ -192,6 +214,14 @@ void kernel_setup (int stack_start, int total_sys_memory, const char *boot_param
   kprintf ("IDE ");
   ide_init ();      // Creates DEVICES:/IDEC?D? devices and /IDEC?D?P? for partitions
 
+  // Init SATA controllers and disks (and partitions)
+  kprintf ("SAT ");
+  ahci_init ();     // Creates DEVICES:/SATA? devices and /SATA?P? for partitions
+
+  // Init virtio disks (and partitions)
+  kprintf ("VIO ");
+  virtio_blk_init ();     // Creates DEVICES:/VIRTIO? devices and /VIRTIO?P? for partitions
+
   // Initialize multitasking environment
   kprintf ("TSK ");
   sched_init ();
@@ -237,6 +267,9 @@ void mount_root_system (const char *boot_params) {
   sys_mount ("DEVICE:/IDE0C0D0P0", "ext2", "HARDDISK1", "/", MOUNTOPTION_REMOUNT);
   vfs_get_node_from_path ("HARDDISK1:/", &node);
   readdir (&node, 0);
+  bcache_print_stats ();
+  block_print_stats ();
+  virtio_blk_print_stats ();
   kprintf ("-F3----------------------------------------\n");
 }
 
@@ -432,6 +465,14 @@ void kernel_entry (int stack_start, int total_sys_memory, const char *boot_param
     start_init(boot_params);
   }
 
+  if (!fork()) {
+    // Child fork writes back dirty buffers every few seconds (and does not return)
+    for (;;) {
+      bdflush ();
+      sleep (BCACHE_FLUSH_INTERVAL);
+    }
+  }
+
   // PID 0 idles when no running process could be found
   for (;;) idle ();
 }
@@ -11,6 +11,10 @@
 #include "conio.h"
 #include "keys.h"
 #include "io.h"
+#include "kmem.h"
+#include "schedule.h"
+#include "vfs.h"
+#include "poll.h"
 
 // Key status flags
 static int KEY_ALT      = 0;
@@ -25,6 +29,8 @@ static int KEY_SCRLOCK  = 0;
 unsigned char keybuf[MAX_KEYBUF];
 int keyptr = 0;
 
+waitqueue_t keyboard_wait;               // Tasks waiting for a key (readers and pollers)
+
 // Special <ctrl><tab> switches
 static int  in_console_switch  = 0;      // 1 if we are currently ctrl-tabbing
 static console_t *ctrltab_console;       // Points to the console we currently select in the ctrltab-bar
@@ -79,6 +85,9 @@ int keyboard_stuffkey (unsigned char key[]) {
   // Add all valid key-entries
   for (i=0; i!=key[0]; i++) keybuf[keyptr++] = key[i+1];
 
+  // Wake up everybody waiting for a key
+  sched_wakeup (&keyboard_wait);
+
   // Return
   return ERR_OK;
 }
@@ -306,7 +315,15 @@ unsigned char keyboard_poll (void) {
   // wait until a key is placed in the keybuffer
   // by an "externel" source. This is most likely the keyboard
   // handler on IRQ 1 but could also be done by another process.
-  while (keyptr == 0) ;
+  while (keyptr == 0) {
+    // Without multitasking (or as the idle task) we cannot sleep, so keep spinning
+    if (_current_task == NULL || _current_task->pid == PID_IDLE) continue;
+
+    // Check again with ints disabled so we cannot miss the wakeup
+    int state = disable_ints ();
+    if (keyptr == 0) sched_interruptable_sleep (&keyboard_wait);
+    restore_ints (state);
+  }
 
   // Remember the key we return
   ch = keybuf[0];
@@ -331,3 +348,44 @@ unsigned char keyboard_poll (void) {
 }
 
 
+/********************************************************************
+ * Device read for DEVICE:/KEYBOARD. Blocks until at least one key is
+ * available and returns as many keys as are buffered (max size).
+ */
+Uint32 keyboard_dev_read (Uint8 major, Uint8 minor, Uint64 offset, Uint32 size, char *buffer) {
+  Uint32 count = 0;
+
+  if (size == 0) return 0;
+
+  buffer[count++] = keyboard_poll ();
+  while (count != size && keyptr != 0) buffer[count++] = keyboard_poll ();
+
+  return count;
+}
+
+
+/********************************************************************
+ * Device poll for DEVICE:/KEYBOARD. Readable as soon as a key is buffered.
+ */
+int keyboard_dev_poll (Uint8 major, Uint8 minor, struct poll_table *table) {
+  poll_wait (table, &keyboard_wait);
+  return (keyptr != 0) ? POLLIN : 0;
+}
+
+
+/********************************************************************
+ * Initializes the keyboard wait queue and creates DEVICE:/KEYBOARD
+ */
+void keyboard_init (void) {
+  sched_init_waitqueue (&keyboard_wait);
+
+  device_t *device = (device_t *)kmalloc (sizeof (device_t));
+  memset (device, 0, sizeof (device_t));
+  device->major_num = DEV_MAJOR_MISC;
+  device->minor_num = DEV_MINOR_KEYBOARD;
+  device->type = FS_CHARDEVICE;
+  device->read = keyboard_dev_read;
+  device->poll = keyboard_dev_poll;
+
+  device_register (device, "KEYBOARD");
+}
@@ -25,6 +25,7 @@ unsigned int clone_debug = 0;   // When set, extra info is shown in clone_pagedi
 // Forward and external declarations
 pagedirectory_t *clone_pagedirectory (pagedirectory_t *src);
 void copy_physical_pageframe_data (Uint32 src, Uint32 dst);
+void map_virtual_memory (pagedirectory_t *directory, Uint32 src_address, Uint32 dst_address, int pagelevels, int set_bitmap);
 
 
 /************************************************************
@@ -138,6 +139,73 @@ void allocate_pageframe (page_t *page, int rw, int level) {
   if (level) *page |= PAGEFLAG_USER;
 }
 
+
+/************************************************************
+ * Allocates physically contiguous memory from the lower 16MB, which is mapped 1:1 on
+ * 0xF0000000. Blocks of 64KB or less never cross a 64KB boundary, so they can be used
+ * by both ISA and bus master DMA. The memory can never be freed.
+ * Returns NULL when there is no room left.
+ */
+void *kmalloc_dma (Uint32 size, Uint32 *physical_address) {
+  int frames = (size + 0xFFF) >> 12;
+  int max_frame = (16 * 1024 * 1024) >> 12;
+  int frame, i;
+
+  if (max_frame > framebitmap->size * framebitmap->bitsize) max_frame = framebitmap->size * framebitmap->bitsize;
+
+  // Everything below 1MB is BIOS and kernel
+  frame = 0x100;
+  while (frame + frames <= max_frame) {
+    // Skip to the next 64KB boundary when the block would cross it
+    if (frames <= 16 && (frame & 0xF) + frames > 16) {
+      frame = (frame | 0xF) + 1;
+      continue;
+    }
+
+    for (i=0; i!=frames; i++) {
+      if (bm_test (framebitmap, frame + i)) break;
+    }
+
+    // Not enough free frames here, continue after the frame that is in use
+    if (i != frames) {
+      frame += i + 1;
+      continue;
+    }
+
+    for (i=0; i!=frames; i++) bm_set (framebitmap, frame + i);
+    _unfreeable_kmem += frames << 12;
+
+    if (physical_address != NULL) *physical_address = frame << 12;
+    return (void *)((frame << 12) + 0xF0000000);
+  }
+
+  return NULL;
+}
+
+/************************************************************
+ * Maps size bytes of device registers at physical_address into the MMIO window. The
+ * pages are not cached, so every access reaches the device. The mapping cannot be
+ * undone. Returns the virtual address of physical_address, or NULL when the window is full.
+ */
+void *kmap_mmio (Uint32 physical_address, Uint32 size) {
+  static Uint32 mmio_top = MMIO_START;
+  Uint32 offset = physical_address & 0xFFF;
+  Uint32 frames = (offset + size + 0xFFF) >> 12;
+  Uint32 virtual_address = mmio_top;
+  Uint32 i;
+
+  if (mmio_top + (frames << 12) > MMIO_START + MMIO_SIZE) return NULL;
+
+  // The page table was created by paging_init(), so all page directories see the pages
+  for (i=0; i!=frames; i++) {
+    map_virtual_memory (_kernel_pagedirectory, (physical_address & 0xFFFFF000) + (i << 12), virtual_address + (i << 12),
+                        PAGEFLAG_PRESENT | PAGEFLAG_READWRITE | PAGEFLAG_WRITETHROUGH | PAGEFLAG_NOCACHE, DONT_SET_BITMAP);
+  }
+  mmio_top += frames << 12;
+
+  return (void *)(virtual_address + offset);
+}
+
 // ====================================================================================
 void obsolete_free_frame (page_t *page) {
   // Frame was not allocated in the first place
@@ -429,6 +497,78 @@ Uint32 get_physical_address (pagedirectory_t *directory, Uint32 virtual_address)
 }
 
 
+/**
+ * Returns 1 when the range only uses page tables of the kernel directory. Those tables
+ * are linked into every directory, so the range is the same memory in every task and
+ * in interrupt handlers. Returns 0 for task memory (like user buffers and stacks).
+ */
+int is_kernel_address (pagedirectory_t *directory, Uint32 address, Uint32 size) {
+  Uint32 table;
+
+  if (size == 0) return 1;
+  if (address + size - 1 < address) return 0;
+
+  for (table = address / 0x400000; table <= (address + size - 1) / 0x400000; table++) {
+    if (_kernel_pagedirectory->phystables[table] == 0) return 0;
+    if ((directory->phystables[table] & 0xFFFFF000) != (_kernel_pagedirectory->phystables[table] & 0xFFFFF000)) return 0;
+  }
+
+  return 1;
+}
+
+
+/**
+ * Returns 1 when the whole range is writable task memory: it stays between USER_START
+ * and the kernel at 0xC0000000, and every page is present, writable and user accessible.
+ * Use this before the kernel writes into memory a task handed to it.
+ */
+int is_user_address (pagedirectory_t *directory, Uint32 address, Uint32 size) {
+  Uint32 frame;
+  page_t page;
+
+  if (size == 0) return 1;
+  if (address < USER_START || address + size - 1 < address || address + size - 1 >= 0xC0000000) return 0;
+
+  for (frame = address / 0x1000; frame <= (address + size - 1) / 0x1000; frame++) {
+    if (directory->tables[frame / 1024] == NULL) return 0;
+
+    page = directory->tables[frame / 1024]->pages[frame % 1024];
+    if ((page & (PAGEFLAG_PRESENT | PAGEFLAG_READWRITE | PAGEFLAG_USER)) != (PAGEFLAG_PRESENT | PAGEFLAG_READWRITE | PAGEFLAG_USER)) return 0;
+  }
+
+  return 1;
+}
+
+
+/**
+ * Exchanges the frames behind two page aligned virtual addresses inside a directory. The
+ * page flags of both addresses stay untouched, only the data moves. Returns 1 on success,
+ * 0 when one of the pages is not present or not writable.
+ */
+int swap_pageframes (pagedirectory_t *directory, Uint32 va1, Uint32 va2) {
+  Uint32 frame1 = va1 / 0x1000;
+  Uint32 frame2 = va2 / 0x1000;
+
+  if (directory->tables[frame1 / 1024] == NULL || directory->tables[frame2 / 1024] == NULL) return 0;
+
+  page_t *page1 = &directory->tables[frame1 / 1024]->pages[frame1 % 1024];
+  page_t *page2 = &directory->tables[frame2 / 1024]->pages[frame2 % 1024];
+
+  if (! (*page1 & PAGEFLAG_PRESENT) || ! (*page1 & PAGEFLAG_READWRITE)) return 0;
+  if (! (*page2 & PAGEFLAG_PRESENT) || ! (*page2 & PAGEFLAG_READWRITE)) return 0;
+
+  Uint32 tmp = *page1 & 0xFFFFF000;
+  *page1 = (*page2 & 0xFFFFF000) | (*page1 & 0xFFF);
+  *page2 = tmp | (*page2 & 0xFFF);
+
+  // Only these 2 pages changed, no need to flush the whole TLB
+  __asm__ __volatile__ ("invlpg (%0)" : : "r" (va1) : "memory");
+  __asm__ __volatile__ ("invlpg (%0)" : : "r" (va2) : "memory");
+
+  return 1;
+}
+
+
 // ====================================================================================
 int stack_init (Uint32 src_stack_top) {
   Uint32 old_esp, old_ebp;
@@ -501,6 +641,7 @@ int stack_init (Uint32 src_stack_top) {
 // ====================================================================================
 int paging_init () {
   int i, framecount;
+  Uint32 tmp;
 
   // Allocate a bitmap big enough to hold 1 bit for each page of memory
   framecount = _memory_total / 0x1000;                        // We use 4KB pages. Framecount is the number of frames of PHYSICAL memory
@@ -541,6 +682,13 @@ int paging_init () {
     map_virtual_memory (_kernel_pagedirectory, i, (i + 0xF0000000), PAGEFLAG_USER | PAGEFLAG_PRESENT | PAGEFLAG_READWRITE, DONT_SET_BITMAP);
   }
 
+  /* Create the (empty) page table for the MMIO window now. Tables that exist in the kernel
+   * directory are linked by every cloned directory, so device registers that are mapped
+   * later on are visible for all tasks. */
+  _kernel_pagedirectory->tables[MMIO_START >> 22] = (pagetable_t *)kmalloc_pageboundary_physical (sizeof (pagetable_t), &tmp);
+  memset (_kernel_pagedirectory->tables[MMIO_START >> 22], 0, sizeof (pagetable_t));
+  _kernel_pagedirectory->phystables[MMIO_START >> 22] = tmp | 0x7;
+
   // We mapped all important kernel area's. Later on, we add a heap, stack and more stuff.
   set_pagedirectory (_kernel_pagedirectory);
 
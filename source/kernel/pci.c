@@ -23,6 +23,11 @@ Uint32 pci_config_get_dword (pci_device_t *dev, int offset) {
   Uint32 *cs = (Uint32 *)&dev->config_space[offset];
   return *cs;
 }
+void pci_config_set_word (pci_device_t *dev, int offset, Uint16 value) {
+  Uint16 *cs = (Uint16 *)&dev->config_space[offset];
+  *cs = value;
+  pci_writeword (dev->bus, dev->slot, dev->func, offset, value);
+}
 
 
 /**
@@ -42,6 +47,20 @@ Uint16 pci_readword (Uint16 bus, Uint16 slot, Uint16 func, Uint16 offset) {
   return ret;
 }
 
+/**
+ *
+ */
+void pci_writeword (Uint16 bus, Uint16 slot, Uint16 func, Uint16 offset, Uint16 value) {
+  Uint32 address = 0x80000000; // Bit 31 set
+  address |= (Uint32)bus << 16;
+  address |= (Uint32)slot << 11;
+  address |= (Uint32)func << 8;
+  address |= (Uint32)offset & 0xfc;
+
+  outl (PCI_CONFIG_ADDRESS, address);
+  outw (PCI_CONFIG_DATA + (offset & 2), value);
+}
+
 /**
  *
  */
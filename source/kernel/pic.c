@@ -20,7 +20,7 @@
  */
 int pic_mask_irq (Uint16 irq_mask) {
   outb (0x21, LO8 (irq_mask));
-  outb (0x21, HI8 (irq_mask));
+  outb (0xA1, HI8 (irq_mask));
 
   return ERR_OK;
 }
@@ -34,7 +34,7 @@ int pic_init (void) {
   outb (0xA0, 0x11);    // Output ICW1 to slave 8259
 
   outb (0x21, IRQINT_START);     // ICW2: Master IRQ0..7 on 50..57
-  outb (0xA1, IRQINT_START+7);   // ICW2: Slave IRQ8..F on 58..5F
+  outb (0xA1, IRQINT_START+8);   // ICW2: Slave IRQ8..F on 58..5F (the low 3 bits are ignored)
 
   outb (0x21, 0x04);    // Slave PIC connected to Master IRQ 2
   outb (0xA1, 0x02);    // Slave PIC connected to Master IRQ 2
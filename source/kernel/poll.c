@@ -0,0 +1,93 @@
+/******************************************************************************
+ *
+ *  File        : poll.c
+ *  Description : Readiness multiplexing over file descriptors. Every file type
+ *                reports its readiness through the poll() file operation, and
+ *                adds the polling task to the wait queues that will be woken up
+ *                when the readiness changes.
+ *
+ *****************************************************************************/
+#include "kernel.h"
+#include "schedule.h"
+#include "vfs.h"
+#include "poll.h"
+#include "pit.h"
+
+
+/**
+ * Called by the poll() file operations. Adds the current task to the wait queue so
+ * it gets woken up when this queue is woken. When table is NULL, the caller is only
+ * interested in the readiness and we do not wait.
+ */
+void poll_wait (poll_table_t *table, waitqueue_t *queue) {
+  if (table == NULL || table->count == POLL_MAX_QUEUES) return;
+
+  if (sched_waitqueue_add (queue, _current_task)) {
+    table->queue[table->count++] = queue;
+  }
+}
+
+
+/**
+ * Removes the current task from all wait queues inside the table
+ */
+void poll_free (poll_table_t *table) {
+  int i;
+
+  for (i=0; i!=table->count; i++) {
+    sched_waitqueue_remove (table->queue[i], _current_task);
+  }
+  table->count = 0;
+}
+
+
+/**
+ * Waits until at least one of the descriptors is ready. Timeout is in milliseconds,
+ * a timeout of 0 only checks, a negative timeout waits forever.
+ * Returns the number of descriptors with revents set.
+ */
+int sys_poll (pollfd_t *fds, int nfds, int timeout) {
+  poll_table_t table;
+  vfs_file_t *file;
+  int i, ready;
+
+  table.count = 0;
+
+  // Disable ints so no wakeup gets lost between checking and going to sleep
+  int state = disable_ints ();
+
+  // The timer clears the deadline when it wakes us up. The alarm belongs to user space.
+  if (timeout > 0) _current_task->wakeup = _kernel_ticks + PIT_MS_TO_TICKS (timeout);
+
+  for (;;) {
+    ready = 0;
+    for (i=0; i!=nfds; i++) {
+      file = vfs_get_file (fds[i].fd);
+      if (! file) {
+        fds[i].revents = POLLNVAL;
+        ready++;
+        continue;
+      }
+
+      // Once something is ready we won't sleep, so there is no need to add more queues
+      fds[i].revents = vfs_poll (&file->node, ready ? NULL : &table) & (fds[i].events | POLLERR | POLLHUP | POLLNVAL);
+      if (fds[i].revents) ready++;
+    }
+
+    // Something is ready, or we don't want to wait (anymore)
+    if (ready || timeout == 0) break;
+    if (timeout > 0 && _current_task->wakeup == 0) break;
+
+    _current_task->state = TASK_STATE_INTERRUPTABLE;
+    reschedule ();
+
+    // Woken up by one of the queues (or the timeout). Check everything again
+    poll_free (&table);
+  }
+
+  poll_free (&table);
+  if (timeout > 0) _current_task->wakeup = 0;
+
+  restore_ints (state);
+  return ready;
+}
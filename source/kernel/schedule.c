@@ -15,6 +15,9 @@
 #include "gdt.h"
 #include "idt.h"
 #include "io.h"
+#include "vfs.h"
+#include "aio.h"
+#include "pit.h"
 
 
 task_t *_current_task = NULL;    // Current active task on the CPU.
@@ -58,7 +61,8 @@ void sched_wakeup (waitqueue_t *queue) {
 }
 
 /**
- *
+ * Puts the current task to sleep on the wait queue until it's woken up by sched_wakeup()
+ * or by a signal.
  */
 void sched_interruptable_sleep (waitqueue_t *queue) {
   int i;
@@ -72,6 +76,9 @@ void sched_interruptable_sleep (waitqueue_t *queue) {
 //      kprintf ("sis: Going to sleep..\n");
       reschedule ();
 
+      // Woken up by a signal, our slot is still taken
+      if (queue->task[i] == _current_task) queue->task[i] = NULL;
+
 //      kprintf ("sis: Done sleeping..\n");
       return;
     }
@@ -79,6 +86,38 @@ void sched_interruptable_sleep (waitqueue_t *queue) {
   kpanic ("Not enough room on the waitqueue\n");
 }
 
+/**
+ * Adds a task to a wait queue without going to sleep. Used when waiting on multiple
+ * queues at once. Returns 1 when added, 0 when the task was already on the queue.
+ */
+int sched_waitqueue_add (waitqueue_t *queue, task_t *task) {
+  int i;
+
+  for (i=0; i!=queue->count; i++) {
+    if (queue->task[i] == task) return 0;
+  }
+
+  for (i=0; i!=queue->count; i++) {
+    if (queue->task[i] == NULL) {
+      queue->task[i] = task;
+      return 1;
+    }
+  }
+  kpanic ("Not enough room on the waitqueue\n");
+  return 0;
+}
+
+/**
+ * Removes a task from a wait queue (when it was not woken up through this queue)
+ */
+void sched_waitqueue_remove (waitqueue_t *queue, task_t *task) {
+  int i;
+
+  for (i=0; i!=queue->count; i++) {
+    if (queue->task[i] == task) queue->task[i] = NULL;
+  }
+}
+
 
 /**
  * Creates a new thread (process)
@@ -117,6 +156,9 @@ void sched_init_pid_0 () {
   // Use the kernel console
   task->console = _kconsole;
 
+  // Nobody is waiting for our children yet
+  sched_init_waitqueue (&task->child_wait);
+
   // Add task to schedule-switcher. We are still initialising so it does not run yet.
   sched_add_task (task);
 
@@ -239,9 +281,13 @@ void sys_signal (task_t *task, int signal) {
 
 
 /****
- * Checks for signals in the current task, and act accordingly
+ * Checks for signals in the current task, and drops the ones that would be ignored
+ * anyway. Signals with a user handler (or that terminate the task) are left pending
+ * and are delivered by signal_deliver() when the task returns to user space.
  */
 void handle_pending_signals (void) {
+  int signal;
+
   int state = disable_ints ();
 
 //  kprintf ("sign handling (%d, %08X)\n", _current_task->pid, _current_task->signal);
@@ -250,38 +296,9 @@ void handle_pending_signals (void) {
     return;
   }
 
-  // No pending signals for this task. Do nothing
-  if (_current_task->signal == 0) {
-    restore_ints (state);
-    return;
-  }
-
-  /*
-    Since we scan signals forward, it means the least significant bit has the highest
-    priority. So the lower the signal number (ie: the bit in the field), the higher
-    it's priority will be.
-  */
-
-  int signal = bsf (_current_task->signal);                       // Fetch signal
-  _current_task->signal = btr (_current_task->signal, signal);    // Clear this signal from the list. Next time we can do another signal.
-
-// TODO: handle like this:  _current_task->sighandler[signal]
-  switch (signal) {
-    case SIGCHLD :
-                   kprintf ("SIGCHLD");
-                   break;
-
-    case SIGHUP :
-                   kprintf ("SIGHUP");
-                   break;
-
-    case SIGALRM :
-//                   kprintf ("SIGALRM");
-                   break;
-    default :
-                   kprintf ("Default handler");
-                   break;
-
+  for (signal = 0; signal != NSIG; signal++) {
+    if (! (_current_task->signal & (1 << signal))) continue;
+    if (signal_is_ignored (_current_task, signal)) _current_task->signal = btr (_current_task->signal, signal);
   }
 
   restore_ints (state);
@@ -311,11 +328,20 @@ void global_task_administration (void) {
       if (task->alarm == 0) sys_signal (task, SIGALRM);
     }
 
-    // A signal is found and the task can be interrupted. Set the task to be ready again
-    if (task->signal && task->state == TASK_STATE_INTERRUPTABLE) {
+    // Kernel timeouts (like the one from poll) wake up the task without a signal
+    if (task->wakeup && task->wakeup <= _kernel_ticks) {
+      task->wakeup = 0;
+      if (task->state == TASK_STATE_INTERRUPTABLE) task->state = TASK_STATE_RUNNABLE;
+    }
+
+    // An unblocked signal is found and the task can be interrupted. Set the task to be ready again
+    if (signal_pending (task) && task->state == TASK_STATE_INTERRUPTABLE) {
 //      kprintf ("A signal is found on pid %d\n", task->pid);
       task->state = TASK_STATE_RUNNABLE;
     }
+
+    // Wake up tasks waiting on expired async sleep operations
+    aio_timer_tick (task);
   }
 
   restore_ints (state);
@@ -331,12 +357,6 @@ void switch_task () {
 
   if (_current_task == NULL) return;
 
-  // There is a signal pending. Do that first before we actually run code again (TODO: is this really a good idea?)
-  if (_current_task->signal != 0) {
-    kprintf ("signal not zero");
-    return;
-  }
-
   int state = disable_ints ();
 
   // This is the task we're running. It will be the old task after this
@@ -488,15 +508,17 @@ int sys_idle () {
 
 
 /**
- *
+ * Sleeps for ms milliseconds (rounded up to whole timer ticks), or until a signal
+ * arrives. Uses the wakeup deadline, so a pending alarm of the task stays untouched.
  */
 int sys_sleep (int ms) {
   if (_current_task->pid == PID_IDLE) kpanic ("Cannot sleep idle task!");
-  
+  if (ms <= 0) return 0;
+
   int state = disable_ints ();
 //  kprintf ("Sleeping process %d for %d ms\n", _current_task->pid, ms);
 
-  _current_task->alarm = ms;
+  _current_task->wakeup = _kernel_ticks + PIT_MS_TO_TICKS (ms);
   _current_task->state = TASK_STATE_INTERRUPTABLE;
 
   restore_ints (state);
@@ -506,6 +528,9 @@ int sys_sleep (int ms) {
   // We're sleeping. So go to a next task.
   reschedule ();
 
+  // A signal can wake us up before the deadline, which is not needed anymore then
+  _current_task->wakeup = 0;
+
   return 0;
 }
 
@@ -525,6 +550,16 @@ task_t *sched_get_task (int pid) {
   return NULL;
 }
 
+/**
+ * Frees a task that is already removed from the task list
+ */
+void sched_free_task (task_t *task) {
+  // @TODO: Free all user-allocated pages from the page-directory
+  kfree (task->kstack);
+  kfree (task);
+}
+
+
 /**
  * Exits current task
  */
@@ -536,26 +571,43 @@ int sys_exit (char exitcode) {
     return -1;
   }
 
-  // @TODO: Free all user-allocated pages from the page-directory
+  // Close all open files and remove the async ring
+  vfs_close_files (_current_task->files);
+  aio_destroy (_current_task);
+
+  int state = disable_ints ();
+
+  task_t *task, *next;
+  for (task = _task_list; task != NULL; task = next) {
+    next = task->next;
+    if (task->ppid != _current_task->pid) continue;
+
+    // Nobody can reap our zombie children anymore, so free them right away
+    if (task->state == TASK_STATE_ZOMBIE) {
+      sched_remove_task (task);
+      sched_free_task (task);
+      continue;
+    }
 
-  task_t *task;
-  for (task = _task_list; task != NULL; task = task->next) {
     // Set parent to 0 when a task has the current task as a parent
-    if (task->ppid == _current_task->pid) task->ppid = 0;
+    task->ppid = 0;
   }
 
-  // Set this child as a zombie when there is a parent tas
-  if (_current_task->ppid > 0) {
-    _current_task->state = TASK_STATE_ZOMBIE;
-    sys_signal (sched_get_task (_current_task->ppid), SIGCHLD);
+  // Set this child as a zombie when there is a parent task. The parent frees us in sys_waitpid().
+  task_t *parent = (_current_task->ppid > 0) ? sched_get_task (_current_task->ppid) : NULL;
+  if (parent) {
     _current_task->exitcode = exitcode;
+    _current_task->state = TASK_STATE_ZOMBIE;
+    sys_signal (parent, SIGCHLD);
+    sched_wakeup (&parent->child_wait);
   } else {
+    /* No parent that will reap us. We cannot free our own kernel stack since we are running
+     * on it, but kfree() does not release memory yet anyway (@TODO) */
     sched_remove_task (_current_task);
+    _current_task->state = TASK_STATE_ZOMBIE;
   }
 
-  // Remove kernel stack for the process
-  kfree (_current_task->kstack);   // @TODO: can this be interrupted?
-  kfree (_current_task);
+  restore_ints (state);
 
   // Reschedule to another task
   reschedule ();
@@ -566,6 +618,59 @@ int sys_exit (char exitcode) {
 }
 
 
+/**
+ * Waits for a child to exit. A pid of -1 waits for any child. The exit code is
+ * stored in status (when not NULL). Returns the PID of the reaped child, 0 when
+ * WNOHANG is given and no child has exited yet, or -1 when there are no (matching)
+ * children or we were interrupted by a signal.
+ */
+int sys_waitpid (int pid, int *status, int options) {
+  task_t *task;
+  int found, child_pid;
+  int interrupted = 0;
+
+  int state = disable_ints ();
+
+  for (;;) {
+    found = 0;
+    for (task = _task_list; task != NULL; task = task->next) {
+      if (task->ppid != _current_task->pid) continue;
+      if (pid > 0 && task->pid != pid) continue;
+      found = 1;
+
+      if (task->state != TASK_STATE_ZOMBIE) continue;
+
+      // Reap the zombie
+      child_pid = task->pid;
+      if (status) *status = (Uint8)task->exitcode;
+
+      sched_remove_task (task);
+      sched_free_task (task);
+
+      restore_ints (state);
+      return child_pid;
+    }
+
+    // No children to wait for
+    if (! found || (options & WNOHANG)) {
+      restore_ints (state);
+      return found ? 0 : -1;
+    }
+
+    // Interrupted by a signal that needs delivering, and nothing to reap
+    if (interrupted) {
+      restore_ints (state);
+      return -1;
+    }
+
+    sched_interruptable_sleep (&_current_task->child_wait);
+
+    // The signal might be the SIGCHLD of the child we wait for, so scan once more first
+    interrupted = signal_pending (_current_task);
+  }
+}
+
+
 /**
  * Returns the current process ID
  */
@@ -609,6 +714,17 @@ int sys_fork (regs_t *r) {
   // Reset task times for the child
   child_task->ktime = child_task->utime = 0;
 
+  // Child inherits signal actions and the blocked mask, but not the pending signals
+  child_task->signal = 0;
+  child_task->wakeup = 0;
+
+  // The memcpy() copied the tasks waiting on the parent's queue, start with an empty one
+  sched_init_waitqueue (&child_task->child_wait);
+
+  // Child shares the open files of the parent, but does not inherit the async ring
+  vfs_dup_files (child_task->files);
+  child_task->aio = NULL;
+
   // Allocate child's kernel stack
   child_task->kstack = (Uint32 *)kmalloc_pageboundary (KERNEL_STACK_SIZE);
 //  kprintf ("kmalloc() child kernel stack at %08X\n", (Uint32)child_task->kstack);
@@ -11,6 +11,11 @@
 #include "schedule.h"
 #include "keyboard.h"
 #include "exec.h"
+#include "vfs.h"
+#include "aio.h"
+#include "vfs/pipe.h"
+#include "poll.h"
+#include "bcache.h"
 
 
 /* These macro creates an <func>() function that does a syscall (INT 42) call with the correct
@@ -24,6 +29,30 @@ CREATE_SYSCALL_ENTRY0(idle,    SYS_IDLE)
 CREATE_SYSCALL_ENTRY0(signal,  SYS_SIGNAL)
 CREATE_SYSCALL_ENTRY1(sleep,   SYS_SLEEP, int)
 CREATE_SYSCALL_ENTRY3(execve,  SYS_EXECVE, char *, char **, char **)
+CREATE_SYSCALL_ENTRY3(waitpid, SYS_WAITPID, int, int *, int)
+CREATE_SYSCALL_ENTRY2(open,    SYS_OPEN, const char *, int)
+CREATE_SYSCALL_ENTRY1(close,   SYS_CLOSE, int)
+CREATE_SYSCALL_ENTRY3(read,    SYS_READ, int, char *, Uint32)
+CREATE_SYSCALL_ENTRY3(write,   SYS_WRITE, int, char *, Uint32)
+CREATE_SYSCALL_ENTRY2(pipe,    SYS_PIPE, int *, int)
+CREATE_SYSCALL_ENTRY0(getticks, SYS_GETTICKS)
+CREATE_SYSCALL_ENTRY3(poll,    SYS_POLL, pollfd_t *, int, int)
+CREATE_SYSCALL_ENTRY0(bdflush, SYS_BDFLUSH)
+CREATE_SYSCALL_ENTRY3(getdents, SYS_GETDENTS, int, vfs_dirent_t *, int)
+CREATE_SYSCALL_ENTRY2(ftruncate, SYS_FTRUNCATE, int, Uint32)
+CREATE_SYSCALL_ENTRY1(fsync,   SYS_FSYNC, int)
+CREATE_SYSCALL_ENTRY3(sigaction, SYS_SIGACTION, int, sigaction_t *, sigaction_t *)
+CREATE_SYSCALL_ENTRY3(sigprocmask, SYS_SIGPROCMASK, int, Uint32 *, Uint32 *)
+CREATE_SYSCALL_ENTRY2(kill,    SYS_KILL, int, int)
+CREATE_SYSCALL_ENTRY2(aio_setup, SYS_AIO_SETUP, aio_ring_t *, Uint32)
+CREATE_SYSCALL_ENTRY2(aio_enter, SYS_AIO_ENTER, Uint32, Uint32)
+
+/**
+ * Waits for any child to exit
+ */
+int wait (int *status) {
+  return waitpid (-1, status, 0);
+}
 
 
 
@@ -46,6 +75,10 @@ CREATE_SYSCALL_ENTRY3(execve,  SYS_EXECVE, char *, char **, char **)
     int retval = 0;
     int service = (r->eax & 0x0000FFFF);
 
+    // Consume whatever the task has queued on its async ring before doing the actual call.
+    // sys_aio_enter() consumes the ring itself, so it can report how much it submitted.
+    if (_current_task && _current_task->aio && service != SYS_AIO_ENTER) aio_submit_pending ();
+
     switch (service) {
       default        :
       case  SYS_NULL :
@@ -57,6 +90,9 @@ CREATE_SYSCALL_ENTRY3(execve,  SYS_EXECVE, char *, char **, char **)
       case  SYS_CONWRITE :
                       retval = sys_conwrite ((char)r->ebx, r->ecx);
                       break;
+      case  SYS_CONREAD :
+                      retval = sys_conread ();
+                      break;
       case  SYS_CONFLUSH :
                       retval = sys_conflush ();
                       break;
@@ -81,6 +117,60 @@ CREATE_SYSCALL_ENTRY3(execve,  SYS_EXECVE, char *, char **, char **)
       case  SYS_EXECVE :
                       retval = sys_execve (r, (char *)r->ebx, (char **)r->ecx, (char **)r->edx);
                       break;
+      case  SYS_WAITPID :
+                      retval = sys_waitpid (r->ebx, (int *)r->ecx, r->edx);
+                      break;
+      case  SYS_OPEN :
+                      retval = sys_open ((const char *)r->ebx, r->ecx);
+                      break;
+      case  SYS_CLOSE :
+                      retval = sys_close (r->ebx);
+                      break;
+      case  SYS_READ :
+                      retval = sys_read (r->ebx, (char *)r->ecx, r->edx);
+                      break;
+      case  SYS_WRITE :
+                      retval = sys_write (r->ebx, (char *)r->ecx, r->edx);
+                      break;
+      case  SYS_PIPE :
+                      retval = sys_pipe ((int *)r->ebx, r->ecx);
+                      break;
+      case  SYS_POLL :
+                      retval = sys_poll ((pollfd_t *)r->ebx, r->ecx, r->edx);
+                      break;
+      case  SYS_GETDENTS :
+                      retval = sys_getdents (r->ebx, (vfs_dirent_t *)r->ecx, r->edx);
+                      break;
+      case  SYS_FTRUNCATE :
+                      retval = sys_ftruncate (r->ebx, r->ecx);
+                      break;
+      case  SYS_FSYNC :
+                      retval = sys_fsync (r->ebx);
+                      break;
+      case  SYS_BDFLUSH :
+                      retval = sys_bdflush ();
+                      break;
+      case  SYS_GETTICKS :
+                      retval = sys_getticks ();
+                      break;
+      case  SYS_SIGACTION :
+                      retval = sys_sigaction (r->ebx, (sigaction_t *)r->ecx, (sigaction_t *)r->edx);
+                      break;
+      case  SYS_SIGPROCMASK :
+                      retval = sys_sigprocmask (r->ebx, (Uint32 *)r->ecx, (Uint32 *)r->edx);
+                      break;
+      case  SYS_KILL :
+                      retval = sys_kill (r->ebx, r->ecx);
+                      break;
+      case  SYS_SIGRETURN :
+                      retval = sys_sigreturn (r);
+                      break;
+      case  SYS_AIO_SETUP :
+                      retval = sys_aio_setup ((aio_ring_t *)r->ebx, r->ecx);
+                      break;
+      case  SYS_AIO_ENTER :
+                      retval = sys_aio_enter (r->ebx, r->ecx);
+                      break;
     }
     return retval;
   }
@@ -108,3 +198,8 @@ CREATE_SYSCALL_ENTRY3(execve,  SYS_EXECVE, char *, char **, char **)
     con_flush (_current_task->console);
     return 0;
   }
+
+  // ========================================================
+  int sys_getticks (void) {
+    return LO32(_kernel_ticks);
+  }
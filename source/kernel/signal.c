@@ -0,0 +1,241 @@
+/******************************************************************************
+ *
+ *  File        : signal.c
+ *  Description : Signal actions and delivery to user space. A signal with a
+ *                user handler is delivered when the task returns to ring 3 by
+ *                pushing a sigframe_t on the user stack. The handler returns into
+ *                a small trampoline inside that frame which calls sys_sigreturn().
+ *
+ *****************************************************************************/
+#include "kernel.h"
+#include "schedule.h"
+#include "service.h"
+#include "signal.h"
+
+
+/**
+ * Returns 1 when the default action of the signal is to ignore it.
+ *
+ * Note that SIGSTOP is ignored since tasks cannot be stopped yet.
+ */
+int signal_default_ignored (int signal) {
+  switch (signal) {
+    case SIGCHLD :
+    case SIGCONT :
+    case SIGSTOP :
+    case SIGUNUSED :
+                   return 1;
+  }
+  return 0;
+}
+
+
+/**
+ * Returns the bitfield of pending signals that are not blocked
+ */
+int signal_pending (task_t *task) {
+  return task->signal & ~(task->sigmask & ~SIG_UNCATCHABLE);
+}
+
+
+/**
+ * Returns 1 when the signal will be ignored when delivered
+ */
+int signal_is_ignored (task_t *task, int signal) {
+  if (SIG_UNCATCHABLE & (1 << signal)) return signal_default_ignored (signal);
+  if (task->sigaction[signal].handler == SIG_IGN) return 1;
+  if (task->sigaction[signal].handler == SIG_DFL) return signal_default_ignored (signal);
+  return 0;
+}
+
+
+/**
+ * Pushes a signal frame on the user stack and lets the context return into the handler
+ */
+void signal_setup_frame (regs_t *r, int signal, sigaction_t *sa) {
+  task_t *task = _current_task;
+
+  sigframe_t *frame = (sigframe_t *)((r->user_esp - sizeof (sigframe_t)) & ~0x3);
+
+  frame->retaddr = (Uint32)&frame->trampoline;
+  frame->signal  = signal;
+  frame->oldmask = task->sigmask;
+
+  frame->edi = r->edi;
+  frame->esi = r->esi;
+  frame->ebp = r->ebp;
+  frame->ebx = r->ebx;
+  frame->edx = r->edx;
+  frame->ecx = r->ecx;
+  frame->eax = r->eax;
+  frame->eip = r->eip;
+  frame->eflags = r->eflags;
+  frame->esp = r->user_esp;
+
+  // mov eax, SYS_SIGRETURN ; int SYSCALL_INT ; nop
+  frame->trampoline[0] = 0xB8;
+  frame->trampoline[1] = (SYS_SIGRETURN >>  0) & 0xFF;
+  frame->trampoline[2] = (SYS_SIGRETURN >>  8) & 0xFF;
+  frame->trampoline[3] = (SYS_SIGRETURN >> 16) & 0xFF;
+  frame->trampoline[4] = (SYS_SIGRETURN >> 24) & 0xFF;
+  frame->trampoline[5] = 0xCD;
+  frame->trampoline[6] = SYSCALL_INT;
+  frame->trampoline[7] = 0x90;
+
+  // Block signals while the handler runs
+  task->sigmask |= sa->mask;
+  if (! (sa->flags & SA_NODEFER)) task->sigmask |= (1 << signal);
+  task->sigmask &= ~SIG_UNCATCHABLE;
+
+  // Continue in the handler
+  r->user_esp = (Uint32)frame;
+  r->eip = sa->handler;
+
+  if (sa->flags & SA_RESETHAND) sa->handler = SIG_DFL;
+}
+
+
+/**
+ * Delivers pending signals to the current task. Must be called with the context
+ * that is about to be restored, and only does something when we return to user space.
+ */
+void signal_deliver (regs_t *r) {
+  task_t *task = _current_task;
+  int pending, signal;
+
+  if (task == NULL || (r->cs & 0x3) != 0x3) return;
+
+  int state = disable_ints ();
+
+  while ((pending = signal_pending (task)) != 0) {
+    /* Since we scan signals forward, it means the least significant bit has the highest
+     * priority. So the lower the signal number, the higher it's priority will be. */
+    signal = bsf (pending);
+    task->signal = btr (task->signal, signal);
+
+    if (signal_is_ignored (task, signal)) continue;
+
+    // Default action for everything else is to terminate
+    if ((SIG_UNCATCHABLE & (1 << signal)) || task->sigaction[signal].handler == SIG_DFL) {
+      restore_ints (state);
+      sys_exit (128 + signal);
+      return;
+    }
+
+    // Only one handler at a time. Others will follow when this one returns through sigreturn
+    signal_setup_frame (r, signal, &task->sigaction[signal]);
+    break;
+  }
+
+  restore_ints (state);
+}
+
+
+/**
+ * Resets caught signals to their default action (on execve). Ignored signals stay ignored.
+ */
+void signal_reset_handlers (task_t *task) {
+  int i;
+
+  for (i=0; i!=NSIG; i++) {
+    if (task->sigaction[i].handler == SIG_IGN) continue;
+    task->sigaction[i].handler = SIG_DFL;
+    task->sigaction[i].mask = 0;
+    task->sigaction[i].flags = 0;
+  }
+}
+
+
+/**
+ * Examines and/or changes the action of a signal. Returns 0 on success, -1 on error.
+ */
+int sys_sigaction (int signal, sigaction_t *act, sigaction_t *oldact) {
+  if (signal <= 0 || signal >= NSIG) return -1;
+
+  if (oldact) memcpy (oldact, &_current_task->sigaction[signal], sizeof (sigaction_t));
+
+  if (act) {
+    // SIGKILL and SIGSTOP cannot be caught or ignored
+    if (SIG_UNCATCHABLE & (1 << signal)) return -1;
+
+    memcpy (&_current_task->sigaction[signal], act, sizeof (sigaction_t));
+
+    // Setting a signal to ignore discards it when it's pending
+    if (act->handler == SIG_IGN) _current_task->signal = btr (_current_task->signal, signal);
+  }
+
+  return 0;
+}
+
+
+/**
+ * Examines and/or changes the blocked signals. Returns 0 on success, -1 on error.
+ */
+int sys_sigprocmask (int how, Uint32 *set, Uint32 *oldset) {
+  if (oldset) *oldset = _current_task->sigmask;
+  if (! set) return 0;
+
+  switch (how) {
+    case SIG_BLOCK :
+                   _current_task->sigmask |= *set;
+                   break;
+    case SIG_UNBLOCK :
+                   _current_task->sigmask &= ~(*set);
+                   break;
+    case SIG_SETMASK :
+                   _current_task->sigmask = *set;
+                   break;
+    default :
+                   return -1;
+  }
+
+  _current_task->sigmask &= ~SIG_UNCATCHABLE;
+  return 0;
+}
+
+
+/**
+ * Sends a signal to a task. Signal 0 only checks if the task exists.
+ * Returns 0 on success, -1 on error.
+ */
+int sys_kill (int pid, int signal) {
+  if (signal < 0 || signal >= NSIG) return -1;
+
+  task_t *task = sched_get_task (pid);
+  if (! task || task->pid == PID_IDLE || task->state == TASK_STATE_ZOMBIE) return -1;
+
+  if (signal == 0) return 0;
+
+  int state = disable_ints ();
+  sys_signal (task, signal);
+  restore_ints (state);
+
+  return 0;
+}
+
+
+/**
+ * Returns from a signal handler. The trampoline calls this after the handler did a 'ret',
+ * so the user stack points just past the return address of the frame. Restores the
+ * interrupted context and returns the interrupted EAX.
+ */
+int sys_sigreturn (regs_t *r) {
+  sigframe_t *frame = (sigframe_t *)(r->user_esp - sizeof (Uint32));
+
+  r->edi = frame->edi;
+  r->esi = frame->esi;
+  r->ebp = frame->ebp;
+  r->ebx = frame->ebx;
+  r->edx = frame->edx;
+  r->ecx = frame->ecx;
+  r->eax = frame->eax;
+  r->eip = frame->eip;
+  r->user_esp = frame->esp;
+
+  // User space can only change the arithmetic, trap and direction flags
+  r->eflags = (r->eflags & ~0xDD5) | (frame->eflags & 0xDD5);
+
+  _current_task->sigmask = frame->oldmask & ~SIG_UNCATCHABLE;
+
+  return r->eax;
+}
@@ -10,11 +10,18 @@
 #include "klib.h"
 #include "vfs.h"
 #include "vfs/cybfs.h"
+#include "bcache.h"
+#include "schedule.h"
+#include "poll.h"
 
 
 vfs_mount_t vfs_mount_table[VFS_MAX_MOUNTS];    // Mount table with all mount points (@TODO: dynamically allocated or linkedlist)
 vfs_system_t vfs_systems[VFS_MAX_FILESYSTEMS];  // There will be a maximum of 100 different filesystems that can be loaded (@TODO: linkedlist or dynamically allocation)
 
+vfs_dentry_t vfs_dcache[VFS_DCACHE_SIZE];                 // Cached path components
+vfs_dentry_t *vfs_dcache_hash[VFS_DCACHE_HASH_SIZE];      // Hash buckets for the cached path components
+Uint32 vfs_dcache_clock = 0;                              // Increased on every cache hit or insert
+
 
 /**
  * Returns the mount from the path (path is formatted like MOUNT:PATH), the path
@@ -54,13 +61,61 @@ vfs_mount_t *vsf_get_mount (const char *full_path, char **path) {
  *
  */
 Uint32 vfs_read (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer) {
-  // Check if it's a directory
-  if ((node->flags & 0x7) != FS_FILE) return 0;
+  // Directories cannot be read, use vfs_readdir() instead
+  if ((node->flags & 0x7) == FS_DIRECTORY) return 0;
 
   if (! node->fileops || ! node->fileops->read) return NULL;
   return node->fileops->read (node, offset, size, buffer);
 }
 
+/**
+ * Reads ahead of a read of size bytes at the current offset of a file. A read that
+ * continues where the previous one stopped is sequential: the window starts at
+ * VFS_READAHEAD_MIN and doubles every time it is refilled, up to VFS_READAHEAD_MAX.
+ * Any other read halves the window, so random access stops reading ahead. The next
+ * window is started when the reader is halfway the current one, so the data is in
+ * the cache before it's needed.
+ */
+void vfs_readahead (vfs_file_t *file, Uint32 size) {
+  vfs_readahead_t *ra = &file->ra;
+  vfs_node_t *node = &file->node;
+  Uint32 start, end;
+
+  if (! node->fileops || ! node->fileops->readahead) return;
+  if ((node->flags & 0x7) != FS_FILE) return;
+
+  if (file->offset != ra->next) {
+    // Random access, whatever we read ahead is not used
+    ra->size /= 2;
+    if (ra->size < VFS_READAHEAD_MIN) ra->size = 0;
+    ra->end = 0;
+    return;
+  }
+
+  if (ra->size == 0) {
+    ra->size = VFS_READAHEAD_MIN;
+  } else if (file->offset + size + ra->size / 2 <= ra->end) {
+    // Still far enough from the end of the window
+    return;
+  } else if (ra->end > file->offset) {
+    // The previous window was used, so make the next one larger
+    ra->size *= 2;
+    if (ra->size > VFS_READAHEAD_MAX) ra->size = VFS_READAHEAD_MAX;
+  }
+
+  // Continue after the window, but never read the request itself ahead
+  start = file->offset + size;
+  if (ra->end > start) start = ra->end;
+
+  end = file->offset + size + ra->size;
+  if (end > node->length || end < file->offset) end = node->length;
+  if (start >= end) return;
+
+  node->fileops->readahead (node, start, end - start);
+  ra->end = end;
+}
+
+
 /**
  *
  */
@@ -69,6 +124,34 @@ Uint32 vfs_write (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer) {
   return node->fileops->write (node, offset, size, buffer);
 }
 
+/**
+ * Creates a regular file inside the directory node. Returns 1 on success, 0 on error.
+ */
+int vfs_create (vfs_node_t *node, const char *name, vfs_node_t *target_node) {
+  // Check if it's a directory
+  if ((node->flags & 0x7) != FS_DIRECTORY) return 0;
+
+  if (! node->fileops || ! node->fileops->create) return 0;
+
+  // The name might be cached as not existing
+  if (node->mount) vfs_dcache_invalidate (node->mount);
+
+  return node->fileops->create (node, name, target_node);
+}
+
+/**
+ * Sets the length of a regular file. Returns 1 on success, 0 on error.
+ */
+int vfs_truncate (vfs_node_t *node, Uint32 length) {
+  if ((node->flags & 0x7) != FS_FILE) return 0;
+
+  if (! node->fileops || ! node->fileops->truncate) return 0;
+  if (! node->fileops->truncate (node, length)) return 0;
+
+  node->length = length;
+  return 1;
+}
+
 /**
  *
  */
@@ -104,6 +187,30 @@ int vfs_readdir(vfs_node_t *node, Uint32 index, struct dirent *target_dirent) {
   return node->fileops->readdir (node, index, target_dirent);
 }
 
+/**
+ * Reads at most count entries from a directory, starting at position *offset. The
+ * position is opaque (its meaning depends on the filesystem) and starts at 0. It is
+ * moved past the returned entries. Returns the number of entries, 0 at the end of
+ * the directory.
+ */
+int vfs_getdents (vfs_node_t *node, Uint32 *offset, vfs_dirent_t *dirents, int count) {
+  int filled = 0;
+
+  // Check if it's a directory
+  if ((node->flags & 0x7) != FS_DIRECTORY) return 0;
+  if (! node->fileops) return 0;
+
+  if (node->fileops->getdents) return node->fileops->getdents (node, offset, dirents, count);
+
+  // Filesystems without getdents() use the entry index as position
+  while (filled != count && vfs_readdir (node, *offset, &dirents[filled])) {
+    (*offset)++;
+    filled++;
+  }
+  return filled;
+}
+
+
 /**
  *
  */
@@ -123,6 +230,9 @@ void vfs_mknod (struct vfs_node *node, const char *name, char device_type, Uint8
   // Check if it's a directory
   if ((node->flags & 0x7) != FS_DIRECTORY) return;
 
+  // The name might be cached as not existing
+  if (node->mount) vfs_dcache_invalidate (node->mount);
+
 //  kprintf ("vfs_mknod: 1\n");
 
   if (! node->fileops || ! node->fileops->mknod) return;
@@ -132,6 +242,17 @@ void vfs_mknod (struct vfs_node *node, const char *name, char device_type, Uint8
 }
 
 
+/**
+ * Returns the POLL* events that are ready on the node. When table is given, the current
+ * task is added to the wait queues that are woken when the readiness changes. Nodes
+ * without a poll operation never block, so they are always ready.
+ */
+int vfs_poll (vfs_node_t *node, struct poll_table *table) {
+  if (! node->fileops || ! node->fileops->poll) return POLLIN | POLLOUT;
+  return node->fileops->poll (node, table);
+}
+
+
 /**
  * Return 1 when filesystem is registered (FAT12, CYBFS etc). 0 otherwise
  */
@@ -215,6 +336,12 @@ vfs_system_t *vfs_get_vfs_system (const char *tag) {
  *
  */
 void vfs_init (void) {
+  int i;
+
+  // Empty path component cache
+  memset (vfs_dcache, 0, sizeof (vfs_dcache));
+  for (i=0; i!=VFS_DCACHE_HASH_SIZE; i++) vfs_dcache_hash[i] = NULL;
+
   // Clear all fs slot data
   memset (vfs_systems, 0, sizeof (vfs_systems));
 
@@ -236,6 +363,117 @@ vfs_mount_t *vfs_get_mount_from_path (const char *path) {
   return mount;
 }
 
+/**
+ * Returns the hash bucket for a name inside a directory
+ */
+int vfs_dcache_hash_key (struct vfs_mount *mount, inode_t parent_inode, const char *name) {
+  Uint32 hash = (Uint32)mount ^ parent_inode;
+
+  while (*name) hash = (hash * 31) + *name++;
+  return hash & (VFS_DCACHE_HASH_SIZE - 1);
+}
+
+
+/**
+ * Removes a cached entry from its hash bucket
+ */
+void vfs_dcache_hash_remove (vfs_dentry_t *dentry) {
+  vfs_dentry_t **ptr = &vfs_dcache_hash[vfs_dcache_hash_key (dentry->mount, dentry->parent_inode, dentry->name)];
+
+  while (*ptr) {
+    if (*ptr == dentry) {
+      *ptr = dentry->hash_next;
+      break;
+    }
+    ptr = &(*ptr)->hash_next;
+  }
+  dentry->hash_next = NULL;
+}
+
+
+/**
+ * Adds the result of a lookup to the cache. The least recently used entry is
+ * overwritten. target_node is NULL for names that do not exist.
+ */
+void vfs_dcache_add (vfs_node_t *node, const char *name, vfs_node_t *target_node) {
+  vfs_dentry_t *dentry = &vfs_dcache[0];
+  int i;
+
+  // Find a free entry, or otherwise the least recently used one
+  for (i=0; i!=VFS_DCACHE_SIZE; i++) {
+    if (vfs_dcache[i].mount == NULL) {
+      dentry = &vfs_dcache[i];
+      break;
+    }
+    if (vfs_dcache[i].last_used < dentry->last_used) dentry = &vfs_dcache[i];
+  }
+
+  if (dentry->mount) vfs_dcache_hash_remove (dentry);
+
+  dentry->mount = node->mount;
+  dentry->parent_inode = node->inode_nr;
+  strcpy (dentry->name, name);
+  dentry->negative = (target_node == NULL);
+  if (target_node) memcpy (&dentry->node, target_node, sizeof (vfs_node_t));
+  dentry->last_used = ++vfs_dcache_clock;
+
+  int bucket = vfs_dcache_hash_key (dentry->mount, dentry->parent_inode, dentry->name);
+  dentry->hash_next = vfs_dcache_hash[bucket];
+  vfs_dcache_hash[bucket] = dentry;
+}
+
+
+/**
+ * Drops all cached path components of a mount (on (re)mount, or when directories change)
+ */
+void vfs_dcache_invalidate (struct vfs_mount *mount) {
+  int i;
+
+  int state = disable_ints ();
+  for (i=0; i!=VFS_DCACHE_SIZE; i++) {
+    if (vfs_dcache[i].mount != mount) continue;
+
+    vfs_dcache_hash_remove (&vfs_dcache[i]);
+    vfs_dcache[i].mount = NULL;
+    vfs_dcache[i].last_used = 0;
+  }
+  restore_ints (state);
+}
+
+
+/**
+ * Finds a name inside a directory like vfs_finddir(), but checks the path component
+ * cache first. Returns 1 when found, 0 when not.
+ */
+int vfs_lookup (vfs_node_t *node, const char *name, vfs_node_t *target_node) {
+  vfs_dentry_t *dentry;
+  int ret;
+
+  // Nodes without a mount, or too long names are not cached
+  if (! node->mount || strlen (name) >= VFS_DCACHE_NAME_LEN) return vfs_finddir (node, name, target_node);
+
+  int state = disable_ints ();
+  for (dentry = vfs_dcache_hash[vfs_dcache_hash_key (node->mount, node->inode_nr, name)]; dentry; dentry = dentry->hash_next) {
+    if (dentry->mount != node->mount || dentry->parent_inode != node->inode_nr || strcmp (dentry->name, name) != 0) continue;
+
+    dentry->last_used = ++vfs_dcache_clock;
+    if (! dentry->negative) memcpy (target_node, &dentry->node, sizeof (vfs_node_t));
+    ret = ! dentry->negative;
+    restore_ints (state);
+    return ret;
+  }
+  restore_ints (state);
+
+  ret = vfs_finddir (node, name, target_node);
+
+  state = disable_ints ();
+  vfs_dcache_add (node, name, ret ? target_node : NULL);
+  restore_ints (state);
+
+  return ret;
+}
+
+
 /**
  *
  */
@@ -302,7 +540,7 @@ int vfs_get_node_from_path (const char *path, vfs_node_t *node) {
 
     // Find the entry if it exists
     vfs_node_t new_node;
-    if (! vfs_finddir (node, component, &new_node)) {
+    if (! vfs_lookup (node, component, &new_node)) {
 //      kprintf ("component not found\n\n");
       return NULL;   // Cannot find node... error :(
     }
@@ -378,6 +616,9 @@ int sys_mount (const char *device_path, const char *fs_type, const char *mount,
     vfs_mount_table[i].system->mount_count++;      // Increase mount count for this filesystem
     strcpy (vfs_mount_table[i].mount, mount);
 
+    // Path components cached for a previous mount on this slot are not valid anymore
+    vfs_dcache_invalidate (&vfs_mount_table[i]);
+
 
     // Check if mount function is available
     if (!vfs_mount_table[i].system->info.mountops || !vfs_mount_table[i].system->info.mountops->mount) return 0;
@@ -411,5 +652,210 @@ int sys_mount (const char *device_path, const char *fs_type, const char *mount,
 }
 
 
+/**
+ * Returns the opened file for the descriptor of the current task, or NULL when
+ * the descriptor is not in use.
+ */
+vfs_file_t *vfs_get_file (int fd) {
+  if (fd < 0 || fd >= TASK_MAX_FILES) return NULL;
+  return _current_task->files[fd];
+}
+
+/**
+ * Installs a file into the first free descriptor slot of the current task.
+ * Returns the descriptor or -1 when the table is full.
+ */
+int vfs_install_file (vfs_file_t *file) {
+  int fd;
+
+  for (fd=0; fd!=TASK_MAX_FILES; fd++) {
+    if (_current_task->files[fd] != NULL) continue;
+    _current_task->files[fd] = file;
+    return fd;
+  }
+
+  // No more room
+  return -1;
+}
+
+/**
+ * Drops a reference to a file and closes it when nobody uses it anymore
+ */
+void vfs_release_file (vfs_file_t *file) {
+  file->refcount--;
+  if (file->refcount > 0) return;
+
+  vfs_close (&file->node);
+  kfree (file);
+}
+
+/**
+ * Increases the reference count of all files in a (freshly copied) descriptor table
+ */
+void vfs_dup_files (struct vfs_file **files) {
+  int fd;
+  for (fd=0; fd!=TASK_MAX_FILES; fd++) {
+    if (files[fd]) files[fd]->refcount++;
+  }
+}
+
+/**
+ * Releases all files in a descriptor table
+ */
+void vfs_close_files (struct vfs_file **files) {
+  int fd;
+  for (fd=0; fd!=TASK_MAX_FILES; fd++) {
+    if (! files[fd]) continue;
+    vfs_release_file (files[fd]);
+    files[fd] = NULL;
+  }
+}
+
+/**
+ * Creates a regular file from a full path (MOUNT:/dir/name). The directory must exist.
+ * Returns 1 on success, 0 on error.
+ */
+int vfs_create_from_path (const char *path, vfs_node_t *node) {
+  char dir_path[255];
+  vfs_node_t dir_node;
+  int i, len;
+
+  // Split in directory and name
+  len = strlen (path);
+  for (i=len-1; i>=0 && path[i] != '/'; i--) ;
+  if (i < 0 || i == len-1 || i >= sizeof (dir_path) - 1) return 0;
+
+  // Keep the slash when the file is created in the root
+  if (i == 0 || path[i-1] == ':') {
+    strncpy (dir_path, path, i+1);
+    dir_path[i+1] = 0;
+  } else {
+    strncpy (dir_path, path, i);
+    dir_path[i] = 0;
+  }
+
+  if (! vfs_get_node_from_path (dir_path, &dir_node)) return 0;
+  return vfs_create (&dir_node, path + i + 1, node);
+}
+
+/**
+ * Opens a file and returns the file descriptor, or -1 on error
+ */
+int sys_open (const char *path, int flags) {
+  vfs_file_t *file = (vfs_file_t *)kmalloc (sizeof (vfs_file_t));
+  memset (file, 0, sizeof (vfs_file_t));
+
+  if (! vfs_get_node_from_path (path, &file->node) &&
+      (! (flags & O_CREAT) || ! vfs_create_from_path (path, &file->node))) {
+    kfree (file);
+    return -1;
+  }
+
+  // Directories cannot be read or written through a descriptor
+  if ((file->node.flags & 0x7) == FS_DIRECTORY && (flags & (O_WRONLY | O_RDWR))) {
+    kfree (file);
+    return -1;
+  }
+
+  // Throw away the old contents
+  if ((flags & O_TRUNC) && (flags & (O_WRONLY | O_RDWR)) && ! vfs_truncate (&file->node, 0)) {
+    kfree (file);
+    return -1;
+  }
+
+  file->flags = flags;
+  file->refcount = 1;
+
+  int fd = vfs_install_file (file);
+  if (fd == -1) {
+    kfree (file);
+    return -1;
+  }
+
+  // Opening might update the length of the node
+  vfs_open (&file->node);
+  if (flags & O_APPEND) file->offset = file->node.length;
+  return fd;
+}
+
+/**
+ * Closes a file descriptor
+ */
+int sys_close (int fd) {
+  vfs_file_t *file = vfs_get_file (fd);
+  if (! file) return -1;
+
+  _current_task->files[fd] = NULL;
+  vfs_release_file (file);
+  return 0;
+}
+
+/**
+ * Reads from a file descriptor at the current offset. Returns the number of bytes read.
+ */
+int sys_read (int fd, char *buffer, Uint32 size) {
+  vfs_file_t *file = vfs_get_file (fd);
+  if (! file || (file->flags & O_WRONLY)) return -1;
+
+  vfs_readahead (file, size);
+
+  Uint32 count = vfs_read (&file->node, file->offset, size, buffer);
+  file->offset += count;
+  file->ra.next = file->offset;
+  return count;
+}
 
+/**
+ * Writes to a file descriptor at the current offset. Returns the number of bytes written.
+ */
+int sys_write (int fd, char *buffer, Uint32 size) {
+  vfs_file_t *file = vfs_get_file (fd);
+  if (! file || ! (file->flags & (O_WRONLY | O_RDWR))) return -1;
 
+  if (file->flags & O_APPEND) file->offset = file->node.length;
+
+  Uint32 count = vfs_write (&file->node, file->offset, size, buffer);
+  file->offset += count;
+  if (file->offset > file->node.length) file->node.length = file->offset;
+  return count;
+}
+
+
+/**
+ * Sets the length of a file opened for writing. Returns 0 on success, -1 on error.
+ */
+int sys_ftruncate (int fd, Uint32 length) {
+  vfs_file_t *file = vfs_get_file (fd);
+  if (! file || ! (file->flags & (O_WRONLY | O_RDWR))) return -1;
+
+  return vfs_truncate (&file->node, length) ? 0 : -1;
+}
+
+
+/**
+ * Writes everything that is cached for the device of a file to the medium. Returns 0
+ * on success, -1 on error.
+ */
+int sys_fsync (int fd) {
+  vfs_file_t *file = vfs_get_file (fd);
+  if (! file) return -1;
+
+  // Pipes and cybfs files have nothing to write
+  if (! file->node.mount || ! file->node.mount->dev) return 0;
+
+  return bcache_sync (file->node.mount->dev);
+}
+
+
+/**
+ * Reads at most count directory entries from a directory opened with sys_open(). The
+ * offset of the descriptor is the directory position, so every call continues where the
+ * previous one stopped. Returns the number of entries, 0 at the end of the directory and
+ * -1 on error.
+ */
+int sys_getdents (int fd, vfs_dirent_t *dirents, int count) {
+  vfs_file_t *file = vfs_get_file (fd);
+  if (! file || (file->node.flags & 0x7) != FS_DIRECTORY || count <= 0) return -1;
+
+  return vfs_getdents (&file->node, &file->offset, dirents, count);
+}
@@ -11,13 +11,18 @@
 #include "kmem.h"
 #include "vfs.h"
 #include "vfs/devfs.h"
+#include "poll.h"
+#include "block.h"
 
 
 // File operations
 static struct vfs_fileops devfs_fileops = {
+    .read = devfs_read,
+    .write = devfs_write,
     .readdir = devfs_readdir,
     .finddir = devfs_finddir,
-    .mknod = devfs_mknod
+    .mknod = devfs_mknod,
+    .poll = devfs_poll
 };
 
 // Mount operations
@@ -171,6 +176,39 @@ int devfs_finddir (vfs_node_t *dirnode, const char *name, vfs_node_t *target_nod
   return 1;
 }
 
+/**
+ * Reads from the device behind the node. Block devices go through their request queue,
+ * which takes care of buffers in task memory.
+ */
+Uint32 devfs_read (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer) {
+  device_t *dev = device_get_device (node->major_num, node->minor_num);
+  if (! dev || ! dev->read) return 0;
+  if (node->flags == FS_BLOCKDEVICE) return block_read (dev, offset, size, buffer);
+  return dev->read (node->major_num, node->minor_num, offset, size, buffer);
+}
+
+/**
+ * Writes to the device behind the node. Block devices go through their request queue.
+ */
+Uint32 devfs_write (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer) {
+  device_t *dev = device_get_device (node->major_num, node->minor_num);
+  if (! dev || ! dev->write) return 0;
+  if (node->flags == FS_BLOCKDEVICE) return block_write (dev, offset, size, buffer);
+  return dev->write (node->major_num, node->minor_num, offset, size, buffer);
+}
+
+/**
+ * Returns the readiness of the device behind the node. Only character devices can be
+ * polled. Block devices always wait for the disk, so they report POLLNVAL. Character
+ * devices without a poll function never block and are always ready.
+ */
+int devfs_poll (vfs_node_t *node, struct poll_table *table) {
+  device_t *dev = device_get_device (node->major_num, node->minor_num);
+  if (! dev || node->flags == FS_BLOCKDEVICE) return POLLNVAL;
+  if (! dev->poll) return POLLIN | POLLOUT;
+  return dev->poll (node->major_num, node->minor_num, table);
+}
+
 /**
  *
  */
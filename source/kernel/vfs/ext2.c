@@ -9,6 +9,7 @@
 #include "kernel.h"
 #include "kmem.h"
 #include "vfs.h"
+#include "bcache.h"
 #include "vfs/ext2.h"
 #include "drivers/floppy.h"
 #include "drivers/ide.h"
@@ -17,7 +18,10 @@
 static struct vfs_fileops ext2_fileops = {
     .read = ext2_read, .write = ext2_write,
     .open = ext2_open, .close = ext2_close,
-    .readdir = ext2_readdir, .finddir = ext2_finddir
+    .readdir = ext2_readdir, .finddir = ext2_finddir,
+    .getdents = ext2_getdents,
+    .create = ext2_create, .truncate = ext2_truncate,
+    .readahead = ext2_readahead
 };
 
 // Mount operations
@@ -53,11 +57,11 @@ static vfs_node_t ext2_supernode = {
  * @param inode_block
  * @return
  */
-Uint32 ext2_block2diskoffset(struct vfs_mount *mount, Uint32 ext2_block) {
+Uint64 ext2_block2diskoffset(struct vfs_mount *mount, Uint32 ext2_block) {
   ext2_info_t *ext2_info = mount->fs_data;
 //  kprintf("b2d: %d\n", ext2_block);
   // @TODO: Do we really want to fixate sector size here?
-  return ext2_block * ext2_info->sectors_per_block * IDE_SECTOR_SIZE;
+  return (Uint64)ext2_block * ext2_info->sectors_per_block * IDE_SECTOR_SIZE;
 }
 
 
@@ -74,9 +78,9 @@ int ext2_read_block(struct vfs_mount *mount, int block_num, int block_count, cha
   ext2_info_t *ext2_info = mount->fs_data;
 
   // Convert block inti
-  Uint32 offset = ext2_block2diskoffset(mount, block_num);
+  Uint64 offset = ext2_block2diskoffset(mount, block_num);
   Uint32 size = block_count * ext2_info->block_size;
-  return (mount->dev->read (mount->dev->major_num, mount->dev->minor_num, offset, size, buffer) == size);
+  return (bcache_read (mount->dev, offset, size, buffer) == size);
 }
 
 /**
@@ -122,7 +126,7 @@ void *ext2_allocate_and_read_offset(struct vfs_mount *mount, int offset, int siz
   memset(buffer, 0, size);
 
   // Read direct from offset/size
-  if (mount->dev->read (mount->dev->major_num, mount->dev->minor_num, offset, size, buffer) != size) {
+  if (bcache_read (mount->dev, offset, size, buffer) != size) {
       // Error while reading
       kfree(buffer);
       return NULL;
@@ -131,411 +135,1757 @@ void *ext2_allocate_and_read_offset(struct vfs_mount *mount, int offset, int siz
   return buffer;
 }
 
+// Source of zeros for clearing new blocks
+char ext2_zero_buffer[BCACHE_BLOCK_SIZE];
+
+// Inode cache
+ext2_cached_inode_t *ext2_inode_cache = NULL;
+ext2_cached_inode_t *ext2_inode_hash[EXT2_INODE_HASH_SIZE];
+ext2_cached_inode_t *ext2_inode_lru_head = NULL;
+ext2_cached_inode_t *ext2_inode_lru_tail = NULL;
+
+#define EXT2_INODE_HASH(mount, inode_nr)   ((((Uint32)(mount) >> 4) ^ (inode_nr)) & (EXT2_INODE_HASH_SIZE - 1))
+
+
+/**
+ * Adds an unreferenced inode to the head (most recently used side) of the LRU list
+ */
+void ext2_inode_lru_add(ext2_cached_inode_t *cached) {
+  cached->lru_prev = NULL;
+  cached->lru_next = ext2_inode_lru_head;
+  if (ext2_inode_lru_head) ext2_inode_lru_head->lru_prev = cached;
+  ext2_inode_lru_head = cached;
+  if (! ext2_inode_lru_tail) ext2_inode_lru_tail = cached;
+}
+
+/**
+ * Removes an inode from the LRU list (because it gets referenced or reused)
+ */
+void ext2_inode_lru_remove(ext2_cached_inode_t *cached) {
+  if (cached->lru_prev) cached->lru_prev->lru_next = cached->lru_next;
+  else ext2_inode_lru_head = cached->lru_next;
+
+  if (cached->lru_next) cached->lru_next->lru_prev = cached->lru_prev;
+  else ext2_inode_lru_tail = cached->lru_prev;
+
+  cached->lru_prev = cached->lru_next = NULL;
+}
+
+/**
+ * Removes an inode from its hash bucket
+ */
+void ext2_inode_hash_remove(ext2_cached_inode_t *cached) {
+  ext2_cached_inode_t **ptr = &ext2_inode_hash[EXT2_INODE_HASH(cached->mount, cached->inode_nr)];
+
+  while (*ptr) {
+    if (*ptr == cached) {
+      *ptr = cached->hash_next;
+      break;
+    }
+    ptr = &(*ptr)->hash_next;
+  }
+  cached->hash_next = NULL;
+}
+
+/**
+ * Adds an inode to its hash bucket
+ */
+void ext2_inode_hash_add(ext2_cached_inode_t *cached) {
+  int bucket = EXT2_INODE_HASH(cached->mount, cached->inode_nr);
+
+  cached->hash_next = ext2_inode_hash[bucket];
+  ext2_inode_hash[bucket] = cached;
+}
+
+/**
+ * Finds an inode in the cache
+ */
+ext2_cached_inode_t *ext2_inode_lookup(struct vfs_mount *mount, Uint32 inode_nr) {
+  ext2_cached_inode_t *cached;
+
+  for (cached = ext2_inode_hash[EXT2_INODE_HASH(mount, inode_nr)]; cached; cached = cached->hash_next) {
+    if (cached->inode_nr == inode_nr && cached->mount == mount) return cached;
+  }
+  return NULL;
+}
+
+/**
+ * Allocates the inode cache. All entries start out free on the LRU list.
+ */
+void ext2_inode_cache_init(void) {
+  int i;
+
+  ext2_inode_cache = (ext2_cached_inode_t *)kmalloc(EXT2_INODE_CACHE_SIZE * sizeof(ext2_cached_inode_t));
+  memset(ext2_inode_cache, 0, EXT2_INODE_CACHE_SIZE * sizeof(ext2_cached_inode_t));
+
+  for (i=0; i!=EXT2_INODE_HASH_SIZE; i++) ext2_inode_hash[i] = NULL;
+  for (i=0; i!=EXT2_INODE_CACHE_SIZE; i++) ext2_inode_lru_add(&ext2_inode_cache[i]);
+}
+
+/**
+ * Drops all unreferenced inodes of a mount from the cache
+ */
+void ext2_inode_cache_invalidate(struct vfs_mount *mount) {
+  int i;
+
+  int state = disable_ints();
+  for (i=0; i!=EXT2_INODE_CACHE_SIZE; i++) {
+    ext2_cached_inode_t *cached = &ext2_inode_cache[i];
+    if (cached->mount != mount || cached->refcount > 0) continue;
+
+    ext2_inode_hash_remove(cached);
+    cached->mount = NULL;
+  }
+  restore_ints(state);
+}
+
+
+/**
+ * Returns the disk offset of an inode inside the inode table, or 0 when the inode
+ * number is not valid.
+ */
+Uint64 ext2_inode_diskoffset(struct vfs_mount *mount, Uint32 inode_nr) {
+  ext2_info_t *ext2_info = mount->fs_data;
+
+  // Find the blockgroup in which this inode resides
+  Uint32 block_group = (inode_nr - 1) / ext2_info->superblock->inodesInGroupCount;
+  if (block_group >= ext2_info->group_count) return 0;
+
+  // Find the block inside the inode table that has got our inode data
+  Uint32 inodes_per_block = ext2_info->block_size / ext2_info->inode_size;
+  Uint32 block_offset = ((inode_nr - 1) % ext2_info->superblock->inodesInGroupCount) / inodes_per_block;
+
+  // Find the actual start of inodes in this group
+  ext2_blockdescriptor_t *group_descriptor = &ext2_info->block_descriptor[block_group];
+  Uint32 inode_block = group_descriptor->inodeTableStart + block_offset;
+
+  // Find the offset of the inode inside the block
+  Uint32 inode_index = (((inode_nr - 1) % ext2_info->superblock->inodesInGroupCount) % inodes_per_block) * ext2_info->inode_size;
+
+  return ext2_block2diskoffset(mount, inode_block) + inode_index;
+}
+
+
+/**
+ * Writes a cached inode back to the inode table (through the buffer cache)
+ *
+ * @return 1 on success, 0 on error
+ */
+int ext2_write_inode(ext2_inode_t *inode) {
+  ext2_cached_inode_t *cached = (ext2_cached_inode_t *)inode;
+
+  Uint64 disk_offset = ext2_inode_diskoffset(cached->mount, cached->inode_nr);
+  if (! disk_offset) return 0;
+
+  return (bcache_write(cached->mount->dev, disk_offset, sizeof(ext2_inode_t), (char *)inode) == sizeof(ext2_inode_t));
+}
+
+
+/**
+ * Returns an inode from the inode cache, reads it from disk when it's not cached.
+ *
+ * NOTE, you need to release this inode with ext2_release_inode()!
+ *
+ * @param mount
+ * @param inode_nr
+ * @return
+ */
+ext2_inode_t *ext2_read_inode(struct vfs_mount *mount, Uint32 inode_nr) {
+  ext2_info_t *ext2_info = mount->fs_data;
+  ext2_cached_inode_t *cached, *found;
+
+  // Check if inode number is correct
+  if (! inode_nr || inode_nr > ext2_info->superblock->inodeCount) {
+    kprintf ("Incorrect inode number");
+    return NULL;
+  }
+
+  int state = disable_ints();
+
+  // Already cached
+  if ((cached = ext2_inode_lookup(mount, inode_nr))) {
+    if (cached->refcount == 0) ext2_inode_lru_remove(cached);
+    cached->refcount++;
+    restore_ints(state);
+    return &cached->inode;
+  }
+
+  // Reuse the least recently used entry
+  if (! (cached = ext2_inode_lru_tail)) {
+    restore_ints(state);
+    kprintf ("Ext2: all cached inodes are in use\n");
+    return NULL;
+  }
+  ext2_inode_lru_remove(cached);
+  if (cached->mount) ext2_inode_hash_remove(cached);
+  struct vfs_mount *old_mount = cached->mount;
+  cached->mount = NULL;
+  cached->refcount = 1;
+  cached->map_count = 0;
+
+  restore_ints(state);
+
+  // The entry we reuse might still have preallocated blocks
+  if (cached->prealloc_count) ext2_discard_prealloc(old_mount, cached);
+
+  Uint64 disk_offset = ext2_inode_diskoffset(mount, inode_nr);
+  if (! disk_offset) goto cleanup;
+
+  // Read the inode itself. The block that holds it stays in the buffer cache for the other inodes in it.
+  if (bcache_read(mount->dev, disk_offset, sizeof(ext2_inode_t), (char *)&cached->inode) != sizeof(ext2_inode_t)) {
+    kprintf ("Error: could not read inode from device %d:%d", mount->dev->major_num, mount->dev->minor_num);
+    goto cleanup;
+  }
+
+  state = disable_ints();
+
+  // Somebody else read the same inode while we were reading it. Use that one instead.
+  if ((found = ext2_inode_lookup(mount, inode_nr))) {
+    if (found->refcount == 0) ext2_inode_lru_remove(found);
+    found->refcount++;
+    cached->refcount = 0;
+    ext2_inode_lru_add(cached);
+    restore_ints(state);
+    return &found->inode;
+  }
+
+  cached->mount = mount;
+  cached->inode_nr = inode_nr;
+  ext2_inode_hash_add(cached);
+
+  restore_ints(state);
+  return &cached->inode;
+
+cleanup:
+  state = disable_ints();
+  cached->refcount = 0;
+  ext2_inode_lru_add(cached);
+  restore_ints(state);
+  return NULL;
+}
+
+
+/**
+ * Releases an inode returned by ext2_read_inode()
+ */
+void ext2_release_inode(ext2_inode_t *inode) {
+  ext2_cached_inode_t *cached = (ext2_cached_inode_t *)inode;
+
+  int state = disable_ints();
+  cached->refcount--;
+  if (cached->refcount == 0) ext2_inode_lru_add(cached);
+  restore_ints(state);
+}
+
+
+/**
+ * Writes zeros to size bytes at a disk offset (through the buffer cache)
+ *
+ * @return 1 on success, 0 on error
+ */
+int ext2_zero(struct vfs_mount *mount, Uint64 disk_offset, Uint32 size) {
+  Uint32 len;
+
+  while (size) {
+    len = (size > BCACHE_BLOCK_SIZE) ? BCACHE_BLOCK_SIZE : size;
+    if (bcache_write(mount->dev, disk_offset, len, ext2_zero_buffer) != len) return 0;
+    disk_offset += len;
+    size -= len;
+  }
+  return 1;
+}
+
+
+/**
+ * Writes the in-memory superblock back to disk
+ */
+void ext2_write_superblock(struct vfs_mount *mount) {
+  ext2_info_t *ext2_info = mount->fs_data;
+
+  // @TODO: the backup superblocks in the other groups are not updated
+  bcache_write(mount->dev, 1024, 1024, (char *)ext2_info->superblock);
+}
+
+
+/**
+ * Writes the descriptor of a block group back to disk
+ */
+void ext2_write_group_descriptor(struct vfs_mount *mount, Uint32 group) {
+  ext2_info_t *ext2_info = mount->fs_data;
+
+  bcache_write(mount->dev, ext2_info->descriptor_offset + group * sizeof(ext2_blockdescriptor_t), sizeof(ext2_blockdescriptor_t), (char *)&ext2_info->block_descriptor[group]);
+}
+
+
+/**
+ * Finds the first clear bit at or after start inside a bitmap block, and returns in run
+ * how many clear bits (at most max) start there.
+ *
+ * @return bit number, or -1 when all bits from start up to bits are set
+ */
+int ext2_bitmap_find(struct vfs_mount *mount, Uint32 bitmap_block, Uint32 start, Uint32 bits, Uint32 max, Uint32 *run) {
+  Uint8 chunk[64];
+  Uint32 chunk_start = 0, chunk_len = 0;
+  Uint32 bit, len;
+  int found = -1;
+
+  Uint64 disk_offset = ext2_block2diskoffset(mount, bitmap_block);
+
+  *run = 0;
+  for (bit = start; bit < bits; bit++) {
+    // Fetch the part of the bitmap this bit is in
+    if (bit / 8 < chunk_start || bit / 8 >= chunk_start + chunk_len) {
+      chunk_start = bit / 8;
+      len = (bits + 7) / 8 - chunk_start;
+      if (len > sizeof(chunk)) len = sizeof(chunk);
+      if (bcache_read(mount->dev, disk_offset + chunk_start, len, (char *)chunk) != len) return -1;
+      chunk_len = len;
+    }
+
+    // Skip completely used bytes at once
+    if (found == -1 && (bit % 8) == 0 && chunk[bit / 8 - chunk_start] == 0xFF) {
+      bit += 7;
+      continue;
+    }
+
+    if (chunk[bit / 8 - chunk_start] & (1 << (bit % 8))) {
+      if (found != -1) break;
+      continue;
+    }
+
+    if (found == -1) found = bit;
+    (*run)++;
+    if (*run == max) break;
+  }
+
+  return found;
+}
+
+
+/**
+ * Sets or clears count bits in a bitmap block, starting at bit
+ *
+ * @return 1 on success, 0 on error
+ */
+int ext2_bitmap_update(struct vfs_mount *mount, Uint32 bitmap_block, Uint32 bit, Uint32 count, int set) {
+  Uint64 disk_offset = ext2_block2diskoffset(mount, bitmap_block);
+  Uint8 byte;
+
+  for (; count; count--, bit++) {
+    if (bcache_read(mount->dev, disk_offset + bit / 8, 1, (char *)&byte) != 1) return 0;
+    if (set) {
+      byte |= (1 << (bit % 8));
+    } else {
+      byte &= ~(1 << (bit % 8));
+    }
+    if (bcache_write(mount->dev, disk_offset + bit / 8, 1, (char *)&byte) != 1) return 0;
+  }
+  return 1;
+}
+
+
+/**
+ * Takes the allocator of the mount. Finding a free bit and setting it are separate bcache
+ * transfers which can sleep, so another task could find the same bit in between.
+ */
+void ext2_lock_alloc(struct vfs_mount *mount) {
+  ext2_info_t *ext2_info = mount->fs_data;
+
+  while (1) {
+    int state = disable_ints ();
+    if (! ext2_info->alloc_busy) {
+      ext2_info->alloc_busy = 1;
+      restore_ints (state);
+      return;
+    }
+    if (_current_task != NULL && _current_task->pid != PID_IDLE) sched_interruptable_sleep (&ext2_info->alloc_wait);
+    restore_ints (state);
+  }
+}
+
+
+/**
+ * Releases the allocator of the mount
+ */
+void ext2_unlock_alloc(struct vfs_mount *mount) {
+  ext2_info_t *ext2_info = mount->fs_data;
+
+  int state = disable_ints ();
+  ext2_info->alloc_busy = 0;
+  if (_current_task != NULL) sched_wakeup (&ext2_info->alloc_wait);
+  restore_ints (state);
+}
+
+
+/**
+ * Allocates a run of at most max contiguous blocks, as close after goal as possible.
+ * The group of the goal is tried first, then the groups after it.
+ *
+ * @return first block of the run (count holds its length), or 0 when the disk is full
+ */
+Uint32 ext2_alloc_blocks(struct vfs_mount *mount, Uint32 goal, Uint32 max, Uint32 *count) {
+  ext2_info_t *ext2_info = mount->fs_data;
+  ext2_superblock_t *superblock = ext2_info->superblock;
+  ext2_blockdescriptor_t *descriptor;
+  Uint32 goal_group, goal_bit, group, bits, run, i;
+  int found;
+
+  if (goal < superblock->firstDataBlock || goal >= superblock->blockCount) goal = superblock->firstDataBlock;
+  goal_group = (goal - superblock->firstDataBlock) / superblock->blocksInGroupCount;
+  goal_bit = (goal - superblock->firstDataBlock) % superblock->blocksInGroupCount;
+
+  ext2_lock_alloc(mount);
+
+  // The goal group is visited twice, the last time for the blocks in front of the goal
+  for (i=0; i<=ext2_info->group_count; i++) {
+    group = (goal_group + i) % ext2_info->group_count;
+    descriptor = &ext2_info->block_descriptor[group];
+    if (descriptor->unallocatedBlockCount == 0) continue;
+
+    // The last group can be smaller
+    bits = superblock->blockCount - superblock->firstDataBlock - group * superblock->blocksInGroupCount;
+    if (bits > superblock->blocksInGroupCount) bits = superblock->blocksInGroupCount;
+
+    found = ext2_bitmap_find(mount, descriptor->blockUsageBitmapAddress, (i == 0) ? goal_bit : 0, bits, max, &run);
+    if (found == -1) continue;
+
+    if (! ext2_bitmap_update(mount, descriptor->blockUsageBitmapAddress, found, run, 1)) {
+      ext2_unlock_alloc(mount);
+      return 0;
+    }
+
+    descriptor->unallocatedBlockCount -= run;
+    superblock->unallocatedBlockCount -= run;
+    ext2_write_group_descriptor(mount, group);
+    ext2_write_superblock(mount);
+    ext2_unlock_alloc(mount);
+
+    *count = run;
+    return superblock->firstDataBlock + group * superblock->blocksInGroupCount + found;
+  }
+
+  ext2_unlock_alloc(mount);
+  kprintf ("Ext2: no free blocks on device %d:%d\n", mount->dev->major_num, mount->dev->minor_num);
+  return 0;
+}
+
+
+/**
+ * Frees count blocks starting at block. The blocks must be inside a single group.
+ */
+void ext2_free_blocks(struct vfs_mount *mount, Uint32 block, Uint32 count) {
+  ext2_info_t *ext2_info = mount->fs_data;
+  ext2_superblock_t *superblock = ext2_info->superblock;
+
+  Uint32 group = (block - superblock->firstDataBlock) / superblock->blocksInGroupCount;
+  Uint32 bit = (block - superblock->firstDataBlock) % superblock->blocksInGroupCount;
+  ext2_blockdescriptor_t *descriptor = &ext2_info->block_descriptor[group];
+
+  ext2_lock_alloc(mount);
+  if (ext2_bitmap_update(mount, descriptor->blockUsageBitmapAddress, bit, count, 0)) {
+    descriptor->unallocatedBlockCount += count;
+    superblock->unallocatedBlockCount += count;
+    ext2_write_group_descriptor(mount, group);
+    ext2_write_superblock(mount);
+  }
+  ext2_unlock_alloc(mount);
+}
+
+
+/**
+ * Allocates an inode, preferably in the group of the parent inode
+ *
+ * @return inode number, or 0 when there are no free inodes
+ */
+Uint32 ext2_alloc_inode(struct vfs_mount *mount, Uint32 parent_inode_nr) {
+  ext2_info_t *ext2_info = mount->fs_data;
+  ext2_superblock_t *superblock = ext2_info->superblock;
+  ext2_blockdescriptor_t *descriptor;
+  Uint32 parent_group, group, run, i;
+  int found;
+
+  parent_group = (parent_inode_nr - 1) / superblock->inodesInGroupCount;
+
+  ext2_lock_alloc(mount);
+  for (i=0; i!=ext2_info->group_count; i++) {
+    group = (parent_group + i) % ext2_info->group_count;
+    descriptor = &ext2_info->block_descriptor[group];
+    if (descriptor->unallocatedInodeCount == 0) continue;
+
+    // The first inodes of group 0 are reserved
+    found = ext2_bitmap_find(mount, descriptor->inodeUsageBitmapAddress, (group == 0) ? ext2_info->first_inode - 1 : 0, superblock->inodesInGroupCount, 1, &run);
+    if (found == -1) continue;
+
+    if (! ext2_bitmap_update(mount, descriptor->inodeUsageBitmapAddress, found, 1, 1)) {
+      ext2_unlock_alloc(mount);
+      return 0;
+    }
+
+    descriptor->unallocatedInodeCount--;
+    superblock->unalloactedInodeCount--;
+    ext2_write_group_descriptor(mount, group);
+    ext2_write_superblock(mount);
+    ext2_unlock_alloc(mount);
+
+    return group * superblock->inodesInGroupCount + found + 1;
+  }
+
+  ext2_unlock_alloc(mount);
+  kprintf ("Ext2: no free inodes on device %d:%d\n", mount->dev->major_num, mount->dev->minor_num);
+  return 0;
+}
+
+
+/**
+ * Frees an inode in the inode bitmap
+ */
+void ext2_free_inode(struct vfs_mount *mount, Uint32 inode_nr) {
+  ext2_info_t *ext2_info = mount->fs_data;
+  ext2_superblock_t *superblock = ext2_info->superblock;
+
+  Uint32 group = (inode_nr - 1) / superblock->inodesInGroupCount;
+  ext2_blockdescriptor_t *descriptor = &ext2_info->block_descriptor[group];
+
+  ext2_lock_alloc(mount);
+  if (ext2_bitmap_update(mount, descriptor->inodeUsageBitmapAddress, (inode_nr - 1) % superblock->inodesInGroupCount, 1, 0)) {
+    descriptor->unallocatedInodeCount++;
+    superblock->unalloactedInodeCount++;
+    ext2_write_group_descriptor(mount, group);
+    ext2_write_superblock(mount);
+  }
+  ext2_unlock_alloc(mount);
+}
+
+
+/**
+ * Gives the preallocated blocks of an inode back to the bitmap
+ */
+void ext2_discard_prealloc(struct vfs_mount *mount, ext2_cached_inode_t *cached) {
+  if (cached->prealloc_count == 0) return;
+
+  ext2_free_blocks(mount, cached->prealloc_block, cached->prealloc_count);
+  cached->prealloc_count = 0;
+}
+
+
+/**
+ * Allocates a block for a file near goal. Blocks come from the preallocation of the
+ * inode, which is refilled with a run of contiguous blocks when it's empty. Streaming
+ * writes end up contiguous on disk that way.
+ *
+ * @return block number or 0 when the disk is full
+ */
+Uint32 ext2_new_block(struct vfs_mount *mount, ext2_inode_t *inode, Uint32 goal) {
+  ext2_cached_inode_t *cached = (ext2_cached_inode_t *)inode;
+  Uint32 count;
+
+  // A goal right in front of the preallocation is fine too, an indirect block took its place then
+  if (cached->prealloc_count && goal != cached->prealloc_block && goal + 1 != cached->prealloc_block) {
+    ext2_discard_prealloc(mount, cached);
+  }
+
+  if (cached->prealloc_count == 0) {
+    cached->prealloc_block = ext2_alloc_blocks(mount, goal, EXT2_PREALLOC_BLOCKS, &count);
+    if (cached->prealloc_block == 0) return 0;
+    cached->prealloc_count = count;
+  }
+
+  cached->prealloc_count--;
+  return cached->prealloc_block++;
+}
+
+
+/**
+ * Stores block as disk block of a branch of the block map. Depth is 0 for a data block,
+ * 1 for a single indirect block etc. Missing indirect blocks are allocated.
+ *
+ * @return 1 on success, 0 on error
+ */
+int ext2_set_branch(struct vfs_mount *mount, ext2_inode_t *inode, Uint32 *pointer, int depth, Uint32 index, Uint32 block) {
+  ext2_info_t *ext2_info = mount->fs_data;
+  Uint32 per_block = ext2_info->block_size / sizeof(Uint32);
+  Uint32 span = 1;
+  Uint32 child, old_child, indirect;
+  int i;
+
+  if (depth == 0) {
+    *pointer = block;
+    return 1;
+  }
+
+  if (*pointer == 0) {
+    indirect = ext2_new_block(mount, inode, block);
+    if (indirect == 0) return 0;
+
+    if (! ext2_zero(mount, ext2_block2diskoffset(mount, indirect), ext2_info->block_size)) {
+      ext2_free_blocks(mount, indirect, 1);
+      return 0;
+    }
+    inode->sectorCount += ext2_info->block_size / 512;
+    *pointer = indirect;
+  }
+
+  // Number of blocks below every entry of this indirect block
+  for (i=1; i!=depth; i++) span *= per_block;
+
+  child = old_child = ext2_read_block_pointer(mount, *pointer, index / span);
+  if (! ext2_set_branch(mount, inode, &child, depth - 1, index % span, block)) return 0;
+
+  if (child != old_child && bcache_write(mount->dev, ext2_block2diskoffset(mount, *pointer) + (index / span) * sizeof(Uint32), sizeof(Uint32), (char *)&child) != sizeof(Uint32)) return 0;
+  return 1;
+}
+
+
+/**
+ * Stores block as the disk block for block index of a file. The inode must be written
+ * by the caller.
+ *
+ * @return 1 on success, 0 on error
+ */
+int ext2_set_file_block(struct vfs_mount *mount, ext2_inode_t *inode, Uint32 index, Uint32 block) {
+  ext2_info_t *ext2_info = mount->fs_data;
+  Uint32 per_block = ext2_info->block_size / sizeof(Uint32);
+
+  if (index < 12) {
+    inode->directPointerBlock[index] = block;
+    return 1;
+  }
+  index -= 12;
+
+  if (index < per_block) return ext2_set_branch(mount, inode, &inode->singleIndirectPointerBlock, 1, index, block);
+  index -= per_block;
+
+  if (index < per_block * per_block) return ext2_set_branch(mount, inode, &inode->doubleIndirectPointerBlock, 2, index, block);
+  index -= per_block * per_block;
+
+  return ext2_set_branch(mount, inode, &inode->tripleIndirectPointerBlock, 3, index, block);
+}
+
+
+/**
+ * Allocates a new disk block for block index of a file, right behind the previous block
+ * of the file or at the start of the inode's group.
+ *
+ * @return block number or 0 on error
+ */
+Uint32 ext2_alloc_file_block(struct vfs_mount *mount, ext2_inode_t *inode, Uint32 index) {
+  ext2_info_t *ext2_info = mount->fs_data;
+  ext2_cached_inode_t *cached = (ext2_cached_inode_t *)inode;
+  Uint32 goal = 0, block;
+
+  if (index > 0) goal = ext2_get_file_block(mount, inode, index - 1);
+  if (goal) {
+    goal++;
+  } else {
+    goal = ext2_info->superblock->firstDataBlock + ((cached->inode_nr - 1) / ext2_info->superblock->inodesInGroupCount) * ext2_info->superblock->blocksInGroupCount;
+  }
+
+  block = ext2_new_block(mount, inode, goal);
+  if (block == 0) return 0;
+
+  if (! ext2_set_file_block(mount, inode, index, block)) {
+    ext2_free_blocks(mount, block, 1);
+    return 0;
+  }
+
+  inode->sectorCount += ext2_info->block_size / 512;
+  return block;
+}
+
+
+
+
+
+
+
+
+
+
+/**
+ * Called when a device that holds a EXT2 image gets mounted onto a mount_point
+ */
+vfs_node_t *ext2_mount (struct vfs_mount *mount, device_t *dev, const char *path) {
+  //  kprintf ("fat12_mount\n");
+
+  // Create infoblock for this mount
+  mount->fs_data = kmalloc (sizeof (ext2_info_t));
+  if (!mount->fs_data) goto cleanup;
+  ext2_info_t *ext2_info = mount->fs_data;
+
+  // Load superblock
+  if (! (ext2_info->superblock = ext2_allocate_and_read_offset(mount, 1024, 1024))) goto cleanup;
+
+
+  // Check filesystem
+  if (ext2_info->superblock->filesystemState == 2) {
+    switch(ext2_info->superblock->errorHandling) {
+      case 1 :
+                kprintf("Warning: EXT2 filesystem has errors.\n");
+                break;
+      case 2 :
+                kpanic("Remounting EXT2 filesystem in RO mode (but this is not yet implemented\n");
+                break;
+      case 3 :
+      default :
+                kpanic("EXT2 filesystem has errors\n");
+                break;
+    }
+
+  }
+
+  // Precalc some values
+  ext2_info->block_size = 1024 << ext2_info->superblock->blockSizeLog2;
+  ext2_info->group_descriptor_count = ext2_info->superblock->firstDataBlock + 1;
+  ext2_info->group_count = ext2_info->superblock->inodeCount / ext2_info->superblock->inodesInGroupCount;
+  ext2_info->sectors_per_block = ext2_info->block_size / IDE_SECTOR_SIZE ;
+  ext2_info->first_group_start = ext2_info->group_descriptor_count + ext2_info->sectors_per_block;
+
+  // Revision 1 and up have an extended superblock right after the base superblock
+  ext2_info->superblock_ext = NULL;
+  if (ext2_info->superblock->versionMajor >= 1) {
+    ext2_info->superblock_ext = (ext2_superblock_extended_t *)((char *)ext2_info->superblock + sizeof(ext2_superblock_t));
+  }
+
+  // Revision 0 always has 128 byte inodes, later revisions store the size in the superblock
+  ext2_info->inode_size = ext2_info->superblock_ext ? ext2_info->superblock_ext->inodeSize : 128;
+  ext2_info->first_inode = ext2_info->superblock_ext ? ext2_info->superblock_ext->firstNonReservedInode : 11;
+
+  ext2_info->alloc_busy = 0;
+  sched_init_waitqueue (&ext2_info->alloc_wait);
+
+  // Load other blocks that are needed a lot
+  // The group descriptor table starts in the block after the superblock (block 2 for 1KB blocks, block 1 otherwise)
+  Uint32 descriptor_size = ext2_info->group_count * sizeof(ext2_blockdescriptor_t);
+  descriptor_size = (descriptor_size + ext2_info->block_size - 1) / ext2_info->block_size * ext2_info->block_size;
+  ext2_info->descriptor_offset = (ext2_info->superblock->firstDataBlock + 1) * ext2_info->block_size;
+  if (! (ext2_info->block_descriptor = ext2_allocate_and_read_offset(mount, ext2_info->descriptor_offset, descriptor_size))) goto cleanup;
+
+  // Create and return root node
+  ext2_inode_t *inode = ext2_read_inode(mount, EXT2_ROOT_INO);
+  if (! inode) goto cleanup;
+  ext2_supernode.length = inode->sizeLow;
+  ext2_supernode.mount = mount;
+  ext2_release_inode(inode);
+  return &ext2_supernode;
+
+cleanup:
+  // Things went wrong when we are here. Do a cleanup
+  if (ext2_info->block_descriptor) kfree (ext2_info->block_descriptor);
+  if (ext2_info->superblock) kfree (ext2_info->superblock);
+  if (ext2_info) kfree (ext2_info);
+  return NULL;
+}
+
+
+/**
+ * Called when a mount_point gets unmounted
+ */
+void ext2_umount (struct vfs_mount *mount) {
+  ext2_info_t *ext2_info = (ext2_info_t *)mount->fs_data;
+  int i;
+
+  // Give back the blocks that are reserved but never used
+  for (i=0; i!=EXT2_INODE_CACHE_SIZE; i++) {
+    if (ext2_inode_cache[i].mount == mount) ext2_discard_prealloc(mount, &ext2_inode_cache[i]);
+  }
+
+  // Cached inodes are of no use anymore
+  ext2_inode_cache_invalidate(mount);
+
+  // Free up info
+  if (ext2_info->superblock) kfree (ext2_info->superblock);
+  if (ext2_info->block_descriptor) kfree (ext2_info->block_descriptor);
+  kfree (ext2_info);
+}
+
+
+
+/**
+ *
+ */
+Uint32 ext2_read (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer) {
+  ext2_info_t *ext2_info = node->mount->fs_data;
+  Uint32 count = 0;
+  Uint32 index, block_offset, block, blocks, len;
+
+  // We do need nothing to read
+  if (size == 0) return 0;
+
+  ext2_inode_t *inode = ext2_read_inode(node->mount, node->inode_nr);
+  if (! inode) return 0;
+
+  // Cannot read behind file length
+  Uint64 length = ext2_inode_size(inode);
+  if (offset >= length) {
+    ext2_release_inode(inode);
+    return 0;
+  }
+
+  // We can only read X amount of bytes, so adjust maximum size
+  if ((Uint64)offset + size > length) size = (Uint32)(length - offset);
+
+  while (count != size) {
+    index = (offset + count) / ext2_info->block_size;
+    block_offset = (offset + count) % ext2_info->block_size;
+
+    if (block_offset != 0 || size - count < ext2_info->block_size) {
+      // Partial block, goes through the buffer cache
+      len = ext2_info->block_size - block_offset;
+      if (len > size - count) len = size - count;
+
+      block = ext2_map_blocks(node->mount, inode, index, 1, &blocks);
+      if (block == 0) {
+        memset(buffer + count, 0, len);
+      } else if (bcache_read(node->mount->dev, ext2_block2diskoffset(node->mount, block) + block_offset, len, buffer + count) != len) {
+        break;
+      }
+
+    } else {
+      // Whole blocks. A run of blocks that are contiguous on disk is read in one go.
+      block = ext2_map_blocks(node->mount, inode, index, (size - count) / ext2_info->block_size, &blocks);
+      len = blocks * ext2_info->block_size;
+      if (block == 0) {
+        memset(buffer + count, 0, len);
+      } else if (bcache_read_uncached(node->mount->dev, ext2_block2diskoffset(node->mount, block), len, buffer + count) != len) {
+        break;
+      }
+    }
+
+    count += len;
+  }
+
+  ext2_release_inode(inode);
+  return count;
+}
+
+/**
+ * Reads a part of a file into the buffer cache. Blocks that are contiguous on disk
+ * are handed to the cache as one run. Holes have nothing to read.
+ */
+void ext2_readahead(vfs_node_t *node, Uint32 offset, Uint32 size) {
+  ext2_info_t *ext2_info = node->mount->fs_data;
+  Uint32 index, last, block, blocks;
+
+  if (size == 0) return;
+
+  ext2_inode_t *inode = ext2_read_inode(node->mount, node->inode_nr);
+  if (! inode) return;
+
+  index = offset / ext2_info->block_size;
+  last = (offset + size - 1) / ext2_info->block_size;
+  while (index <= last) {
+    block = ext2_map_blocks(node->mount, inode, index, last - index + 1, &blocks);
+    if (block != 0) bcache_readahead(node->mount->dev, ext2_block2diskoffset(node->mount, block), blocks * ext2_info->block_size);
+    index += blocks;
+  }
+
+  ext2_release_inode(inode);
+}
+
+/**
+ * Writes to a regular file. Holes and blocks past the end of the file are allocated,
+ * the file grows when data is written past its end.
+ *
+ * @return number of bytes written
+ */
+Uint32 ext2_write (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer) {
+  ext2_info_t *ext2_info = node->mount->fs_data;
+  Uint32 count = 0;
+  Uint32 index, block_offset, block, blocks, len;
+
+  // Offsets are 32 bits, so files cannot grow beyond 4GB
+  if ((Uint64)offset + size > 0xFFFFFFFF) size = 0xFFFFFFFF - offset;
+  if (size == 0) return 0;
+
+  ext2_inode_t *inode = ext2_read_inode(node->mount, node->inode_nr);
+  if (! inode) return 0;
+
+  if ((inode->typeAndPermissions & EXT2_S_IFMT) != EXT2_S_IFREG) {
+    ext2_release_inode(inode);
+    return 0;
+  }
+
+  while (count != size) {
+    index = (offset + count) / ext2_info->block_size;
+    block_offset = (offset + count) % ext2_info->block_size;
+    len = ext2_info->block_size - block_offset;
+    if (len > size - count) len = size - count;
+
+    block = ext2_map_blocks(node->mount, inode, index, 1, &blocks);
+    if (block == 0) {
+      block = ext2_alloc_file_block(node->mount, inode, index);
+      if (block == 0) break;
+
+      // The parts of a new block that we do not write must read as zeros
+      if (len != ext2_info->block_size && ! ext2_zero(node->mount, ext2_block2diskoffset(node->mount, block), ext2_info->block_size)) break;
+    }
+
+    if (bcache_write(node->mount->dev, ext2_block2diskoffset(node->mount, block) + block_offset, len, buffer + count) != len) break;
+    count += len;
+  }
+
+  // File has grown
+  if ((Uint64)offset + count > ext2_inode_size(inode)) {
+    inode->sizeLow = offset + count;
+
+    // Files of 2GB and larger need a feature flag so older implementations leave them alone
+    if (inode->sizeLow >= 0x80000000 && ext2_info->superblock_ext &&
+        ! (ext2_info->superblock_ext->readonlyFeatures & EXT2_FEATURE_RO_COMPAT_LARGE_FILE)) {
+      ext2_info->superblock_ext->readonlyFeatures |= EXT2_FEATURE_RO_COMPAT_LARGE_FILE;
+      ext2_write_superblock(node->mount);
+    }
+  }
+
+  ext2_write_inode(inode);
+  ext2_release_inode(inode);
+  return count;
+}
+
+
+/**
+ * Frees the blocks of a branch of the block map, starting at block index first inside
+ * the branch. Depth is 0 for a data block, 1 for a single indirect block etc. The
+ * pointer to the branch is cleared when everything below it is freed.
+ */
+void ext2_truncate_branch(struct vfs_mount *mount, ext2_inode_t *inode, Uint32 *pointer, int depth, Uint32 first) {
+  ext2_info_t *ext2_info = mount->fs_data;
+  Uint32 per_block = ext2_info->block_size / sizeof(Uint32);
+  Uint32 span = 1;
+  Uint32 i, child, old_child;
+
+  if (*pointer == 0) return;
+
+  if (depth > 0) {
+    // Number of blocks below every entry of this indirect block
+    for (i=1; i!=depth; i++) span *= per_block;
+
+    for (i = first / span; i != per_block; i++) {
+      child = old_child = ext2_read_block_pointer(mount, *pointer, i);
+      ext2_truncate_branch(mount, inode, &child, depth - 1, (i == first / span) ? first % span : 0);
+      if (child != old_child) bcache_write(mount->dev, ext2_block2diskoffset(mount, *pointer) + i * sizeof(Uint32), sizeof(Uint32), (char *)&child);
+    }
+
+    // Part of the indirect block is still in use
+    if (first != 0) return;
+  }
+
+  ext2_free_blocks(mount, *pointer, 1);
+  inode->sectorCount -= ext2_info->block_size / 512;
+  *pointer = 0;
+}
+
+
+/**
+ * Sets the length of a regular file. Blocks behind the new length are freed. Growing a
+ * file leaves a hole that reads as zeros.
+ *
+ * @return 1 on success, 0 on error
+ */
+int ext2_truncate (vfs_node_t *node, Uint32 length) {
+  ext2_info_t *ext2_info = node->mount->fs_data;
+  Uint32 per_block = ext2_info->block_size / sizeof(Uint32);
+  Uint32 first, base, capacity, block, i;
+  Uint32 *pointer[3];
+
+  ext2_inode_t *inode = ext2_read_inode(node->mount, node->inode_nr);
+  if (! inode) return 0;
+
+  if ((inode->typeAndPermissions & EXT2_S_IFMT) != EXT2_S_IFREG) {
+    ext2_release_inode(inode);
+    return 0;
+  }
+
+  // Reserved blocks and the cached block map might point behind the new end
+  ext2_discard_prealloc(node->mount, (ext2_cached_inode_t *)inode);
+  ((ext2_cached_inode_t *)inode)->map_count = 0;
+
+  // First file block that is not needed anymore
+  first = length / ext2_info->block_size + ((length % ext2_info->block_size) ? 1 : 0);
+
+  for (i=first; i<12; i++) ext2_truncate_branch(node->mount, inode, &inode->directPointerBlock[i], 0, 0);
+
+  pointer[0] = &inode->singleIndirectPointerBlock;
+  pointer[1] = &inode->doubleIndirectPointerBlock;
+  pointer[2] = &inode->tripleIndirectPointerBlock;
+  base = 12;
+  capacity = per_block;
+  for (i=0; i!=3; i++) {
+    if (first < base + capacity) ext2_truncate_branch(node->mount, inode, pointer[i], i + 1, (first > base) ? first - base : 0);
+    base += capacity;
+    capacity *= per_block;
+  }
+
+  // Clear the rest of the last block, so the old data does not show up when the file grows again
+  if (length % ext2_info->block_size && length < ext2_inode_size(inode)) {
+    block = ext2_get_file_block(node->mount, inode, length / ext2_info->block_size);
+    if (block) ext2_zero(node->mount, ext2_block2diskoffset(node->mount, block) + length % ext2_info->block_size, ext2_info->block_size - length % ext2_info->block_size);
+  }
+
+  inode->sizeLow = length;
+  inode->sizeHigh = 0;
+
+  int ret = ext2_write_inode(inode);
+  ext2_release_inode(inode);
+  return ret;
+}
+
+
 /**
- * Read inode from disk
+ * Tries to place a new entry inside a single directory block, using the unused space
+ * at the end of one of the entries.
  *
- * NOTE, you need to free this inode!
- *
- * @param mount
- * @param inode_nr
- * @return
+ * @return 1 when the entry is added, 0 when there is no room, -1 on error
  */
-ext2_inode_t *ext2_read_inode(struct vfs_mount *mount, Uint32 inode_nr) {
+int ext2_add_entry_to_block(struct vfs_mount *mount, Uint32 block, const char *name, int namelen, Uint32 inode_nr, Uint8 file_type) {
   ext2_info_t *ext2_info = mount->fs_data;
+  ext2_dir_t ext2_dir;
+  Uint32 offset = 0;
+  Uint32 used, rec_len;
+  Uint32 needed = (sizeof(ext2_dir_t) + namelen + 3) & ~3;
+
+  Uint64 disk_offset = ext2_block2diskoffset(mount, block);
+
+  while (offset + sizeof(ext2_dir_t) <= ext2_info->block_size) {
+    if (bcache_read(mount->dev, disk_offset + offset, sizeof(ext2_dir_t), (char *)&ext2_dir) != sizeof(ext2_dir_t)) return -1;
+
+    // Corrupt entry, do not loop forever
+    if (ext2_dir.rec_len == 0 || offset + ext2_dir.rec_len > ext2_info->block_size) return -1;
+
+    // Unused entries (inode 0) can be taken completely
+    used = (ext2_dir.inode_nr != 0) ? (sizeof(ext2_dir_t) + ext2_dir.name_len + 3) & ~3 : 0;
+
+    if (ext2_dir.rec_len - used >= needed) {
+      rec_len = ext2_dir.rec_len - used;
+
+      // Shrink the current entry, the new one takes the rest of its space
+      if (used) {
+        ext2_dir.rec_len = used;
+        if (bcache_write(mount->dev, disk_offset + offset, sizeof(ext2_dir_t), (char *)&ext2_dir) != sizeof(ext2_dir_t)) return -1;
+        offset += used;
+      }
+
+      ext2_dir.inode_nr = inode_nr;
+      ext2_dir.rec_len = rec_len;
+      ext2_dir.name_len = namelen;
+      ext2_dir.file_type = file_type;
+      if (bcache_write(mount->dev, disk_offset + offset, sizeof(ext2_dir_t), (char *)&ext2_dir) != sizeof(ext2_dir_t)) return -1;
+      if (bcache_write(mount->dev, disk_offset + offset + sizeof(ext2_dir_t), namelen, (char *)name) != namelen) return -1;
+      return 1;
+    }
 
-  // Check if inode number is correct
-  if (! inode_nr || inode_nr > ext2_info->superblock->inodeCount) {
-    kprintf ("Incorrect inode number");
-    return NULL;
+    offset += ext2_dir.rec_len;
   }
 
-  // Find the blockgroup in which this inode resides
-  Uint32 block_group = (inode_nr - 1) / ext2_info->superblock->inodesInGroupCount;
-  if (block_group > ext2_info->group_descriptor_count) return NULL;
-
-  // @TODO: Inode size must be checked from superblock (version 1+)
+  return 0;
+}
 
-  // We will only read 1 block: the block that has actually got our inode data
-  Uint32 inodes_per_block = ext2_info->block_size / 128;
-  Uint32 block_offset = ((inode_nr - 1) % ext2_info->superblock->inodesInGroupCount) / inodes_per_block;
 
-  // Find the actual start of inodes in this group
-  ext2_blockdescriptor_t *group_descriptor = &ext2_info->block_descriptor[block_group];
-  Uint32 inode_block = group_descriptor->inodeTableStart + block_offset;
+/**
+ * Adds an entry to a directory. The caller must write the directory inode afterwards,
+ * since its size, flags and blocks can change.
+ *
+ * @return 1 on success, 0 on error
+ */
+int ext2_add_dir_entry(struct vfs_mount *mount, ext2_inode_t *dir, const char *name, int namelen, Uint32 inode_nr, Uint8 file_type) {
+  ext2_info_t *ext2_info = mount->fs_data;
+  ext2_dir_t ext2_dir;
+  Uint32 i, block;
+  int ret;
+
+  // Only filesystems with the filetype feature store the type, others use it as high byte of the name length
+  if (! (ext2_info->superblock_ext && (ext2_info->superblock_ext->requiredFeatures & EXT2_FEATURE_INCOMPAT_FILETYPE))) file_type = EXT2_FT_UNKNOWN;
+
+  // Indexed directories need the entry inside the leaf its hash belongs to
+  if (dir->flags & EXT2_INDEX_FL) {
+    block = ext2_htree_leaf(mount, dir, name, namelen);
+    if (block) {
+      ret = ext2_add_entry_to_block(mount, block, name, namelen, inode_nr, file_type);
+      if (ret != 0) return (ret == 1);
+    }
 
-  // Find the offset of the inode inside the block
-  Uint32 inode_index = (((inode_nr - 1) % ext2_info->superblock->inodesInGroupCount) % inodes_per_block) * 128;
+    // @TODO: Full leaves are not split. Drop the index, the directory is still valid without it.
+    dir->flags &= ~EXT2_INDEX_FL;
+  }
 
+  // Find room in one of the existing blocks
+  for (i=0; i!=dir->sizeLow / ext2_info->block_size; i++) {
+    block = ext2_get_file_block(mount, dir, i);
+    if (block == 0) continue;
 
-  // Read the block that holds our inode
-  char *data_block;
-  if (! (data_block = ext2_allocate_and_read_block(mount, inode_block, 1))) {
-    kprintf ("Error: could not read inode from device %d:%d", mount->dev->major_num, mount->dev->minor_num);
-    return NULL;
+    ret = ext2_add_entry_to_block(mount, block, name, namelen, inode_nr, file_type);
+    if (ret == 1) return 1;
+    if (ret == -1) return 0;
   }
 
-  // Read inode entry from block
-  ext2_inode_t *inode = (ext2_inode_t *)kmalloc(sizeof(ext2_inode_t));
-  memcpy(inode, (char *)data_block+inode_index, sizeof(ext2_inode_t));
+  // No room, add a block to the directory that holds only this entry
+  block = ext2_alloc_file_block(mount, dir, dir->sizeLow / ext2_info->block_size);
+  ext2_discard_prealloc(mount, (ext2_cached_inode_t *)dir);
+  if (block == 0) return 0;
 
-  // Free data block
-  kfree(data_block);
+  if (! ext2_zero(mount, ext2_block2diskoffset(mount, block), ext2_info->block_size)) return 0;
 
-  // And return
-  return inode;
-}
+  ext2_dir.inode_nr = inode_nr;
+  ext2_dir.rec_len = ext2_info->block_size;
+  ext2_dir.name_len = namelen;
+  ext2_dir.file_type = file_type;
+  if (bcache_write(mount->dev, ext2_block2diskoffset(mount, block), sizeof(ext2_dir_t), (char *)&ext2_dir) != sizeof(ext2_dir_t)) return 0;
+  if (bcache_write(mount->dev, ext2_block2diskoffset(mount, block) + sizeof(ext2_dir_t), namelen, (char *)name) != namelen) return 0;
 
+  dir->sizeLow += ext2_info->block_size;
+  return 1;
+}
 
 
+/**
+ * Creates an empty regular file inside the directory node and fills target_node with it
+ *
+ * @return 1 on success, 0 on error (or when the name already exists)
+ */
+int ext2_create (vfs_node_t *node, const char *name, vfs_node_t *target_node) {
+  ext2_info_t *ext2_info = node->mount->fs_data;
+  ext2_inode_t *dir, *inode;
+  Uint32 inode_nr;
 
+  // Check if it's a directory
+  if ((node->flags & 0x7) != FS_DIRECTORY) return 0;
 
+  int namelen = strlen(name);
+  if (namelen == 0 || namelen > 255) return 0;
 
+  if (ext2_finddir(node, name, target_node)) return 0;
 
+  dir = ext2_read_inode(node->mount, node->inode_nr);
+  if (! dir) return 0;
 
+  // Place the inode close to the directory
+  inode_nr = ext2_alloc_inode(node->mount, node->inode_nr);
+  if (! inode_nr) goto cleanup;
 
+  // Inodes can be larger than our structure, clear all of it
+  if (! ext2_zero(node->mount, ext2_inode_diskoffset(node->mount, inode_nr), ext2_info->inode_size)) goto cleanup_inode;
 
-/**
- * Called when a device that holds a EXT2 image gets mounted onto a mount_point
- */
-vfs_node_t *ext2_mount (struct vfs_mount *mount, device_t *dev, const char *path) {
-  //  kprintf ("fat12_mount\n");
+  inode = ext2_read_inode(node->mount, inode_nr);
+  if (! inode) goto cleanup_inode;
 
-  // Create infoblock for this mount
-  mount->fs_data = kmalloc (sizeof (ext2_info_t));
-  if (!mount->fs_data) goto cleanup;
-  ext2_info_t *ext2_info = mount->fs_data;
+  memset(inode, 0, sizeof(ext2_inode_t));
+  inode->typeAndPermissions = EXT2_S_IFREG | EXT2_S_IRUSR | EXT2_S_IWUSR | EXT2_S_IRGRP | EXT2_S_IROTH;
+  inode->linkCount = 1;
+  ext2_write_inode(inode);
+  ext2_release_inode(inode);
 
-  // Load superblock
-  if (! (ext2_info->superblock = ext2_allocate_and_read_offset(mount, 1024, 1024))) goto cleanup;
+  if (! ext2_add_dir_entry(node->mount, dir, name, namelen, inode_nr, EXT2_FT_REG_FILE)) goto cleanup_inode;
+  ext2_write_inode(dir);
+  ext2_release_inode(dir);
 
+  // Copy node info into new node
+  memcpy (target_node, node, sizeof (vfs_node_t));
+  target_node->inode_nr = inode_nr;
+  strncpy((char *)target_node->name, name, sizeof(target_node->name) - 1);
+  target_node->name[sizeof(target_node->name) - 1] = 0;
+  target_node->owner = 0;
+  target_node->length = 0;
+  target_node->flags = FS_FILE;
 
-  // Check filesystem
-  if (ext2_info->superblock->filesystemState == 2) {
-    switch(ext2_info->superblock->errorHandling) {
-      case 1 :
-                kprintf("Warning: EXT2 filesystem has errors.\n");
-                break;
-      case 2 :
-                kpanic("Remounting EXT2 filesystem in RO mode (but this is not yet implemented\n");
-                break;
-      case 3 :
-      default :
-                kpanic("EXT2 filesystem has errors\n");
-                break;
-    }
+  return 1;
 
-  }
+cleanup_inode:
+  ext2_free_inode(node->mount, inode_nr);
+cleanup:
+  ext2_write_inode(dir);
+  ext2_release_inode(dir);
+  return 0;
+}
 
-  // Precalc some values
-  ext2_info->block_size = 1024 << ext2_info->superblock->blockSizeLog2;
-  ext2_info->group_descriptor_count = ext2_info->superblock->firstDataBlock + 1;
-  ext2_info->group_count = ext2_info->superblock->inodeCount / ext2_info->superblock->inodesInGroupCount;
-  ext2_info->sectors_per_block = ext2_info->block_size / IDE_SECTOR_SIZE ;
-  ext2_info->first_group_start = ext2_info->group_descriptor_count + ext2_info->sectors_per_block;
+/**
+ *
+ */
+void ext2_open (vfs_node_t *node) {
+  // The node might come from the path cache, so take the current length from the inode
+  ext2_inode_t *inode = ext2_read_inode(node->mount, node->inode_nr);
+  if (! inode) return;
 
-  // Load other blocks that are needed a lot
-  if (! (ext2_info->block_descriptor = ext2_allocate_and_read_offset(mount, EXT2_BLOCKGROUPDESCRIPTOR_BLOCK * ext2_info->block_size, ext2_info->block_size))) goto cleanup;
+  node->length = (ext2_inode_size(inode) > 0xFFFFFFFF) ? 0xFFFFFFFF : inode->sizeLow;
+  ext2_release_inode(inode);
+}
 
-  // Create and return root node
-  ext2_inode_t *inode = ext2_read_inode(mount, EXT2_ROOT_INO);
-  ext2_supernode.length = inode->sizeLow;
-  ext2_supernode.mount = mount;
-  kfree(inode);
-  return &ext2_supernode;
+/**
+ *
+ */
+void ext2_close (vfs_node_t *node) {
+  // Blocks that were reserved for further writes are not needed anymore
+  ext2_inode_t *inode = ext2_read_inode(node->mount, node->inode_nr);
+  if (! inode) return;
 
-cleanup:
-  // Things went wrong when we are here. Do a cleanup
-  if (ext2_info->block_descriptor) kfree (ext2_info->block_descriptor);
-  if (ext2_info->superblock) kfree (ext2_info->superblock);
-  if (ext2_info) kfree (ext2_info);
-  return NULL;
+  ext2_discard_prealloc(node->mount, (ext2_cached_inode_t *)inode);
+  ext2_release_inode(inode);
 }
 
 
 /**
- * Called when a mount_point gets unmounted
+ * Initialises the ext2 on current drive
  */
-void ext2_umount (struct vfs_mount *mount) {
-  ext2_info_t *ext2_info = (ext2_info_t *)mount->fs_data;
+void ext2_init (void) {
+  // Setup inode cache
+  ext2_inode_cache_init();
 
-  // Free up info
-  if (ext2_info->superblock) kfree (ext2_info->superblock);
-  if (ext2_info->block_descriptor) kfree (ext2_info->block_descriptor);
-  kfree (ext2_info);
+  // Register file system to the VFS
+  vfs_register_filesystem (&ext2_vfs_info);
 }
 
 
 
 /**
- *
+ * Returns the block number stored at entry index of an indirect block, or 0 when there
+ * is no indirect block (a hole).
  */
-Uint32 ext2_read (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer) {
-  return 0;
-/*
-  ext2_superblock_t *superblock = node->mount->fs_data;
+Uint32 ext2_read_block_pointer(struct vfs_mount *mount, Uint32 block, Uint32 index) {
+  Uint32 pointer;
 
-  // We do need nothing to read
-  if (size == 0) return 0;
+  if (block == 0) return 0;
 
-  // Cannot read behind file length
-  if (offset > node->length) return 0;
+  Uint64 disk_offset = ext2_block2diskoffset(mount, block) + index * sizeof(Uint32);
+  if (bcache_read(mount->dev, disk_offset, sizeof(Uint32), (char *)&pointer) != sizeof(Uint32)) return 0;
+  return pointer;
+}
 
-  // We can only read X amount of bytes, so adjust maximum size
-  if (offset + size > node->length) {
-    kprintf ("Truncated size from %d\n", size);
-    size = node->length - offset;
-    kprintf ("to %d\n", size);
-  }
 
+/**
+ * Searches a single directory block for name.
+ *
+ * @return inode number of the entry, or 0 when it is not in this block
+ */
+Uint32 ext2_find_in_block(struct vfs_mount *mount, Uint32 block, const char *name, int namelen) {
+  ext2_info_t *ext2_info = mount->fs_data;
+  ext2_dir_t ext2_dir;
+  char entry_name[256];
+  Uint32 offset = 0;
+
+  Uint64 disk_offset = ext2_block2diskoffset(mount, block);
 
-  // Calculate disk offset
-  Uint32 disk_offset = (fat12_info->dataOffset+cluster) * fat12_info->bpb->SectorsPerCluster * fat12_info->bpb->BytesPerSector;
+  while (offset + sizeof(ext2_dir_t) <= ext2_info->block_size) {
+    if (bcache_read(mount->dev, disk_offset + offset, sizeof(ext2_dir_t), (char *)&ext2_dir) != sizeof(ext2_dir_t)) return 0;
 
+    // Corrupt entry, do not loop forever
+    if (ext2_dir.rec_len == 0) return 0;
 
-  // Read partial cluster
-  if (size + cluster_offset < 512) {
-//    kprintf ("Reading partial cluster\n");
-    // We do not cross a sector, only 1 sector is needed
-    node->mount->dev->read (node->mount->dev->major_num, node->mount->dev->minor_num, disk_offset + cluster_offset, size, buffer);
-//    kprintf ("Returing %d bytes read\n", size);
-    return size;
+    // Only read the name when it can match
+    if (ext2_dir.inode_nr != 0 && ext2_dir.name_len == namelen) {
+      if (bcache_read(mount->dev, disk_offset + offset + sizeof(ext2_dir_t), namelen, entry_name) != namelen) return 0;
+      if (strncmp(entry_name, name, namelen) == 0) return ext2_dir.inode_nr;
+    }
+
+    offset += ext2_dir.rec_len;
   }
 
+  return 0;
+}
 
-  // read intial half block
-  if (cluster_offset > 0) {
-//    kprintf ("Reading intial half cluster\n");
-    tmp = (cluster_size - cluster_offset);
-    disk_offset += 512-tmp;
-    node->mount->dev->read (node->mount->dev->major_num, node->mount->dev->minor_num, disk_offset, tmp, buf_ptr);
 
-    disk_offset += tmp;
-    buf_ptr += tmp;
-    count -= tmp;
+/**
+ * Converts the name to the hash input buffer. Names are padded with their length.
+ */
+void ext2_str2hashbuf(const char *name, int len, Uint32 *buf, int num, int unsigned_chars) {
+  Uint32 pad, val;
+  int i, c;
+
+  pad = (Uint32)len | ((Uint32)len << 8);
+  pad |= pad << 16;
+
+  val = pad;
+  if (len > num * 4) len = num * 4;
+  for (i=0; i!=len; i++) {
+    c = unsigned_chars ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+    val = c + (val << 8);
+    if ((i % 4) == 3) {
+      *buf++ = val;
+      val = pad;
+      num--;
+    }
   }
+  if (--num >= 0) *buf++ = val;
+  while (--num >= 0) *buf++ = pad;
+}
 
-  // read whole blocks
-  while (count > 512) {
-//    kprintf ("Reading whole cluster\n");
-    node->mount->dev->read (node->mount->dev->major_num, node->mount->dev->minor_num, disk_offset, 512, buf_ptr);
 
-    disk_offset += 512;
-    buf_ptr += 512;
-    count -= 512;
-  }
+// Half MD4 helpers
+#define EXT2_ROL32(x, s)          (((x) << (s)) | ((x) >> (32 - (s))))
+#define EXT2_MD4_F(x, y, z)       ((z) ^ ((x) & ((y) ^ (z))))
+#define EXT2_MD4_G(x, y, z)       (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define EXT2_MD4_H(x, y, z)       ((x) ^ (y) ^ (z))
+#define EXT2_MD4_ROUND(f, a, b, c, d, x, s)  (a += f(b, c, d) + x, a = EXT2_ROL32(a, s))
+#define EXT2_MD4_K2               013240474631UL
+#define EXT2_MD4_K3               015666365641UL
 
-  // read last half block
-  if (count > 0) {
-//    kprintf ("Reading final partial cluster\n");
-    tmp = count;
+/**
+ * Half MD4 transform as used by the htree (only 3 rounds of 8 steps)
+ */
+void ext2_half_md4_transform(Uint32 buf[4], Uint32 in[8]) {
+  Uint32 a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+  // Round 1
+  EXT2_MD4_ROUND(EXT2_MD4_F, a, b, c, d, in[0],  3);
+  EXT2_MD4_ROUND(EXT2_MD4_F, d, a, b, c, in[1],  7);
+  EXT2_MD4_ROUND(EXT2_MD4_F, c, d, a, b, in[2], 11);
+  EXT2_MD4_ROUND(EXT2_MD4_F, b, c, d, a, in[3], 19);
+  EXT2_MD4_ROUND(EXT2_MD4_F, a, b, c, d, in[4],  3);
+  EXT2_MD4_ROUND(EXT2_MD4_F, d, a, b, c, in[5],  7);
+  EXT2_MD4_ROUND(EXT2_MD4_F, c, d, a, b, in[6], 11);
+  EXT2_MD4_ROUND(EXT2_MD4_F, b, c, d, a, in[7], 19);
+
+  // Round 2
+  EXT2_MD4_ROUND(EXT2_MD4_G, a, b, c, d, in[1] + EXT2_MD4_K2,  3);
+  EXT2_MD4_ROUND(EXT2_MD4_G, d, a, b, c, in[3] + EXT2_MD4_K2,  5);
+  EXT2_MD4_ROUND(EXT2_MD4_G, c, d, a, b, in[5] + EXT2_MD4_K2,  9);
+  EXT2_MD4_ROUND(EXT2_MD4_G, b, c, d, a, in[7] + EXT2_MD4_K2, 13);
+  EXT2_MD4_ROUND(EXT2_MD4_G, a, b, c, d, in[0] + EXT2_MD4_K2,  3);
+  EXT2_MD4_ROUND(EXT2_MD4_G, d, a, b, c, in[2] + EXT2_MD4_K2,  5);
+  EXT2_MD4_ROUND(EXT2_MD4_G, c, d, a, b, in[4] + EXT2_MD4_K2,  9);
+  EXT2_MD4_ROUND(EXT2_MD4_G, b, c, d, a, in[6] + EXT2_MD4_K2, 13);
+
+  // Round 3
+  EXT2_MD4_ROUND(EXT2_MD4_H, a, b, c, d, in[3] + EXT2_MD4_K3,  3);
+  EXT2_MD4_ROUND(EXT2_MD4_H, d, a, b, c, in[7] + EXT2_MD4_K3,  9);
+  EXT2_MD4_ROUND(EXT2_MD4_H, c, d, a, b, in[2] + EXT2_MD4_K3, 11);
+  EXT2_MD4_ROUND(EXT2_MD4_H, b, c, d, a, in[6] + EXT2_MD4_K3, 15);
+  EXT2_MD4_ROUND(EXT2_MD4_H, a, b, c, d, in[1] + EXT2_MD4_K3,  3);
+  EXT2_MD4_ROUND(EXT2_MD4_H, d, a, b, c, in[5] + EXT2_MD4_K3,  9);
+  EXT2_MD4_ROUND(EXT2_MD4_H, c, d, a, b, in[0] + EXT2_MD4_K3, 11);
+  EXT2_MD4_ROUND(EXT2_MD4_H, b, c, d, a, in[4] + EXT2_MD4_K3, 15);
+
+  buf[0] += a;
+  buf[1] += b;
+  buf[2] += c;
+  buf[3] += d;
+}
 
-    node->mount->dev->read (node->mount->dev->major_num, node->mount->dev->minor_num, disk_offset, tmp, buf_ptr);
 
-    disk_offset += tmp;
-    buf_ptr += tmp;
-    count -= tmp;
+/**
+ * TEA transform as used by the htree
+ */
+void ext2_tea_transform(Uint32 buf[4], Uint32 in[4]) {
+  Uint32 sum = 0;
+  Uint32 b0 = buf[0], b1 = buf[1];
+  int n;
+
+  for (n=0; n!=16; n++) {
+    sum += 0x9E3779B9;
+    b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+    b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
   }
 
-  return size;
-*/
+  buf[0] += b0;
+  buf[1] += b1;
 }
 
+
 /**
- *
+ * The original (legacy) htree hash
  */
-Uint32 ext2_write (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer) {
-  return 0;
-//  return node->block->write (node->block->major, node->block->minor, offset, size, buffer);
+Uint32 ext2_legacy_hash(const char *name, int len, int unsigned_chars) {
+  Uint32 hash, hash0 = 0x12A3FE2D, hash1 = 0x37ABE8F9;
+  int c;
+
+  while (len--) {
+    c = unsigned_chars ? (int)(unsigned char)*name : (int)(signed char)*name;
+    name++;
+
+    hash = hash1 + (hash0 ^ (c * 7152373));
+    if (hash & 0x80000000) hash -= 0x7FFFFFFF;
+    hash1 = hash0;
+    hash0 = hash;
+  }
+  return hash0 << 1;
 }
 
+
 /**
- *
+ * Returns the htree hash of a name. The lowest bit is always cleared, since the index
+ * uses it to mark hash collisions that continue in the next block.
  */
-void ext2_open (vfs_node_t *node) {
-  // node->block->open (node->block->major, node->block->minor);
+Uint32 ext2_dirhash(struct vfs_mount *mount, int hash_version, const char *name, int len) {
+  ext2_info_t *ext2_info = mount->fs_data;
+  Uint32 buf[4], in[8];
+  Uint32 hash = 0;
+  int i;
+
+  // Default seed, unless the superblock has one
+  buf[0] = 0x67452301;
+  buf[1] = 0xEFCDAB89;
+  buf[2] = 0x98BADCFE;
+  buf[3] = 0x10325476;
+  if (ext2_info->superblock_ext) {
+    for (i=0; i!=4; i++) {
+      if (ext2_info->superblock_ext->hashSeed[i] == 0) continue;
+      memcpy(buf, ext2_info->superblock_ext->hashSeed, sizeof(buf));
+      break;
+    }
+  }
+
+  switch (hash_version) {
+    case EXT2_HASH_LEGACY :
+    case EXT2_HASH_LEGACY_UNSIGNED :
+              hash = ext2_legacy_hash(name, len, hash_version == EXT2_HASH_LEGACY_UNSIGNED);
+              break;
+    case EXT2_HASH_HALF_MD4 :
+    case EXT2_HASH_HALF_MD4_UNSIGNED :
+              for (; len > 0; len -= 32, name += 32) {
+                ext2_str2hashbuf(name, len, in, 8, hash_version == EXT2_HASH_HALF_MD4_UNSIGNED);
+                ext2_half_md4_transform(buf, in);
+              }
+              hash = buf[1];
+              break;
+    case EXT2_HASH_TEA :
+    case EXT2_HASH_TEA_UNSIGNED :
+              for (; len > 0; len -= 16, name += 16) {
+                ext2_str2hashbuf(name, len, in, 4, hash_version == EXT2_HASH_TEA_UNSIGNED);
+                ext2_tea_transform(buf, in);
+              }
+              hash = buf[0];
+              break;
+  }
+
+  hash &= ~1;
+
+  // 0xFFFFFFFE marks the end of the index, so that value cannot be used
+  if (hash == (0x7FFFFFFF << 1)) hash = (0x7FFFFFFF - 1) << 1;
+  return hash;
 }
 
+
 /**
+ * Walks the hashed b-tree index of a directory down to the leaf level index node that
+ * covers the hash of name. The hash, the disk offset of the entries inside that node
+ * and its count/limit are returned.
  *
+ * @return entry number inside the node, or -1 when the index cannot be used and the
+ *         directory must be handled as a plain directory
  */
-void ext2_close (vfs_node_t *node) {
-//  node->block->close (node->block->major, node->block->minor);
+int ext2_htree_descend(struct vfs_mount *mount, ext2_inode_t *inode, const char *name, int namelen, Uint32 *hash, Uint64 *disk_offset, ext2_dx_countlimit_t *countlimit) {
+  ext2_info_t *ext2_info = mount->fs_data;
+  ext2_dx_root_info_t root_info;
+  ext2_dx_entry_t entry;
+  Uint32 block;
+  int hash_version, levels, lo, hi, mid, found;
+
+  // The root lives in block 0, right after the '.' and '..' entries (12 bytes each)
+  block = ext2_get_file_block(mount, inode, 0);
+  if (block == 0) return -1;
+  *disk_offset = ext2_block2diskoffset(mount, block) + 24;
+
+  if (bcache_read(mount->dev, *disk_offset, sizeof(ext2_dx_root_info_t), (char *)&root_info) != sizeof(ext2_dx_root_info_t)) return -1;
+
+  // Unknown layouts are searched the old way. Directories stay readable that way.
+  if (root_info.reserved_zero != 0 || root_info.info_length != 8 || root_info.indirect_levels > 2) return -1;
+  if (root_info.hash_version > EXT2_HASH_TEA) return -1;
+
+  hash_version = root_info.hash_version;
+  if (ext2_info->superblock_ext && (ext2_info->superblock_ext->flags & EXT2_FLAGS_UNSIGNED_HASH)) hash_version += 3;
+  *hash = ext2_dirhash(mount, hash_version, name, namelen);
+
+  *disk_offset += root_info.info_length;
+  levels = root_info.indirect_levels;
+
+  for (;;) {
+    if (bcache_read(mount->dev, *disk_offset, sizeof(ext2_dx_countlimit_t), (char *)countlimit) != sizeof(ext2_dx_countlimit_t)) return -1;
+    if (countlimit->count == 0 || countlimit->count > countlimit->limit) return -1;
+
+    // Find the last entry with a hash <= our hash. Entry 0 has an implied hash of 0.
+    lo = 1;
+    hi = countlimit->count - 1;
+    while (lo <= hi) {
+      mid = (lo + hi) / 2;
+      if (bcache_read(mount->dev, *disk_offset + mid * sizeof(ext2_dx_entry_t), sizeof(ext2_dx_entry_t), (char *)&entry) != sizeof(ext2_dx_entry_t)) return -1;
+      if (entry.hash > *hash) {
+        hi = mid - 1;
+      } else {
+        lo = mid + 1;
+      }
+    }
+    found = lo - 1;
+
+    if (levels == 0) return found;
+
+    // Index nodes have a fake directory entry spanning the whole block in front of the entries
+    if (bcache_read(mount->dev, *disk_offset + found * sizeof(ext2_dx_entry_t), sizeof(ext2_dx_entry_t), (char *)&entry) != sizeof(ext2_dx_entry_t)) return -1;
+    block = ext2_get_file_block(mount, inode, entry.block);
+    if (block == 0) return -1;
+    *disk_offset = ext2_block2diskoffset(mount, block) + 8;
+    levels--;
+  }
 }
 
 
 /**
- * Initialises the ext2 on current drive
+ * Returns the disk block of the htree leaf that name belongs in, or 0 when the index
+ * cannot be used.
  */
-void ext2_init (void) {
-  // Register file system to the VFS
-  vfs_register_filesystem (&ext2_vfs_info);
+Uint32 ext2_htree_leaf(struct vfs_mount *mount, ext2_inode_t *inode, const char *name, int namelen) {
+  ext2_dx_countlimit_t countlimit;
+  ext2_dx_entry_t entry;
+  Uint32 hash;
+  Uint64 disk_offset;
+
+  int found = ext2_htree_descend(mount, inode, name, namelen, &hash, &disk_offset, &countlimit);
+  if (found == -1) return 0;
+
+  if (bcache_read(mount->dev, disk_offset + found * sizeof(ext2_dx_entry_t), sizeof(ext2_dx_entry_t), (char *)&entry) != sizeof(ext2_dx_entry_t)) return 0;
+  return ext2_get_file_block(mount, inode, entry.block);
 }
 
 
+/**
+ * Looks up a name through the hashed b-tree index of a directory. Only the leaf block
+ * the name hashes to is searched (plus the next ones when the hash collides).
+ *
+ * @return inode number, 0 when the name does not exist, or -1 when the index cannot be
+ *         used and the directory must be searched linearly
+ */
+Uint32 ext2_htree_lookup(struct vfs_mount *mount, ext2_inode_t *inode, const char *name, int namelen) {
+  ext2_dx_countlimit_t countlimit;
+  ext2_dx_entry_t entry;
+  Uint32 hash, block, inode_nr;
+  Uint64 disk_offset;
+
+  int found = ext2_htree_descend(mount, inode, name, namelen, &hash, &disk_offset, &countlimit);
+  if (found == -1) return -1;
+
+  // Search the leaf. When the name is not there, but the next leaf starts with the same
+  // hash (lowest bit set), the entries with this hash continue over there.
+  for (;;) {
+    if (bcache_read(mount->dev, disk_offset + found * sizeof(ext2_dx_entry_t), sizeof(ext2_dx_entry_t), (char *)&entry) != sizeof(ext2_dx_entry_t)) return -1;
+    block = ext2_get_file_block(mount, inode, entry.block);
+    if (block == 0) return -1;
+
+    inode_nr = ext2_find_in_block(mount, block, name, namelen);
+    if (inode_nr != 0) return inode_nr;
+
+    // @TODO: collisions that continue in the next index node are not followed
+    found++;
+    if (found >= countlimit.count) return 0;
+    if (bcache_read(mount->dev, disk_offset + found * sizeof(ext2_dx_entry_t), sizeof(ext2_dx_entry_t), (char *)&entry) != sizeof(ext2_dx_entry_t)) return -1;
+    if ((entry.hash & 1) == 0 || (entry.hash & ~1) != hash) return 0;
+  }
+}
+
 
+/**
+ * Finds the entry name inside the directory node and fills target_node with it.
+ * Indexed directories are searched through their htree, others block by block.
+ *
+ * @return 1 when found, 0 otherwise
+ */
 int ext2_finddir (vfs_node_t *node, const char *name, vfs_node_t *target_node) {
   ext2_info_t *ext2_info = node->mount->fs_data;
-  Uint32 i;
+  Uint32 i, block, inode_nr = -1;
 
   // Check if it's a directory
   if ((node->flags & 0x7) != FS_DIRECTORY) return NULL;
 
-  // Hmz,.. looks like we need to start from the first entry and read until
-  // we find the correct entry. @TODO: needs more caching.
-  ext2_inode_t *inode = ext2_read_inode(node->mount, node->inode_nr);
-
-  // So what we do is read the *COMPLETE* directory structure into memory,
-  // and afterwards we iterate through it. I can't even begin to describe how
-  // bad this method is.
-
-  // Allocate buffer
-  char *buffer = (char *)kmalloc(inode->sizeLow);
-  char *buf_ptr = buffer;
-  ext2_dir_t *ext2_dir = (ext2_dir_t *)buffer;
+  int namelen = strlen(name);
+  if (namelen == 0 || namelen > 255) return NULL;
 
+  ext2_inode_t *inode = ext2_read_inode(node->mount, node->inode_nr);
+  if (! inode) return NULL;
 
-  // Read the directory blocks
-  for (i=0; i!=inode->sizeLow / ext2_info->block_size; i++) {
-    // @TODO: We don't do indirect blocks now
-    if (i > 11) {
-      kprintf ("Ext2: we can only read direct blocks\n");
-      kfree(buffer);
-      kfree(inode);
-      return NULL;
-    }
+  // Use the index when the filesystem allows it
+  if ((inode->flags & EXT2_INDEX_FL) && ext2_info->superblock_ext &&
+      (ext2_info->superblock_ext->optionalFeatures & EXT2_FEATURE_COMPAT_DIR_INDEX)) {
+    inode_nr = ext2_htree_lookup(node->mount, inode, name, namelen);
+  }
 
-    // Block 0 encountered, reached end of blocks
-    if (inode->directPointerBlock[i] == 0) break;
+  // Linear scan through all directory blocks
+  if (inode_nr == (Uint32)-1) {
+    inode_nr = 0;
+    for (i=0; i!=inode->sizeLow / ext2_info->block_size; i++) {
+      block = ext2_get_file_block(node->mount, inode, i);
+      if (block == 0) continue;
 
-    // Read blocks from disk into buffer
-    if (! ext2_read_block(node->mount, inode->directPointerBlock[i], 1, buf_ptr)) {
-      kprintf("Ext2: cannot read complete block\n");
-      kfree(buffer);
-      kfree(inode);
-      return NULL;
+      inode_nr = ext2_find_in_block(node->mount, block, name, namelen);
+      if (inode_nr != 0) break;
     }
-
-    // Store next data here
-    buf_ptr += ext2_info->block_size;
   }
 
-
-
-  // Iterate until we find the correct name
-  Uint8 namelen = strlen(name);
-  while (ext2_dir->inode_nr != 0 &&
-         ext2_dir->name_len != namelen &&
-         strncmp(name, (char *)&ext2_dir->name, ext2_dir->name_len) != 0) {
-
-    ext2_dir = (ext2_dir_t *)( (void *)ext2_dir + ext2_dir->rec_len );
-  }
+  ext2_release_inode(inode);
 
   // Could not find entry
-  if (ext2_dir->inode_nr == 0) {
-    kfree(buffer);
-    kfree(inode);
-    return NULL;
-  }
-
-  // Found the node
+  if (inode_nr == 0) return NULL;
 
   // Read file inode
-  ext2_inode_t *file_inode = ext2_read_inode(node->mount, ext2_dir->inode_nr);
+  ext2_inode_t *file_inode = ext2_read_inode(node->mount, inode_nr);
+  if (! file_inode) return NULL;
 
   // Copy node info into new node
   memcpy (target_node, node, sizeof (vfs_node_t));
 
   // Set correct values for new inode
-  target_node->inode_nr = ext2_dir->inode_nr;
-  strncpy((char *)target_node->name, (char *)&ext2_dir->name, ext2_dir->name_len);
+  target_node->inode_nr = inode_nr;
+  strncpy((char *)target_node->name, name, sizeof(target_node->name) - 1);
+  target_node->name[sizeof(target_node->name) - 1] = 0;
   target_node->owner = file_inode->uid;
-  target_node->length = file_inode->sizeLow; // @TODO: 32bit.
+  // Files of 4GB and up do not fit in the node, but can still be read up to 4GB
+  target_node->length = (ext2_inode_size(file_inode) > 0xFFFFFFFF) ? 0xFFFFFFFF : file_inode->sizeLow;
   target_node->flags = ((file_inode->typeAndPermissions & EXT2_S_IFDIR) == EXT2_S_IFDIR) ? FS_DIRECTORY : FS_FILE;
 
-  kfree(buffer);
-  kfree(inode);
-  kfree(file_inode);
+  ext2_release_inode(file_inode);
 
   return 1;
 }
 
 
-int ext2_readdir (vfs_node_t *node, Uint32 index, vfs_dirent_t *target_dirent) {
+/**
+ * Returns the size of the file. Regular files on revision 1 filesystems use sizeHigh
+ * for the upper 32 bits, directories use it for the directory ACL.
+ */
+Uint64 ext2_inode_size(ext2_inode_t *inode) {
+  Uint64 size = inode->sizeLow;
+
+  if ((inode->typeAndPermissions & EXT2_S_IFMT) == EXT2_S_IFREG) size |= (Uint64)inode->sizeHigh << 32;
+  return size;
+}
+
+
+/**
+ * Returns the disk block that holds block index of a file, or 0 when there is none.
+ *
+ * @param mount
+ * @param inode
+ * @param index
+ * @return
+ */
+Uint32 ext2_get_file_block(struct vfs_mount *mount, ext2_inode_t *inode, Uint32 index) {
+  ext2_info_t *ext2_info = mount->fs_data;
+  Uint32 per_block = ext2_info->block_size / sizeof(Uint32);
+  Uint32 block;
+
+  if (index < 12) return inode->directPointerBlock[index];
+  index -= 12;
+
+  // Single indirect
+  if (index < per_block) {
+    return ext2_read_block_pointer(mount, inode->singleIndirectPointerBlock, index);
+  }
+  index -= per_block;
+
+  // Double indirect
+  if (index < per_block * per_block) {
+    block = ext2_read_block_pointer(mount, inode->doubleIndirectPointerBlock, index / per_block);
+    return ext2_read_block_pointer(mount, block, index % per_block);
+  }
+  index -= per_block * per_block;
+
+  // Triple indirect
+  block = ext2_read_block_pointer(mount, inode->tripleIndirectPointerBlock, index / (per_block * per_block));
+  block = ext2_read_block_pointer(mount, block, (index / per_block) % per_block);
+  return ext2_read_block_pointer(mount, block, index % per_block);
+}
+
+
+/**
+ * Maps file block index to a disk block, and returns in count how many of the following
+ * file blocks (at most max) are stored right behind it on disk. The last run that was
+ * found is cached in the inode, so sequential reads do not walk the indirect blocks for
+ * every block.
+ *
+ * @return disk block, or 0 for a hole (count is 1 then)
+ */
+Uint32 ext2_map_blocks(struct vfs_mount *mount, ext2_inode_t *inode, Uint32 index, Uint32 max, Uint32 *count) {
+  ext2_cached_inode_t *cached = (ext2_cached_inode_t *)inode;
+  Uint32 block, window;
+
+  if (max == 0) max = 1;
+
+  // Inside the cached run
+  if (cached->map_count && index >= cached->map_index && index - cached->map_index < cached->map_count) {
+    *count = cached->map_count - (index - cached->map_index);
+    if (*count > max) *count = max;
+    return cached->map_block + (index - cached->map_index);
+  }
+
+  *count = 1;
+  block = ext2_get_file_block(mount, inode, index);
+  if (block == 0) return 0;
+
+  // Look a bit further than asked for, so the next reads are found in the cached run
+  window = (max > EXT2_BLOCKMAP_WINDOW) ? max : EXT2_BLOCKMAP_WINDOW;
+  for (cached->map_count = 1; cached->map_count != window; cached->map_count++) {
+    if (ext2_get_file_block(mount, inode, index + cached->map_count) != block + cached->map_count) break;
+  }
+  cached->map_index = index;
+  cached->map_block = block;
+
+  *count = (cached->map_count > max) ? max : cached->map_count;
+  return block;
+}
+
+
+/**
+ * Reads at most count directory entries, starting at byte position *offset inside the
+ * directory. *offset is moved past the returned entries, so the next call continues
+ * where this one stopped.
+ *
+ * @return number of entries returned, 0 at the end of the directory
+ */
+int ext2_getdents (vfs_node_t *node, Uint32 *offset, vfs_dirent_t *dirents, int count) {
   ext2_info_t *ext2_info = node->mount->fs_data;
-  Uint32 i;
+  ext2_dir_t ext2_dir;
+  Uint32 block;
+  Uint64 disk_offset;
+  int filled = 0;
 
   // Check if it's a directory
-  if ((node->flags & 0x7) != FS_DIRECTORY) return NULL;
+  if ((node->flags & 0x7) != FS_DIRECTORY) return 0;
 
-  // Hmz,.. looks like we need to start from the first entry and read until
-  // we find the correct entry. @TODO: needs more caching.
   ext2_inode_t *inode = ext2_read_inode(node->mount, node->inode_nr);
+  if (! inode) return 0;
+
+  while (filled != count && *offset < inode->sizeLow) {
+    // Entries never cross a block, so only the start of the entry is needed to find it
+    block = ext2_get_file_block(node->mount, inode, *offset / ext2_info->block_size);
+    if (block == 0) {
+      kprintf ("Ext2: directory inode %d has a hole\n", node->inode_nr);
+      break;
+    }
+    disk_offset = ext2_block2diskoffset(node->mount, block) + (*offset % ext2_info->block_size);
 
-  // So what we do is read the *COMPLETE* directory structure into memory,
-  // and afterwards we iterate through it. I can't even begin to describe how
-  // bad this method is.
-
-  // But since we don't have a fixed length, we always must start at the
-  // first block. But let's merge the whole system: load a block, iterate
-  // through the block, if found, we're done. Not found, continue...
+    if (bcache_read(node->mount->dev, disk_offset, sizeof(ext2_dir_t), (char *)&ext2_dir) != sizeof(ext2_dir_t)) break;
 
-  // Allocate buffer
-  char *buffer = (char *)kmalloc(inode->sizeLow);
-  char *buf_ptr = buffer;
-  ext2_dir_t *ext2_dir = (ext2_dir_t *)buffer;
-
-  // Read the directory blocks
-  for (i=0; i!=inode->sizeLow / ext2_info->block_size; i++) {
-    // @TODO: We don't do indirect blocks now, sorry
-    if (i > 11) {
-      kprintf ("Ext2: we can only read direct blocks\n");
-      kfree(buffer);
-      kfree(inode);
-      return NULL;
+    // Corrupt entry, do not loop forever
+    if (ext2_dir.rec_len == 0) {
+      kprintf ("Ext2: directory entry with zero length in inode %d\n", node->inode_nr);
+      break;
     }
 
-    // Block 0 encountered, reached end of blocks
-    if (inode->directPointerBlock[i] == 0) break;
+    // Unused entries have inode 0
+    if (ext2_dir.inode_nr != 0) {
+      // Names can be 255 chars, which leaves no room for the terminating 0
+      if (ext2_dir.name_len > sizeof(dirents[filled].name) - 1) ext2_dir.name_len = sizeof(dirents[filled].name) - 1;
 
-//    kprintf("IDPB[%d]: %d\n", i, inode->directPointerBlock[i]);
-
-    // Read blocks from disk into buffer
-    if (! ext2_read_block(node->mount, inode->directPointerBlock[i], 1, buf_ptr)) {
-      kprintf("Ext2: cannot read complete block\n");
-      kfree(buffer);
-      kfree(inode);
-      return NULL;
+      if (bcache_read(node->mount->dev, disk_offset + sizeof(ext2_dir_t), ext2_dir.name_len, dirents[filled].name) != ext2_dir.name_len) break;
+      dirents[filled].name[ext2_dir.name_len] = 0;
+      dirents[filled].inode_nr = ext2_dir.inode_nr;
+      filled++;
     }
 
-    // Store next data here
-    buf_ptr += ext2_info->block_size;
+    *offset += ext2_dir.rec_len;
   }
 
-  // Iterate through N directory entries
-  while (1) {
-    if (ext2_dir->inode_nr == 0) {
-      // No more inodes found (index too large probably)
-      kfree(buffer);
-      kfree(inode);
-      return NULL;
-    }
+  ext2_release_inode(inode);
+  return filled;
+}
 
-    // Break when we have reached our index
-    if (index <= 0) break;
 
-    // Decrease index
-    index--;
+/**
+ * Returns directory entry index. Every call scans from the start of the directory,
+ * use ext2_getdents() to iterate through a directory.
+ */
+int ext2_readdir (vfs_node_t *node, Uint32 index, vfs_dirent_t *target_dirent) {
+  Uint32 offset = 0;
 
-    // Goto next entry
-//    kprintf ("[%d] Rec_len: %d (Inode: %d)\n", index, ext2_dir->rec_len, ext2_dir->inode_nr);
-    ext2_dir = (ext2_dir_t *)( (void *)ext2_dir + ext2_dir->rec_len );
+  // Skip index entries
+  while (ext2_getdents(node, &offset, target_dirent, 1) == 1) {
+    if (index == 0) return 1;
+    index--;
   }
 
-  // ext2_dir points to correct directory
-  strncpy((char *)target_dirent->name, (char *)&ext2_dir->name, ext2_dir->name_len);
-  target_dirent->inode_nr = ext2_dir->inode_nr;
-
-  kfree(buffer);
-  kfree(inode);
-  return 1;
+  return NULL;
 }
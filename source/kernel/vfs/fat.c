@@ -0,0 +1,1231 @@
+/******************************************************************************
+ *
+ *  File        : fat.c
+ *  Description : FAT16 and FAT32 filesystem with VFAT long filenames. The FAT
+ *                is never loaded as a whole, entries are read through the buffer
+ *                cache when they are needed. Free clusters are searched from the
+ *                hint in the FSInfo sector.
+ *
+ *                Inode numbers are the disk offset of the 8.3 directory entry
+ *                divided by 32, except for the root directory which is 0.
+ *
+ *****************************************************************************/
+
+#include "kernel.h"
+#include "kmem.h"
+#include "vfs.h"
+#include "bcache.h"
+#include "vfs/fat.h"
+
+// File operations
+static struct vfs_fileops fat_fileops = {
+    .read = fat_read, .write = fat_write,
+    .open = fat_open, .close = fat_close,
+    .readdir = fat_readdir, .finddir = fat_finddir,
+    .getdents = fat_getdents,
+    .create = fat_create, .truncate = fat_truncate,
+    .readahead = fat_readahead
+};
+
+// Mount operations
+static struct vfs_mountops fat_mountops = {
+    .mount = fat_mount, .umount = fat_umount
+};
+
+// Global structure
+static vfs_info_t fat_vfs_info = { .tag = "fat",
+                                   .name = "FAT16/FAT32 File System",
+                                   .mountops = &fat_mountops
+                                 };
+
+// Root supernode (will be overwritten on mounting)
+static vfs_node_t fat_supernode = {
+  .inode_nr = FAT_ROOT_INO,
+  .name = "/",
+  .owner = 0,
+  .length = 0,
+  .flags = FS_DIRECTORY,
+  .major_num = 0,
+  .minor_num = 0,
+  .fileops = &fat_fileops,
+  .mount = NULL,
+};
+
+// Source for zero filled clusters
+char fat_zero_buffer[BCACHE_BLOCK_SIZE];
+
+
+
+/**
+ * Called when a device that holds a FAT16 or FAT32 filesystem gets mounted onto a mount_point
+ */
+vfs_node_t *fat_mount (struct vfs_mount *mount, device_t *dev, const char *path) {
+  fat_info_t *fat_info = NULL;
+  fat_fsinfo_t *fsinfo = NULL;
+  Uint32 total_sectors, fat_sectors, root_sectors, bytes_per_sector;
+
+  // Boot sector holds the BIOS parameter block
+  fat_bpb_t *bpb = (fat_bpb_t *)kmalloc (512);
+  if (! bpb) goto cleanup;
+  if (bcache_read (mount->dev, 0, 512, (char *)bpb) != 512) goto cleanup;
+
+  // Do not trust anything that does not look like a FAT boot sector
+  bytes_per_sector = bpb->bytes_per_sector;
+  if (bytes_per_sector < 512 || bytes_per_sector > 4096 || (bytes_per_sector & (bytes_per_sector - 1))) goto cleanup;
+  if (bpb->sectors_per_cluster == 0 || (bpb->sectors_per_cluster & (bpb->sectors_per_cluster - 1))) goto cleanup;
+  if (bpb->reserved_sectors == 0 || bpb->fat_count == 0) goto cleanup;
+
+  total_sectors = bpb->total_sectors16 ? bpb->total_sectors16 : bpb->total_sectors32;
+  fat_sectors = bpb->sectors_per_fat16 ? bpb->sectors_per_fat16 : bpb->sectors_per_fat32;
+  root_sectors = (bpb->root_entries * sizeof (fat_dirent_t) + bytes_per_sector - 1) / bytes_per_sector;
+  if (fat_sectors == 0) goto cleanup;
+  if (total_sectors <= bpb->reserved_sectors + bpb->fat_count * fat_sectors + root_sectors) goto cleanup;
+
+  // @TODO: Directory entries are identified by their disk offset / 32, and vfs dirents only
+  // have a 32 bit inode number. So the volume must be smaller than 128GB.
+  if ((Uint64)total_sectors * bytes_per_sector / sizeof (fat_dirent_t) > 0xFFFFFFFF) {
+    kprintf ("FAT: volumes of 128GB and larger are not supported yet\n");
+    goto cleanup;
+  }
+
+  fat_info = (fat_info_t *)kmalloc (sizeof (fat_info_t));
+  if (! fat_info) goto cleanup;
+  memset (fat_info, 0, sizeof (fat_info_t));
+
+  fat_info->cluster_size = bpb->sectors_per_cluster * bytes_per_sector;
+  fat_info->fat_offset = bpb->reserved_sectors * bytes_per_sector;
+  fat_info->fat_size = fat_sectors * bytes_per_sector;
+  fat_info->fat_count = bpb->fat_count;
+  fat_info->active_fat = -1;
+  fat_info->root_offset = fat_info->fat_offset + fat_info->fat_count * fat_info->fat_size;
+  fat_info->root_size = root_sectors * bytes_per_sector;
+  fat_info->data_offset = fat_info->root_offset + fat_info->root_size;
+  fat_info->cluster_count = (total_sectors - fat_info->data_offset / bytes_per_sector) / bpb->sectors_per_cluster;
+
+  // The number of clusters decides the type of FAT, nothing else does
+  if (fat_info->cluster_count < FAT16_MIN_CLUSTERS) {
+    kprintf ("FAT: volume is FAT12, use the fat12 filesystem instead\n");
+    goto cleanup;
+  }
+  if (fat_info->cluster_count < FAT32_MIN_CLUSTERS) {
+    fat_info->type = FAT_TYPE_FAT16;
+    if (bpb->root_entries == 0) goto cleanup;
+  } else {
+    fat_info->type = FAT_TYPE_FAT32;
+    fat_info->root_cluster = bpb->root_cluster;
+    if (! fat_valid_cluster (fat_info, fat_info->root_cluster)) goto cleanup;
+
+    // FAT mirroring can be disabled, only one FAT is used then
+    if ((bpb->ext_flags & 0x80) && (bpb->ext_flags & 0x0F) < fat_info->fat_count) fat_info->active_fat = bpb->ext_flags & 0x0F;
+  }
+
+  // Every cluster needs an entry inside the FAT
+  if (fat_info->fat_size / (fat_info->type / 8) < fat_info->cluster_count + 2) goto cleanup;
+
+  // Free cluster hints. They are only hints, so check them before using them
+  fat_info->free_count = FAT_FSINFO_UNKNOWN;
+  fat_info->next_free = 2;
+  sched_init_waitqueue (&fat_info->alloc_wait);
+  if (fat_info->type == FAT_TYPE_FAT32 && bpb->fsinfo_sector != 0 && bpb->fsinfo_sector < bpb->reserved_sectors) {
+    fsinfo = (fat_fsinfo_t *)kmalloc (sizeof (fat_fsinfo_t));
+    if (fsinfo && bcache_read (mount->dev, bpb->fsinfo_sector * bytes_per_sector, sizeof (fat_fsinfo_t), (char *)fsinfo) == sizeof (fat_fsinfo_t) &&
+        fsinfo->lead_signature == FAT_FSINFO_LEAD_SIG && fsinfo->struct_signature == FAT_FSINFO_STRUCT_SIG) {
+      fat_info->fsinfo_offset = bpb->fsinfo_sector * bytes_per_sector;
+      if (fsinfo->free_count <= fat_info->cluster_count) fat_info->free_count = fsinfo->free_count;
+      if (fat_valid_cluster (fat_info, fsinfo->next_free)) fat_info->next_free = fsinfo->next_free;
+    }
+    if (fsinfo) kfree (fsinfo);
+  }
+
+//  kprintf ("FAT%d: %d clusters of %d bytes, %d free\n", fat_info->type, fat_info->cluster_count, fat_info->cluster_size, fat_info->free_count);
+
+  kfree (bpb);
+  mount->fs_data = fat_info;
+
+  fat_supernode.length = 0;
+  fat_supernode.mount = mount;
+  return &fat_supernode;
+
+cleanup:
+  // Things went wrong when we are here. Do a cleanup
+  if (fat_info) kfree (fat_info);
+  if (bpb) kfree (bpb);
+  mount->fs_data = NULL;
+  return NULL;
+}
+
+
+/**
+ * Called when a mount_point gets unmounted
+ */
+void fat_umount (struct vfs_mount *mount) {
+  fat_write_fsinfo (mount);
+  kfree (mount->fs_data);
+}
+
+
+/**
+ * Returns the disk offset of a cluster
+ */
+Uint64 fat_cluster2diskoffset (fat_info_t *fat_info, Uint32 cluster) {
+  return fat_info->data_offset + (Uint64)(cluster - 2) * fat_info->cluster_size;
+}
+
+
+/**
+ * Returns 1 when the cluster is a data cluster. Free, reserved, bad and end of chain
+ * values are not.
+ */
+int fat_valid_cluster (fat_info_t *fat_info, Uint32 cluster) {
+  return (cluster >= 2 && cluster < fat_info->cluster_count + 2);
+}
+
+
+/**
+ * Returns the FAT entry of a cluster. The FAT sector is read through the buffer cache.
+ */
+Uint32 fat_get_entry (struct vfs_mount *mount, Uint32 cluster) {
+  fat_info_t *fat_info = mount->fs_data;
+  Uint32 entry_size = fat_info->type / 8;
+  Uint32 fat = (fat_info->active_fat == -1) ? 0 : fat_info->active_fat;
+  Uint32 value = 0;
+
+  // An entry we cannot read ends the chain
+  if (bcache_read (mount->dev, fat_info->fat_offset + fat * fat_info->fat_size + cluster * entry_size, entry_size, (char *)&value) != entry_size) return FAT32_EOC_MARK;
+
+  if (fat_info->type == FAT_TYPE_FAT32) value &= FAT32_MASK;
+  return value;
+}
+
+
+/**
+ * Sets the FAT entry of a cluster in all FATs (or in the active FAT only when
+ * mirroring is disabled).
+ *
+ * @return 0 when something is wrong
+ */
+int fat_set_entry (struct vfs_mount *mount, Uint32 cluster, Uint32 value) {
+  fat_info_t *fat_info = mount->fs_data;
+  Uint32 entry_size = fat_info->type / 8;
+  Uint32 fat, offset, old;
+
+  for (fat=0; fat!=fat_info->fat_count; fat++) {
+    if (fat_info->active_fat != -1 && fat != fat_info->active_fat) continue;
+    offset = fat_info->fat_offset + fat * fat_info->fat_size + cluster * entry_size;
+
+    // The upper 4 bits of a FAT32 entry must be kept
+    if (fat_info->type == FAT_TYPE_FAT32) {
+      if (bcache_read (mount->dev, offset, 4, (char *)&old) != 4) return 0;
+      value = (old & ~FAT32_MASK) | (value & FAT32_MASK);
+    }
+
+    if (bcache_write (mount->dev, offset, entry_size, (char *)&value) != entry_size) return 0;
+  }
+
+  return 1;
+}
+
+
+/**
+ * Returns the cluster at position index in the chain that starts at start, and in
+ * *count how many clusters (max at most) follow each other on disk from there. The
+ * end of the run is remembered, so reading a file from front to back does not walk
+ * the chain from the start every time.
+ *
+ * @return cluster, or 0 when the chain is shorter than index
+ */
+Uint32 fat_map_clusters (struct vfs_mount *mount, Uint32 start, Uint32 index, Uint32 max, Uint32 *count) {
+  fat_info_t *fat_info = mount->fs_data;
+  fat_chain_t *chain, *best = NULL, *victim = NULL;
+  Uint32 cluster, position;
+  int i;
+
+  *count = 0;
+  if (max == 0) max = 1;
+  if (! fat_valid_cluster (fat_info, start)) return 0;
+
+  // Start walking from the closest remembered position in front of index
+  fat_info->chain_clock++;
+  for (i=0; i!=FAT_CHAIN_CACHE; i++) {
+    chain = &fat_info->chain[i];
+    if (chain->start == start && chain->index <= index && (! best || chain->index > best->index)) best = chain;
+    if (! victim || chain->last_used < victim->last_used) victim = chain;
+  }
+
+  position = best ? best->index : 0;
+  cluster = best ? best->cluster : start;
+  while (position != index) {
+    cluster = fat_get_entry (mount, cluster);
+    if (! fat_valid_cluster (fat_info, cluster)) return 0;
+    position++;
+  }
+
+  // Count the clusters that follow on disk
+  for (*count=1; *count!=max; (*count)++) {
+    if (fat_get_entry (mount, cluster + *count - 1) != cluster + *count) break;
+  }
+
+  chain = best ? best : victim;
+  chain->start = start;
+  chain->index = index + *count - 1;
+  chain->cluster = cluster + *count - 1;
+  chain->last_used = fat_info->chain_clock;
+
+  return cluster;
+}
+
+
+/**
+ * Forgets all remembered positions of a chain. Must be called when a chain gets shorter.
+ */
+void fat_chain_forget (fat_info_t *fat_info, Uint32 start) {
+  int i;
+
+  for (i=0; i!=FAT_CHAIN_CACHE; i++) {
+    if (fat_info->chain[i].start == start) memset (&fat_info->chain[i], 0, sizeof (fat_chain_t));
+  }
+}
+
+
+/**
+ * Takes the allocator of the mount. The FAT is scanned through a copy, so without it
+ * another task could find the same free cluster before we mark it.
+ */
+void fat_lock_alloc (struct vfs_mount *mount) {
+  fat_info_t *fat_info = mount->fs_data;
+
+  while (1) {
+    int state = disable_ints ();
+    if (! fat_info->alloc_busy) {
+      fat_info->alloc_busy = 1;
+      restore_ints (state);
+      return;
+    }
+    if (_current_task != NULL && _current_task->pid != PID_IDLE) sched_interruptable_sleep (&fat_info->alloc_wait);
+    restore_ints (state);
+  }
+}
+
+
+/**
+ * Releases the allocator of the mount
+ */
+void fat_unlock_alloc (struct vfs_mount *mount) {
+  fat_info_t *fat_info = mount->fs_data;
+
+  int state = disable_ints ();
+  fat_info->alloc_busy = 0;
+  if (_current_task != NULL) sched_wakeup (&fat_info->alloc_wait);
+  restore_ints (state);
+}
+
+
+/**
+ * Allocates a cluster and marks it as the end of a chain. The search starts at goal
+ * (when it's a valid cluster) or at the next free hint, and wraps around the end of
+ * the FAT. The FAT is scanned one 512 byte part at a time.
+ *
+ * @return cluster, or 0 when the volume is full
+ */
+Uint32 fat_alloc_cluster (struct vfs_mount *mount, Uint32 goal) {
+  fat_info_t *fat_info = mount->fs_data;
+  Uint32 entries_per_part = 512 / (fat_info->type / 8);
+  Uint32 part = 0xFFFFFFFF;       // Part of the FAT that is inside the buffer
+  Uint32 cluster, value, n;
+  char buffer[512];
+
+  fat_lock_alloc (mount);
+
+  if (! fat_valid_cluster (fat_info, goal)) goal = fat_info->next_free;
+  if (! fat_valid_cluster (fat_info, goal)) goal = 2;
+
+  cluster = goal;
+  for (n=0; n!=fat_info->cluster_count; n++, cluster++) {
+    if (! fat_valid_cluster (fat_info, cluster)) cluster = 2;
+
+    if (cluster / entries_per_part != part) {
+      part = cluster / entries_per_part;
+      if (bcache_read (mount->dev, fat_info->fat_offset + (fat_info->active_fat == -1 ? 0 : fat_info->active_fat) * fat_info->fat_size + part * 512, 512, buffer) != 512) break;
+    }
+
+    if (fat_info->type == FAT_TYPE_FAT32) {
+      value = ((Uint32 *)buffer)[cluster % entries_per_part] & FAT32_MASK;
+    } else {
+      value = ((Uint16 *)buffer)[cluster % entries_per_part];
+    }
+    if (value != FAT_FREE_CLUSTER) continue;
+
+    if (! fat_set_entry (mount, cluster, (fat_info->type == FAT_TYPE_FAT32) ? FAT32_EOC_MARK : FAT16_EOC_MARK)) break;
+
+    if (fat_info->free_count != FAT_FSINFO_UNKNOWN && fat_info->free_count > 0) fat_info->free_count--;
+    fat_info->next_free = fat_valid_cluster (fat_info, cluster + 1) ? cluster + 1 : 2;
+    fat_info->fsinfo_dirty = 1;
+    fat_unlock_alloc (mount);
+    return cluster;
+  }
+
+  // Nothing free, so now we know the free count for sure
+  if (n == fat_info->cluster_count) {
+    fat_info->free_count = 0;
+    fat_info->fsinfo_dirty = 1;
+  }
+  fat_unlock_alloc (mount);
+  return 0;
+}
+
+
+/**
+ * Frees a chain of clusters, starting at cluster
+ */
+void fat_free_chain (struct vfs_mount *mount, Uint32 cluster) {
+  fat_info_t *fat_info = mount->fs_data;
+  Uint32 next;
+
+  fat_lock_alloc (mount);
+
+  // A loop inside a corrupted chain ends at the first cluster that is already freed
+  while (fat_valid_cluster (fat_info, cluster)) {
+    next = fat_get_entry (mount, cluster);
+    if (! fat_set_entry (mount, cluster, FAT_FREE_CLUSTER)) break;
+
+    if (fat_info->free_count != FAT_FSINFO_UNKNOWN) fat_info->free_count++;
+    if (cluster < fat_info->next_free) fat_info->next_free = cluster;
+    fat_info->fsinfo_dirty = 1;
+
+    cluster = next;
+  }
+
+  fat_unlock_alloc (mount);
+}
+
+
+/**
+ * Writes the free cluster count and next free hint back to the FSInfo sector
+ */
+void fat_write_fsinfo (struct vfs_mount *mount) {
+  fat_info_t *fat_info = mount->fs_data;
+  fat_fsinfo_t fsinfo;
+
+  if (! fat_info->fsinfo_dirty || fat_info->fsinfo_offset == 0) return;
+
+  // Allocations in between would be lost when the dirty flag is cleared
+  fat_lock_alloc (mount);
+  if (bcache_read (mount->dev, fat_info->fsinfo_offset, sizeof (fat_fsinfo_t), (char *)&fsinfo) == sizeof (fat_fsinfo_t)) {
+    fsinfo.free_count = fat_info->free_count;
+    fsinfo.next_free = fat_info->next_free;
+    if (bcache_write (mount->dev, fat_info->fsinfo_offset, sizeof (fat_fsinfo_t), (char *)&fsinfo) == sizeof (fat_fsinfo_t)) fat_info->fsinfo_dirty = 0;
+  }
+  fat_unlock_alloc (mount);
+}
+
+
+/**
+ * Fills size bytes at disk_offset with zeros
+ *
+ * @return 0 when something is wrong
+ */
+int fat_zero (struct vfs_mount *mount, Uint64 disk_offset, Uint32 size) {
+  Uint32 len;
+
+  while (size) {
+    len = (size > BCACHE_BLOCK_SIZE) ? BCACHE_BLOCK_SIZE : size;
+    if (bcache_write (mount->dev, disk_offset, len, fat_zero_buffer) != len) return 0;
+    disk_offset += len;
+    size -= len;
+  }
+  return 1;
+}
+
+
+/**
+ * Reads the directory entry of an inode
+ *
+ * @return 0 when something is wrong
+ */
+int fat_read_dirent (struct vfs_mount *mount, inode_t inode_nr, fat_dirent_t *entry) {
+  if (inode_nr == FAT_ROOT_INO) return 0;
+  return (bcache_read (mount->dev, (Uint64)inode_nr * sizeof (fat_dirent_t), sizeof (fat_dirent_t), (char *)entry) == sizeof (fat_dirent_t));
+}
+
+
+/**
+ * Writes the directory entry of an inode
+ *
+ * @return 0 when something is wrong
+ */
+int fat_write_dirent (struct vfs_mount *mount, inode_t inode_nr, fat_dirent_t *entry) {
+  if (inode_nr == FAT_ROOT_INO) return 0;
+  return (bcache_write (mount->dev, (Uint64)inode_nr * sizeof (fat_dirent_t), sizeof (fat_dirent_t), (char *)entry) == sizeof (fat_dirent_t));
+}
+
+
+/**
+ * Returns the first cluster of a directory entry (0 for empty files)
+ */
+Uint32 fat_dirent_cluster (fat_info_t *fat_info, fat_dirent_t *entry) {
+  // The high word is only used on FAT32 (OS/2 keeps other things there on FAT16)
+  if (fat_info->type != FAT_TYPE_FAT32) return entry->cluster_low;
+  return entry->cluster_low | ((Uint32)entry->cluster_high << 16);
+}
+
+
+/**
+ * Sets the first cluster of a directory entry
+ */
+void fat_dirent_set_cluster (fat_info_t *fat_info, fat_dirent_t *entry, Uint32 cluster) {
+  entry->cluster_low = cluster & 0xFFFF;
+  if (fat_info->type == FAT_TYPE_FAT32) entry->cluster_high = cluster >> 16;
+}
+
+
+/**
+ * Returns the first cluster of a directory, or 0 for the fixed root directory of FAT16.
+ * Returns a cluster that is not valid when the directory entry cannot be read.
+ */
+Uint32 fat_dir_cluster (vfs_node_t *node) {
+  fat_info_t *fat_info = node->mount->fs_data;
+  fat_dirent_t entry;
+  Uint32 cluster;
+
+  if (node->inode_nr == FAT_ROOT_INO) return fat_info->root_cluster;
+  if (! fat_read_dirent (node->mount, node->inode_nr, &entry)) return 1;
+
+  // ".." entries of directories inside the root directory point to cluster 0
+  cluster = fat_dirent_cluster (fat_info, &entry);
+  if (cluster == 0) return fat_info->root_cluster;
+  return cluster;
+}
+
+
+/**
+ * Returns the disk offset of byte position inside a directory
+ *
+ * @return disk offset, or 0 when position is past the end of the directory
+ */
+Uint64 fat_dir_diskoffset (struct vfs_mount *mount, Uint32 dir_cluster, Uint32 position) {
+  fat_info_t *fat_info = mount->fs_data;
+  Uint32 cluster, count;
+
+  if (position >= FAT_MAX_DIR_SIZE) return 0;
+
+  // The root directory of FAT16 is a fixed area in front of the data clusters
+  if (dir_cluster == 0) {
+    if (position >= fat_info->root_size) return 0;
+    return fat_info->root_offset + position;
+  }
+
+  cluster = fat_map_clusters (mount, dir_cluster, position / fat_info->cluster_size, 1, &count);
+  if (cluster == 0) return 0;
+  return fat_cluster2diskoffset (fat_info, cluster) + position % fat_info->cluster_size;
+}
+
+
+/**
+ * Reads the next entry of a directory, starting at byte *position. The long filename
+ * entries in front of it are combined into name (at least FAT_MAX_NAME bytes),
+ * otherwise the name is made from the short name. Free entries and volume labels
+ * are skipped. *position is moved past the entry.
+ *
+ * @return 1 when an entry is found, 0 at the end of the directory
+ */
+int fat_dir_next (struct vfs_mount *mount, Uint32 dir_cluster, Uint32 *position, char *name, fat_dirent_t *entry, inode_t *inode_nr) {
+  fat_lfn_t *lfn = (fat_lfn_t *)entry;
+  char long_name[FAT_LFN_ORDER_MASK * FAT_LFN_CHARS + 1];
+  Uint16 chars[FAT_LFN_CHARS];
+  int next_order = 0;         // Order of the long filename part we expect next
+  int complete = 0;           // All parts of the long filename are read
+  Uint8 checksum = 0;
+  Uint64 disk_offset;
+  int order, i;
+
+  for (;;) {
+    disk_offset = fat_dir_diskoffset (mount, dir_cluster, *position);
+    if (disk_offset == 0) return 0;
+    if (bcache_read (mount->dev, disk_offset, sizeof (fat_dirent_t), (char *)entry) != sizeof (fat_dirent_t)) return 0;
+    if (entry->name[0] == FAT_ENTRY_END) return 0;
+    *position += sizeof (fat_dirent_t);
+
+    if (entry->name[0] == FAT_ENTRY_DELETED) {
+      next_order = complete = 0;
+      continue;
+    }
+
+    if ((entry->attr & 0x3F) == FAT_ATTR_LFN) {
+      order = lfn->order & FAT_LFN_ORDER_MASK;
+
+      // The last part of the name is stored first and starts a new long name
+      if (lfn->order & FAT_LFN_LAST) {
+        next_order = order;
+        checksum = lfn->checksum;
+        long_name[order * FAT_LFN_CHARS] = 0;
+      }
+
+      // Parts out of order belong to a long name that was partly overwritten
+      complete = 0;
+      if (order == 0 || order != next_order || lfn->checksum != checksum) {
+        next_order = 0;
+        continue;
+      }
+
+      // @TODO: Characters outside of Latin-1 cannot be shown, they become '?'
+      memcpy (chars, lfn->name1, sizeof (lfn->name1));
+      memcpy (chars + 5, lfn->name2, sizeof (lfn->name2));
+      memcpy (chars + 11, lfn->name3, sizeof (lfn->name3));
+      for (i=0; i!=FAT_LFN_CHARS; i++) {
+        if (chars[i] == 0 || chars[i] == 0xFFFF) {
+          long_name[(order - 1) * FAT_LFN_CHARS + i] = 0;
+        } else {
+          long_name[(order - 1) * FAT_LFN_CHARS + i] = (chars[i] < 0x100) ? chars[i] : '?';
+        }
+      }
+
+      next_order--;
+      if (next_order == 0) complete = 1;
+      continue;
+    }
+
+    if (entry->attr & FAT_ATTR_VOLUME) {
+      next_order = complete = 0;
+      continue;
+    }
+
+    // The long name is only used when it belongs to this short name
+    if (complete && long_name[0] && fat_lfn_checksum (entry->name) == checksum) {
+      strncpy (name, long_name, FAT_MAX_NAME - 1);
+      name[FAT_MAX_NAME - 1] = 0;
+    } else {
+      fat_short_to_c_name (entry, name);
+    }
+
+    *inode_nr = disk_offset / sizeof (fat_dirent_t);
+    return 1;
+  }
+}
+
+
+/**
+ * Finds count free directory entries in a row. The directory is extended with new
+ * clusters when there is not enough room (the fixed FAT16 root directory cannot grow).
+ *
+ * @return 1 and the byte position of the first entry in *position, 0 when there is no room
+ */
+int fat_dir_find_free (struct vfs_mount *mount, Uint32 dir_cluster, int count, Uint32 *position) {
+  fat_info_t *fat_info = mount->fs_data;
+  Uint32 pos, start = 0, last, cluster, clusters;
+  Uint64 disk_offset;
+  Uint8 first;
+  int run = 0;
+
+  for (pos=0; ; pos+=sizeof (fat_dirent_t)) {
+    disk_offset = fat_dir_diskoffset (mount, dir_cluster, pos);
+    if (disk_offset == 0) break;
+    if (bcache_read (mount->dev, disk_offset, 1, (char *)&first) != 1) return 0;
+
+    if (first != FAT_ENTRY_END && first != FAT_ENTRY_DELETED) {
+      run = 0;
+      continue;
+    }
+
+    if (run == 0) start = pos;
+    if (++run == count) {
+      *position = start;
+      return 1;
+    }
+  }
+
+  if (dir_cluster == 0) return 0;
+
+  // Add zeroed clusters to the end of the directory
+  while (run < count) {
+    if (pos + fat_info->cluster_size > FAT_MAX_DIR_SIZE) return 0;
+
+    last = fat_map_clusters (mount, dir_cluster, pos / fat_info->cluster_size - 1, 1, &clusters);
+    if (last == 0) return 0;
+
+    cluster = fat_alloc_cluster (mount, last + 1);
+    if (cluster == 0) return 0;
+
+    if (! fat_zero (mount, fat_cluster2diskoffset (fat_info, cluster), fat_info->cluster_size) || ! fat_set_entry (mount, last, cluster)) {
+      fat_free_chain (mount, cluster);
+      return 0;
+    }
+
+    if (run == 0) start = pos;
+    run += fat_info->cluster_size / sizeof (fat_dirent_t);
+    pos += fat_info->cluster_size;
+  }
+
+  *position = start;
+  return 1;
+}
+
+
+/**
+ * Converts a character to uppercase
+ */
+char fat_toupper (char c) {
+  return (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+}
+
+
+/**
+ * Converts a character to lowercase
+ */
+char fat_tolower (char c) {
+  return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+
+/**
+ * Returns the checksum of a short name that is stored in its long filename entries
+ */
+Uint8 fat_lfn_checksum (const Uint8 *short_name) {
+  Uint8 sum = 0;
+  int i;
+
+  for (i=0; i!=11; i++) sum = ((sum & 1) ? 0x80 : 0) + (sum >> 1) + short_name[i];
+  return sum;
+}
+
+
+/**
+ * Converts the short name of a directory entry into a C string ("README.TXT")
+ */
+void fat_short_to_c_name (fat_dirent_t *entry, char *name) {
+  int i, j = 0;
+  char c;
+
+  for (i=0; i!=8 && entry->name[i] != ' '; i++) {
+    c = (i == 0 && entry->name[i] == FAT_ENTRY_KANJI) ? FAT_ENTRY_DELETED : entry->name[i];
+    name[j++] = (entry->nt_flags & FAT_NT_LOWER_BASE) ? fat_tolower (c) : c;
+  }
+
+  if (entry->name[8] != ' ') {
+    name[j++] = '.';
+    for (i=8; i!=11 && entry->name[i] != ' '; i++) {
+      name[j++] = (entry->nt_flags & FAT_NT_LOWER_EXT) ? fat_tolower (entry->name[i]) : entry->name[i];
+    }
+  }
+
+  name[j] = 0;
+}
+
+
+/**
+ * Returns the character as it is stored inside a short name. Clears *exact when the
+ * character had to be changed.
+ */
+char fat_short_char (char c, int *exact) {
+  const char *invalid = "+,;=[]";
+
+  if ((Uint8)c >= 0x80) {
+    *exact = 0;
+    return '_';
+  }
+  while (*invalid) {
+    if (*invalid++ == c) {
+      *exact = 0;
+      return '_';
+    }
+  }
+
+  // Lowercase is only kept inside the long name
+  if (c >= 'a' && c <= 'z') *exact = 0;
+  return fat_toupper (c);
+}
+
+
+/**
+ * Converts a C string into a space padded 8.3 name. Characters that are not allowed
+ * become '_', lowercase becomes uppercase, and base and extension are cut off.
+ *
+ * @return 1 when the short name is exactly the same as name, 0 when a long name is needed
+ */
+int fat_c_to_short_name (const char *name, Uint8 *short_name) {
+  const char *ext = NULL;
+  int exact = 1;
+  int i, j;
+  char c;
+
+  memset (short_name, ' ', 11);
+
+  // The extension starts at the last dot, a dot at the start is part of the base
+  for (i=0; name[i]; i++) if (name[i] == '.') ext = name + i;
+  if (ext == name) ext = NULL;
+
+  for (i=0, j=0; name[i] && name + i != ext; i++) {
+    c = name[i];
+    if (c == ' ' || c == '.') {
+      exact = 0;
+      continue;
+    }
+    if (j == 8) {
+      exact = 0;
+      break;
+    }
+    short_name[j++] = fat_short_char (c, &exact);
+  }
+
+  for (i=1, j=8; ext && ext[i]; i++) {
+    c = ext[i];
+    if (c == ' ') {
+      exact = 0;
+      continue;
+    }
+    if (j == 11) {
+      exact = 0;
+      break;
+    }
+    short_name[j++] = fat_short_char (c, &exact);
+  }
+
+  // Names without a usable base (like "...x") still need something in front
+  if (short_name[0] == ' ') {
+    short_name[0] = '_';
+    exact = 0;
+  }
+
+  if (short_name[0] == FAT_ENTRY_DELETED) short_name[0] = FAT_ENTRY_KANJI;
+  return exact;
+}
+
+
+/**
+ * Returns 1 when a directory holds an entry with this short name
+ */
+int fat_short_name_exists (struct vfs_mount *mount, Uint32 dir_cluster, const Uint8 *short_name) {
+  char name[FAT_MAX_NAME];
+  fat_dirent_t entry;
+  Uint32 position = 0;
+  inode_t inode_nr;
+
+  while (fat_dir_next (mount, dir_cluster, &position, name, &entry, &inode_nr)) {
+    if (strncmp ((char *)entry.name, (char *)short_name, 11) == 0) return 1;
+  }
+  return 0;
+}
+
+
+/**
+ * Returns 1 when both names are the same (FAT names are not case sensitive)
+ */
+int fat_compare_names (const char *name1, const char *name2) {
+  while (*name1 && fat_toupper (*name1) == fat_toupper (*name2)) {
+    name1++;
+    name2++;
+  }
+  return (*name1 == *name2);
+}
+
+
+/**
+ * Reads a file
+ */
+Uint32 fat_read (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer) {
+  fat_info_t *fat_info = node->mount->fs_data;
+  fat_dirent_t entry;
+  Uint32 count = 0;
+  Uint32 start, index, cluster_offset, cluster, clusters, len;
+  Uint64 disk_offset;
+
+  // We do need nothing to read
+  if (size == 0) return 0;
+
+  // Directories are read with fat_getdents()
+  if (! fat_read_dirent (node->mount, node->inode_nr, &entry)) return 0;
+  if (entry.attr & FAT_ATTR_DIRECTORY) return 0;
+
+  // Cannot read behind file length
+  if (offset >= entry.size) return 0;
+  if (offset + size > entry.size || offset + size < offset) size = entry.size - offset;
+
+  start = fat_dirent_cluster (fat_info, &entry);
+  while (count != size) {
+    index = (offset + count) / fat_info->cluster_size;
+    cluster_offset = (offset + count) % fat_info->cluster_size;
+
+    // Find the run of clusters that holds (the start of) the rest of the data
+    clusters = (cluster_offset + (size - count) + fat_info->cluster_size - 1) / fat_info->cluster_size;
+    cluster = fat_map_clusters (node->mount, start, index, clusters, &clusters);
+    if (cluster == 0) break;
+
+    len = clusters * fat_info->cluster_size - cluster_offset;
+    if (len > size - count) len = size - count;
+    disk_offset = fat_cluster2diskoffset (fat_info, cluster) + cluster_offset;
+
+    // Small reads stay in the cache, larger ones do not push out the directories and FAT
+    if (len < BCACHE_BLOCK_SIZE) {
+      if (bcache_read (node->mount->dev, disk_offset, len, buffer + count) != len) break;
+    } else {
+      if (bcache_read_uncached (node->mount->dev, disk_offset, len, buffer + count) != len) break;
+    }
+
+    count += len;
+  }
+
+  return count;
+}
+
+
+/**
+ * Reads a part of a file into the buffer cache. Every run of clusters that follow each
+ * other on disk is handed to the cache at once.
+ */
+void fat_readahead (vfs_node_t *node, Uint32 offset, Uint32 size) {
+  fat_info_t *fat_info = node->mount->fs_data;
+  fat_dirent_t entry;
+  Uint32 start, index, last, cluster, clusters;
+
+  if (size == 0) return;
+  if (! fat_read_dirent (node->mount, node->inode_nr, &entry)) return;
+
+  start = fat_dirent_cluster (fat_info, &entry);
+  index = offset / fat_info->cluster_size;
+  last = (offset + size - 1) / fat_info->cluster_size;
+
+  while (index <= last) {
+    cluster = fat_map_clusters (node->mount, start, index, last - index + 1, &clusters);
+    if (cluster == 0) break;
+
+    bcache_readahead (node->mount->dev, fat_cluster2diskoffset (fat_info, cluster), clusters * fat_info->cluster_size);
+    index += clusters;
+  }
+}
+
+
+/**
+ * Writes size bytes at offset into the clusters of a directory entry, or zeros when
+ * buffer is NULL. Clusters are added when the chain is too short, and the size of the
+ * entry grows when writing past its end. The entry itself is not written to disk.
+ *
+ * @return number of bytes written
+ */
+Uint32 fat_write_range (struct vfs_mount *mount, fat_dirent_t *entry, Uint32 offset, Uint32 size, char *buffer) {
+  fat_info_t *fat_info = mount->fs_data;
+  Uint32 count = 0;
+  Uint32 start, index, cluster_offset, cluster, previous, clusters, len;
+  Uint64 disk_offset;
+
+  while (count != size) {
+    index = (offset + count) / fat_info->cluster_size;
+    cluster_offset = (offset + count) % fat_info->cluster_size;
+
+    start = fat_dirent_cluster (fat_info, entry);
+    clusters = (cluster_offset + (size - count) + fat_info->cluster_size - 1) / fat_info->cluster_size;
+    cluster = fat_map_clusters (mount, start, index, clusters, &clusters);
+
+    if (cluster == 0) {
+      // The chain ends here, add a cluster right behind the previous one when possible
+      if (index == 0) {
+        cluster = fat_alloc_cluster (mount, 0);
+        if (cluster == 0) break;
+        fat_dirent_set_cluster (fat_info, entry, cluster);
+      } else {
+        previous = fat_map_clusters (mount, start, index - 1, 1, &clusters);
+        if (previous == 0) break;
+
+        cluster = fat_alloc_cluster (mount, previous + 1);
+        if (cluster == 0) break;
+        if (! fat_set_entry (mount, previous, cluster)) {
+          fat_free_chain (mount, cluster);
+          break;
+        }
+      }
+      clusters = 1;
+    }
+
+    len = clusters * fat_info->cluster_size - cluster_offset;
+    if (len > size - count) len = size - count;
+    disk_offset = fat_cluster2diskoffset (fat_info, cluster) + cluster_offset;
+
+    if (buffer) {
+      if (bcache_write (mount->dev, disk_offset, len, buffer + count) != len) break;
+    } else {
+      if (! fat_zero (mount, disk_offset, len)) break;
+    }
+
+    count += len;
+    if (offset + count > entry->size) entry->size = offset + count;
+  }
+
+  return count;
+}
+
+
+/**
+ * Writes to a file. FAT files cannot have holes, so writing past the end first fills
+ * the gap with zeros.
+ */
+Uint32 fat_write (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer) {
+  fat_dirent_t entry;
+  Uint32 count = 0;
+  Uint32 gap;
+
+  // Files cannot be 4GB or larger
+  if (offset + size < offset) size = 0xFFFFFFFF - offset;
+  if (size == 0) return 0;
+
+  if (! fat_read_dirent (node->mount, node->inode_nr, &entry)) return 0;
+  if (entry.attr & (FAT_ATTR_DIRECTORY | FAT_ATTR_READONLY)) return 0;
+
+  gap = (offset > entry.size) ? offset - entry.size : 0;
+  if (gap == 0 || fat_write_range (node->mount, &entry, entry.size, gap, NULL) == gap) {
+    count = fat_write_range (node->mount, &entry, offset, size, buffer);
+  }
+
+  // @TODO: There is no real time clock yet, so the modification time is not set
+  fat_write_dirent (node->mount, node->inode_nr, &entry);
+  return count;
+}
+
+
+/**
+ * Changes the length of a file. Growing fills the file with zeros, shrinking frees
+ * the clusters that are not needed anymore.
+ *
+ * @return 0 when something is wrong
+ */
+int fat_truncate (vfs_node_t *node, Uint32 length) {
+  fat_info_t *fat_info = node->mount->fs_data;
+  fat_dirent_t entry;
+  Uint32 start, keep, last, next, clusters, gap;
+
+  if (! fat_read_dirent (node->mount, node->inode_nr, &entry)) return 0;
+  if (entry.attr & (FAT_ATTR_DIRECTORY | FAT_ATTR_READONLY)) return 0;
+
+  if (length > entry.size) {
+    gap = length - entry.size;
+    if (fat_write_range (node->mount, &entry, entry.size, gap, NULL) != gap) {
+      fat_write_dirent (node->mount, node->inode_nr, &entry);
+      return 0;
+    }
+    if (! fat_write_dirent (node->mount, node->inode_nr, &entry)) return 0;
+
+    node->length = length;
+    return 1;
+  }
+
+  start = fat_dirent_cluster (fat_info, &entry);
+  keep = (length + fat_info->cluster_size - 1) / fat_info->cluster_size;
+  fat_chain_forget (fat_info, start);
+
+  entry.size = length;
+  if (keep == 0) {
+    // The entry must not point to the chain anymore before the chain is freed
+    fat_dirent_set_cluster (fat_info, &entry, 0);
+    if (! fat_write_dirent (node->mount, node->inode_nr, &entry)) return 0;
+    fat_free_chain (node->mount, start);
+  } else {
+    if (! fat_write_dirent (node->mount, node->inode_nr, &entry)) return 0;
+
+    last = fat_map_clusters (node->mount, start, keep - 1, 1, &clusters);
+    next = last ? fat_get_entry (node->mount, last) : 0;
+    if (fat_valid_cluster (fat_info, next)) {
+      fat_set_entry (node->mount, last, (fat_info->type == FAT_TYPE_FAT32) ? FAT32_EOC_MARK : FAT16_EOC_MARK);
+      fat_free_chain (node->mount, next);
+    }
+  }
+
+  node->length = length;
+  return 1;
+}
+
+
+/**
+ * Creates a new (empty) file inside a directory. Names that do not fit an 8.3 name
+ * get long filename entries, and a unique short name with a "~N" tail.
+ *
+ * @return 0 when something is wrong
+ */
+int fat_create (vfs_node_t *node, const char *name, vfs_node_t *target_node) {
+  const char *invalid = "\"*/:<>?\\|";
+  fat_dirent_t entry;
+  fat_lfn_t lfn;
+  Uint8 short_name[11];
+  char tail[10];
+  Uint32 dir_cluster, position;
+  Uint64 disk_offset;
+  int namelen, exact, parts, order, base, len, i, j, k;
+  Uint16 c;
+
+  // Check if it's a directory
+  if ((node->flags & 0x7) != FS_DIRECTORY) return 0;
+
+  // Names must fit into the name of a vfs node
+  namelen = strlen (name);
+  if (namelen == 0 || namelen > FAT_MAX_NAME - 1) return 0;
+  if (strcmp (name, ".") == 0 || strcmp (name, "..") == 0) return 0;
+  if (name[namelen - 1] == '.' || name[namelen - 1] == ' ') return 0;
+  for (i=0; i!=namelen; i++) {
+    if ((Uint8)name[i] < 0x20) return 0;
+    for (j=0; invalid[j]; j++) if (name[i] == invalid[j]) return 0;
+  }
+
+  if (fat_finddir (node, name, target_node)) return 0;
+
+  dir_cluster = fat_dir_cluster (node);
+  exact = fat_c_to_short_name (name, short_name);
+
+  if (! exact) {
+    // Find a "~N" tail that makes the short name unique
+    for (base=0; base!=8 && short_name[base] != ' '; base++) ;
+    for (i=1; i!=1000000; i++) {
+      len = sprintf (tail, "~%d", i);
+      k = (base > 8 - len) ? 8 - len : base;
+      memcpy (short_name + k, tail, len);
+      if (! fat_short_name_exists (node->mount, dir_cluster, short_name)) break;
+    }
+    if (i == 1000000) return 0;
+  } else if (fat_short_name_exists (node->mount, dir_cluster, short_name)) {
+    return 0;
+  }
+
+  parts = exact ? 0 : (namelen + FAT_LFN_CHARS - 1) / FAT_LFN_CHARS;
+  if (! fat_dir_find_free (node->mount, dir_cluster, parts + 1, &position)) return 0;
+
+  // Long filename parts are stored last part first, right in front of the short entry
+  for (i=0; i!=parts; i++) {
+    order = parts - i;
+
+    memset (&lfn, 0, sizeof (fat_lfn_t));
+    lfn.order = order | (i == 0 ? FAT_LFN_LAST : 0);
+    lfn.attr = FAT_ATTR_LFN;
+    lfn.checksum = fat_lfn_checksum (short_name);
+
+    // The name ends with a 0 (when there is room) and is padded with 0xFFFF
+    for (j=0; j!=FAT_LFN_CHARS; j++) {
+      k = (order - 1) * FAT_LFN_CHARS + j;
+      c = (k < namelen) ? (Uint8)name[k] : (k == namelen) ? 0 : 0xFFFF;
+      if (j < 5) {
+        lfn.name1[j] = c;
+      } else if (j < 11) {
+        lfn.name2[j - 5] = c;
+      } else {
+        lfn.name3[j - 11] = c;
+      }
+    }
+
+    disk_offset = fat_dir_diskoffset (node->mount, dir_cluster, position + i * sizeof (fat_dirent_t));
+    if (disk_offset == 0) return 0;
+    if (bcache_write (node->mount->dev, disk_offset, sizeof (fat_lfn_t), (char *)&lfn) != sizeof (fat_lfn_t)) return 0;
+  }
+
+  // @TODO: There is no real time clock yet, so all time stamps are 0
+  memset (&entry, 0, sizeof (fat_dirent_t));
+  memcpy (entry.name, short_name, 11);
+  entry.attr = FAT_ATTR_ARCHIVE;
+
+  disk_offset = fat_dir_diskoffset (node->mount, dir_cluster, position + parts * sizeof (fat_dirent_t));
+  if (disk_offset == 0) return 0;
+  if (! fat_write_dirent (node->mount, disk_offset / sizeof (fat_dirent_t), &entry)) return 0;
+
+  // Copy node info into new node
+  memcpy (target_node, node, sizeof (vfs_node_t));
+  target_node->inode_nr = disk_offset / sizeof (fat_dirent_t);
+  strcpy (target_node->name, name);
+  target_node->owner = 0;
+  target_node->length = 0;
+  target_node->flags = FS_FILE;
+
+  return 1;
+}
+
+
+/**
+ * Called when a file is opened
+ */
+void fat_open (vfs_node_t *node) {
+  fat_dirent_t entry;
+
+  // The node might come from the path cache, so take the current length from the entry
+  if (! fat_read_dirent (node->mount, node->inode_nr, &entry)) return;
+  if (! (entry.attr & FAT_ATTR_DIRECTORY)) node->length = entry.size;
+}
+
+
+/**
+ * Called when a file is closed
+ */
+void fat_close (vfs_node_t *node) {
+  // Keep the free cluster hints on disk up to date
+  fat_write_fsinfo (node->mount);
+}
+
+
+/**
+ * Finds a file inside a directory. Files can be found by their long and by their
+ * short name, neither is case sensitive.
+ */
+int fat_finddir (vfs_node_t *node, const char *name, vfs_node_t *target_node) {
+  char entry_name[FAT_MAX_NAME];
+  char short_name[13];
+  fat_dirent_t entry;
+  Uint32 dir_cluster, position = 0;
+  inode_t inode_nr;
+
+  // Check if it's a directory
+  if ((node->flags & 0x7) != FS_DIRECTORY) return 0;
+
+  dir_cluster = fat_dir_cluster (node);
+  while (fat_dir_next (node->mount, dir_cluster, &position, entry_name, &entry, &inode_nr)) {
+    fat_short_to_c_name (&entry, short_name);
+    if (! fat_compare_names (name, entry_name) && ! fat_compare_names (name, short_name)) continue;
+
+    // Copy node info into new node
+    memcpy (target_node, node, sizeof (vfs_node_t));
+    target_node->inode_nr = inode_nr;
+    strcpy (target_node->name, entry_name);
+    target_node->owner = 0;
+    target_node->length = (entry.attr & FAT_ATTR_DIRECTORY) ? 0 : entry.size;
+    target_node->flags = (entry.attr & FAT_ATTR_DIRECTORY) ? FS_DIRECTORY : FS_FILE;
+    return 1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * Reads up to count directory entries. *offset is the byte position inside the
+ * directory and is moved past the entries that are returned.
+ */
+int fat_getdents (vfs_node_t *node, Uint32 *offset, vfs_dirent_t *dirents, int count) {
+  fat_dirent_t entry;
+  Uint32 dir_cluster;
+  int filled = 0;
+
+  // Check if it's a directory
+  if ((node->flags & 0x7) != FS_DIRECTORY) return 0;
+
+  dir_cluster = fat_dir_cluster (node);
+  while (filled != count && fat_dir_next (node->mount, dir_cluster, offset, dirents[filled].name, &entry, &dirents[filled].inode_nr)) {
+    filled++;
+  }
+
+  return filled;
+}
+
+
+/**
+ * Returns directory entry number index
+ */
+int fat_readdir (vfs_node_t *node, Uint32 index, vfs_dirent_t *target_dirent) {
+  Uint32 offset = 0;
+
+  // Skip index entries
+  while (fat_getdents (node, &offset, target_dirent, 1) == 1) {
+    if (index == 0) return 1;
+    index--;
+  }
+
+  return 0;
+}
+
+
+/**
+ * Initialises the FAT16/FAT32 filesystem
+ */
+void fat_init (void) {
+  // Register file system to the VFS
+  vfs_register_filesystem (&fat_vfs_info);
+}
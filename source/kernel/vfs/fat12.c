@@ -10,6 +10,7 @@
 #include "kernel.h"
 #include "kmem.h"
 #include "vfs.h"
+#include "bcache.h"
 #include "vfs/fat12.h"
 #include "drivers/floppy.h"
 #include "device.h"
@@ -18,7 +19,9 @@
 static struct vfs_fileops fat12_fileops = {
     .read = fat12_read, .write = fat12_write,
     .open = fat12_open, .close = fat12_close,
-    .readdir = fat12_readdir, .finddir = fat12_finddir
+    .readdir = fat12_readdir, .finddir = fat12_finddir,
+    .getdents = fat12_getdents,
+    .readahead = fat12_readahead
 };
 
 // Mount operations
@@ -68,13 +71,13 @@ vfs_node_t *fat12_mount (struct vfs_mount *mount, device_t *dev, const char *pat
   if (!fat12_info) goto cleanup;
   memset (fat12_info, 0, sizeof (fat12_fatinfo_t));
 
-  // Allocate and read BPB
-  fat12_info->bpb = (fat12_bpb_t *)kmalloc (sizeof (fat12_bpb_t));
+  // Allocate and read BPB (the whole boot sector is read into it)
+  fat12_info->bpb = (fat12_bpb_t *)kmalloc (512);
   if (!fat12_info->bpb) goto cleanup;
-  memset (fat12_info->bpb, 0, sizeof (fat12_bpb_t));
+  memset (fat12_info->bpb, 0, 512);
 
   // Read boot sector from disk
-  int rb = mount->dev->read (mount->dev->major_num, mount->dev->minor_num, 0, 512, (char *)fat12_info->bpb);
+  int rb = bcache_read (mount->dev, 0, 512, (char *)fat12_info->bpb);
   if (rb != 512) {
     kprintf ("Cannot read enough bytes from boot sector (%d read, %d needed)\n", rb, fat12_info->bpb->BytesPerSector);
     goto cleanup;
@@ -104,9 +107,15 @@ vfs_node_t *fat12_mount (struct vfs_mount *mount, device_t *dev, const char *pat
   fat12_info->fatEntrySizeBits        = 8;
   fat12_info->numRootEntries          = fat12_info->bpb->NumDirEntries;
   fat12_info->numRootEntriesPerSector = fat12_info->bpb->BytesPerSector / 32;
-  fat12_info->rootOffset              = (fat12_info->bpb->NumberOfFats * fat12_info->bpb->SectorsPerFat) + 1;
-  fat12_info->rootSizeSectors         = (fat12_info->bpb->NumDirEntries * 32 ) / fat12_info->bpb->BytesPerSector;
-  fat12_info->dataOffset              = fat12_info->rootOffset + fat12_info->rootSizeSectors - 2;
+  fat12_info->rootOffset              = (fat12_info->bpb->NumberOfFats * fat12_info->bpb->SectorsPerFat) + fat12_info->bpb->ReservedSectors;
+  fat12_info->rootSizeSectors         = (fat12_info->bpb->NumDirEntries * 32 + fat12_info->bpb->BytesPerSector - 1) / fat12_info->bpb->BytesPerSector;
+  fat12_info->dataOffset              = fat12_info->rootOffset + fat12_info->rootSizeSectors;
+  fat12_info->clusterSize             = fat12_info->bpb->SectorsPerCluster * fat12_info->bpb->BytesPerSector;
+
+  if (fat12_info->clusterSize == 0) {
+    kprintf ("Invalid cluster size\n");
+    goto cleanup;
+  }
 
 /*
   kprintf ("FAT12INFO\n");
@@ -132,7 +141,7 @@ vfs_node_t *fat12_mount (struct vfs_mount *mount, device_t *dev, const char *pat
 
   for (i=0; i!=fat12_info->fatSizeSectors; i++) {
     Uint32 offset = (fat12_info->fatOffset+i) * fat12_info->bpb->BytesPerSector;
-    int rb = mount->dev->read (mount->dev->major_num, mount->dev->minor_num, offset, fat12_info->bpb->BytesPerSector, (char *)fat12_info->fat+(i*512));
+    int rb = bcache_read (mount->dev, offset, fat12_info->bpb->BytesPerSector, (char *)fat12_info->fat+(i*fat12_info->bpb->BytesPerSector));
     if (rb != fat12_info->bpb->BytesPerSector) {
       kprintf ("Cannot read fat sector %d\n", i);
       goto cleanup;
@@ -167,6 +176,12 @@ vfs_node_t *fat12_mount (struct vfs_mount *mount, device_t *dev, const char *pat
   }
 */
 
+  // Cluster maps are built when files are opened
+  fat12_info->extent_maps = (fat12_extent_map_t *)kmalloc (FAT12_EXTENT_MAPS * sizeof (fat12_extent_map_t));
+  if (!fat12_info->extent_maps) goto cleanup;
+  memset (fat12_info->extent_maps, 0, FAT12_EXTENT_MAPS * sizeof (fat12_extent_map_t));
+  fat12_info->extent_clock = 0;
+
 //  kprintf ("Returning FAT12's supernode\n");
   return &fat12_supernode;
 
@@ -187,6 +202,7 @@ void fat12_umount (struct vfs_mount *mount) {
   // Free our fs_data
   fat12_fatinfo_t *fat12_info = (fat12_fatinfo_t *)mount->fs_data;
 
+  kfree (fat12_info->extent_maps);
   kfree (fat12_info->fat);
   kfree (fat12_info->bpb);
   kfree (fat12_info);
@@ -195,13 +211,13 @@ void fat12_umount (struct vfs_mount *mount) {
 
 
 /**
- *
+ * Reads from a file. Clusters that follow each other on disk are read in one go.
  */
 Uint32 fat12_read (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer) {
   fat12_fatinfo_t *fat12_info = node->mount->fs_data; // Alias for easier usage
-  char *buf_ptr = buffer;
-  int count = size;
-  int tmp;
+  Uint32 count = 0;
+  Uint32 index, cluster_offset, clusters, disk_offset, len;
+  Uint16 cluster;
 
 //  kprintf ("Reading inode: %d  Offset: %d  Size: %d\n", node->inode_nr, offset, size);
 
@@ -209,87 +225,60 @@ Uint32 fat12_read (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer) {
   if (size == 0) return 0;
 
   // Cannot read behind file length
-  if (offset > node->length) return 0;
+  if (offset >= node->length) return 0;
 
   // We can only read X amount of bytes, so adjust maximum size
-  if (offset + size > node->length) {
-    kprintf ("Truncated size from %d\n", size);
-    size = node->length - offset;
-    kprintf ("to %d\n", size);
-  }
-
-  // Find the starting cluster we need to read from
-  int cluster_size = fat12_info->bpb->SectorsPerCluster * fat12_info->bpb->BytesPerSector;
-  if (cluster_size != 512) kpanic ("cluster size needs to be 512!");
-
-  int skip_cluster_count = offset / cluster_size;
-  int cluster_offset = offset % cluster_size;
-//  kprintf ("We need to skip the first %d clusters\n", skip_cluster_count);
-
-  /* Find start cluster and skip X amount of clusters to find the correct position in the
-   * file */
-  Uint16 cluster = node->inode_nr;
-  while (skip_cluster_count > 0) {
-//    kprintf ("Pre skip: %02X\n", cluster);
-    cluster = fat12_get_next_cluster (fat12_info->fat, cluster);
-//    kprintf ("Post skip: %02X\n", cluster);
-    skip_cluster_count--;
-  }
-
-
-  Uint32 disk_offset = (fat12_info->dataOffset+cluster) * fat12_info->bpb->SectorsPerCluster * fat12_info->bpb->BytesPerSector;
-//  kprintf ("Start cluster  : %08X\n", cluster);
-//  kprintf ("Disk offset    : %08X\n", disk_offset);
-//  kprintf ("Cluster offset : %08X\n", cluster_offset);
-
+  if (offset + size > node->length || offset + size < offset) size = node->length - offset;
+
+  while (count != size) {
+    index = (offset + count) / fat12_info->clusterSize;
+    cluster_offset = (offset + count) % fat12_info->clusterSize;
+
+    // Find the run of clusters that holds (the start of) the rest of the data
+    clusters = (cluster_offset + (size - count) + fat12_info->clusterSize - 1) / fat12_info->clusterSize;
+    cluster = fat12_map_clusters (fat12_info, node->inode_nr, index, clusters, &clusters);
+    if (cluster == 0) break;
+
+    len = clusters * fat12_info->clusterSize - cluster_offset;
+    if (len > size - count) len = size - count;
+    disk_offset = fat12_cluster2diskoffset (fat12_info, cluster) + cluster_offset;
+
+    // Small reads stay in the cache, larger ones do not push out the directories
+    if (len < BCACHE_BLOCK_SIZE) {
+      if (bcache_read (node->mount->dev, disk_offset, len, buffer + count) != len) break;
+    } else {
+      if (bcache_read_uncached (node->mount->dev, disk_offset, len, buffer + count) != len) break;
+    }
 
-  // Read partial cluster
-  if (size + cluster_offset < 512) {
-//    kprintf ("Reading partial cluster\n");
-    // We do not cross a sector, only 1 sector is needed
-    node->mount->dev->read (node->mount->dev->major_num, node->mount->dev->minor_num, disk_offset + cluster_offset, size, buffer);
-//    kprintf ("Returing %d bytes read\n", size);
-    return size;
+    count += len;
   }
 
+//  kprintf ("Returing %d bytes read\n", count);
+  return count;
+}
 
-  // read intial half block
-  if (cluster_offset > 0) {
-//    kprintf ("Reading intial half cluster\n");
-    tmp = (cluster_size - cluster_offset);
-    disk_offset += 512-tmp;
-    node->mount->dev->read (node->mount->dev->major_num, node->mount->dev->minor_num, disk_offset, tmp, buf_ptr);
-
-    disk_offset += tmp;
-    buf_ptr += tmp;
-    count -= tmp;
-  }
 
-  // read whole blocks
-  while (count > 512) {
-//    kprintf ("Reading whole cluster\n");
-    node->mount->dev->read (node->mount->dev->major_num, node->mount->dev->minor_num, disk_offset, 512, buf_ptr);
+/**
+ * Reads a part of a file into the buffer cache. Every run of clusters that follow each
+ * other on disk is handed to the cache at once.
+ */
+void fat12_readahead (vfs_node_t *node, Uint32 offset, Uint32 size) {
+  fat12_fatinfo_t *fat12_info = node->mount->fs_data; // Alias for easier usage
+  Uint32 index, last, clusters;
+  Uint16 cluster;
 
-    disk_offset += 512;
-    buf_ptr += 512;
-    count -= 512;
-  }
+  if (size == 0) return;
 
-  // read last half block
-  if (count > 0) {
-//    kprintf ("Reading final partial cluster\n");
-    tmp = count;
+  index = offset / fat12_info->clusterSize;
+  last = (offset + size - 1) / fat12_info->clusterSize;
 
-    node->mount->dev->read (node->mount->dev->major_num, node->mount->dev->minor_num, disk_offset, tmp, buf_ptr);
+  while (index <= last) {
+    cluster = fat12_map_clusters (fat12_info, node->inode_nr, index, last - index + 1, &clusters);
+    if (cluster == 0) break;
 
-    disk_offset += tmp;
-    buf_ptr += tmp;
-    count -= tmp;
+    bcache_readahead (node->mount->dev, fat12_cluster2diskoffset (fat12_info, cluster), clusters * fat12_info->clusterSize);
+    index += clusters;
   }
-
-
-//  kprintf ("Returing %d bytes read\n", size);
-  return size;
 }
 
 /**
@@ -305,6 +294,9 @@ Uint32 fat12_write (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer)
  */
 void fat12_open (vfs_node_t *node) {
 //  node->block->open (node->block->major, node->block->minor);
+
+  // Build the cluster map now, so reads and seeks do not need to walk the FAT
+  if ((node->flags & 0x7) == FS_FILE) fat12_get_extent_map (node->mount->fs_data, node->inode_nr);
 }
 
 /**
@@ -330,7 +322,7 @@ vfs_dirent_t *fat12_readdir (vfs_node_t *node, Uint32 index) {
 
   // Every sector holds this many directories
   int dirsPerSector = fat12_info->bpb->BytesPerSector / 32;
-  int sectorNeeded = index / dirsPerSector;   // Sector we need (@TODO: problem when sector != cluster)
+  int sectorNeeded = index / dirsPerSector;   // Sector we need
   int indexNeeded = index % dirsPerSector;    // N'th entry in this sector needed
 
   // Create entry that holds 1 sector
@@ -342,19 +334,19 @@ vfs_dirent_t *fat12_readdir (vfs_node_t *node, Uint32 index) {
 //    kprintf ("Root read\n");
     Uint32 offset = (fat12_info->rootOffset+sectorNeeded) * fat12_info->bpb->BytesPerSector;
 //    kprintf ("Offset: %08X\n", offset);
-    node->mount->dev->read (node->mount->dev->major_num, node->mount->dev->minor_num, offset, fat12_info->bpb->BytesPerSector, (char *)direntbuf);
+    bcache_read (node->mount->dev, offset, fat12_info->bpb->BytesPerSector, (char *)direntbuf);
   } else {
 //    kprintf ("Cluster read read\n");
     // First start cluster (which is the INODE number :P), and seek N'th cluster
     Uint16 cluster = node->inode_nr;
-    for (i=0; i!=sectorNeeded; i++) {
+    for (i=0; i!=sectorNeeded / fat12_info->bpb->SectorsPerCluster; i++) {
       cluster = fat12_get_next_cluster (fat12_info->fat, cluster);
     }
 
-    // Read this cluster
-    Uint32 offset = (fat12_info->dataOffset+cluster) * fat12_info->bpb->BytesPerSector;
+    // Read the sector from this cluster
+    Uint32 offset = fat12_cluster2diskoffset (fat12_info, cluster) + (sectorNeeded % fat12_info->bpb->SectorsPerCluster) * fat12_info->bpb->BytesPerSector;
 //    kprintf ("Offset: %08X\n", offset);
-    node->mount->dev->read (node->mount->dev->major_num, node->mount->dev->minor_num, offset, fat12_info->bpb->BytesPerSector, (char *)direntbuf);
+    bcache_read (node->mount->dev, offset, fat12_info->bpb->BytesPerSector, (char *)direntbuf);
   }
 
   // Seek correcy entry
@@ -384,6 +376,62 @@ vfs_dirent_t *fat12_readdir (vfs_node_t *node, Uint32 index) {
 }
 
 
+/**
+ * Reads at most count directory entries, starting at entry *offset of the directory.
+ * *offset is moved past the returned entries, so the next call continues where this
+ * one stopped. Returns the number of entries returned, 0 at the end of the directory.
+ */
+int fat12_getdents (vfs_node_t *node, Uint32 *offset, vfs_dirent_t *dirents, int count) {
+  fat12_fatinfo_t *fat12_info = node->mount->fs_data; // Alias for easier usage
+  fat12_dirent_t entry;
+  Uint32 disk_offset, sector;
+  Uint32 cluster_index = 0;
+  Uint16 cluster = node->inode_nr;
+  int filled = 0;
+
+  // Check if it's a directory
+  if ((node->flags & 0x7) != FS_DIRECTORY) return 0;
+
+  // Every sector holds this many directories
+  int dirsPerSector = fat12_info->bpb->BytesPerSector / 32;
+
+  while (filled != count) {
+    sector = *offset / dirsPerSector;
+
+    if (node->inode_nr == 0) {
+      // The root directory has a fixed size
+      if (sector >= fat12_info->rootSizeSectors) break;
+      disk_offset = (fat12_info->rootOffset+sector) * fat12_info->bpb->BytesPerSector;
+    } else {
+      // Follow the cluster chain up to the cluster that holds the sector we need
+      while (cluster_index != sector / fat12_info->bpb->SectorsPerCluster && cluster >= 0x002 && cluster <= 0xFF7) {
+        cluster = fat12_get_next_cluster (fat12_info->fat, cluster);
+        cluster_index++;
+      }
+      if (cluster < 0x002 || cluster > 0xFF7) break;
+      disk_offset = fat12_cluster2diskoffset (fat12_info, cluster) + (sector % fat12_info->bpb->SectorsPerCluster) * fat12_info->bpb->BytesPerSector;
+    }
+    disk_offset += (*offset % dirsPerSector) * sizeof (fat12_dirent_t);
+
+    if (bcache_read (node->mount->dev, disk_offset, sizeof (fat12_dirent_t), (char *)&entry) != sizeof (fat12_dirent_t)) break;
+
+    // No more entries when first char of filename is 0
+    if (entry.Filename[0] == 0) break;
+
+    (*offset)++;
+
+    // Skip deleted entries, the volume label and long filename entries
+    if (entry.Filename[0] == 0xE5 || (entry.Attrib & 0x08)) continue;
+
+    fat12_convert_dos_to_c_filename (dirents[filled].name, (char *)entry.Filename);
+    dirents[filled].inode_nr = entry.FirstCluster;
+    filled++;
+  }
+
+  return filled;
+}
+
+
 /**
  * Returns:
  *   0 = end of buffer, need more data
@@ -450,7 +498,7 @@ vfs_node_t *fat12_finddir (vfs_node_t *node, const char *name) {
     for (i=0; i!=fat12_info->rootSizeSectors; i++) {
       // Read directory sector
       Uint32 offset = (fat12_info->rootOffset+i) * fat12_info->bpb->BytesPerSector;
-      node->mount->dev->read (node->mount->dev->major_num, node->mount->dev->minor_num, offset, fat12_info->bpb->BytesPerSector, (char *)direntbuf);
+      bcache_read (node->mount->dev, offset, fat12_info->bpb->BytesPerSector, (char *)direntbuf);
 
       int ret = fat12_parse_directory_sector (direntbuf, node, dosName);
       switch (ret) {
@@ -475,22 +523,24 @@ vfs_node_t *fat12_finddir (vfs_node_t *node, const char *name) {
     // Do as long as we have file entries (always padded on sector which is always divved by 512)
     do {
       // read 1 sector at a time
-      Uint32 offset = (fat12_info->dataOffset+cluster) * fat12_info->bpb->BytesPerSector;
-      node->mount->dev->read (node->mount->dev->major_num, node->mount->dev->minor_num, offset, fat12_info->bpb->BytesPerSector, (char *)direntbuf);
-
-      int ret = fat12_parse_directory_sector (direntbuf, node, dosName);
-      switch (ret) {
-        case 0 :
-                  // More directories needed, read next sector
-                  break;
-        case 1 :
-                  // Directory found
-                  kfree (direntbuf);
-                  return &filenode;
-        case 2 :
-                  // No directory found and end of buffer
-                  kfree (direntbuf);
-                  return NULL;
+      for (i=0; i!=fat12_info->bpb->SectorsPerCluster; i++) {
+        Uint32 offset = fat12_cluster2diskoffset (fat12_info, cluster) + i * fat12_info->bpb->BytesPerSector;
+        bcache_read (node->mount->dev, offset, fat12_info->bpb->BytesPerSector, (char *)direntbuf);
+
+        int ret = fat12_parse_directory_sector (direntbuf, node, dosName);
+        switch (ret) {
+          case 0 :
+                    // More directories needed, read next sector
+                    break;
+          case 1 :
+                    // Directory found
+                    kfree (direntbuf);
+                    return &filenode;
+          case 2 :
+                    // No directory found and end of buffer
+                    kfree (direntbuf);
+                    return NULL;
+        }
       }
 
       // Fetch next cluster from file
@@ -617,3 +667,107 @@ Uint16 fat12_get_next_cluster (fat12_fat_t *fat, Uint16 cluster) {
 
   return next_cluster;
 }
+
+
+/**
+ * Returns the offset on disk of a data cluster
+ */
+Uint32 fat12_cluster2diskoffset (fat12_fatinfo_t *fat12_info, Uint16 cluster) {
+  return (fat12_info->dataOffset + (cluster - 2) * fat12_info->bpb->SectorsPerCluster) * fat12_info->bpb->BytesPerSector;
+}
+
+
+/**
+ * Returns the cluster map of the file that starts at start_cluster, or NULL for empty
+ * files. Maps are built by walking the FAT once and kept in a small LRU cache. Since
+ * nothing writes the FAT yet, maps never have to be invalidated.
+ */
+fat12_extent_map_t *fat12_get_extent_map (fat12_fatinfo_t *fat12_info, Uint16 start_cluster) {
+  fat12_extent_map_t *map, *victim = NULL;
+  fat12_extent_t *extent = NULL;
+  Uint16 cluster;
+  Uint32 index;
+  int i;
+
+  if (start_cluster < 0x002 || start_cluster > 0xFF7) return NULL;
+
+  fat12_info->extent_clock++;
+
+  for (i=0; i!=FAT12_EXTENT_MAPS; i++) {
+    map = &fat12_info->extent_maps[i];
+    if (map->start_cluster == start_cluster) {
+      map->last_used = fat12_info->extent_clock;
+      return map;
+    }
+    if (! victim || map->last_used < victim->last_used) victim = map;
+  }
+
+  // Not cached, reuse the least recently used map
+  map = victim;
+  map->start_cluster = start_cluster;
+  map->extent_count = 0;
+  map->last_used = fat12_info->extent_clock;
+
+  // A FAT12 chain can never be longer than 0xFF8 clusters, so a corrupt (looping) FAT ends here too
+  cluster = start_cluster;
+  for (index = 0; cluster >= 0x002 && cluster <= 0xFF7 && index != 0xFF8; index++) {
+    if (extent && cluster == extent->cluster + extent->count) {
+      extent->count++;
+    } else {
+      if (map->extent_count == FAT12_MAX_EXTENTS) break;
+      extent = &map->extent[map->extent_count++];
+      extent->index = index;
+      extent->cluster = cluster;
+      extent->count = 1;
+    }
+    cluster = fat12_get_next_cluster (fat12_info->fat, cluster);
+  }
+
+//  kprintf ("fat12: mapped cluster chain %d in %d extents\n", start_cluster, map->extent_count);
+  return map;
+}
+
+
+/**
+ * Returns the disk cluster of the index'th cluster of the file that starts at
+ * start_cluster. *count is set to the number of clusters (at most max) that follow it
+ * on disk. Returns 0 when the file has no such cluster.
+ */
+Uint16 fat12_map_clusters (fat12_fatinfo_t *fat12_info, Uint16 start_cluster, Uint32 index, Uint32 max, Uint32 *count) {
+  fat12_extent_t *extent;
+  Uint16 cluster, next;
+  Uint32 i;
+
+  if (max == 0) max = 1;
+  *count = 0;
+
+  fat12_extent_map_t *map = fat12_get_extent_map (fat12_info, start_cluster);
+  if (! map || map->extent_count == 0) return 0;
+
+  for (i=0; i!=map->extent_count; i++) {
+    extent = &map->extent[i];
+    if (index < extent->index || index >= extent->index + extent->count) continue;
+
+    *count = extent->index + extent->count - index;
+    if (*count > max) *count = max;
+    return extent->cluster + (index - extent->index);
+  }
+
+  // A complete map has no further clusters
+  if (map->extent_count != FAT12_MAX_EXTENTS) return 0;
+
+  // Behind the mapped part of a very fragmented file, continue through the FAT
+  extent = &map->extent[map->extent_count - 1];
+  if (index < extent->index) return 0;
+  cluster = extent->cluster + extent->count - 1;
+  for (i = extent->index + extent->count - 1; i != index; i++) {
+    cluster = fat12_get_next_cluster (fat12_info->fat, cluster);
+    if (cluster < 0x002 || cluster > 0xFF7) return 0;
+  }
+
+  for (*count = 1; *count != max; (*count)++) {
+    next = fat12_get_next_cluster (fat12_info->fat, cluster + *count - 1);
+    if (next != cluster + *count) break;
+  }
+  return cluster;
+}
@@ -0,0 +1,686 @@
+/******************************************************************************
+ *
+ *  File        : iso9660.c
+ *  Description : ISO9660 filesystem (read only) with Joliet and Rock Ridge
+ *                names. Rock Ridge names are preferred, then Joliet names, and
+ *                plain ISO9660 names are used when there is neither.
+ *
+ *                The path table is loaded at mount time, so directories are
+ *                found without reading their parent directory. Directories are
+ *                identified by their index in the path table, other files by
+ *                the disk offset of their directory record divided by 2.
+ *
+ *****************************************************************************/
+
+#include "kernel.h"
+#include "kmem.h"
+#include "vfs.h"
+#include "bcache.h"
+#include "vfs/iso9660.h"
+
+// File operations
+static struct vfs_fileops iso9660_fileops = {
+    .read = iso9660_read,
+    .open = iso9660_open,
+    .readdir = iso9660_readdir, .finddir = iso9660_finddir,
+    .getdents = iso9660_getdents,
+    .readahead = iso9660_readahead
+};
+
+// Mount operations
+static struct vfs_mountops iso9660_mountops = {
+    .mount = iso9660_mount, .umount = iso9660_umount
+};
+
+// Global structure
+static vfs_info_t iso9660_vfs_info = { .tag = "iso9660",
+                                       .name = "ISO9660 File System (Joliet, Rock Ridge)",
+                                       .mountops = &iso9660_mountops
+                                     };
+
+// Root supernode (will be overwritten on mounting)
+static vfs_node_t iso9660_supernode = {
+  .inode_nr = ISO_ROOT_INO,
+  .name = "/",
+  .owner = 0,
+  .length = 0,
+  .flags = FS_DIRECTORY,
+  .major_num = 0,
+  .minor_num = 0,
+  .fileops = &iso9660_fileops,
+  .mount = NULL,
+};
+
+
+
+/**
+ * Called when a device that holds an ISO9660 filesystem gets mounted onto a mount_point
+ */
+vfs_node_t *iso9660_mount (struct vfs_mount *mount, device_t *dev, const char *path) {
+  iso_info_t *iso_info = NULL;
+  iso_volume_desc_t *vd = NULL;
+  Uint32 sector, primary = 0, joliet = 0;
+  Uint8 record[256];
+  Uint8 *su;
+
+  vd = (iso_volume_desc_t *)kmalloc (sizeof (iso_volume_desc_t));
+  if (! vd) goto cleanup;
+
+  // Find the primary and the Joliet volume descriptor
+  for (sector=ISO_FIRST_DESCRIPTOR; sector!=ISO_FIRST_DESCRIPTOR + ISO_MAX_DESCRIPTORS; sector++) {
+    if (bcache_read (mount->dev, (Uint64)sector * ISO_SECTOR_SIZE, ISO_SECTOR_SIZE, (char *)vd) != ISO_SECTOR_SIZE) goto cleanup;
+    if (strncmp ((char *)vd->id, "CD001", 5) != 0) goto cleanup;
+    if (vd->type == ISO_VD_TERMINATOR) break;
+
+    if (vd->type == ISO_VD_PRIMARY && ! primary) primary = sector;
+    if (vd->type == ISO_VD_SUPPLEMENTARY && ! joliet && vd->escape[0] == '%' && vd->escape[1] == '/' &&
+        (vd->escape[2] == '@' || vd->escape[2] == 'C' || vd->escape[2] == 'E')) joliet = sector;
+  }
+  if (! primary) goto cleanup;
+
+  iso_info = (iso_info_t *)kmalloc (sizeof (iso_info_t));
+  if (! iso_info) goto cleanup;
+  memset (iso_info, 0, sizeof (iso_info_t));
+  mount->fs_data = iso_info;
+
+  // Rock Ridge is there when the "." entry of the root directory starts with a SUSP "SP" entry
+  if (bcache_read (mount->dev, (Uint64)primary * ISO_SECTOR_SIZE, ISO_SECTOR_SIZE, (char *)vd) != ISO_SECTOR_SIZE) goto cleanup;
+  iso_info->block_size = vd->block_size;
+  if (iso_info->block_size < 512 || iso_info->block_size > ISO_SECTOR_SIZE || (iso_info->block_size & (iso_info->block_size - 1))) goto cleanup;
+
+  if (bcache_read (mount->dev, iso9660_block2diskoffset (iso_info, vd->root.extent), sizeof (record), (char *)record) != sizeof (record)) goto cleanup;
+  su = record + 34;
+  if (record[0] >= 34 + 7 && su[0] == 'S' && su[1] == 'P' && su[2] >= 7 && su[4] == 0xBE && su[5] == 0xEF) {
+    iso_info->names = ISO_NAMES_ROCKRIDGE;
+    iso_info->susp_skip = su[6];
+  } else if (joliet) {
+    if (bcache_read (mount->dev, (Uint64)joliet * ISO_SECTOR_SIZE, ISO_SECTOR_SIZE, (char *)vd) != ISO_SECTOR_SIZE) goto cleanup;
+    if (vd->block_size != iso_info->block_size) goto cleanup;
+    iso_info->names = ISO_NAMES_JOLIET;
+  } else {
+    iso_info->names = ISO_NAMES_ISO;
+  }
+
+  iso_info->root_extent = vd->root.extent;
+  iso_info->root_size = vd->root.size;
+
+  // Without a path table everything still works, but every lookup reads the directory
+  if (! iso9660_load_path_table (mount, vd)) kprintf ("ISO9660: cannot load the path table\n");
+
+//  kprintf ("ISO9660: %d directories, names: %d\n", iso_info->path_count, iso_info->names);
+
+  kfree (vd);
+
+  iso9660_supernode.length = 0;
+  iso9660_supernode.mount = mount;
+  return &iso9660_supernode;
+
+cleanup:
+  // Things went wrong when we are here. Do a cleanup
+  if (iso_info) kfree (iso_info);
+  if (vd) kfree (vd);
+  mount->fs_data = NULL;
+  return NULL;
+}
+
+
+/**
+ * Called when a mount_point gets unmounted
+ */
+void iso9660_umount (struct vfs_mount *mount) {
+  iso_info_t *iso_info = mount->fs_data;
+  Uint32 index;
+
+  for (index=1; index<=iso_info->path_count; index++) {
+    if (iso_info->path[index].name) kfree (iso_info->path[index].name);
+  }
+  if (iso_info->path) kfree (iso_info->path);
+  kfree (iso_info);
+}
+
+
+/**
+ * Returns the disk offset of a logical block
+ */
+Uint64 iso9660_block2diskoffset (iso_info_t *iso_info, Uint32 block) {
+  return (Uint64)block * iso_info->block_size;
+}
+
+
+/**
+ * Loads the (little endian) path table of the volume descriptor. Names are converted
+ * right away, except for Rock Ridge names which are only found inside the directories.
+ *
+ * @return 0 when something is wrong
+ */
+int iso9660_load_path_table (struct vfs_mount *mount, iso_volume_desc_t *vd) {
+  iso_info_t *iso_info = mount->fs_data;
+  iso_path_entry_t *entry;
+  iso_path_t *path;
+  char name[ISO_MAX_NAME];
+  Uint32 size = vd->path_table_size;
+  Uint32 pos, count, index;
+  char *table;
+
+  if (size < sizeof (iso_path_entry_t) || size > ISO_MAX_PATH_TABLE) return 0;
+
+  table = (char *)kmalloc (size);
+  if (! table) return 0;
+  if (bcache_read_uncached (mount->dev, iso9660_block2diskoffset (iso_info, vd->path_table_l), size, table) != size) {
+    kfree (table);
+    return 0;
+  }
+
+  // Count the directories first
+  count = 0;
+  for (pos=0; pos + sizeof (iso_path_entry_t) <= size; count++) {
+    entry = (iso_path_entry_t *)(table + pos);
+    if (entry->name_len == 0) break;
+    pos += sizeof (iso_path_entry_t) + entry->name_len + (entry->name_len & 1);
+  }
+
+  // Parent numbers are 16 bits, so there cannot be more directories
+  if (count == 0 || count > 0xFFFF) {
+    kfree (table);
+    return 0;
+  }
+
+  iso_info->path = (iso_path_t *)kmalloc ((count + 1) * sizeof (iso_path_t));
+  if (! iso_info->path) {
+    kfree (table);
+    return 0;
+  }
+  memset (iso_info->path, 0, (count + 1) * sizeof (iso_path_t));
+  iso_info->path_count = count;
+
+  for (pos=0, index=1; index<=count; index++) {
+    entry = (iso_path_entry_t *)(table + pos);
+    path = &iso_info->path[index];
+    if (pos + sizeof (iso_path_entry_t) + entry->name_len > size) break;
+
+    // Parents come before their children, and the table is sorted on parent
+    if (entry->parent == 0 || entry->parent > index || (index > 1 && entry->parent == index)) break;
+    if (index > 1 && entry->parent < iso_info->path[index - 1].parent) break;
+
+    path->extent = entry->extent;
+    path->parent = entry->parent;
+    path->complete = (iso_info->names != ISO_NAMES_ROCKRIDGE);
+
+    if (index > 1 && iso_info->names != ISO_NAMES_ROCKRIDGE) {
+      iso9660_convert_name (iso_info, (Uint8 *)entry + sizeof (iso_path_entry_t), entry->name_len, name);
+      path->name = (char *)kmalloc (strlen (name) + 1);
+      if (path->name) strcpy (path->name, name);
+    }
+
+    pos += sizeof (iso_path_entry_t) + entry->name_len + (entry->name_len & 1);
+  }
+
+  kfree (table);
+
+  // Do not use a path table that does not make sense
+  if (index <= count) {
+    while (--index > 0) {
+      if (iso_info->path[index].name) kfree (iso_info->path[index].name);
+    }
+    kfree (iso_info->path);
+    iso_info->path = NULL;
+    iso_info->path_count = 0;
+    return 0;
+  }
+  return 1;
+}
+
+
+/**
+ * Returns the index of the first subdirectory of a directory in the path table, or 0
+ * when it has none. The subdirectories follow each other, since the table is sorted
+ * on parent.
+ */
+Uint32 iso9660_path_children (iso_info_t *iso_info, Uint32 dir_index) {
+  Uint32 low = 2, high = iso_info->path_count + 1, middle;
+
+  while (low < high) {
+    middle = (low + high) / 2;
+    if (iso_info->path[middle].parent < dir_index) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  if (low > iso_info->path_count || iso_info->path[low].parent != dir_index) return 0;
+  return low;
+}
+
+
+/**
+ * Returns the path table index of the subdirectory of dir_index that starts at extent,
+ * or of any directory that starts at extent when dir_index is 0.
+ *
+ * @return index, or 0 when the directory is not in the path table
+ */
+Uint32 iso9660_path_find (iso_info_t *iso_info, Uint32 dir_index, Uint32 extent) {
+  Uint32 index;
+
+  if (dir_index == 0) {
+    for (index=1; index<=iso_info->path_count; index++) {
+      if (iso_info->path[index].extent == extent) return index;
+    }
+    return 0;
+  }
+
+  for (index = iso9660_path_children (iso_info, dir_index); index && index <= iso_info->path_count && iso_info->path[index].parent == dir_index; index++) {
+    if (iso_info->path[index].extent == extent) return index;
+  }
+  return 0;
+}
+
+
+/**
+ * Reads the directory record of an inode (directories from the path table have none)
+ *
+ * @return 0 when something is wrong
+ */
+int iso9660_read_dirent (struct vfs_mount *mount, inode_t inode_nr, iso_dirent_t *entry) {
+  if (inode_nr & ISO_DIR_INO) return 0;
+  return (bcache_read (mount->dev, (Uint64)inode_nr * 2, sizeof (iso_dirent_t), (char *)entry) == sizeof (iso_dirent_t));
+}
+
+
+/**
+ * Returns the first block and the size of a directory
+ *
+ * @return 0 when the node is not a directory or something is wrong
+ */
+int iso9660_dir_extent (vfs_node_t *node, Uint32 *extent, Uint32 *size) {
+  iso_info_t *iso_info = node->mount->fs_data;
+  Uint32 index = node->inode_nr & ~ISO_DIR_INO;
+  iso_dirent_t entry;
+
+  if (node->inode_nr == ISO_ROOT_INO) {
+    *extent = iso_info->root_extent;
+    *size = iso_info->root_size;
+    return 1;
+  }
+
+  if (node->inode_nr & ISO_DIR_INO) {
+    if (index > iso_info->path_count) return 0;
+    *extent = iso_info->path[index].extent;
+
+    // The path table has no sizes, the "." record at the start of the directory does
+    if (bcache_read (node->mount->dev, iso9660_block2diskoffset (iso_info, *extent), sizeof (iso_dirent_t), (char *)&entry) != sizeof (iso_dirent_t)) return 0;
+    *size = entry.size;
+    return 1;
+  }
+
+  if (! iso9660_read_dirent (node->mount, node->inode_nr, &entry)) return 0;
+  if (! (entry.flags & ISO_FLAG_DIRECTORY)) return 0;
+  *extent = entry.extent;
+  *size = entry.size;
+  return 1;
+}
+
+
+/**
+ * Converts a character to lowercase
+ */
+char iso9660_tolower (char c) {
+  return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+
+/**
+ * Converts an ISO9660 or Joliet file identifier into a C string. The version number
+ * (";1") and the dot of names without extension are removed. Plain ISO9660 names
+ * are shown in lowercase.
+ */
+void iso9660_convert_name (iso_info_t *iso_info, const Uint8 *id, int len, char *name) {
+  Uint16 c;
+  int i, j = 0;
+
+  // @TODO: Characters outside of Latin-1 cannot be shown, they become '?'
+  if (iso_info->names == ISO_NAMES_JOLIET) {
+    for (i=0; i+1<len && j!=ISO_MAX_NAME-1; i+=2) {
+      c = (id[i] << 8) | id[i+1];
+      name[j++] = (c < 0x100) ? c : '?';
+    }
+  } else {
+    for (i=0; i<len && j!=ISO_MAX_NAME-1; i++) {
+      name[j++] = (iso_info->names == ISO_NAMES_ISO) ? iso9660_tolower (id[i]) : id[i];
+    }
+  }
+  name[j] = 0;
+
+  for (i=j-1; i>0; i--) {
+    if (name[i] != ';') continue;
+    name[i] = 0;
+    j = i;
+    break;
+  }
+  if (j > 1 && name[j-1] == '.') name[j-1] = 0;
+}
+
+
+/**
+ * Reads the Rock Ridge entries from the system use area of a directory record (and
+ * from its continuation areas). The NM entries are combined into name (at least
+ * ISO_MAX_NAME bytes). *child_link is set to the block of a relocated directory that
+ * belongs here (CL), *relocated when this is such a directory in its new place (RE).
+ *
+ * @return 1 when there is a Rock Ridge name
+ */
+int iso9660_rr_name (struct vfs_mount *mount, iso_dirent_t *entry, char *name, Uint32 *child_link, int *relocated) {
+  iso_info_t *iso_info = mount->fs_data;
+  Uint8 area[256];
+  Uint8 *su = (Uint8 *)entry + 33 + entry->name_len + ((entry->name_len & 1) ? 0 : 1) + iso_info->susp_skip;
+  Uint8 *end = (Uint8 *)entry + entry->length;
+  Uint32 ce_block = 0, ce_offset = 0, ce_length = 0;
+  int found = 0, len = 0, hops = 0, n;
+
+  *child_link = 0;
+  *relocated = 0;
+
+  for (;;) {
+    for (; su + 4 <= end && su[2] >= 4 && su + su[2] <= end; su += su[2]) {
+      if (su[0] == 'S' && su[1] == 'T') break;
+
+      if (su[0] == 'N' && su[1] == 'M' && su[2] >= 5 && ! (su[4] & (ISO_RR_NM_CURRENT | ISO_RR_NM_PARENT))) {
+        n = su[2] - 5;
+        if (n > ISO_MAX_NAME - 1 - len) n = ISO_MAX_NAME - 1 - len;
+        memcpy (name + len, su + 5, n);
+        len += n;
+        found = 1;
+      }
+      if (su[0] == 'C' && su[1] == 'E' && su[2] >= 28) {
+        ce_block = *(Uint32 *)(su + 4);
+        ce_offset = *(Uint32 *)(su + 12);
+        ce_length = *(Uint32 *)(su + 20);
+      }
+      if (su[0] == 'C' && su[1] == 'L' && su[2] >= 12) *child_link = *(Uint32 *)(su + 4);
+      if (su[0] == 'R' && su[1] == 'E') *relocated = 1;
+    }
+
+    // Go on inside the continuation area, which holds more entries of the same record
+    if (ce_block == 0 || ++hops > ISO_RR_MAX_CE) break;
+    if (ce_length > sizeof (area)) ce_length = sizeof (area);
+    if (bcache_read (mount->dev, iso9660_block2diskoffset (iso_info, ce_block) + ce_offset, ce_length, (char *)area) != ce_length) break;
+
+    su = area;
+    end = area + ce_length;
+    ce_block = 0;
+  }
+
+  name[len] = 0;
+  return (found && len > 0);
+}
+
+
+/**
+ * Reads the next entry of a directory, starting at byte *position. The name is the
+ * best name the volume has (at least ISO_MAX_NAME bytes). "." and ".." are skipped,
+ * just like associated files and relocated directories. *position is moved past the
+ * entry. Subdirectories in the path table get their path table index as inode, and
+ * their Rock Ridge name is remembered in the path table.
+ *
+ * @return 1 when an entry is found, 0 at the end of the directory
+ */
+int iso9660_dir_next (struct vfs_mount *mount, Uint32 dir_index, Uint32 extent, Uint32 size, Uint32 *position, char *name, iso_dirent_t *entry, inode_t *inode_nr) {
+  iso_info_t *iso_info = mount->fs_data;
+  Uint8 record[256];
+  iso_dirent_t *rec = (iso_dirent_t *)record;
+  Uint32 child_link, index;
+  Uint64 disk_offset;
+  int relocated, multi_extent = 0;
+
+  while (*position < size) {
+    disk_offset = iso9660_block2diskoffset (iso_info, extent) + *position;
+    if (bcache_read (mount->dev, disk_offset, 1, (char *)record) != 1) return 0;
+
+    // Records do not cross sector boundaries, the rest of the sector is padded with zeros
+    if (record[0] == 0) {
+      *position = (*position & ~(ISO_SECTOR_SIZE - 1)) + ISO_SECTOR_SIZE;
+      continue;
+    }
+
+    if (bcache_read (mount->dev, disk_offset, record[0], (char *)record) != record[0]) return 0;
+    if (rec->length < 33 || rec->length < 33 + rec->name_len) return 0;
+    *position += rec->length;
+
+    if (rec->name_len == 1 && rec->name[0] <= 1) continue;
+    if (rec->flags & ISO_FLAG_ASSOCIATED) continue;
+
+    // @TODO: Files of 4GB and larger are stored in more than one extent, they are not shown
+    if (rec->flags & ISO_FLAG_MULTI_EXTENT) {
+      multi_extent = 1;
+      continue;
+    }
+    if (multi_extent) {
+      multi_extent = 0;
+      continue;
+    }
+
+    child_link = 0;
+    relocated = 0;
+    if (iso_info->names != ISO_NAMES_ROCKRIDGE || ! iso9660_rr_name (mount, rec, name, &child_link, &relocated)) {
+      iso9660_convert_name (iso_info, rec->name, rec->name_len, name);
+    }
+    if (relocated || name[0] == 0) continue;
+
+    memcpy (entry, rec, sizeof (iso_dirent_t));
+
+    // A directory that was moved away because the tree was too deep shows up here again
+    if (child_link) {
+      entry->extent = child_link;
+      entry->flags |= ISO_FLAG_DIRECTORY;
+    }
+
+    if (entry->flags & ISO_FLAG_DIRECTORY) {
+      index = iso9660_path_find (iso_info, child_link ? 0 : dir_index, entry->extent);
+      if (index) {
+        // Remember the name, so the next lookup does not need to read this directory
+        if (! iso_info->path[index].name) {
+          iso_info->path[index].name = (char *)kmalloc (strlen (name) + 1);
+          if (iso_info->path[index].name) strcpy (iso_info->path[index].name, name);
+        }
+
+        *inode_nr = ISO_DIR_INO | index;
+        return 1;
+      }
+
+      // Only directories in the path table can be found through a child link
+      if (child_link) continue;
+    }
+
+    // Records further than 4GB into the volume cannot be identified
+    if (disk_offset / 2 >= ISO_DIR_INO) continue;
+
+    *inode_nr = disk_offset / 2;
+    return 1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * Returns 1 when both names are the same. Plain ISO9660 names are not case sensitive,
+ * Joliet and Rock Ridge names are.
+ */
+int iso9660_compare_names (iso_info_t *iso_info, const char *name1, const char *name2) {
+  if (iso_info->names != ISO_NAMES_ISO) return (strcmp (name1, name2) == 0);
+
+  while (*name1 && iso9660_tolower (*name1) == iso9660_tolower (*name2)) {
+    name1++;
+    name2++;
+  }
+  return (*name1 == *name2);
+}
+
+
+/**
+ * Reads a file. Files are stored in a single extent, so this is a single read from
+ * the device.
+ */
+Uint32 iso9660_read (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer) {
+  iso_info_t *iso_info = node->mount->fs_data;
+  iso_dirent_t entry;
+  Uint64 disk_offset;
+
+  // We do need nothing to read
+  if (size == 0) return 0;
+
+  // Directories are read with iso9660_getdents()
+  if (! iso9660_read_dirent (node->mount, node->inode_nr, &entry)) return 0;
+  if (entry.flags & ISO_FLAG_DIRECTORY) return 0;
+
+  // @TODO: Interleaved files are not supported
+  if (entry.unit_size || entry.interleave) return 0;
+
+  // Cannot read behind file length
+  if (offset >= entry.size) return 0;
+  if (offset + size > entry.size || offset + size < offset) size = entry.size - offset;
+
+  // The data comes after the extended attribute record (if any)
+  disk_offset = iso9660_block2diskoffset (iso_info, entry.extent + entry.ext_attr_length) + offset;
+
+  // Small reads stay in the cache, larger ones do not push out the directories
+  if (size < BCACHE_BLOCK_SIZE) return bcache_read (node->mount->dev, disk_offset, size, buffer);
+  return bcache_read_uncached (node->mount->dev, disk_offset, size, buffer);
+}
+
+
+/**
+ * Reads a part of a file into the buffer cache
+ */
+void iso9660_readahead (vfs_node_t *node, Uint32 offset, Uint32 size) {
+  iso_info_t *iso_info = node->mount->fs_data;
+  iso_dirent_t entry;
+
+  if (size == 0) return;
+  if (! iso9660_read_dirent (node->mount, node->inode_nr, &entry)) return;
+  if (entry.flags & ISO_FLAG_DIRECTORY) return;
+
+  if (offset >= entry.size) return;
+  if (offset + size > entry.size || offset + size < offset) size = entry.size - offset;
+
+  bcache_readahead (node->mount->dev, iso9660_block2diskoffset (iso_info, entry.extent + entry.ext_attr_length) + offset, size);
+}
+
+
+/**
+ * Called when a file is opened
+ */
+void iso9660_open (vfs_node_t *node) {
+  iso_dirent_t entry;
+
+  // The node might come from the path cache, so take the length from the record
+  if (! iso9660_read_dirent (node->mount, node->inode_nr, &entry)) return;
+  if (! (entry.flags & ISO_FLAG_DIRECTORY)) node->length = entry.size;
+}
+
+
+/**
+ * Finds a file inside a directory. Subdirectories are looked up in the path table
+ * when their names are known, so the directory is only read for other files. The first
+ * time a Rock Ridge directory is read, it is read completely to learn the names of
+ * all its subdirectories.
+ */
+int iso9660_finddir (vfs_node_t *node, const char *name, vfs_node_t *target_node) {
+  iso_info_t *iso_info = node->mount->fs_data;
+  char entry_name[ISO_MAX_NAME];
+  iso_dirent_t entry;
+  Uint32 dir_index, index, extent, size, position = 0;
+  inode_t inode_nr;
+  int found = 0;
+
+  // Check if it's a directory
+  if ((node->flags & 0x7) != FS_DIRECTORY) return 0;
+
+  dir_index = (node->inode_nr & ISO_DIR_INO) ? node->inode_nr & ~ISO_DIR_INO : 0;
+  if (dir_index > iso_info->path_count) dir_index = 0;
+
+  if (dir_index && iso_info->path[dir_index].complete) {
+    for (index = iso9660_path_children (iso_info, dir_index); index && index <= iso_info->path_count && iso_info->path[index].parent == dir_index; index++) {
+      if (! iso_info->path[index].name || ! iso9660_compare_names (iso_info, name, iso_info->path[index].name)) continue;
+
+      // Copy node info into new node
+      memcpy (target_node, node, sizeof (vfs_node_t));
+      target_node->inode_nr = ISO_DIR_INO | index;
+      strcpy (target_node->name, iso_info->path[index].name);
+      target_node->owner = 0;
+      target_node->length = 0;
+      target_node->flags = FS_DIRECTORY;
+      return 1;
+    }
+  }
+
+  if (! iso9660_dir_extent (node, &extent, &size)) return 0;
+  while (iso9660_dir_next (node->mount, dir_index, extent, size, &position, entry_name, &entry, &inode_nr)) {
+    if (found || ! iso9660_compare_names (iso_info, name, entry_name)) continue;
+
+    // Copy node info into new node
+    memcpy (target_node, node, sizeof (vfs_node_t));
+    target_node->inode_nr = inode_nr;
+    strcpy (target_node->name, entry_name);
+    target_node->owner = 0;
+    target_node->length = (entry.flags & ISO_FLAG_DIRECTORY) ? 0 : entry.size;
+    target_node->flags = (entry.flags & ISO_FLAG_DIRECTORY) ? FS_DIRECTORY : FS_FILE;
+    found = 1;
+
+    if (! dir_index || iso_info->path[dir_index].complete) return 1;
+  }
+
+  // Everything is read, so the names of all subdirectories are known now
+  if (dir_index && position >= size) iso_info->path[dir_index].complete = 1;
+  return found;
+}
+
+
+/**
+ * Reads up to count directory entries. *offset is the byte position inside the
+ * directory and is moved past the entries that are returned.
+ */
+int iso9660_getdents (vfs_node_t *node, Uint32 *offset, vfs_dirent_t *dirents, int count) {
+  iso_info_t *iso_info = node->mount->fs_data;
+  iso_dirent_t entry;
+  Uint32 dir_index, extent, size;
+  int filled = 0;
+
+  // Check if it's a directory
+  if ((node->flags & 0x7) != FS_DIRECTORY) return 0;
+  if (! iso9660_dir_extent (node, &extent, &size)) return 0;
+
+  dir_index = (node->inode_nr & ISO_DIR_INO) ? node->inode_nr & ~ISO_DIR_INO : 0;
+  if (dir_index > iso_info->path_count) dir_index = 0;
+
+  while (filled != count && iso9660_dir_next (node->mount, dir_index, extent, size, offset, dirents[filled].name, &entry, &dirents[filled].inode_nr)) {
+    filled++;
+  }
+
+  return filled;
+}
+
+
+/**
+ * Returns directory entry number index
+ */
+int iso9660_readdir (vfs_node_t *node, Uint32 index, vfs_dirent_t *target_dirent) {
+  Uint32 offset = 0;
+
+  // Skip index entries
+  while (iso9660_getdents (node, &offset, target_dirent, 1) == 1) {
+    if (index == 0) return 1;
+    index--;
+  }
+
+  return 0;
+}
+
+
+/**
+ * Initialises the ISO9660 filesystem
+ */
+void iso9660_init (void) {
+  // Register file system to the VFS
+  vfs_register_filesystem (&iso9660_vfs_info);
+}
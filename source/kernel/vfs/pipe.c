@@ -0,0 +1,290 @@
+/******************************************************************************
+ *
+ *  File        : pipe.c
+ *  Description : Anonymous pipes. A pipe is a ring of pages. Writers fill the
+ *                pages, readers empty them. Whole page aligned transfers are done
+ *                by exchanging page frames instead of copying the data.
+ *
+ *****************************************************************************/
+
+#include "kernel.h"
+#include "kmem.h"
+#include "paging.h"
+#include "vfs.h"
+#include "vfs/pipe.h"
+#include "poll.h"
+
+
+// File operations
+static struct vfs_fileops pipe_fileops = {
+    .read = pipe_read,
+    .write = pipe_write,
+    .close = pipe_close,
+    .poll = pipe_poll
+};
+
+
+// Pipes of which both ends are closed. kfree() does not free anything, so the pipes
+// and their pages are recycled by sys_pipe() instead.
+static pipe_t *pipe_free_list = NULL;
+
+
+/**
+ * Returns an empty pipe with both ends open. Reuses a closed pipe when possible.
+ */
+pipe_t *pipe_alloc (int flags) {
+  char *page[PIPE_PAGES];
+  pipe_t *pipe;
+  int i;
+
+  int state = disable_ints ();
+  pipe = pipe_free_list;
+  if (pipe) pipe_free_list = pipe->next_free;
+  restore_ints (state);
+
+  if (pipe) {
+    // Keep the pages, they may have been exchanged with pages of a task, but are still ours
+    for (i=0; i!=PIPE_PAGES; i++) page[i] = pipe->page[i];
+  } else {
+    pipe = (pipe_t *)kmalloc (sizeof (pipe_t));
+    for (i=0; i!=PIPE_PAGES; i++) page[i] = (char *)kmalloc_pageboundary (PIPE_PAGE_SIZE);
+  }
+
+  memset (pipe, 0, sizeof (pipe_t));
+  for (i=0; i!=PIPE_PAGES; i++) pipe->page[i] = page[i];
+
+  pipe->flags = flags;
+  pipe->readers = 1;
+  pipe->writers = 1;
+  sched_init_waitqueue (&pipe->read_wait);
+  sched_init_waitqueue (&pipe->write_wait);
+  return pipe;
+}
+
+
+/**
+ * Puts a pipe of which both ends are closed, together with its pages, on the free list
+ */
+void pipe_free (pipe_t *pipe) {
+  int state = disable_ints ();
+  pipe->next_free = pipe_free_list;
+  pipe_free_list = pipe;
+  restore_ints (state);
+}
+
+
+/**
+ * Returns 1 when a transfer of size bytes from/to this user address can be done by
+ * exchanging a whole page.
+ */
+int pipe_can_flip (char *buffer, Uint32 size) {
+  return (((Uint32)buffer & 0xFFF) == 0 && size >= PIPE_PAGE_SIZE);
+}
+
+
+/**
+ * Reads from a pipe. Blocks until there is at least some data, or returns 0 when
+ * there is no data and no writers left (end of file).
+ */
+Uint32 pipe_read (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer) {
+  pipe_t *pipe = (pipe_t *)node->data;
+  Uint32 count = 0;
+  Uint32 len;
+  int slot;
+
+  int state = disable_ints ();
+
+  // Wait until data is available
+  while (pipe->used == 0) {
+    if (pipe->writers == 0) {
+      restore_ints (state);
+      return 0;
+    }
+    sched_interruptable_sleep (&pipe->read_wait);
+  }
+
+  while (count != size && pipe->used > 0) {
+    slot = pipe->head;
+
+    if (pipe->off[slot] == 0 && pipe->len[slot] == PIPE_PAGE_SIZE && pipe_can_flip (buffer + count, size - count) &&
+        swap_pageframes (_current_task->page_directory, (Uint32)buffer + count, (Uint32)pipe->page[slot])) {
+      // The full page is now mapped in the reader. The pipe got the reader's old page in return.
+      pipe->off[slot] = PIPE_PAGE_SIZE;
+      count += PIPE_PAGE_SIZE;
+    } else {
+      len = pipe->len[slot] - pipe->off[slot];
+      if (len > size - count) len = size - count;
+
+      memcpy (buffer + count, pipe->page[slot] + pipe->off[slot], len);
+      pipe->off[slot] += len;
+      count += len;
+    }
+
+    // Page is empty, move on to the next one
+    if (pipe->off[slot] == pipe->len[slot]) {
+      pipe->off[slot] = pipe->len[slot] = 0;
+      pipe->head = (pipe->head + 1) % PIPE_PAGES;
+      pipe->used--;
+    }
+  }
+
+  // There is room again for writers
+  sched_wakeup (&pipe->write_wait);
+
+  restore_ints (state);
+  return count;
+}
+
+
+/**
+ * Writes to a pipe. Blocks until everything is written or until there are no
+ * readers left, in which case SIGPIPE is raised.
+ */
+Uint32 pipe_write (vfs_node_t *node, Uint32 offset, Uint32 size, char *buffer) {
+  pipe_t *pipe = (pipe_t *)node->data;
+  Uint32 count = 0;
+  Uint32 len;
+  int slot;
+
+  int state = disable_ints ();
+
+  while (count != size) {
+    // Nobody will ever read this
+    if (pipe->readers == 0) {
+      sys_signal (_current_task, SIGPIPE);
+      break;
+    }
+
+    slot = (pipe->head + pipe->used - 1 + PIPE_PAGES) % PIPE_PAGES;
+
+    // No room left in the last page, start a new one
+    if (pipe->used == 0 || pipe->len[slot] == PIPE_PAGE_SIZE) {
+      // Pipe is full. Let the readers empty it first
+      if (pipe->used == PIPE_PAGES) {
+        sched_wakeup (&pipe->read_wait);
+        sched_interruptable_sleep (&pipe->write_wait);
+        continue;
+      }
+
+      slot = (pipe->head + pipe->used) % PIPE_PAGES;
+      pipe->off[slot] = pipe->len[slot] = 0;
+      pipe->used++;
+
+      // Move the writer's page into the pipe when the writer allows us to
+      if ((pipe->flags & PIPE_GIFT) && pipe_can_flip (buffer + count, size - count) &&
+          swap_pageframes (_current_task->page_directory, (Uint32)buffer + count, (Uint32)pipe->page[slot])) {
+        pipe->len[slot] = PIPE_PAGE_SIZE;
+        count += PIPE_PAGE_SIZE;
+        continue;
+      }
+    }
+
+    len = PIPE_PAGE_SIZE - pipe->len[slot];
+    if (len > size - count) len = size - count;
+
+    memcpy (pipe->page[slot] + pipe->len[slot], buffer + count, len);
+    pipe->len[slot] += len;
+    count += len;
+  }
+
+  // Data available for the readers
+  sched_wakeup (&pipe->read_wait);
+
+  restore_ints (state);
+  return count;
+}
+
+
+/**
+ * Called when the last descriptor of one of the pipe ends is closed
+ */
+void pipe_close (vfs_node_t *node) {
+  pipe_t *pipe = (pipe_t *)node->data;
+
+  if (node->inode_nr == PIPE_READ_END) {
+    pipe->readers--;
+  } else {
+    pipe->writers--;
+  }
+
+  // Nobody can reach the pipe anymore
+  if (pipe->readers == 0 && pipe->writers == 0) {
+    pipe_free (pipe);
+    return;
+  }
+
+  // Blocked readers get EOF, blocked writers get SIGPIPE
+  sched_wakeup (&pipe->read_wait);
+  sched_wakeup (&pipe->write_wait);
+}
+
+
+/**
+ * Returns the readiness of one of the ends of the pipe
+ */
+int pipe_poll (vfs_node_t *node, struct poll_table *table) {
+  pipe_t *pipe = (pipe_t *)node->data;
+  int events = 0;
+  int last;
+
+  if (node->inode_nr == PIPE_READ_END) {
+    poll_wait (table, &pipe->read_wait);
+    if (pipe->used > 0) events |= POLLIN;
+    if (pipe->writers == 0) events |= POLLHUP;
+  } else {
+    poll_wait (table, &pipe->write_wait);
+    last = (pipe->head + pipe->used - 1 + PIPE_PAGES) % PIPE_PAGES;
+    if (pipe->used < PIPE_PAGES || pipe->len[last] < PIPE_PAGE_SIZE) events |= POLLOUT;
+    if (pipe->readers == 0) events |= POLLERR;
+  }
+
+  return events;
+}
+
+
+/**
+ * Creates a file for one of the ends of the pipe
+ */
+vfs_file_t *pipe_create_file (pipe_t *pipe, int end) {
+  vfs_file_t *file = (vfs_file_t *)kmalloc (sizeof (vfs_file_t));
+  memset (file, 0, sizeof (vfs_file_t));
+
+  strcpy (file->node.name, "pipe");
+  file->node.inode_nr = end;
+  file->node.flags = FS_PIPE;
+  file->node.fileops = &pipe_fileops;
+  file->node.data = pipe;
+
+  file->flags = (end == PIPE_READ_END) ? O_RDONLY : O_WRONLY;
+  file->refcount = 1;
+  return file;
+}
+
+
+/**
+ * Creates a pipe. fds[0] will be the read end, fds[1] the write end.
+ * Returns 0 on success, -1 on error.
+ */
+int sys_pipe (int *fds, int flags) {
+  pipe_t *pipe = pipe_alloc (flags);
+
+  vfs_file_t *rfile = pipe_create_file (pipe, PIPE_READ_END);
+  vfs_file_t *wfile = pipe_create_file (pipe, PIPE_WRITE_END);
+
+  // Releasing the files closes both ends, which puts the pipe back on the free list
+  fds[0] = vfs_install_file (rfile);
+  if (fds[0] == -1) {
+    vfs_release_file (rfile);
+    vfs_release_file (wfile);
+    return -1;
+  }
+
+  fds[1] = vfs_install_file (wfile);
+  if (fds[1] == -1) {
+    sys_close (fds[0]);
+    vfs_release_file (wfile);
+    return -1;
+  }
+
+  return 0;
+}